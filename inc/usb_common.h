@@ -74,6 +74,7 @@ please contact mla_licensing@microchip.com
 #define USB_ENDPOINT_NAK_TIMEOUT                0x17    // Too many NAK's occurred while waiting for the current transaction.
 #define USB_ENDPOINT_ILLEGAL_TYPE               0x18    // Transfer type must match endpoint description.
 #define USB_ENDPOINT_UNRESOLVED_STATE           0x19    // Endpoint is in an unknown state after completing a transaction.
+#define USB_ENDPOINT_TRANSFER_CANCELLED         0x1A    // Queued transfer was cancelled before it completed.
 #define USB_ENDPOINT_ERROR_BIT_STUFF            0x20    // USB Module - Bit stuff error.
 #define USB_ENDPOINT_ERROR_DMA                  0x21    // USB Module - DMA error.
 #define USB_ENDPOINT_ERROR_TIMEOUT              0x22    // USB Module - Bus timeout.
@@ -334,6 +335,11 @@ typedef enum
     // layer should return FALSE.
     EVENT_HOLD_BEFORE_CONFIGURATION,
 
+    // In host mode, this event is thrown when the attached device is running or has
+    // been put in a holding state, if USB_ENABLE_ENUMERATION_PROFILE is defined.  The
+    // data associated with this event is of data type USB_ENUMERATION_PROFILE.
+    EVENT_ENUMERATION_PROFILE,
+
     // Class-defined event offsets start here:
     EVENT_GENERIC_BASE  = 400,      // Offset for Generic class events
 
@@ -200,4 +200,319 @@ extern volatile uint8_t CtrlTrfData[USB_EP0_BUFF_SIZE];
 
  *******************************************************************/
 void USBCheckAudioRequest(void);
+
+#if defined(USB_AUDIO_SUPPORT_STREAMING)
+
+/** S T R E A M I N G ********************************************************/
+
+/* Size of the explicit feedback value (10.14 format, full speed) */
+#define USB_AUDIO_FEEDBACK_SIZE     3
+
+/* Amount, in 10.14 format, by which the feedback value is nudged when the
+   playback ring buffer drifts away from half full.  1/64 of a sample per
+   frame by default. */
+#ifndef USB_AUDIO_FEEDBACK_LEVEL_CORRECTION
+    #define USB_AUDIO_FEEDBACK_LEVEL_CORRECTION     (1ul << 8)
+#endif
+
+/* State of one isochronous audio streaming endpoint.  The application owns
+   the structure, the sample ring buffer and the two packet buffers; the
+   packet buffers must be located in USB module accessible RAM. */
+typedef struct
+{
+    uint8_t*    ring;               // sample ring buffer
+    uint16_t    ringMask;           // ring size - 1 (size is a power of two)
+    volatile uint16_t head;         // write index, free running
+    volatile uint16_t tail;         // read index, free running
+    uint8_t*    packet[2];          // isochronous packet buffers
+    USB_HANDLE  handle[2];          // BDT each packet buffer is armed on
+    uint16_t    packetSize;         // size of each packet buffer
+    uint8_t     next;               // packet buffer that completes next
+    uint8_t     armed;              // packet buffers owned by the USB module
+    uint8_t     ep;                 // endpoint number
+    uint8_t     dir;                // IN_TO_HOST (record) or OUT_FROM_HOST (playback)
+    uint8_t     sampleBytes;        // bytes per sample frame (all channels)
+    uint32_t    rate;               // samples per USB frame, 16.16 format
+    uint32_t    rateAccumulator;    // fractional samples carried between frames
+    volatile uint32_t consumed;     // bytes taken out of the ring by the codec (playback)
+    volatile uint16_t overrunCount;
+    volatile uint16_t underrunCount;
+    bool        running;
+    bool        primed;             // playback: ring has reached half full
+} USB_AUDIO_STREAM;
+
+/* State of an explicit feedback endpoint for an asynchronous playback
+   stream.  value[] is the packet buffer and must be located in USB module
+   accessible RAM. */
+typedef struct
+{
+    uint8_t     value[USB_AUDIO_FEEDBACK_SIZE + 1];
+    USB_AUDIO_STREAM* stream;       // the playback stream being regulated
+    USB_HANDLE  handle;
+    uint32_t    feedback;           // current value, 10.14 format
+    uint32_t    lastConsumed;       // stream->consumed at the last update
+    uint16_t    frameCount;
+    uint8_t     refreshShift;       // bRefresh of the feedback endpoint
+    uint8_t     ep;
+} USB_AUDIO_FEEDBACK;
+
+/********************************************************************
+    Function:
+        bool USBAudioStreamInit(USB_AUDIO_STREAM* stream, uint8_t ep,
+                                uint8_t dir, uint8_t* ring, uint16_t ringSize,
+                                uint8_t* packet0, uint8_t* packet1,
+                                uint16_t packetSize, uint32_t sampleRate,
+                                uint8_t sampleBytes)
+
+    Summary:
+        Initializes an isochronous audio streaming engine.
+
+    Description:
+        Sets up a stream that moves samples between a ring buffer and an
+        isochronous endpoint.  For a playback (OUT_FROM_HOST) stream, every
+        received packet is appended to the ring and the codec pulls samples
+        with USBAudioStreamRead().  For a record (IN_TO_HOST) stream, the
+        codec pushes samples with USBAudioStreamWrite() and every USB frame
+        gets sampleRate/1000 samples (with the fractional part carried over,
+        so 44.1 kHz alternates 44 and 45 sample packets).
+
+        Both packet buffers are kept armed on the endpoint's ping-pong BDTs,
+        so the stream keeps running as long as USBAudioStreamTasks() is
+        called once per frame, independent of the main loop.
+
+        Typical Usage:
+        <code>
+        //48 kHz, stereo, 16-bit playback
+        USBAudioStreamInit(&playback, AS_OUT_EP, OUT_FROM_HOST,
+                           ring, sizeof(ring), packet[0], packet[1], 196,
+                           48000, 4);
+        </code>
+
+    PreCondition:
+        None
+
+    Parameters:
+        USB_AUDIO_STREAM* stream - the stream object
+        uint8_t ep          - isochronous endpoint number
+        uint8_t dir         - IN_TO_HOST or OUT_FROM_HOST
+        uint8_t* ring       - sample ring buffer
+        uint16_t ringSize   - ring buffer size, a power of two
+        uint8_t* packet0    - first packet buffer
+        uint8_t* packet1    - second packet buffer
+        uint16_t packetSize - size of each packet buffer (wMaxPacketSize),
+                              at most 255 bytes
+        uint32_t sampleRate - sampling frequency in Hz
+        uint8_t sampleBytes - bytes per sample frame (channels * subframe size)
+
+    Return Values:
+        true - the stream is ready to be started
+        false - packetSize is larger than 255 bytes, the stream must not be
+                started
+
+    Remarks:
+        None
+
+ *******************************************************************/
+bool USBAudioStreamInit(USB_AUDIO_STREAM* stream, uint8_t ep, uint8_t dir,
+                        uint8_t* ring, uint16_t ringSize,
+                        uint8_t* packet0, uint8_t* packet1, uint16_t packetSize,
+                        uint32_t sampleRate, uint8_t sampleBytes);
+
+/********************************************************************
+    Function:
+        void USBAudioStreamStart(USB_AUDIO_STREAM* stream)
+        void USBAudioStreamStop(USB_AUDIO_STREAM* stream)
+
+    Summary:
+        Starts or stops streaming on the endpoint.
+
+    Description:
+        USBAudioStreamStart() empties the ring buffer and arms the packet
+        buffers; it is normally called when the host selects the operational
+        alternate setting of the streaming interface (SET_INTERFACE, alternate
+        setting 1).  USBAudioStreamStop() is called when alternate setting 0
+        is selected; buffers already armed are simply left to the USB module.
+
+    PreCondition:
+        USBAudioStreamInit() has been called and the endpoint is enabled.
+
+    Parameters:
+        USB_AUDIO_STREAM* stream - the stream object
+
+    Return Values:
+        None
+
+    Remarks:
+        None
+
+ *******************************************************************/
+void USBAudioStreamStart(USB_AUDIO_STREAM* stream);
+void USBAudioStreamStop(USB_AUDIO_STREAM* stream);
+
+/********************************************************************
+    Function:
+        void USBAudioStreamTasks(USB_AUDIO_STREAM* stream)
+
+    Summary:
+        Services the isochronous packet buffers of a stream.
+
+    Description:
+        Processes every packet buffer released by the USB module (copying
+        received samples into the ring, or the next frame's samples out of
+        it) and re-arms it immediately.  Call this from the application's
+        USB event handler on EVENT_TRANSFER and EVENT_SOF.  With the stack in
+        USB_INTERRUPT mode this runs in the USB interrupt, so playback does
+        not depend on how quickly the main loop comes around.
+
+    PreCondition:
+        USBAudioStreamInit() has been called.
+
+    Parameters:
+        USB_AUDIO_STREAM* stream - the stream object
+
+    Return Values:
+        None
+
+    Remarks:
+        None
+
+ *******************************************************************/
+void USBAudioStreamTasks(USB_AUDIO_STREAM* stream);
+
+/********************************************************************
+    Function:
+        uint16_t USBAudioStreamRead(USB_AUDIO_STREAM* stream, uint8_t* data,
+                                    uint16_t len)
+        uint16_t USBAudioStreamWrite(USB_AUDIO_STREAM* stream,
+                                     const uint8_t* data, uint16_t len)
+
+    Summary:
+        Codec side access to the sample ring buffer.
+
+    Description:
+        USBAudioStreamRead() takes len bytes of playback samples out of the
+        ring.  Until the ring has first filled to half (after start or after
+        an underrun) and whenever it runs dry, silence is returned for the
+        missing bytes and the underrun counter is incremented.
+
+        USBAudioStreamWrite() puts len bytes of recorded samples into the
+        ring.  Bytes that do not fit are dropped and the overrun counter is
+        incremented.
+
+        Both are normally called from the codec (I2S/DMA) interrupt.
+
+    PreCondition:
+        USBAudioStreamInit() has been called.
+
+    Parameters:
+        USB_AUDIO_STREAM* stream - the stream object
+        uint8_t* data            - sample data
+        uint16_t len             - number of bytes, a multiple of sampleBytes
+
+    Return Values:
+        uint16_t - number of real (non silence / not dropped) bytes
+
+    Remarks:
+        The ring is single producer, single consumer.  If the codec interrupt
+        and the USB interrupt can preempt each other, the higher priority
+        one must not be interrupted while updating the 16-bit ring indices
+        on 8-bit devices.
+
+ *******************************************************************/
+uint16_t USBAudioStreamRead(USB_AUDIO_STREAM* stream, uint8_t* data, uint16_t len);
+uint16_t USBAudioStreamWrite(USB_AUDIO_STREAM* stream, const uint8_t* data, uint16_t len);
+
+/********************************************************************
+    Function:
+        uint16_t USBAudioStreamGetOverrunCount(USB_AUDIO_STREAM* stream)
+        uint16_t USBAudioStreamGetUnderrunCount(USB_AUDIO_STREAM* stream)
+
+    Summary:
+        Return the overrun/underrun counters of a stream.
+
+    Description:
+        For playback, an overrun means a received packet did not fit in the
+        ring (the host is sending faster than the codec consumes) and an
+        underrun means the codec found the ring empty.  For record, an
+        overrun means the codec found the ring full and an underrun means a
+        frame was sent short.  The counters saturate and are cleared by
+        USBAudioStreamStart().
+
+    Remarks:
+        Implemented as macros.
+
+ *******************************************************************/
+#define USBAudioStreamGetOverrunCount(stream)   ((stream)->overrunCount)
+#define USBAudioStreamGetUnderrunCount(stream)  ((stream)->underrunCount)
+
+/********************************************************************
+    Function:
+        void USBAudioFeedbackInit(USB_AUDIO_FEEDBACK* feedback, uint8_t ep,
+                                  uint8_t refreshShift,
+                                  USB_AUDIO_STREAM* stream)
+
+    Summary:
+        Initializes the explicit feedback endpoint of an asynchronous
+        playback stream.
+
+    Description:
+        The feedback value starts at the nominal rate of the stream and is
+        recomputed every 2^refreshShift frames from the number of samples the
+        codec actually consumed (through USBAudioStreamRead()) over that
+        period, that is from the codec clock measured against SOF.  It is
+        then nudged by USB_AUDIO_FEEDBACK_LEVEL_CORRECTION whenever the ring
+        buffer is more than 1/8 away from half full, so long term drift can
+        not slowly drain or fill the buffer.
+
+    PreCondition:
+        USBAudioStreamInit() has been called for stream.
+
+    Parameters:
+        USB_AUDIO_FEEDBACK* feedback - the feedback object
+        uint8_t ep                   - feedback (isochronous IN) endpoint
+        uint8_t refreshShift         - bRefresh of the endpoint descriptor (1-9)
+        USB_AUDIO_STREAM* stream     - the playback stream
+
+    Return Values:
+        None
+
+    Remarks:
+        None
+
+ *******************************************************************/
+void USBAudioFeedbackInit(USB_AUDIO_FEEDBACK* feedback, uint8_t ep, uint8_t refreshShift, USB_AUDIO_STREAM* stream);
+
+/********************************************************************
+    Function:
+        void USBAudioFeedbackSOFHandler(USB_AUDIO_FEEDBACK* feedback)
+
+    Summary:
+        Updates and transmits the feedback value.
+
+    Description:
+        Call this from the application's USB event handler on every
+        EVENT_SOF.  It counts frames, recomputes the feedback value once per
+        refresh period and keeps the feedback endpoint armed with the latest
+        value.
+
+    PreCondition:
+        USBAudioFeedbackInit() has been called.
+
+    Parameters:
+        USB_AUDIO_FEEDBACK* feedback - the feedback object
+
+    Return Values:
+        None
+
+    Remarks:
+        The count of consumed bytes is read until two reads agree, so it may
+        be advanced by USBAudioStreamRead() from an interrupt that preempts
+        this function.  If this function is called from an interrupt that
+        can preempt USBAudioStreamRead() instead, call USBAudioStreamRead()
+        with that interrupt masked.
+
+ *******************************************************************/
+void USBAudioFeedbackSOFHandler(USB_AUDIO_FEEDBACK* feedback);
+
+#endif //USB_AUDIO_SUPPORT_STREAMING
 #endif //AUDIO_H
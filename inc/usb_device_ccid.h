@@ -35,6 +35,11 @@ please contact mla_licensing@microchip.com
 #define USB_CCID_BULK_IN_BUSY                 1
 #define USB_CCID_BULK_IN_BUSY_ZLP             2       // ZLP: Zero Length Packet
 #define USB_CCID_BULK_IN_COMPLETING           3
+#define USB_CCID_BULK_IN_STREAMING            4       // see USBCCIDSendDataToHostStream()
+
+/* Size of the CCID message header (bMessageType through the message
+   specific bytes) that precedes abData[] in every bulk message */
+#define USB_CCID_MESSAGE_HEADER_SIZE          10
 
 /****** CCID Class-Specific Request Codes ************/
 #define USB_CCID_ABORT  					0x01
@@ -94,6 +99,11 @@ extern USB_HANDLE usbCcidInterruptInHandle;
 extern unsigned char usbCcidBulkOutEndpoint[USB_EP_SIZE];	//User application buffer for receiving and holding OUT packets sent from the host
 extern unsigned char usbCcidBulkInEndpoint[USB_EP_SIZE];	//User application buffer for sending IN packets to the host
 
+/* Streaming callbacks, see USBCCIDSendDataToHostStream() and
+   USBCCIDBulkOutStreamInit() */
+typedef WORD (*USB_CCID_BULK_IN_CALLBACK)(BYTE *pDest, DWORD offset, WORD maxLen);
+typedef void (*USB_CCID_BULK_OUT_CALLBACK)(BYTE *pData, WORD len, DWORD offset, DWORD total);
+
 /** Section: PUBLIC PROTOTYPES **********************************************/
 
 /******************************************************************************
@@ -262,6 +272,111 @@ void USBCCIDBulkInService(void);
  *****************************************************************************/
 void USBCCIDSendDataToHost(BYTE *pData, WORD len);
 
+#if defined(USB_CCID_SUPPORT_STREAMING)
+/******************************************************************************
+  Function:
+	void USBCCIDSendDataToHostStream(DWORD length, USB_CCID_BULK_IN_CALLBACK callback)
+
+  Summary:
+    Sends a bulk IN message whose payload is produced in chunks, without
+    holding the whole message in RAM.
+
+  Description:
+    Starts a device-to-host message of length bytes (the CCID header plus
+    abData[], so up to 10 + 65544 bytes for an extended APDU response).  The
+    bytes are pulled from the application through callback, which is called
+    from USBCCIDBulkInService() as
+
+        got = callback(pDest, offset, maxLen);
+
+    and must copy up to maxLen bytes, starting at message offset offset, to
+    pDest.  It may return fewer bytes (including 0) if the card interface has
+    not delivered them yet; it is simply called again on the next service
+    pass.  The first bytes requested (offset 0) are the
+    RDR_to_PC_DataBlock header, whose dwLength the application already knows.
+
+    Two packet buffers are used: while one is being transmitted, the callback
+    fills the other, so card I/O overlaps the USB transfer.
+
+    Typical Usage:
+    <code>
+        WORD ReadFromCard(BYTE *pDest, DWORD offset, WORD maxLen)
+        {
+            if(offset == 0)
+            {
+                //Build the 10 byte RDR_to_PC_DataBlock header first
+                ...
+            }
+            return CardReadAvailable(pDest, maxLen);
+        }
+
+        USBCCIDSendDataToHostStream(USB_CCID_MESSAGE_HEADER_SIZE + responseLength, ReadFromCard);
+    </code>
+
+  Conditions:
+    USB_CCID_SUPPORT_STREAMING is defined.  The bulk IN state machine is
+    idle (no USBCCIDSendDataToHost() transfer in progress).
+
+  Input:
+    DWORD length - total number of bytes in the message
+    USB_CCID_BULK_IN_CALLBACK callback - the function producing the bytes
+
+ *****************************************************************************/
+void USBCCIDSendDataToHostStream(DWORD length, USB_CCID_BULK_IN_CALLBACK callback);
+
+/******************************************************************************
+  Function:
+	void USBCCIDBulkOutStreamInit(USB_CCID_BULK_OUT_CALLBACK callback)
+
+  Summary:
+    Switches the bulk OUT endpoint to chained, double buffered reception.
+
+  Description:
+    From now on every packet received on the bulk OUT endpoint is passed to
+    callback from USBCCIDBulkOutService() as
+
+        callback(pData, len, offset, total);
+
+    where offset is the position of the packet in the current message and
+    total is the message length taken from the dwLength field of the header
+    (10 + dwLength).  The next packet buffer is handed to the USB module
+    before the callback runs, so the host can send the next packet while the
+    application forwards the current one to the card.  A message of any
+    length up to the 32-bit dwLength limit can be received this way.
+
+    A first packet shorter than the 10 byte message header is dropped
+    without calling the callback, and the next packet is taken as the start
+    of a new message.
+
+  Conditions:
+    USB_CCID_SUPPORT_STREAMING is defined.  Called after USBCCIDInitEP(),
+    typically right after it in the configured event handler.
+
+  Input:
+    USB_CCID_BULK_OUT_CALLBACK callback - the function consuming the packets
+
+ *****************************************************************************/
+void USBCCIDBulkOutStreamInit(USB_CCID_BULK_OUT_CALLBACK callback);
+
+/************************************************************************
+  Function:
+        void USBCCIDBulkOutService(void)
+
+  Summary:
+    Delivers received bulk OUT packets to the streaming callback.
+
+  Description:
+    This function should be called once per main program loop, along with
+    USBCCIDBulkInService(), once USBCCIDBulkOutStreamInit() has been called.
+
+  Conditions:
+    USB_CCID_SUPPORT_STREAMING is defined.
+  Remarks:
+    None
+  ************************************************************************/
+void USBCCIDBulkOutService(void);
+#endif
+
 /** Section: STRUCTURES **********************************************/
 typedef union {
     BYTE CCID_BulkOutBuffer[271];
@@ -31,6 +31,45 @@ please contact mla_licensing@microchip.com
 
 /** S T R U C T U R E S ******************************************************/
 
+/* USBGEN_STREAM_BUFFER
+ *
+ * One packet buffer for the streaming API (see USBGenStreamSubmit()).  The
+ * application owns the structure and the data memory; the stack only links
+ * the buffer into its queues between USBGenStreamSubmit() and the point
+ * where USBGenStreamGetCompleted() hands it back.  Several buffers can be
+ * chained through the next pointer and submitted in one call.
+ */
+typedef struct _USBGEN_STREAM_BUFFER
+{
+    struct _USBGEN_STREAM_BUFFER* next;     // next buffer in the chain, or NULL
+    uint8_t*    data;                       // packet data
+    uint16_t    size;                       // IN: bytes to send, OUT: buffer capacity (at most maxPacketSize)
+    uint16_t    count;                      // bytes actually transferred, valid on completion
+    USB_HANDLE  handle;                     // BDT the buffer was armed on (stack use)
+} USBGEN_STREAM_BUFFER;
+
+/* USBGEN_STREAM
+ *
+ * Queue state for one direction of one generic class endpoint.  Buffers move
+ * from the submitted list, to the armed list (owned by the SIE, at most one
+ * per ping-pong BDT), to the completed list.
+ */
+typedef struct
+{
+    USBGEN_STREAM_BUFFER* submittedHead;
+    USBGEN_STREAM_BUFFER* submittedTail;
+    USBGEN_STREAM_BUFFER* armedHead;
+    USBGEN_STREAM_BUFFER* armedTail;
+    USBGEN_STREAM_BUFFER* completedHead;
+    USBGEN_STREAM_BUFFER* completedTail;
+    uint8_t     ep;                         // endpoint number
+    uint8_t     dir;                        // IN_TO_HOST or OUT_FROM_HOST
+    uint8_t     armedCount;                 // number of BDTs currently armed
+    uint16_t    maxPacketSize;              // endpoint size, largest buffer size accepted
+    uint16_t    overrunCount;               // OUT: times the endpoint ran out of receive buffers
+    uint16_t    underrunCount;              // IN: times the endpoint ran out of data to send
+} USBGEN_STREAM;
+
 /** E X T E R N S ************************************************************/
 
 /** P U B L I C  P R O T O T Y P E S *****************************************/
@@ -116,6 +155,210 @@ please contact mla_licensing@microchip.com
 #define USBGenRead(ep,data,len) USBRxOnePacket(ep,data,len)
 
 
+/********************************************************************
+    Function:
+        void USBGenStreamInit(USBGEN_STREAM* stream, uint8_t ep, uint8_t dir,
+                              uint16_t maxPacketSize)
+
+    Summary:
+        Initializes a multi-buffer stream on a generic class endpoint.
+
+    Description:
+        Initializes the queues and counters of a stream for one direction of
+        the specified endpoint.  Any buffers previously linked into the stream
+        are forgotten, so this should be called when the endpoint is enabled
+        (typically from the EVENT_CONFIGURED handler, right after
+        USBEnableEndpoint()).
+
+        Typical Usage:
+        <code>
+        static USBGEN_STREAM inStream;
+        static USBGEN_STREAM_BUFFER samples[4];
+
+        //In the EVENT_CONFIGURED handler
+        USBEnableEndpoint(USBGEN_EP_NUM,USB_OUT_ENABLED|USB_IN_ENABLED|USB_HANDSHAKE_ENABLED|USB_DISALLOW_SETUP);
+        USBGenStreamInit(&inStream, USBGEN_EP_NUM, IN_TO_HOST, USBGEN_EP_SIZE);
+        </code>
+
+    PreCondition:
+        The endpoint has been enabled with USBEnableEndpoint().
+
+    Parameters:
+        USBGEN_STREAM* stream - the stream object to initialize
+        uint8_t ep            - the endpoint number
+        uint8_t dir           - IN_TO_HOST or OUT_FROM_HOST
+        uint16_t maxPacketSize - the wMaxPacketSize of the endpoint
+
+    Return Values:
+        None
+
+    Remarks:
+        None
+
+ *******************************************************************/
+void USBGenStreamInit(USBGEN_STREAM* stream, uint8_t ep, uint8_t dir, uint16_t maxPacketSize);
+
+
+/********************************************************************
+    Function:
+        bool USBGenStreamSubmit(USBGEN_STREAM* stream, USBGEN_STREAM_BUFFER* buffer)
+
+    Summary:
+        Queues one buffer, or a chain of buffers, on a stream.
+
+    Description:
+        Appends the buffer (and every buffer linked after it through the next
+        pointer) to the stream's submitted list.  Each buffer is one packet:
+        for an IN stream, size bytes are sent; for an OUT stream, up to size
+        bytes are received.  If any buffer of the chain is larger than the
+        maxPacketSize given to USBGenStreamInit(), or than 255 bytes, none of
+        them is queued.  Buffers are armed on the endpoint's BDTs in
+        submission order by USBGenStreamTasks(), so with ping-pong buffering
+        enabled two packets are always in flight while buffers are queued.
+
+        Typical Usage:
+        <code>
+        //Hand a filled sample buffer to the stack
+        samples[i].data = (uint8_t*)&sampleData[i][0];
+        samples[i].size = 64;
+        samples[i].next = NULL;
+        USBGenStreamSubmit(&inStream, &samples[i]);
+        </code>
+
+    PreCondition:
+        USBGenStreamInit() has been called for the stream.
+
+    Parameters:
+        USBGEN_STREAM* stream        - the stream
+        USBGEN_STREAM_BUFFER* buffer - the first buffer of a NULL terminated
+                                       chain
+
+    Return Values:
+        true  - the buffers were queued
+        false - a buffer is larger than the endpoint size or 255 bytes,
+                nothing was queued
+
+    Remarks:
+        The buffers and their data memory must not be touched by the
+        application until they are returned by USBGenStreamGetCompleted().
+
+ *******************************************************************/
+bool USBGenStreamSubmit(USBGEN_STREAM* stream, USBGEN_STREAM_BUFFER* buffer);
+
+
+/********************************************************************
+    Function:
+        USBGEN_STREAM_BUFFER* USBGenStreamGetCompleted(USBGEN_STREAM* stream)
+
+    Summary:
+        Returns the oldest completed buffer of a stream.
+
+    Description:
+        Removes and returns the oldest buffer whose transfer has finished, or
+        NULL if no buffer has completed yet.  For OUT streams the count field
+        holds the number of bytes received.  The returned buffer can be
+        refilled and passed back to USBGenStreamSubmit().
+
+        Typical Usage:
+        <code>
+        USBGEN_STREAM_BUFFER* buffer;
+
+        USBGenStreamTasks(&outStream);
+        while((buffer = USBGenStreamGetCompleted(&outStream)) != NULL)
+        {
+            ProcessSamples(buffer->data, buffer->count);
+            USBGenStreamSubmit(&outStream, buffer);
+        }
+        </code>
+
+    PreCondition:
+        USBGenStreamInit() has been called for the stream.
+
+    Parameters:
+        USBGEN_STREAM* stream - the stream
+
+    Return Values:
+        USBGEN_STREAM_BUFFER* - the completed buffer, or NULL
+
+    Remarks:
+        None
+
+ *******************************************************************/
+USBGEN_STREAM_BUFFER* USBGenStreamGetCompleted(USBGEN_STREAM* stream);
+
+
+/********************************************************************
+    Function:
+        void USBGenStreamTasks(USBGEN_STREAM* stream)
+
+    Summary:
+        Moves finished buffers to the completed list and keeps the
+        endpoint's BDTs armed.
+
+    Description:
+        Retires every armed buffer whose BDT has been released by the SIE,
+        then arms submitted buffers on the endpoint until all of its BDTs
+        (two with ping-pong buffering, otherwise one) are owned by the SIE.
+        If the endpoint is left with nothing armed, the underrun (IN) or
+        overrun (OUT) counter is incremented once for that starvation
+        period.
+
+        This function should be called periodically from the main loop, at
+        least once per packet time of the stream, or from the EVENT_TRANSFER
+        handler when the stack is operated in USB_POLLING mode.
+
+    PreCondition:
+        USBGenStreamInit() has been called for the stream.
+
+    Parameters:
+        USBGEN_STREAM* stream - the stream
+
+    Return Values:
+        None
+
+    Remarks:
+        The stream functions are not re-entrant.  If USBGenStreamTasks() is
+        called from interrupt context, the application must disable the USB
+        interrupt around its own USBGenStreamSubmit() and
+        USBGenStreamGetCompleted() calls.
+
+ *******************************************************************/
+void USBGenStreamTasks(USBGEN_STREAM* stream);
+
+
+/********************************************************************
+    Function:
+        uint16_t USBGenStreamGetOverrunCount(USBGEN_STREAM* stream)
+        uint16_t USBGenStreamGetUnderrunCount(USBGEN_STREAM* stream)
+
+    Summary:
+        Return the starvation counters of a stream.
+
+    Description:
+        The overrun count applies to OUT streams and counts how many times
+        the endpoint had no receive buffer armed (the host was NAKed and data
+        may have been held off or lost).  The underrun count applies to IN
+        streams and counts how many times the endpoint had no data armed
+        when the host could have read it.  Both counters saturate at 0xFFFF
+        and are cleared by USBGenStreamInit().
+
+    PreCondition:
+        USBGenStreamInit() has been called for the stream.
+
+    Parameters:
+        USBGEN_STREAM* stream - the stream
+
+    Return Values:
+        uint16_t - the counter value
+
+    Remarks:
+        Implemented as macros.
+
+ *******************************************************************/
+#define USBGenStreamGetOverrunCount(stream)     ((stream)->overrunCount)
+#define USBGenStreamGetUnderrunCount(stream)    ((stream)->underrunCount)
+
+
 /********************************************************************
 	Function:
 		void USBCheckVendorRequest(void)
@@ -0,0 +1,480 @@
+// DOM-IGNORE-BEGIN
+/*******************************************************************************
+Copyright 2015 Microchip Technology Inc. (www.microchip.com)
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+To request to license the code under the MLA license (www.microchip.com/mla_license),
+please contact mla_licensing@microchip.com
+*******************************************************************************/
+//DOM-IGNORE-END
+
+/*******************************************************************************
+  USB Device HID Report Builder
+
+  Company:
+    Microchip Technology Inc.
+
+  File Name:
+    usb_device_hid_report.h
+
+  Summary:
+    Declarative report descriptor and report packing macros for the device
+    HID class.
+
+  Description:
+    A HID report is described once, as a list of fields, and that single list
+    is used to produce both the report descriptor bytes (hid_rpt01) and a set
+    of pack/unpack functions for the report buffer.  The bit offset and width
+    of every field are compile time constants, so with optimizations enabled
+    filling a report reduces to a few shifts and masks per field instead of a
+    generic bit loop.
+
+    A report is described with an "X-macro" list.  Each line names one field:
+
+    <code>
+    // FIELD(report, name, usagePage, usageMin, reportSize, reportCount,
+    //       logicalMin, logicalMax, mainFlags)
+    #define MOUSE_REPORT(FIELD, r) \
+        FIELD(r, buttons, USB_HID_USAGE_PAGE_BUTTON, 1, 1, 3, 0, 1, \
+              USB_HID_RD_DATA | USB_HID_RD_VARIABLE | USB_HID_RD_ABSOLUTE) \
+        USB_HID_RD_PADDING(FIELD, r, 5) \
+        FIELD(r, x, USB_HID_USAGE_PAGE_GENERIC_DESKTOP_CONTROLS, 0x30, 8, 1, -127, 127, \
+              USB_HID_RD_DATA | USB_HID_RD_VARIABLE | USB_HID_RD_RELATIVE) \
+        FIELD(r, y, USB_HID_USAGE_PAGE_GENERIC_DESKTOP_CONTROLS, 0x31, 8, 1, -127, 127, \
+              USB_HID_RD_DATA | USB_HID_RD_VARIABLE | USB_HID_RD_RELATIVE)
+    </code>
+
+    The descriptor is then built from the list (in usb_descriptors.c):
+
+    <code>
+    #define HID_RPT01_SIZE  (USB_HID_RD_COLLECTION_BYTES + USB_HID_RD_REPORT_BYTES(MOUSE_REPORT))
+
+    const struct{uint8_t report[HID_RPT01_SIZE];}hid_rpt01={{
+        USB_HID_RD_USAGE_PAGE(USB_HID_USAGE_PAGE_GENERIC_DESKTOP_CONTROLS),
+        USB_HID_RD_USAGE(0x02),
+        USB_HID_RD_COLLECTION(USB_HID_RD_COLLECTION_APPLICATION),
+        USB_HID_RD_INPUT_REPORT(MOUSE_REPORT)
+        USB_HID_RD_END_COLLECTION
+    }};
+    </code>
+
+    and the accessors are generated from the same list (in the application):
+
+    <code>
+    USB_DEVICE_HID_REPORT_ACCESSORS(Mouse, 0, MOUSE_REPORT)
+
+    uint8_t hid_report_in[Mouse_REPORT_LENGTH];
+
+    Mouse_Clear(hid_report_in);
+    Mouse_buttons_Pack(hid_report_in, buttonState);
+    Mouse_x_Pack(hid_report_in, dx);
+    Mouse_y_Pack(hid_report_in, dy);
+    </code>
+
+    Each field is packed as a single integer of reportSize * reportCount bits
+    (for example the three button bits above are packed as one 3-bit bitmap),
+    so that product must not exceed 32.  Fields are laid out in list order
+    starting at bit 0 of the first byte after the report ID (if any), which
+    matches the order in which the host parses the main items.
+
+    Constant padding is added with USB_HID_RD_PADDING(), which needs no name,
+    so a list can hold any number of padding fields.
+*******************************************************************************/
+
+#ifndef USB_DEVICE_HID_REPORT_H
+#define USB_DEVICE_HID_REPORT_H
+
+/** I N C L U D E S **********************************************************/
+#include <stdint.h>
+#include <stddef.h>
+#include "usb_hid.h"
+
+/** D E F I N I T I O N S ****************************************************/
+
+// Short item prefixes as defined in section 6.2.2 of the HID v1.11
+// specification.  The size code (bits 1:0) is filled in by the
+// USB_HID_RD_ITEM_x() macros below.
+#define USB_HID_RD_PREFIX_INPUT             0x80
+#define USB_HID_RD_PREFIX_OUTPUT            0x90
+#define USB_HID_RD_PREFIX_FEATURE           0xB0
+#define USB_HID_RD_PREFIX_COLLECTION        0xA0
+#define USB_HID_RD_PREFIX_END_COLLECTION    0xC0
+#define USB_HID_RD_PREFIX_USAGE_PAGE        0x04
+#define USB_HID_RD_PREFIX_LOGICAL_MINIMUM   0x14
+#define USB_HID_RD_PREFIX_LOGICAL_MAXIMUM   0x24
+#define USB_HID_RD_PREFIX_REPORT_SIZE       0x74
+#define USB_HID_RD_PREFIX_REPORT_ID         0x84
+#define USB_HID_RD_PREFIX_REPORT_COUNT      0x94
+#define USB_HID_RD_PREFIX_USAGE             0x08
+#define USB_HID_RD_PREFIX_USAGE_MINIMUM     0x18
+#define USB_HID_RD_PREFIX_USAGE_MAXIMUM     0x28
+
+// Main item data bits (section 6.2.2.5).  OR these together for the
+// mainFlags column of a field list.
+#define USB_HID_RD_DATA                     0x00
+#define USB_HID_RD_CONSTANT                 0x01
+#define USB_HID_RD_ARRAY                    0x00
+#define USB_HID_RD_VARIABLE                 0x02
+#define USB_HID_RD_ABSOLUTE                 0x00
+#define USB_HID_RD_RELATIVE                 0x04
+#define USB_HID_RD_NO_WRAP                  0x00
+#define USB_HID_RD_WRAP                     0x08
+#define USB_HID_RD_LINEAR                   0x00
+#define USB_HID_RD_NON_LINEAR               0x10
+#define USB_HID_RD_PREFERRED_STATE          0x00
+#define USB_HID_RD_NO_PREFERRED             0x20
+#define USB_HID_RD_NO_NULL_POSITION         0x00
+#define USB_HID_RD_NULL_STATE               0x40
+#define USB_HID_RD_NON_VOLATILE             0x00
+#define USB_HID_RD_VOLATILE                 0x80
+
+// Collection types (section 6.2.2.6)
+#define USB_HID_RD_COLLECTION_PHYSICAL      0x00
+#define USB_HID_RD_COLLECTION_APPLICATION   0x01
+#define USB_HID_RD_COLLECTION_LOGICAL       0x02
+
+// Raw item encoders.  Each one expands to a comma separated list of bytes.
+#define USB_HID_RD_ITEM_0(prefix)           (uint8_t)(prefix)
+#define USB_HID_RD_ITEM_1(prefix, v)        (uint8_t)((prefix) | 0x01), \
+                                            (uint8_t)((uint32_t)(v))
+#define USB_HID_RD_ITEM_2(prefix, v)        (uint8_t)((prefix) | 0x02), \
+                                            (uint8_t)((uint32_t)(v)), \
+                                            (uint8_t)((uint32_t)(v) >> 8)
+#define USB_HID_RD_ITEM_4(prefix, v)        (uint8_t)((prefix) | 0x03), \
+                                            (uint8_t)((uint32_t)(int32_t)(v)), \
+                                            (uint8_t)((uint32_t)(int32_t)(v) >> 8), \
+                                            (uint8_t)((uint32_t)(int32_t)(v) >> 16), \
+                                            (uint8_t)((uint32_t)(int32_t)(v) >> 24)
+
+// Convenience items for the parts of a descriptor that are not generated
+// from a field list (top level collections, report IDs).
+#define USB_HID_RD_USAGE_PAGE(page)         USB_HID_RD_ITEM_2(USB_HID_RD_PREFIX_USAGE_PAGE, page)
+#define USB_HID_RD_USAGE(usage)             USB_HID_RD_ITEM_2(USB_HID_RD_PREFIX_USAGE, usage)
+#define USB_HID_RD_COLLECTION(type)         USB_HID_RD_ITEM_1(USB_HID_RD_PREFIX_COLLECTION, type)
+#define USB_HID_RD_END_COLLECTION           USB_HID_RD_ITEM_0(USB_HID_RD_PREFIX_END_COLLECTION)
+#define USB_HID_RD_REPORT_ID(id)            USB_HID_RD_ITEM_1(USB_HID_RD_PREFIX_REPORT_ID, id)
+
+// Number of bytes used by the items above, for computing HID_RPT01_SIZE.
+// USB_HID_RD_COLLECTION_BYTES covers the usage page, usage, collection and
+// end collection items that wrap a top level application collection.
+#define USB_HID_RD_USAGE_PAGE_BYTES         3
+#define USB_HID_RD_USAGE_BYTES              3
+#define USB_HID_RD_REPORT_ID_BYTES          2
+#define USB_HID_RD_COLLECTION_BYTES         (USB_HID_RD_USAGE_PAGE_BYTES + USB_HID_RD_USAGE_BYTES + 2 + 1)
+
+// Every field expands to the same fixed set of items: usage page, usage
+// minimum, usage maximum, logical minimum, logical maximum, report size,
+// report count and the main item.  Logical limits always use the four byte
+// form so that signed and 32-bit ranges are encoded correctly.
+#define USB_HID_RD_FIELD_BYTES              25
+
+// DOM-IGNORE-BEGIN
+#define _USB_HID_RD_FIELD(mainPrefix, page, usageMin, size, count, logicalMin, logicalMax, flags) \
+    USB_HID_RD_ITEM_2(USB_HID_RD_PREFIX_USAGE_PAGE, page), \
+    USB_HID_RD_ITEM_2(USB_HID_RD_PREFIX_USAGE_MINIMUM, usageMin), \
+    USB_HID_RD_ITEM_2(USB_HID_RD_PREFIX_USAGE_MAXIMUM, (usageMin) + (count) - 1), \
+    USB_HID_RD_ITEM_4(USB_HID_RD_PREFIX_LOGICAL_MINIMUM, logicalMin), \
+    USB_HID_RD_ITEM_4(USB_HID_RD_PREFIX_LOGICAL_MAXIMUM, logicalMax), \
+    USB_HID_RD_ITEM_1(USB_HID_RD_PREFIX_REPORT_SIZE, size), \
+    USB_HID_RD_ITEM_1(USB_HID_RD_PREFIX_REPORT_COUNT, count), \
+    USB_HID_RD_ITEM_1(mainPrefix, flags),
+
+#define _USB_HID_RD_INPUT_FIELD(r, name, page, usageMin, size, count, logicalMin, logicalMax, flags) \
+    _USB_HID_RD_FIELD(USB_HID_RD_PREFIX_INPUT, page, usageMin, size, count, logicalMin, logicalMax, flags)
+#define _USB_HID_RD_OUTPUT_FIELD(r, name, page, usageMin, size, count, logicalMin, logicalMax, flags) \
+    _USB_HID_RD_FIELD(USB_HID_RD_PREFIX_OUTPUT, page, usageMin, size, count, logicalMin, logicalMax, flags)
+#define _USB_HID_RD_FEATURE_FIELD(r, name, page, usageMin, size, count, logicalMin, logicalMax, flags) \
+    _USB_HID_RD_FIELD(USB_HID_RD_PREFIX_FEATURE, page, usageMin, size, count, logicalMin, logicalMax, flags)
+#define _USB_HID_RD_FIELD_SIZE(r, name, page, usageMin, size, count, logicalMin, logicalMax, flags) \
+    + USB_HID_RD_FIELD_BYTES
+
+// The layout type is never instantiated.  Each member is one byte per report
+// bit, so offsetof() of a member is the bit offset of the field and sizeof()
+// of the type is the number of bits in the report.
+#define _USB_HID_LAYOUT_MEMBER(r, name, page, usageMin, size, count, logicalMin, logicalMax, flags) \
+    uint8_t name[(size) * (count)];
+
+// Padding fields.  USB_HID_RD_PADDING() pastes _PAD onto the name of the
+// callback, so each callback above has a padding variant.  The layout member
+// of a padding field gets a generated name that is never referenced.
+#define _USB_HID_RD_INPUT_FIELD_PAD(r, bits) \
+    _USB_HID_RD_FIELD(USB_HID_RD_PREFIX_INPUT, 0, 0, bits, 1, 0, 0, USB_HID_RD_CONSTANT)
+#define _USB_HID_RD_OUTPUT_FIELD_PAD(r, bits) \
+    _USB_HID_RD_FIELD(USB_HID_RD_PREFIX_OUTPUT, 0, 0, bits, 1, 0, 0, USB_HID_RD_CONSTANT)
+#define _USB_HID_RD_FEATURE_FIELD_PAD(r, bits) \
+    _USB_HID_RD_FIELD(USB_HID_RD_PREFIX_FEATURE, 0, 0, bits, 1, 0, 0, USB_HID_RD_CONSTANT)
+#define _USB_HID_RD_FIELD_SIZE_PAD(r, bits) \
+    + USB_HID_RD_FIELD_BYTES
+
+#if defined(__COUNTER__)
+    #define _USB_HID_PAD_UNIQUE             __COUNTER__
+#else
+    // Without __COUNTER__ every padding field of a list expands on the same
+    // line, so a list can only hold one.
+    #define _USB_HID_PAD_UNIQUE             __LINE__
+#endif
+#define _USB_HID_PAD_NAME_PASTE(n)          _usb_hid_pad_##n
+#define _USB_HID_PAD_NAME(n)                _USB_HID_PAD_NAME_PASTE(n)
+#define _USB_HID_LAYOUT_MEMBER_PAD(r, bits) \
+    uint8_t _USB_HID_PAD_NAME(_USB_HID_PAD_UNIQUE)[bits];
+
+#define _USB_HID_FIELD_ACCESSORS_PAD(r, bits)
+
+#define _USB_HID_FIELD_ACCESSORS(r, name, page, usageMin, size, count, logicalMin, logicalMax, flags) \
+    static inline void r##_##name##_Pack(uint8_t* report, int32_t value) \
+    { \
+        (void)sizeof(char[(((size) * (count)) <= 32) ? 1 : -1]); \
+        USBHIDReportFieldPack(report, \
+                              r##_REPORT_BIT_BASE + offsetof(r##_LAYOUT, name), \
+                              (size) * (count), \
+                              (uint32_t)value); \
+    } \
+    static inline int32_t r##_##name##_Unpack(const uint8_t* report) \
+    { \
+        return USBHIDReportFieldUnpack(report, \
+                                       r##_REPORT_BIT_BASE + offsetof(r##_LAYOUT, name), \
+                                       (size) * (count), \
+                                       ((logicalMin) < 0)); \
+    }
+// DOM-IGNORE-END
+
+/********************************************************************
+    Macro:
+        USB_HID_RD_PADDING(FIELD, r, bits)
+
+    Summary:
+        Adds a constant padding field to a field list.
+
+    Description:
+        Used in place of a FIELD(...) line of a field list.  The padding is a
+        single Constant main item of the given number of bits.  No pack or
+        unpack functions are generated for it, so it needs no name, and a
+        list can contain several padding fields.
+
+    Parameters:
+        FIELD - the FIELD parameter of the field list macro
+        r     - the r parameter of the field list macro
+        bits  - width of the padding in bits
+ *******************************************************************/
+#define USB_HID_RD_PADDING(FIELD, r, bits)  FIELD##_PAD(r, bits)
+
+/********************************************************************
+    Macro:
+        USB_HID_RD_INPUT_REPORT(FIELDS)
+        USB_HID_RD_OUTPUT_REPORT(FIELDS)
+        USB_HID_RD_FEATURE_REPORT(FIELDS)
+
+    Summary:
+        Expands a field list into report descriptor items.
+
+    Description:
+        Expands every field of the list into its report descriptor items,
+        using an Input, Output or Feature main item respectively.  The
+        expansion ends with a comma so it can be followed directly by more
+        items (typically USB_HID_RD_END_COLLECTION).
+
+    Parameters:
+        FIELDS - the name of the field list macro
+
+    Remarks:
+        If the report uses a report ID, place USB_HID_RD_REPORT_ID(id) before
+        this macro and pass the same ID to USB_DEVICE_HID_REPORT_ACCESSORS().
+ *******************************************************************/
+#define USB_HID_RD_INPUT_REPORT(FIELDS)     FIELDS(_USB_HID_RD_INPUT_FIELD, _)
+#define USB_HID_RD_OUTPUT_REPORT(FIELDS)    FIELDS(_USB_HID_RD_OUTPUT_FIELD, _)
+#define USB_HID_RD_FEATURE_REPORT(FIELDS)   FIELDS(_USB_HID_RD_FEATURE_FIELD, _)
+
+/********************************************************************
+    Macro:
+        USB_HID_RD_REPORT_BYTES(FIELDS)
+
+    Summary:
+        Number of descriptor bytes produced by USB_HID_RD_xxx_REPORT(FIELDS).
+
+    Description:
+        Evaluates to a constant expression that can be used when defining
+        HID_RPT01_SIZE.  Does not include the report ID item, if any.
+
+    Parameters:
+        FIELDS - the name of the field list macro
+ *******************************************************************/
+#define USB_HID_RD_REPORT_BYTES(FIELDS)     (0 FIELDS(_USB_HID_RD_FIELD_SIZE, _))
+
+/********************************************************************
+    Macro:
+        USB_DEVICE_HID_REPORT_ACCESSORS(report, reportId, FIELDS)
+
+    Summary:
+        Generates the report buffer size and pack/unpack functions for a
+        field list.
+
+    Description:
+        For a report named "report" this macro defines:
+            report_REPORT_ID      - the report ID passed in (0 = none)
+            report_REPORT_LENGTH  - size of the report buffer in bytes,
+                                    including the report ID byte if used
+            report_Clear(buf)     - zeroes the buffer and writes the report ID
+            report_<field>_Pack(buf, value)
+            report_<field>_Unpack(buf)
+
+        Unpack sign extends the value for fields whose logical minimum is
+        negative.  Pack ignores value bits above the field width and leaves
+        all other bits of the buffer untouched.
+
+    Parameters:
+        report   - identifier used as the prefix for all generated names
+        reportId - the report ID, or 0 if the device does not use report IDs
+        FIELDS   - the name of the field list macro
+
+    Remarks:
+        Expand this macro once per report at file scope in the application.
+        The generated functions are static inline, so any unused ones cost
+        nothing.
+ *******************************************************************/
+#define USB_DEVICE_HID_REPORT_ACCESSORS(report, reportId, FIELDS) \
+    typedef struct { FIELDS(_USB_HID_LAYOUT_MEMBER, report) } report##_LAYOUT; \
+    enum \
+    { \
+        report##_REPORT_ID = (reportId), \
+        report##_REPORT_BIT_BASE = (((reportId) != 0) ? 8 : 0), \
+        report##_REPORT_LENGTH = (((reportId) != 0) ? 1 : 0) + ((sizeof(report##_LAYOUT) + 7) / 8) \
+    }; \
+    static inline void report##_Clear(uint8_t* buffer) \
+    { \
+        uint8_t i; \
+        for(i = 0; i < report##_REPORT_LENGTH; i++) \
+        { \
+            buffer[i] = 0; \
+        } \
+        if(report##_REPORT_ID != 0) \
+        { \
+            buffer[0] = report##_REPORT_ID; \
+        } \
+    } \
+    FIELDS(_USB_HID_FIELD_ACCESSORS, report)
+
+/********************************************************************
+    Function:
+        void USBHIDReportFieldPack(uint8_t* report, uint16_t bitOffset,
+                                   uint8_t bitSize, uint32_t value)
+
+    Summary:
+        Writes a bit field into a HID report buffer.
+
+    Description:
+        Writes the low bitSize bits of value into report starting at
+        bitOffset, least significant bit first as required by the HID
+        specification.  The bytes holding the field are merged as one word
+        with a single mask.  Normally called through the functions generated
+        by USB_DEVICE_HID_REPORT_ACCESSORS(), where bitOffset and bitSize are
+        constants, so the compiler reduces this to a few shifts and masks.
+
+    Parameters:
+        uint8_t* report    - the report buffer
+        uint16_t bitOffset - offset of the field's least significant bit
+        uint8_t bitSize    - width of the field in bits (1-32)
+        uint32_t value     - the value to write
+
+    Return Values:
+        None
+ *******************************************************************/
+static inline void USBHIDReportFieldPack(uint8_t* report, uint16_t bitOffset, uint8_t bitSize, uint32_t value)
+{
+    uint8_t* p = &report[bitOffset >> 3];
+    uint8_t shift = bitOffset & 0x07;
+    uint8_t span = (uint8_t)((shift + bitSize + 7) >> 3);
+    uint8_t bytes = (span > 4) ? 4 : span;
+    uint32_t window = 0;
+    uint32_t mask;
+    uint8_t i;
+
+    //Read the bytes holding the field as one little endian word, merge the
+    //field in with a single mask and write them back.  A 32-bit field that
+    //does not start on a byte boundary spills into a fifth byte.
+    for(i = 0; i < bytes; i++)
+    {
+        window |= (uint32_t)p[i] << (i * 8);
+    }
+
+    mask = ((bitSize < 32) ? (((uint32_t)1 << bitSize) - 1) : 0xFFFFFFFF) << shift;
+    window = (window & ~mask) | ((value << shift) & mask);
+
+    for(i = 0; i < bytes; i++)
+    {
+        p[i] = (uint8_t)(window >> (i * 8));
+    }
+
+    if(span > 4)
+    {
+        mask = ((uint32_t)1 << (shift + bitSize - 32)) - 1;
+        p[4] = (uint8_t)((p[4] & ~mask) | ((value >> (32 - shift)) & mask));
+    }
+}
+
+/********************************************************************
+    Function:
+        int32_t USBHIDReportFieldUnpack(const uint8_t* report,
+                                        uint16_t bitOffset, uint8_t bitSize,
+                                        uint8_t isSigned)
+
+    Summary:
+        Reads a bit field from a HID report buffer.
+
+    Description:
+        Reads bitSize bits from report starting at bitOffset.  If isSigned is
+        set the result is sign extended from the most significant field bit.
+
+    Parameters:
+        const uint8_t* report - the report buffer
+        uint16_t bitOffset    - offset of the field's least significant bit
+        uint8_t bitSize       - width of the field in bits (1-32)
+        uint8_t isSigned      - non-zero to sign extend the result
+
+    Return Values:
+        The field value.
+ *******************************************************************/
+static inline int32_t USBHIDReportFieldUnpack(const uint8_t* report, uint16_t bitOffset, uint8_t bitSize, uint8_t isSigned)
+{
+    const uint8_t* p = &report[bitOffset >> 3];
+    uint8_t shift = bitOffset & 0x07;
+    uint8_t span = (uint8_t)((shift + bitSize + 7) >> 3);
+    uint8_t bytes = (span > 4) ? 4 : span;
+    uint32_t value = 0;
+    uint8_t i;
+
+    for(i = 0; i < bytes; i++)
+    {
+        value |= (uint32_t)p[i] << (i * 8);
+    }
+
+    value >>= shift;
+    if(span > 4)
+    {
+        value |= (uint32_t)p[4] << (32 - shift);
+    }
+
+    if(bitSize < 32)
+    {
+        value &= ((uint32_t)1 << bitSize) - 1;
+
+        if(isSigned && (value & ((uint32_t)1 << (bitSize - 1))))
+        {
+            value |= ~(((uint32_t)1 << bitSize) - 1);
+        }
+    }
+
+    return (int32_t)value;
+}
+
+#endif //USB_DEVICE_HID_REPORT_H
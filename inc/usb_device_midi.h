@@ -19,6 +19,9 @@ please contact mla_licensing@microchip.com
 *******************************************************************************/
 //DOM-IGNORE-END
 
+#ifndef USB_DEVICE_MIDI_H
+#define USB_DEVICE_MIDI_H
+
 typedef union
 {
     uint32_t Val;
@@ -67,3 +70,195 @@ typedef union
 #define MIDI_CIN_CHANNEL_PREASURE               0xD
 #define MIDI_CIN_PITCH_BEND_CHANGE              0xE
 #define MIDI_CIN_SINGLE_uint8_t                    0xF
+
+/** E V E N T  P A C K E R ***************************************************/
+
+/* State of a MIDI IN (device to host) endpoint that converts a MIDI 1.0
+   byte stream into USB-MIDI event packets.  The application owns the
+   structure and the two packet buffers, which must be located in USB module
+   accessible RAM and be wMaxPacketSize bytes long. */
+typedef struct
+{
+    uint8_t*    buffer[2];      // packet buffers, filled alternately
+    USB_HANDLE  handle;         // transfer of the buffer last sent
+    uint16_t    size;           // packet buffer size, a multiple of 4
+    uint16_t    count;          // bytes queued in the active buffer
+    uint8_t     active;         // buffer being filled
+    uint8_t     ep;             // bulk IN endpoint
+    uint8_t     cable;          // cable number placed in every event
+    uint8_t     flushFrames;    // latency deadline in frames, 0 = send ASAP
+    uint8_t     age;            // frames the oldest queued event has waited
+    uint8_t     runningStatus;  // last channel voice status, 0 if none
+    uint8_t     message[3];     // message being assembled
+    uint8_t     index;          // bytes in message[]
+    uint8_t     expected;       // length of the message being assembled
+    bool        sysex;          // inside a System Exclusive message
+} USB_DEVICE_MIDI_TX;
+
+/********************************************************************
+    Function:
+        void USBMIDITxInit(USB_DEVICE_MIDI_TX* tx, uint8_t ep, uint8_t cable,
+                           uint8_t* buffer0, uint8_t* buffer1, uint16_t size,
+                           uint8_t flushFrames)
+
+    Summary:
+        Initializes a MIDI event packer.
+
+    Description:
+        Events are packed back to back into one packet buffer until it is
+        full or the oldest event has waited flushFrames frames, and then sent
+        as a single transfer.  While that transfer is in progress the other
+        buffer is filled, so a dense burst of events goes out in
+        wMaxPacketSize chunks instead of one 4 byte transfer per event.
+
+        With flushFrames set to 0 a buffer is sent as soon as the endpoint is
+        free; events only accumulate while a previous transfer is pending.
+
+        Typical Usage:
+        <code>
+        USBMIDITxInit(&midiTx, USB_DEVICE_AUDIO_MIDI_ENDPOINT, 0,
+                      midiTxBuffer[0], midiTxBuffer[1], 64, 2);
+        </code>
+
+    PreCondition:
+        The endpoint has been enabled.
+
+    Parameters:
+        USB_DEVICE_MIDI_TX* tx - the packer object
+        uint8_t ep             - bulk IN endpoint
+        uint8_t cable          - cable number of the embedded jack
+        uint8_t* buffer0       - first packet buffer
+        uint8_t* buffer1       - second packet buffer
+        uint16_t size          - size of each packet buffer (wMaxPacketSize)
+        uint8_t flushFrames    - latency deadline in frames (ms at full speed)
+
+    Return Values:
+        None
+
+    Remarks:
+        None
+
+ *******************************************************************/
+void USBMIDITxInit(USB_DEVICE_MIDI_TX* tx, uint8_t ep, uint8_t cable,
+                   uint8_t* buffer0, uint8_t* buffer1, uint16_t size,
+                   uint8_t flushFrames);
+
+/********************************************************************
+    Function:
+        uint16_t USBMIDITxPutBytes(USB_DEVICE_MIDI_TX* tx, const uint8_t* data,
+                                   uint16_t len)
+
+    Summary:
+        Converts MIDI 1.0 bytes to USB-MIDI event packets and queues them.
+
+    Description:
+        Accepts a raw MIDI byte stream, as it would appear on a DIN port:
+        running status, System Common and System Exclusive messages of any
+        length are supported, and System Real Time bytes may be interleaved
+        anywhere, including inside a SysEx message.  Stray data bytes without
+        a status are dropped.
+
+        Bytes are consumed until both packet buffers are full; the caller
+        should retry with the remainder later.
+
+    PreCondition:
+        USBMIDITxInit() has been called.
+
+    Parameters:
+        USB_DEVICE_MIDI_TX* tx - the packer object
+        const uint8_t* data    - MIDI bytes
+        uint16_t len           - number of bytes
+
+    Return Values:
+        uint16_t - number of bytes consumed
+
+    Remarks:
+        May be called from the main loop while USBMIDITxTasks() runs in the
+        USB interrupt.
+
+ *******************************************************************/
+uint16_t USBMIDITxPutBytes(USB_DEVICE_MIDI_TX* tx, const uint8_t* data, uint16_t len);
+
+/********************************************************************
+    Function:
+        bool USBMIDITxPutEvent(USB_DEVICE_MIDI_TX* tx,
+                               USB_AUDIO_MIDI_EVENT_PACKET event)
+
+    Summary:
+        Queues an already formed USB-MIDI event packet.
+
+    Description:
+        Queues an already formed USB-MIDI event packet.
+
+    PreCondition:
+        USBMIDITxInit() has been called.
+
+    Parameters:
+        USB_DEVICE_MIDI_TX* tx            - the packer object
+        USB_AUDIO_MIDI_EVENT_PACKET event - the event
+
+    Return Values:
+        true  - the event was queued
+        false - both packet buffers are full
+
+    Remarks:
+        None
+
+ *******************************************************************/
+bool USBMIDITxPutEvent(USB_DEVICE_MIDI_TX* tx, USB_AUDIO_MIDI_EVENT_PACKET event);
+
+/********************************************************************
+    Function:
+        void USBMIDITxTasks(USB_DEVICE_MIDI_TX* tx)
+
+    Summary:
+        Ages queued events and sends them when the deadline expires.
+
+    Description:
+        Call this once per frame, from the application's USB event handler on
+        EVENT_SOF.  Once the oldest queued event has waited flushFrames
+        frames, the partially filled buffer is sent as soon as the endpoint
+        is free.
+
+    PreCondition:
+        USBMIDITxInit() has been called.
+
+    Parameters:
+        USB_DEVICE_MIDI_TX* tx - the packer object
+
+    Return Values:
+        None
+
+    Remarks:
+        None
+
+ *******************************************************************/
+void USBMIDITxTasks(USB_DEVICE_MIDI_TX* tx);
+
+/********************************************************************
+    Function:
+        void USBMIDITxFlush(USB_DEVICE_MIDI_TX* tx)
+
+    Summary:
+        Sends the queued events now if the endpoint is free.
+
+    Description:
+        Sends the queued events now if the endpoint is free, regardless of
+        the latency deadline.
+
+    PreCondition:
+        USBMIDITxInit() has been called.
+
+    Parameters:
+        USB_DEVICE_MIDI_TX* tx - the packer object
+
+    Return Values:
+        None
+
+    Remarks:
+        None
+
+ *******************************************************************/
+void USBMIDITxFlush(USB_DEVICE_MIDI_TX* tx);
+
+#endif //USB_DEVICE_MIDI_H
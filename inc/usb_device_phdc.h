@@ -71,12 +71,47 @@ please contact mla_licensing@microchip.com
 
 #define PHDC_RX_ENDPOINTS			1
 #define PHDC_TX_ENDPOINTS			2
-#define PHDC_BULK_IN_QOS	0x08
-#define PHDC_BULK_OUT_QOS	0x08
-#define PHDC_INT_IN_QOS	0x01
 
-
-/* Events to the Application */
+/* QoS bins, as encoded in the bmLatencyReliability field of the PHDC QoS
+   descriptor.  Bit position is also the bin number, bin 0 being the highest
+   priority. */
+#define PHDC_QOS_LOW_LATENCY_GOOD_RELIABILITY           0x01
+#define PHDC_QOS_MEDIUM_LATENCY_GOOD_RELIABILITY        0x02
+#define PHDC_QOS_MEDIUM_LATENCY_BETTER_RELIABILITY      0x04
+#define PHDC_QOS_MEDIUM_LATENCY_BEST_RELIABILITY        0x08
+#define PHDC_QOS_HIGH_LATENCY_BEST_RELIABILITY          0x10
+#define PHDC_QOS_VERY_HIGH_LATENCY_BEST_RELIABILITY     0x20
+#define PHDC_QOS_BINS                                   6
+
+/* bmLatencyReliability of each data endpoint.  These must match the QoS
+   descriptors in the configuration descriptor; override them in
+   phd_config.h if the descriptors advertise other bins. */
+#ifndef PHDC_BULK_IN_QOS
+    #define PHDC_BULK_IN_QOS	PHDC_QOS_MEDIUM_LATENCY_BEST_RELIABILITY
+#endif
+#ifndef PHDC_BULK_OUT_QOS
+    #define PHDC_BULK_OUT_QOS	PHDC_QOS_MEDIUM_LATENCY_BEST_RELIABILITY
+#endif
+#ifndef PHDC_INT_IN_QOS
+    #define PHDC_INT_IN_QOS	PHDC_QOS_LOW_LATENCY_GOOD_RELIABILITY
+#endif
+
+/* Number of pending USBDevicePHDCSendData() requests held per QoS bin while
+   the endpoint serving that bin is busy. */
+#ifndef PHDC_TX_QUEUE_DEPTH
+    #define PHDC_TX_QUEUE_DEPTH     2
+#endif
+
+/* Define PHDC_TX_ZERO_COPY in phd_config.h to have MEM_RAM transfers sent
+   straight from the caller's buffer instead of being copied packet by packet
+   into phdc_data_tx.  Every RAM buffer passed to USBDevicePHDCSendData()
+   must then be located in USB module accessible RAM (on PIC18 devices, the
+   same section as phdc_data_tx). */
+
+
+/* Events to the Application.  With USB_APP_SEND_COMPLETE, the data pointer
+   of the callback is the buffer passed to USBDevicePHDCSendData() for the
+   transfer that completed. */
 #define USB_APP_SEND_COMPLETE               1
 #define USB_APP_DATA_RECEIVED               2
 #define USB_APP_GET_TRANSFER_SIZE           3
@@ -113,9 +148,40 @@ typedef struct PHDC_TX_ENDPOINT_STRUCT
 	uint8_t size;
 	uint8_t len;
 	uint8_t *app_buff;
+	uint8_t *packet_buff;
 	USB_HANDLE PHDCDataInHandle;
 }PHDC_TX_ENDPOINT,*PTR_PHDC_TX_ENDPOINT;
 
+/* One queued USBDevicePHDCSendData() request */
+typedef struct PHDC_TX_REQUEST_STRUCT
+{
+	uint8_t *data;
+	uint16_t length;
+	bool memtype;
+	uint32_t queued_time;
+}PHDC_TX_REQUEST;
+
+/* Pending requests of one QoS bin */
+typedef struct PHDC_TX_QUEUE_STRUCT
+{
+	PHDC_TX_REQUEST request[PHDC_TX_QUEUE_DEPTH];
+	uint8_t head;
+	uint8_t tail;
+	uint8_t count;
+}PHDC_TX_QUEUE;
+
+/* Transmit statistics of one QoS bin.  Latencies are in milliseconds, from
+   the USBDevicePHDCSendData() call to the first packet of the transfer
+   being handed to the endpoint. */
+typedef struct PHDC_QOS_BIN_STATS_STRUCT
+{
+	uint32_t sent;
+	uint32_t total_latency;
+	uint16_t last_latency;
+	uint16_t max_latency;
+	uint16_t dropped;
+}PHDC_QOS_BIN_STATS;
+
 extern volatile CTRL_TRF_SETUP SetupPkt;
 extern const uint8_t configDescriptor1[];
 
@@ -218,13 +284,18 @@ uint8_t USBDevicePHDCReceiveData(uint8_t qos, uint8_t *buffer, uint16_t len);
 
 /******************************************************************************
   Function:
-	void USBDevicePHDCSendData(uint8_t qos, uint8_t *data, uint8_t Length)
+	bool USBDevicePHDCSendData(uint8_t qos, uint8_t *data, uint16_t length, bool memtype)
 
   Summary:
-    USBDevicePHDCSendData writes an array of data to the USB.
+    USBDevicePHDCSendData queues an array of data for transmission to the USB.
 
   Description:
-    USBDevicePHDCSendData writes an array of data to the USB.
+    USBDevicePHDCSendData queues an array of data for transmission to the USB.
+    The request is placed in the queue of the highest priority QoS bin that is
+    both set in qos and served by one of the PHDC IN endpoints.  Each endpoint
+    always starts the pending transfer of its highest priority bin first, and
+    new bulk transfers are held back while the interrupt endpoint has low
+    latency data in flight, so episodic bulk uploads do not delay alarms.
 
     Typical Usage:
     <code>
@@ -242,16 +313,45 @@ uint8_t USBDevicePHDCReceiveData(uint8_t qos, uint8_t *buffer, uint16_t len);
     must be called periodically to keep sending blocks of data to the host.
 
   Conditions:
-    USBUSARTIsTxTrfReady() must return true. This indicates that the last
-    transfer is complete and is ready to receive a new block of data.
+    The data array must not be modified until USB_APP_SEND_COMPLETE is
+    reported for it.
 
   Input:
 	qos - Quality of service information
     *data - pointer to a RAM array of data to be transfered to the host
     length - the number of bytes to be transfered.
+	memtype - Indicates whether the data array is in ROM or RAM
+
+  Return:
+    true if the request was queued, false if no endpoint serves the
+    requested QoS or the queue of its bin is full.
 
  *****************************************************************************/
-void USBDevicePHDCSendData(uint8_t qos, uint8_t *data, uint16_t length, bool memtype);
+bool USBDevicePHDCSendData(uint8_t qos, uint8_t *data, uint16_t length, bool memtype);
+
+/************************************************************************
+  Function:
+        void USBDevicePHDCGetQoSBinStats(uint8_t bin, PHDC_QOS_BIN_STATS* stats)
+
+  Summary:
+    Returns the transmit statistics of a QoS bin.
+
+  Description:
+    Copies the number of transfers started, the number of requests dropped
+    because the bin's queue was full, and the last, maximum and accumulated
+    queueing latency of the bin into stats.  The average latency is
+    total_latency / sent.  Statistics are cleared by USBDevicePHDCInit().
+
+  Input:
+    bin - the QoS bin number (0 = PHDC_QOS_LOW_LATENCY_GOOD_RELIABILITY, ...)
+    stats - where to copy the statistics
+
+  Conditions:
+    None
+  Remarks:
+    None
+  ************************************************************************/
+void USBDevicePHDCGetQoSBinStats(uint8_t bin, PHDC_QOS_BIN_STATS* stats);
 /************************************************************************
   Function:
         void USBDevicePHDCTxRXService(void)
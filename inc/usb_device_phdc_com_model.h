@@ -53,6 +53,17 @@ typedef void(* PHDC_APP_CB)(uint8_t);
 #define  PHD_COM_STATE_ASSOC_OPERATING               0x05
 #define  PHD_COM_STATE_DISASSOCIATING                0x06
 
+/* Confirmed MDC_NOTI_SCAN_REPORT_FIXED event report built by the
+   PHDScanReportXxx() functions: APDU, data APDU, event report and
+   ScanReportInfoFixed headers, followed by the observations. */
+#define PHD_SCAN_REPORT_HEADER_SIZE         30
+#define PHD_SCAN_REPORT_OBSERVATION_HEADER  4
+
+/* Number of sent scan reports that can wait for their confirmation at once. */
+#ifndef PHD_SCAN_REPORT_MAX_PENDING
+    #define PHD_SCAN_REPORT_MAX_PENDING     4
+#endif
+
 /* requests */
 #define PHD_ASSOCIATION_REQUEST     0xE200
 #define PHD_ASSOCIATION_RESPONSE    0xE300
@@ -212,6 +223,7 @@ void PHDTimeoutHandler(void);
  *
  * Conditions:
  *       Before calling this function the caller should fill the Application buffer with the data to send.
+ *   The buffer must not be filled while PHDAppBufferIsBusy() returns true.
  *
  * Parameters:
  *	None
@@ -257,5 +269,238 @@ void PHDSendMeasuredData(void);
  *****************************************************************************/
 void PHDSendAppBufferPointer(uint8_t * pAppBuffer);
 
+/******************************************************************************
+ * Function:
+ *      bool PHDScanReportBegin(uint8_t *pBuffer, uint16_t size, uint32_t eventTime)
+ *
+ * Summary:
+ *      Starts a fixed format scan report that batches several observations.
+ *
+ * Description:
+ *       This function writes the headers of a confirmed MDC_NOTI_SCAN_REPORT_FIXED
+ *   event report into pBuffer.  Observations are then appended in place with
+ *   PHDScanReportAddObservation() or PHDScanReportReserveObservation(), and the
+ *   whole report is sent as one APDU with PHDScanReportSend().  The invoke-id
+ *   and scan-report-no fields are maintained by the stack.
+ *
+ *   pBuffer is the buffer the report is transmitted from; nothing is copied
+ *   between encoding and transmission.  With PHDC_TX_ZERO_COPY defined the
+ *   USB module reads the packets straight out of it, so it must then be in
+ *   USB module accessible RAM.  Passing NULL uses the application buffer
+ *   registered with PHDSendAppBufferPointer(), limited to PHDC_MAX_APDU_SIZE.
+ *
+ * Conditions:
+ *       The agent is in the operating state and the previous measurement
+ *   report has been confirmed (PHD_MEASUREMENT_SENT reported).
+ *
+ * Parameters:
+ *	uint8_t *pBuffer - buffer to build the report in, or NULL
+ *	uint16_t size - size of pBuffer in bytes
+ *	uint32_t eventTime - relative time of the event report
+ *
+ * Return:
+ *	true if the report was started, false if the buffer is too small
+ *
+ * Side Effects:
+ *	None
+ *
+ * Remarks:
+ *      None
+ *
+ *****************************************************************************/
+bool PHDScanReportBegin(uint8_t *pBuffer, uint16_t size, uint32_t eventTime);
+
+/******************************************************************************
+ * Function:
+ *      uint8_t* PHDScanReportReserveObservation(uint16_t objHandle, uint16_t length)
+ *
+ * Summary:
+ *      Reserves room for one observation in the current scan report.
+ *
+ * Description:
+ *       This function appends the obj-handle and length of an observation to
+ *   the report and returns a pointer to the length bytes of obs-val-data that
+ *   follow, so that the caller can encode the value directly in the transmit
+ *   buffer.
+ *
+ * Conditions:
+ *       PHDScanReportBegin() returned true.
+ *
+ * Parameters:
+ *	uint16_t objHandle - handle of the metric object
+ *	uint16_t length - length of the obs-val-data in bytes
+ *
+ * Return:
+ *	pointer to the obs-val-data area, or NULL if the report is full
+ *
+ * Side Effects:
+ *	None
+ *
+ * Remarks:
+ *      None
+ *
+ *****************************************************************************/
+uint8_t* PHDScanReportReserveObservation(uint16_t objHandle, uint16_t length);
+
+/******************************************************************************
+ * Function:
+ *      bool PHDScanReportAddObservation(uint16_t objHandle, const uint8_t *pData, uint16_t length)
+ *
+ * Summary:
+ *      Appends one already encoded observation to the current scan report.
+ *
+ * Description:
+ *       Same as PHDScanReportReserveObservation(), but copies length bytes of
+ *   obs-val-data from pData.
+ *
+ * Conditions:
+ *       PHDScanReportBegin() returned true.
+ *
+ * Parameters:
+ *	uint16_t objHandle - handle of the metric object
+ *	const uint8_t *pData - encoded obs-val-data
+ *	uint16_t length - length of the obs-val-data in bytes
+ *
+ * Return:
+ *	true if the observation was added, false if the report is full
+ *
+ * Side Effects:
+ *	None
+ *
+ * Remarks:
+ *      None
+ *
+ *****************************************************************************/
+bool PHDScanReportAddObservation(uint16_t objHandle, const uint8_t *pData, uint16_t length);
+
+/******************************************************************************
+ * Function:
+ *      uint16_t PHDScanReportGetObservationCount(void)
+ *
+ * Summary:
+ *      Returns the number of observations in the current scan report.
+ *
+ * Description:
+ *       Returns the number of observations added since PHDScanReportBegin().
+ *
+ * Conditions:
+ *       None
+ *
+ * Parameters:
+ *	None
+ *
+ * Return:
+ *	the observation count
+ *
+ * Side Effects:
+ *	None
+ *
+ * Remarks:
+ *      None
+ *
+ *****************************************************************************/
+uint16_t PHDScanReportGetObservationCount(void);
+
+/******************************************************************************
+ * Function:
+ *      bool PHDScanReportSend(void)
+ *
+ * Summary:
+ *      Sends the current scan report to the PHD Manager.
+ *
+ * Description:
+ *       This function fills in the length and count fields of the report and
+ *   queues it for transmission with SEND_QOS.  Each report gets its own
+ *   CONFIRM_TIMEOUT, started when its invoke-id is issued, and
+ *   PHD_MEASUREMENT_SENT is reported to the application when the Manager
+ *   confirms the report.  If any report is not confirmed in time, the
+ *   association is aborted.
+ *
+ * Conditions:
+ *       PHDScanReportBegin() returned true and at least one observation has
+ *   been added.
+ *
+ * Parameters:
+ *	None
+ *
+ * Return:
+ *	true if the report was queued for transmission, false if it could not be
+ *  sent or PHD_SCAN_REPORT_MAX_PENDING reports are waiting for confirmation
+ *
+ * Side Effects:
+ *	None
+ *
+ * Remarks:
+ *      The buffer must not be modified until PHD_MEASUREMENT_SENT is reported.
+ *   Invoke-ids of reports that are still waiting for confirmation are not
+ *   reused when the invoke-id wraps around.
+ *
+ *****************************************************************************/
+bool PHDScanReportSend(void);
+
+/******************************************************************************
+ * Function:
+ *      uint16_t PHDScanReportGetRetryCount(void)
+ *
+ * Summary:
+ *      Returns the number of PHDScanReportSend() calls that had to be retried.
+ *
+ * Description:
+ *       Counts the calls to PHDScanReportSend() that returned false with a
+ *   report ready to send, because the transmit queue was full or
+ *   PHD_SCAN_REPORT_MAX_PENDING reports were waiting for confirmation.  The
+ *   report is kept and the application sends it again later.  The count is
+ *   cleared by PHDAppInit().
+ *
+ * Conditions:
+ *       None
+ *
+ * Parameters:
+ *	None
+ *
+ * Return:
+ *	the retry count
+ *
+ * Side Effects:
+ *	None
+ *
+ * Remarks:
+ *      None
+ *
+ *****************************************************************************/
+uint16_t PHDScanReportGetRetryCount(void);
+
+/******************************************************************************
+ * Function:
+ *      bool PHDAppBufferIsBusy(void)
+ *
+ * Summary:
+ *      Returns true while a send from the application buffer is queued.
+ *
+ * Description:
+ *       The application buffer is used both to send and to receive APDUs.
+ *   Responses built by the stack, measurements and scan reports built in the
+ *   application buffer are only queued, so the buffer stays in use until
+ *   USB_APP_SEND_COMPLETE reports it back.  Until then, reception is not
+ *   armed and the application must not fill the buffer.
+ *
+ * Conditions:
+ *       None
+ *
+ * Parameters:
+ *	None
+ *
+ * Return:
+ *	true if a send from the application buffer has not completed yet
+ *
+ * Side Effects:
+ *	None
+ *
+ * Remarks:
+ *      None
+ *
+ *****************************************************************************/
+bool PHDAppBufferIsBusy(void);
+
 #endif
 
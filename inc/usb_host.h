@@ -128,6 +128,117 @@ typedef union
 } TRANSFER_ATTRIBUTES;
 
 
+// *****************************************************************************
+/* Transfer Request Status
+
+These values give the state of a USB_HOST_TRANSFER_REQUEST.
+*/
+
+#define USB_HOST_REQUEST_IDLE       0   // Not submitted.
+#define USB_HOST_REQUEST_QUEUED     1   // Waiting behind other requests on the endpoint.
+#define USB_HOST_REQUEST_ACTIVE     2   // Being transferred on the bus.
+#define USB_HOST_REQUEST_COMPLETE   3   // Done, dataCount and errorCode are valid.
+
+
+// *****************************************************************************
+/* Transfer Request Completion Callback
+
+This is the prototype of the routine called from USBHostTasks() when a
+submitted transfer request completes.  The request may be resubmitted from
+within the callback.
+*/
+
+struct _USB_HOST_TRANSFER_REQUEST;
+
+typedef void (*USB_HOST_TRANSFER_CALLBACK)( struct _USB_HOST_TRANSFER_REQUEST *pRequest );
+
+
+// *****************************************************************************
+/* Transfer Request
+
+This structure describes one transfer submitted with USBHostSubmitTransfer().
+Any number of requests may be queued on a bulk or interrupt endpoint.  They are
+performed in order, and the next one is started as soon as the previous one
+completes, so the bus is not left idle while the upper layer resubmits.  The
+structure is owned by the host stack from the time it is submitted until its
+status is USB_HOST_REQUEST_COMPLETE, and must not be modified in that time.
+*/
+
+typedef struct _USB_HOST_TRANSFER_REQUEST
+{
+    struct _USB_HOST_TRANSFER_REQUEST   *next;      // INTERNAL USE ONLY - Next request on the endpoint.
+    uint8_t                             *pData;     // Data to send, or where to store the received data.
+    uint32_t                            size;       // Number of bytes to transfer, at most 0xFFFF.
+    uint32_t                            dataCount;  // Count of bytes transferred.
+    USB_HOST_TRANSFER_CALLBACK          callback;   // Routine to call on completion, or NULL to send the normal event.
+    void                                *context;   // For the use of the submitter.
+    volatile uint8_t                    status;     // USB_HOST_REQUEST_xxx.
+    uint8_t                             errorCode;  // Result of the transfer once complete.
+} USB_HOST_TRANSFER_REQUEST;
+
+
+// *****************************************************************************
+/* Enumeration Memory Information
+
+This structure reports the use of the block of memory that holds the
+enumeration data of the attached device (see USBHostGetArenaInfo()).  The
+high water mark is kept across attaches, so after the supported devices
+have been tested it shows how much heap a device needs.
+*/
+
+typedef struct _USB_HOST_ARENA_INFO
+{
+    uint16_t    size;           // Size of the block allocated for the attached device, or 0.
+    uint16_t    used;           // Bytes of the block currently in use.
+    uint16_t    highWater;      // Most bytes ever needed by a device, including heap fallbacks.
+    uint16_t    heapFallbacks;  // Number of allocations that did not fit in the block.
+} USB_HOST_ARENA_INFO;
+
+
+// *****************************************************************************
+/* Enumeration Profile Stages
+
+These are the stages of enumeration timed by the enumeration profile (see
+USBHostGetEnumerationProfile()).  They are used as indexes into the arrays of
+USB_ENUMERATION_PROFILE.
+*/
+
+#define USB_ENUMERATION_STAGE_SETTLE                    0   // Settling delay after attach (USB_INSERT_TIME).
+#define USB_ENUMERATION_STAGE_RESET                     1   // Bus reset (USB_RESET_TIME).
+#define USB_ENUMERATION_STAGE_RESET_RECOVERY            2   // Recovery after reset (USB_RESET_RECOVERY_TIME).
+#define USB_ENUMERATION_STAGE_DEVICE_DESCRIPTOR_SIZE    3   // First 8 bytes of the device descriptor.
+#define USB_ENUMERATION_STAGE_DEVICE_DESCRIPTOR         4   // Full device descriptor and the VID/PID search of the TPL.
+#define USB_ENUMERATION_STAGE_SET_ADDRESS               5   // SET ADDRESS.
+#define USB_ENUMERATION_STAGE_CONFIG_DESCRIPTORS        6   // Configuration descriptors (and serial number, if cached).
+#define USB_ENUMERATION_STAGE_SELECT_CONFIGURATION      7   // Parsing the descriptors and OTG SET FEATURE.
+#define USB_ENUMERATION_STAGE_APPLICATION_HOLD          8   // EVENT_HOLD_BEFORE_CONFIGURATION held by the application.
+#define USB_ENUMERATION_STAGE_SET_CONFIGURATION         9   // SET CONFIGURATION and client driver initialization.
+#define USB_ENUMERATION_STAGES                          10  // Number of stages.
+
+
+// *****************************************************************************
+/* Enumeration Profile
+
+This structure reports where the time went while the attached device was
+enumerated (see USBHostGetEnumerationProfile()), so device specific delays
+can be tuned.  Times are in milliseconds and are measured from
+USBHostTasks(), so they are only as precise as the rate that it is called.
+NAKs are those received on endpoint 0.  A retry is a command that failed and
+was sent again, or an enumeration that was restarted from the bus reset.
+*/
+
+typedef struct _USB_ENUMERATION_PROFILE
+{
+    uint16_t    stageTime[USB_ENUMERATION_STAGES];      // Milliseconds spent in each stage.
+    uint16_t    stageNAKs[USB_ENUMERATION_STAGES];      // NAKs received in each stage.
+    uint8_t     stageRetries[USB_ENUMERATION_STAGES];   // Commands retried in each stage.
+    uint16_t    totalTime;                              // Milliseconds from attach until the device was running or held.
+    uint8_t     enumerationTries;                       // Number of times enumeration was started.
+    uint8_t     errorCode;                              // USB_SUCCESS, or the reason the device is held.
+    bool        complete;                               // Enumeration has finished.
+} USB_ENUMERATION_PROFILE;
+
+
 // *****************************************************************************
 /* Host Transfer Information
 
@@ -143,6 +254,7 @@ typedef struct _HOST_TRANSFER_DATA
    uint8_t                 bErrorCode;         // Transfer error code.
    TRANSFER_ATTRIBUTES  bmAttributes;       // INTERNAL USE ONLY - Endpoint transfer attributes.
    uint8_t                 clientDriver;       // INTERNAL USE ONLY - Client driver index for sending the event.
+   USB_HOST_TRANSFER_REQUEST *pRequest;        // Submitted request this transfer belongs to, or NULL.
 } HOST_TRANSFER_DATA;
 
 
@@ -606,6 +718,85 @@ bool    USBHostDeviceSpecificClientDriver( uint8_t deviceAddress );
 uint8_t    USBHostDeviceStatus( uint8_t deviceAddress );
 
 
+/****************************************************************************
+  Function:
+    void USBHostEnumerationCacheFlush( void )
+
+  Summary:
+    This function empties the enumeration cache.
+
+  Description:
+    When USB_ENABLE_ENUMERATION_CACHE is defined, the configuration selected
+    for a device is remembered after the device detaches.  When a device with
+    the same VID, PID, bcdDevice and serial number attaches again, the
+    configuration descriptors are not read from the device again, only
+    the remembered configuration is parsed, and its interfaces are bound to
+    the client drivers they were bound to before, without searching the TPL.
+
+    This function forgets all remembered devices and releases their memory.
+    It should be called if a device may have changed its descriptors without
+    changing its bcdDevice, for example after a firmware update, or if the
+    application changes its answers to EVENT_OVERRIDE_CLIENT_DRIVER_SELECTION.
+
+  Precondition:
+    None
+
+  Parameters:
+    None - None
+
+  Returns:
+    None
+
+  Remarks:
+    The device currently attached is not affected.  It is remembered again
+    the next time its configuration is selected.
+  ***************************************************************************/
+
+#if defined( USB_ENABLE_ENUMERATION_CACHE )
+void    USBHostEnumerationCacheFlush( void );
+#endif
+
+
+/****************************************************************************
+  Function:
+    uint8_t USBHostGetArenaInfo( uint8_t deviceAddress,
+                USB_HOST_ARENA_INFO *pInfo )
+
+  Summary:
+    This function reports the memory used for the device's enumeration data.
+
+  Description:
+    The device and configuration descriptors, the EP0 buffer, and the
+    interface, setting and endpoint information of the attached device are
+    all allocated from a single block of heap.  The block is allocated once,
+    when the size of the first configuration descriptor is known, and is
+    released in one step when the device detaches.  This avoids the heap
+    fragmentation caused by allocating and freeing each node separately.
+
+    This function returns the size and use of that block, the most memory
+    ever needed for a device, and the number of allocations that did not fit
+    and had to be taken from the heap.  If allocations fall back to the heap,
+    USB_HOST_ARENA_EXTRA can be defined in usb_config.h to enlarge the block.
+
+  Precondition:
+    None
+
+  Parameters:
+    uint8_t deviceAddress       - Device address, or 0 to read the high water
+                                    mark with no device attached
+    USB_HOST_ARENA_INFO *pInfo  - Where to store the information
+
+  Return Values:
+    USB_SUCCESS         - Success
+    USB_UNKNOWN_DEVICE  - Device not found
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+uint8_t    USBHostGetArenaInfo( uint8_t deviceAddress, USB_HOST_ARENA_INFO *pInfo );
+
+
 /****************************************************************************
   Function:
     uint8_t * USBHostGetCurrentConfigurationDescriptor( uint8_t deviceAddress )
@@ -656,6 +847,48 @@ uint8_t    USBHostDeviceStatus( uint8_t deviceAddress );
 #define USBHostGetDeviceDescriptor( deviceAddress )     ( pDeviceDescriptor )
 
 
+/****************************************************************************
+  Function:
+    uint8_t USBHostGetEnumerationProfile( uint8_t deviceAddress,
+                USB_ENUMERATION_PROFILE *pProfile )
+
+  Summary:
+    This function reports the time taken by each stage of enumeration.
+
+  Description:
+    When USB_ENABLE_ENUMERATION_PROFILE is defined, the host times each stage
+    of the enumeration of an attached device, and counts the NAKs and retries
+    in each stage.  When the device is running, or is held because of an
+    error, EVENT_ENUMERATION_PROFILE is sent to the application event handler
+    with the profile as its data.  This function returns the same data.
+
+    The profile shows which delays dominate the attach to ready time of a
+    device, so that values such as USB_INSERT_TIME and
+    USB_RESET_RECOVERY_TIME can be tuned.
+
+  Precondition:
+    None
+
+  Parameters:
+    uint8_t deviceAddress               - Device address, or 0 to read the
+                                            profile of the last device
+    USB_ENUMERATION_PROFILE *pProfile   - Where to store the profile
+
+  Return Values:
+    USB_SUCCESS         - Success
+    USB_UNKNOWN_DEVICE  - Device not found
+
+  Remarks:
+    The one millisecond timer interrupt is left enabled, as it is for
+    USB_ENABLE_1MS_EVENT.  If enumeration has not finished, complete is
+    false and the time of the current stage is not yet included.
+  ***************************************************************************/
+
+#if defined( USB_ENABLE_ENUMERATION_PROFILE )
+uint8_t    USBHostGetEnumerationProfile( uint8_t deviceAddress, USB_ENUMERATION_PROFILE *pProfile );
+#endif
+
+
 /****************************************************************************
   Function:
     uint8_t USBHostGetStringDescriptor ( uint8_t deviceAddress,  uint8_t stringNumber,
@@ -904,7 +1137,9 @@ void USBHostIsochronousBuffersReset( ISOCHRONOUS_DATA * isocData, uint8_t number
                                     to do this request
     USB_ENDPOINT_BUSY           - A read or write is already in progress
     USB_ILLEGAL_REQUEST         - SET CONFIGURATION cannot be performed with
-                                    this function.
+                                    this function, or the endpoints of the
+                                    setting requested by SET INTERFACE do not
+                                    fit in the bus bandwidth.
 
   Remarks:
     DTS reset is done before the command is issued.
@@ -964,7 +1199,12 @@ uint8_t    USBHostIssueDeviceRequest( uint8_t deviceAddress, uint8_t bmRequestTy
     USB_ENDPOINT_NOT_FOUND          - Invalid endpoint.
 
   Remarks:
-    None
+    If USB_ENABLE_BULK_BURST is defined in usb_config.h, the packets of a
+    bulk transfer are sent back to back from the transfer interrupt once the
+    control and periodic transfers of the frame have been serviced.  Other
+    bulk endpoints wait until the transfer ends or the frame budget is used
+    up.  The burst ends with the transfer, on a short packet, or on any NAK,
+    STALL or bus error, which are then handled as without the option.
   ***************************************************************************/
 
 uint8_t    USBHostRead( uint8_t deviceAddress, uint8_t endpoint, uint8_t *data, uint32_t size );
@@ -1206,6 +1446,63 @@ uint8_t USBHostSetNAKTimeout( uint8_t deviceAddress, uint8_t endpoint, uint16_t
 void    USBHostShutdown( void );
 
 
+/****************************************************************************
+  Function:
+    uint8_t USBHostSubmitTransfer( uint8_t deviceAddress, uint8_t endpoint,
+                USB_HOST_TRANSFER_REQUEST *pRequest )
+
+  Summary:
+    This function queues a transfer request on a bulk or interrupt endpoint.
+
+  Description:
+    This function adds a transfer request to the end of the queue of the
+    given endpoint.  The direction of the transfer is given by the endpoint.
+    If no other request is pending, the transfer is started immediately.
+    Otherwise it is started by the USB interrupt as soon as the request ahead
+    of it completes, so back-to-back transfers do not wait for USBHostTasks().
+
+    When the request completes, its dataCount and errorCode are filled in and
+    its status is set to USB_HOST_REQUEST_COMPLETE.  If callback is not NULL,
+    it is then called from USBHostTasks().  Otherwise the usual EVENT_TRANSFER
+    or EVENT_BUS_ERROR is sent to the client driver, with pRequest in the
+    HOST_TRANSFER_DATA pointing to the request.
+
+    The queue is not advanced past a request that ends in error or a STALL.
+    The remaining requests are started once the condition is cleared with
+    USBHostClearEndpointErrors(), or dropped with USBHostTerminateTransfer().
+
+  Precondition:
+    The pData, size, callback and context members of the request have been
+    set up.  The request is not already queued.
+
+  Parameters:
+    uint8_t deviceAddress               - Device address
+    uint8_t endpoint                    - Endpoint number
+    USB_HOST_TRANSFER_REQUEST *pRequest - Request to queue
+
+  Return Values:
+    USB_SUCCESS                 - Request queued.
+    USB_UNKNOWN_DEVICE          - Device with the specified address not found.
+    USB_INVALID_STATE           - We are not in a normal running state.
+    USB_ILLEGAL_REQUEST         - The request is already queued.
+    USB_ENDPOINT_ILLEGAL_TYPE   - The endpoint is not bulk or interrupt.
+    USB_ENDPOINT_STALLED        - Endpoint is stalled.  Must be cleared
+                                    by the application.
+    USB_ENDPOINT_ERROR          - Endpoint has too many errors.  Must be
+                                    cleared by the application.
+    USB_ENDPOINT_BUSY           - A transfer started with USBHostRead() or
+                                    USBHostWrite() is in progress.
+    USB_ENDPOINT_NOT_FOUND      - Invalid endpoint.
+
+  Remarks:
+    Completion callbacks and events require USB_ENABLE_TRANSFER_EVENT.
+    Without it, the status member of the request must be polled.
+  ***************************************************************************/
+
+uint8_t    USBHostSubmitTransfer( uint8_t deviceAddress, uint8_t endpoint,
+                USB_HOST_TRANSFER_REQUEST *pRequest );
+
+
 /****************************************************************************
   Function:
     uint8_t USBHostSuspendDevice( uint8_t deviceAddress )
@@ -1287,6 +1584,11 @@ void    USBHostTasks( void );
     responding to.  It is also the only way to terminate an isochronous
     transfer.
 
+    Any requests queued on the endpoint with USBHostSubmitTransfer() are
+    removed.  Their status is set to USB_HOST_REQUEST_COMPLETE with an
+    errorCode of USB_ENDPOINT_TRANSFER_CANCELLED; no callback or event is
+    sent for them.
+
   Precondition:
     None
 
@@ -1450,7 +1752,7 @@ uint8_t    USBHostVbusEvent(USB_EVENT vbusEvent, uint8_t hubAddress, uint8_t por
     USB_ENDPOINT_NOT_FOUND          - Invalid endpoint.
 
   Remarks:
-    None
+    See USBHostRead() for the effect of USB_ENABLE_BULK_BURST.
   ***************************************************************************/
 
 uint8_t    USBHostWrite( uint8_t deviceAddress, uint8_t endpoint, uint8_t *data, uint32_t size );
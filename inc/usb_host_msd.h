@@ -77,6 +77,19 @@ please contact mla_licensing@microchip.com
 #define DEVICE_INTERFACE_PROTOCOL_BULK_ONLY 0x50    // Protocol code for Bulk-only mass storage.
 
 
+// *****************************************************************************
+// Section: Command Queue
+// *****************************************************************************
+
+#if defined( USB_MSD_ENABLE_COMMAND_QUEUE )
+    // Number of commands that can wait behind the transfer in progress.  The
+    // CBW of a queued command is built when it is submitted, and is sent as
+    // soon as the CSW of the previous command has been received.
+    #ifndef USB_MSD_COMMAND_QUEUE_SIZE
+        #define USB_MSD_COMMAND_QUEUE_SIZE      2
+    #endif
+#endif
+
 // *****************************************************************************
 // Section: MSD Event Definition
 // *****************************************************************************
@@ -190,7 +203,9 @@ uint8_t    USBHostMSDDeviceStatus( uint8_t deviceAddress );
     USB_MSD_ILLEGAL_REQUEST     - Device is in an illegal state for reset
 
   Remarks:
-    None
+    If USB_MSD_ENABLE_TRANSFER_EVENT is defined, the transfer in progress
+    and any queued transfers are first completed with USB_MSD_RESET_ERROR,
+    each with its own EVENT_MSD_TRANSFER.
   ***************************************************************************/
 
 uint8_t    USBHostMSDResetDevice( uint8_t deviceAddress );
@@ -246,6 +261,10 @@ void    USBHostMSDTasks( void );
   Remarks:
     After executing this function, the application may have to reset the
     device in order for the device to continue working properly.
+
+    If USB_MSD_ENABLE_TRANSFER_EVENT is defined, the terminated transfer
+    and any queued transfers are completed with USB_MSD_RESET_ERROR, each
+    with its own EVENT_MSD_TRANSFER.
   ***************************************************************************/
 
 void    USBHostMSDTerminateTransfer( uint8_t deviceAddress );
@@ -285,7 +304,13 @@ void    USBHostMSDTerminateTransfer( uint8_t deviceAddress );
     USB_MSD_INVALID_LUN         - Specified LUN does not exist
 
   Remarks:
-    None
+    If USB_MSD_ENABLE_COMMAND_QUEUE is defined, a transfer requested while
+    another is in progress is queued, and USB_MSD_DEVICE_BUSY is returned
+    only if the queue is full.  Queued transfers are performed in order, and
+    each completion is reported with EVENT_MSD_TRANSFER, during which
+    USBHostMSDTransferIsComplete() returns its result.
+    USBHostMSDTerminateTransfer() and USBHostMSDResetDevice() complete the
+    transfer in progress and the queued transfers with USB_MSD_RESET_ERROR.
   ***************************************************************************/
 
 uint8_t    USBHostMSDTransfer( uint8_t deviceAddress, uint8_t deviceLUN, uint8_t direction, uint8_t *commandBlock,
@@ -32,6 +32,114 @@ please contact mla_licensing@microchip.com
 // *****************************************************************************
 // *****************************************************************************
 
+// Maximum number of sectors requested by a single READ10 or WRITE10 command.
+// Longer multiple sector transfers are split into several commands.  A
+// command is also limited to 0xFFFF bytes, the longest transfer of the host
+// layer, which is 127 sectors of 512 bytes.
+#ifndef USB_MSD_SCSI_MAX_TRANSFER_SECTORS
+    #define USB_MSD_SCSI_MAX_TRANSFER_SECTORS   64
+#endif
+
+// Maximum number of logical units handled.  Logical units above this number
+// are not reported to the application.
+#ifndef USB_MSD_SCSI_MAX_LUNS
+    #define USB_MSD_SCSI_MAX_LUNS               4
+#endif
+
+#if defined( USB_MSD_SCSI_ENABLE_CACHE )
+    // Number of sectors held in the sector cache.
+    #ifndef USB_MSD_SCSI_CACHE_SECTORS
+        #define USB_MSD_SCSI_CACHE_SECTORS      4
+    #endif
+
+    // Largest sector size that can be cached.  Media with larger sectors are
+    // accessed without the cache.
+    #ifndef USB_MSD_SCSI_CACHE_SECTOR_SIZE
+        #define USB_MSD_SCSI_CACHE_SECTOR_SIZE  512
+    #endif
+
+    // Define USB_MSD_SCSI_CACHE_WRITE_BACK to keep written sectors in the
+    // cache until they are evicted or USBHostMSDSCSICacheFlush() is called.
+    // Otherwise, writes go to the media immediately.
+#endif
+
+#if defined( USB_MSD_SCSI_ENABLE_READ_AHEAD )
+    // Number of sectors read ahead when sequential reads are detected.
+    #ifndef USB_MSD_SCSI_READ_AHEAD_SECTORS
+        #define USB_MSD_SCSI_READ_AHEAD_SECTORS     4
+    #endif
+
+    // Largest sector size that can be read ahead.
+    #ifndef USB_MSD_SCSI_READ_AHEAD_SECTOR_SIZE
+        #define USB_MSD_SCSI_READ_AHEAD_SECTOR_SIZE 512
+    #endif
+
+    // Number of consecutive sequential sector reads before reading ahead.
+    #ifndef USB_MSD_SCSI_READ_AHEAD_THRESHOLD
+        #define USB_MSD_SCSI_READ_AHEAD_THRESHOLD   2
+    #endif
+#endif
+
+#if defined( USB_MSD_SCSI_ENABLE_ASYNC )
+    // Number of asynchronous requests that can be outstanding at once.
+    #ifndef USB_MSD_SCSI_ASYNC_QUEUE_SIZE
+        #define USB_MSD_SCSI_ASYNC_QUEUE_SIZE   4
+    #endif
+
+    // Returned by the asynchronous submit functions if the request cannot be
+    // queued.  Valid handles are 1 to USB_MSD_SCSI_ASYNC_QUEUE_SIZE.
+    #define USB_MSD_SCSI_ASYNC_INVALID_HANDLE   0
+#endif
+
+// Define USB_MSD_SCSI_USE_UAS to also support the USB Attached SCSI client
+// driver (usb_host_uas.c).  The commands of a device are performed by the
+// driver that attached its media, so UAS devices and bulk-only devices both
+// work.  With USB_MSD_SCSI_ENABLE_ASYNC, up to USB_UAS_QUEUE_DEPTH requests
+// are given to a UAS device at once.
+
+#if defined( USB_MSD_SCSI_ENABLE_MEDIA_POLL )
+    // Interval, in milliseconds, between the TEST UNIT READY commands that
+    // poll the state of the media of each logical unit.
+    #ifndef USB_MSD_SCSI_MEDIA_POLL_INTERVAL
+        #define USB_MSD_SCSI_MEDIA_POLL_INTERVAL    500
+    #endif
+#endif
+
+
+// *****************************************************************************
+// *****************************************************************************
+// Section: Data Structures
+// *****************************************************************************
+// *****************************************************************************
+
+#if defined( USB_MSD_SCSI_ENABLE_CACHE )
+// *****************************************************************************
+/* Sector Cache Statistics
+
+This structure holds the counters of the sector cache.  They are cleared when
+the media is initialized.
+*/
+typedef struct _USB_MSD_SCSI_CACHE_STATISTICS
+{
+    uint32_t    readHits;           // Sector reads served from the cache.
+    uint32_t    readMisses;         // Sector reads that went to the media.
+    uint32_t    writeHits;          // Sector writes to a sector that was in the cache.
+    uint32_t    writeMisses;        // Sector writes to a sector that was not in the cache.
+    uint32_t    writeBacks;         // Dirty sectors written to the media.
+} USB_MSD_SCSI_CACHE_STATISTICS;
+#endif
+
+#if defined( USB_MSD_SCSI_ENABLE_ASYNC )
+// *****************************************************************************
+/* Asynchronous Request Completion Callback
+
+This function is called from USBHostMSDTasks() when an asynchronous request
+has completed.  errorCode is USB_SUCCESS or the error of the request, and
+byteCount is the number of data bytes transferred.  The callback may submit
+new requests.
+*/
+typedef void (*USB_MSD_SCSI_ASYNC_CALLBACK)( uint8_t handle, uint8_t errorCode, uint32_t byteCount );
+#endif
 
 // *****************************************************************************
 // *****************************************************************************
@@ -60,6 +168,13 @@ please contact mla_licensing@microchip.com
   Remarks:
     Since this will often be called in a loop while waiting for a device,
     we need to make sure that USB tasks are executed.
+
+    If USB_MSD_SCSI_ENABLE_MEDIA_POLL is defined, the answer also depends on
+    the state of the media, from the last TEST UNIT READY.  This function
+    does not wait for the command; it queues one for each logical unit every
+    USB_MSD_SCSI_MEDIA_POLL_INTERVAL milliseconds.  If UNIT ATTENTION reports
+    that the media may have changed, false is returned once, so the
+    application initializes the media again.
   ***************************************************************************/
 
 uint8_t    USBHostMSDSCSIMediaDetect( uint8_t * address);
@@ -223,6 +338,45 @@ uint8_t    USBHostMSDSCSIMediaReset( uint8_t * address );
 uint8_t    USBHostMSDSCSISectorRead( uint8_t * address, uint32_t sectorAddress, uint8_t *dataBuffer );
 
 
+/****************************************************************************
+  Function:
+    uint8_t USBHostMSDSCSISectorReadMultiple( uint8_t * address,
+                uint32_t sectorAddress, uint16_t sectorCount, uint8_t *dataBuffer )
+
+  Summary:
+    This function reads several contiguous sectors.
+
+  Description:
+    This function uses the SCSI command READ10 to read sectorCount contiguous
+    sectors, starting at sectorAddress, into the application buffer.  Up to
+    USB_MSD_SCSI_MAX_TRANSFER_SECTORS sectors are requested with each
+    command, so a large read costs one CBW/CSW exchange per group of sectors
+    instead of one per sector.
+
+  Precondition:
+    USBHostMSDSCSIMediaInitialize() has determined the sector size.  Until
+    then the function fails.
+
+  Parameters:
+    uint8_t * address           - Endpoint address of the device
+    uint32_t   sectorAddress    - address of the first sector to read
+    uint16_t   sectorCount      - number of sectors to read
+    uint8_t    *dataBuffer      - buffer to store data; must hold
+                                  sectorCount sectors
+
+  Return Values:
+    true    - read performed successfully
+    false   - read was not successful
+
+  Remarks:
+    This function has the same form as USBHostMSDSCSISectorRead(), with the
+    sector count added, so it can be used as the multiple sector read
+    function of a media interface.
+  ***************************************************************************/
+
+uint8_t    USBHostMSDSCSISectorReadMultiple( uint8_t * address, uint32_t sectorAddress, uint16_t sectorCount, uint8_t *dataBuffer );
+
+
 /****************************************************************************
   Function:
     uint8_t USBHostMSDSCSISectorWrite( uint8_t * address, uint32_t sectorAddress, uint8_t *dataBuffer, uint8_t allowWriteToZero )
@@ -271,6 +425,78 @@ uint8_t    USBHostMSDSCSISectorRead( uint8_t * address, uint32_t sectorAddress,
 uint8_t    USBHostMSDSCSISectorWrite( uint8_t * address, uint32_t sectorAddress, uint8_t *dataBuffer, uint8_t allowWriteToZero);
 
 
+/****************************************************************************
+  Function:
+    uint8_t USBHostMSDSCSISectorWriteMultiple( uint8_t * address,
+                uint32_t sectorAddress, uint16_t sectorCount, uint8_t *dataBuffer,
+                uint8_t allowWriteToZero )
+
+  Summary:
+    This function writes several contiguous sectors.
+
+  Description:
+    This function uses the SCSI command WRITE10 to write sectorCount
+    contiguous sectors, starting at sectorAddress, from the application
+    buffer.  Up to USB_MSD_SCSI_MAX_TRANSFER_SECTORS sectors are sent with
+    each command.
+
+  Precondition:
+    USBHostMSDSCSIMediaInitialize() has determined the sector size.  Until
+    then the function fails.
+
+  Parameters:
+    uint8_t * address           - Endpoint address of the device
+    uint32_t   sectorAddress    - address of the first sector to write
+    uint16_t   sectorCount      - number of sectors to write
+    uint8_t    *dataBuffer      - buffer with application data
+    uint8_t    allowWriteToZero - If a write to sector 0 is allowed.
+
+  Return Values:
+    true    - write performed successfully
+    false   - write was not successful
+
+  Remarks:
+    To follow convention, this function blocks until the write is complete.
+    If the write fails part way, some of the sectors may have been written.
+  ***************************************************************************/
+
+uint8_t    USBHostMSDSCSISectorWriteMultiple( uint8_t * address, uint32_t sectorAddress, uint16_t sectorCount, uint8_t *dataBuffer, uint8_t allowWriteToZero );
+
+
+// *****************************************************************************
+/* Multiple Sector Media Hooks
+
+  Summary:
+    Function types of the multiple sector read and write hooks.
+
+  Description:
+    FILEIO_DRIVE_CONFIG only has single sector read and write functions.
+    These types are the multiple sector counterparts, taking the same
+    mediaConfig pointer (the device address pointer for this driver) plus a
+    sector count, so a file system layer that transfers whole clusters or
+    files can hold them next to its FILEIO_DRIVE_CONFIG:
+
+    <code>
+        const USB_MSD_SCSI_MULTIPLE_SECTOR_HOOKS gUSBDriveMultiple =
+        {
+            (FILEIO_DRIVER_SectorReadMultiple)USBHostMSDSCSISectorReadMultiple,
+            (FILEIO_DRIVER_SectorWriteMultiple)USBHostMSDSCSISectorWriteMultiple
+        };
+    </code>
+
+    Both return true on success and false otherwise, like the single sector
+    hooks.
+*/
+typedef uint8_t (*FILEIO_DRIVER_SectorReadMultiple)( void *mediaConfig, uint32_t sectorAddress, uint16_t sectorCount, uint8_t *dataBuffer );
+typedef uint8_t (*FILEIO_DRIVER_SectorWriteMultiple)( void *mediaConfig, uint32_t sectorAddress, uint16_t sectorCount, uint8_t *dataBuffer, uint8_t allowWriteToZero );
+
+typedef struct
+{
+    FILEIO_DRIVER_SectorReadMultiple    funcSectorReadMultiple;     // Reads sectorCount contiguous sectors.
+    FILEIO_DRIVER_SectorWriteMultiple   funcSectorWriteMultiple;    // Writes sectorCount contiguous sectors.
+} USB_MSD_SCSI_MULTIPLE_SECTOR_HOOKS;
+
+
 /****************************************************************************
   Function:
     uint8_t USBHostMSDSCSIWriteProtectState( uint8_t * address )
@@ -286,13 +512,289 @@ uint8_t    USBHostMSDSCSISectorWrite( uint8_t * address, uint32_t sectorAddress,
 
   Return Values:
     0 - not write protected
+    1 - write protected
+
+  Remarks:
+    The state is read with MODE SENSE 6 by USBHostMSDSCSIMediaInitialize().
+  ***************************************************************************/
+
+uint8_t    USBHostMSDSCSIWriteProtectState( uint8_t * address );
 
 
+/****************************************************************************
+  Function:
+    uint8_t * USBHostMSDSCSIGetLUNHandle( uint8_t lun )
+
+  Summary:
+    This function returns the media handle of a logical unit.
+
+  Description:
+    This function returns the media handle of a logical unit of the attached
+    device.  The handle is passed as the mediaConfig parameter to the
+    functions of this layer, in place of a pointer to the device address, to
+    access that logical unit.  Each logical unit keeps its own capacity,
+    sector size, write protect state and ready state.
+
+  Precondition:
+    The device has reported its maximum LUN with GET MAX LUN.
+
+  Parameters:
+    uint8_t lun - Logical Unit Number
+
+  Returns:
+    The media handle of the logical unit, or NULL if the logical unit is not
+    present.
+
   Remarks:
+    A pointer to any other variable holding the device address accesses LUN
+    0, as in previous versions of this layer.
+  ***************************************************************************/
+
+uint8_t *  USBHostMSDSCSIGetLUNHandle( uint8_t lun );
+
+
+#if defined( USB_MSD_SCSI_ENABLE_CACHE )
+
+/****************************************************************************
+  Function:
+    bool USBHostMSDSCSICacheFlush( uint8_t * address )
+
+  Summary:
+    This function writes the dirty sectors of the sector cache to the media.
+
+  Description:
+    This function writes every sector of the sector cache that has been
+    written by the application but not yet by the media.  The sectors stay
+    in the cache.  It is called by USBHostMSDSCSIMediaDeinitialize().
+
+  Precondition:
     None
+
+  Parameters:
+    uint8_t * address - Endpoint address of the device
+
+  Return Values:
+    true    - All dirty sectors were written
+    false   - A sector could not be written
+
+  Remarks:
+    Without USB_MSD_SCSI_CACHE_WRITE_BACK, the cache never holds dirty
+    sectors.  Dirty sectors are lost if the device is detached.
   ***************************************************************************/
 
-uint8_t    USBHostMSDSCSIWriteProtectState( uint8_t * address );
+bool    USBHostMSDSCSICacheFlush( uint8_t * address );
+
+
+/****************************************************************************
+  Function:
+    void USBHostMSDSCSICacheGetStatistics( USB_MSD_SCSI_CACHE_STATISTICS *pStatistics )
+
+  Summary:
+    This function returns the counters of the sector cache.
+
+  Description:
+    This function copies the counters of the sector cache.
+
+  Precondition:
+    None
+
+  Parameters:
+    USB_MSD_SCSI_CACHE_STATISTICS *pStatistics - Where to store the counters
+
+  Returns:
+    None
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+void    USBHostMSDSCSICacheGetStatistics( USB_MSD_SCSI_CACHE_STATISTICS *pStatistics );
+
+#endif
+
+
+#if defined( USB_MSD_SCSI_ENABLE_ASYNC )
+
+/****************************************************************************
+  Function:
+    uint8_t USBHostMSDSCSIAsyncSectorRead( uint8_t * address,
+                uint32_t sectorAddress, uint16_t sectorCount, uint8_t *dataBuffer,
+                USB_MSD_SCSI_ASYNC_CALLBACK callback )
+
+  Summary:
+    This function queues a READ10 of several contiguous sectors.
+
+  Description:
+    This function queues a READ10 of sectorCount contiguous sectors,
+    starting at sectorAddress, and returns without waiting.  The request is
+    performed by USBHostMSDTasks().  When it completes, the callback is
+    called, or, if callback is NULL, USBHostMSDSCSIAsyncIsComplete() reports
+    the result.
+
+  Precondition:
+    USBHostMSDSCSIMediaInitialize() has determined the sector size.
+
+  Parameters:
+    uint8_t * address                       - Endpoint address of the device
+    uint32_t sectorAddress                  - address of the first sector
+    uint16_t sectorCount                    - number of sectors, 1 to
+                                              USB_MSD_SCSI_MAX_TRANSFER_SECTORS,
+                                              and at most 0xFFFF bytes
+    uint8_t *dataBuffer                     - buffer to store data; must stay
+                                              valid until the request completes
+    USB_MSD_SCSI_ASYNC_CALLBACK callback    - completion function, or NULL
+
+  Returns:
+    The handle of the request, or USB_MSD_SCSI_ASYNC_INVALID_HANDLE if the
+    device is not attached, the sector count is not valid, or the queue is
+    full.
+
+  Remarks:
+    The blocking functions of this layer should not be called while
+    asynchronous requests are outstanding.
+  ***************************************************************************/
+
+uint8_t    USBHostMSDSCSIAsyncSectorRead( uint8_t * address, uint32_t sectorAddress, uint16_t sectorCount, uint8_t *dataBuffer, USB_MSD_SCSI_ASYNC_CALLBACK callback );
+
+
+/****************************************************************************
+  Function:
+    uint8_t USBHostMSDSCSIAsyncSectorWrite( uint8_t * address,
+                uint32_t sectorAddress, uint16_t sectorCount, uint8_t *dataBuffer,
+                uint8_t allowWriteToZero, USB_MSD_SCSI_ASYNC_CALLBACK callback )
+
+  Summary:
+    This function queues a WRITE10 of several contiguous sectors.
+
+  Description:
+    This function queues a WRITE10 of sectorCount contiguous sectors,
+    starting at sectorAddress, and returns without waiting.  The request is
+    performed by USBHostMSDTasks().  When it completes, the callback is
+    called, or, if callback is NULL, USBHostMSDSCSIAsyncIsComplete() reports
+    the result.
+
+  Precondition:
+    USBHostMSDSCSIMediaInitialize() has determined the sector size.
+
+  Parameters:
+    uint8_t * address                       - Endpoint address of the device
+    uint32_t sectorAddress                  - address of the first sector
+    uint16_t sectorCount                    - number of sectors, 1 to
+                                              USB_MSD_SCSI_MAX_TRANSFER_SECTORS,
+                                              and at most 0xFFFF bytes
+    uint8_t *dataBuffer                     - buffer with application data;
+                                              must stay valid until the
+                                              request completes
+    uint8_t allowWriteToZero                - If a write to sector 0 is allowed.
+    USB_MSD_SCSI_ASYNC_CALLBACK callback    - completion function, or NULL
+
+  Returns:
+    The handle of the request, or USB_MSD_SCSI_ASYNC_INVALID_HANDLE if the
+    request is not valid or the queue is full.
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+uint8_t    USBHostMSDSCSIAsyncSectorWrite( uint8_t * address, uint32_t sectorAddress, uint16_t sectorCount, uint8_t *dataBuffer, uint8_t allowWriteToZero, USB_MSD_SCSI_ASYNC_CALLBACK callback );
+
+
+/****************************************************************************
+  Function:
+    uint8_t USBHostMSDSCSIAsyncInquiry( uint8_t * address,
+                uint8_t *inquiryData, USB_MSD_SCSI_ASYNC_CALLBACK callback )
+
+  Summary:
+    This function queues an INQUIRY command.
+
+  Description:
+    This function queues an INQUIRY command that returns the 36 bytes of
+    standard inquiry data, and returns without waiting.
+
+  Precondition:
+    None
+
+  Parameters:
+    uint8_t * address                       - Endpoint address of the device
+    uint8_t *inquiryData                    - 36 byte buffer for the data
+    USB_MSD_SCSI_ASYNC_CALLBACK callback    - completion function, or NULL
+
+  Returns:
+    The handle of the request, or USB_MSD_SCSI_ASYNC_INVALID_HANDLE if the
+    device is not attached or the queue is full.
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+uint8_t    USBHostMSDSCSIAsyncInquiry( uint8_t * address, uint8_t *inquiryData, USB_MSD_SCSI_ASYNC_CALLBACK callback );
+
+
+/****************************************************************************
+  Function:
+    uint8_t USBHostMSDSCSIAsyncTestUnitReady( uint8_t * address,
+                USB_MSD_SCSI_ASYNC_CALLBACK callback )
+
+  Summary:
+    This function queues a TEST UNIT READY command.
+
+  Description:
+    This function queues a TEST UNIT READY command, and returns without
+    waiting.  The request completes with USB_SUCCESS if the unit is ready.
+
+  Precondition:
+    None
+
+  Parameters:
+    uint8_t * address                       - Endpoint address of the device
+    USB_MSD_SCSI_ASYNC_CALLBACK callback    - completion function, or NULL
+
+  Returns:
+    The handle of the request, or USB_MSD_SCSI_ASYNC_INVALID_HANDLE if the
+    device is not attached or the queue is full.
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+uint8_t    USBHostMSDSCSIAsyncTestUnitReady( uint8_t * address, USB_MSD_SCSI_ASYNC_CALLBACK callback );
+
+
+/****************************************************************************
+  Function:
+    bool USBHostMSDSCSIAsyncIsComplete( uint8_t handle, uint8_t *errorCode,
+                uint32_t *byteCount )
+
+  Summary:
+    This function indicates whether or not an asynchronous request is
+    complete.
+
+  Description:
+    This function indicates whether or not an asynchronous request that was
+    submitted without a callback is complete.  When it returns true, the
+    error code and byte count are valid and the handle is released.
+
+  Precondition:
+    None
+
+  Parameters:
+    uint8_t handle      - Handle returned when the request was submitted
+    uint8_t *errorCode  - Error code of the request
+    uint32_t *byteCount - Number of data bytes transferred
+
+  Return Values:
+    true    - Request is complete, or the handle is not valid
+              (errorCode is USB_MSD_ILLEGAL_REQUEST)
+    false   - Request is not complete
+
+  Remarks:
+    If a callback was given, the handle is released after the callback
+    returns, and this function must not be used.
+  ***************************************************************************/
+
+bool    USBHostMSDSCSIAsyncIsComplete( uint8_t handle, uint8_t *errorCode, uint32_t *byteCount );
+
+#endif
 
 
 // *****************************************************************************
@@ -357,4 +859,37 @@ bool USBHostMSDSCSIInitialize( uint8_t address, uint32_t flags, uint8_t clientDr
 bool USBHostMSDSCSIEventHandler( uint8_t address, USB_EVENT event, void *data, uint32_t size );
 
 
+#if defined( USB_MSD_SCSI_ENABLE_MEDIA_POLL )
+/****************************************************************************
+  Function:
+    bool USBHostMSDSCSIDataEventHandler( uint8_t address, USB_EVENT event,
+                        void *data, uint32_t size )
+
+  Description:
+    This function is called by the USB Embedded Host layer when a data event
+    occurs.  EVENT_1MS times the TEST UNIT READY polls of the media.
+
+  Precondition:
+    None
+
+  Parameters:
+    uint8_t address    -   Address of the device
+    USB_EVENT event -   Event that has occurred
+    void *data      -   Pointer to data pertinent to the event
+    uint32_t size      -   Size of the data
+
+  Return Values:
+    true    -   Event was handled
+    false   -   Event was not handled
+
+  Remarks:
+    This function should be specified as the DataEventHandler() of the mass
+    storage entry in the usbClientDrvTable[] array, and USB_ENABLE_1MS_EVENT
+    and USB_HOST_APP_DATA_EVENT_HANDLER must be defined.
+  ***************************************************************************/
+
+bool USBHostMSDSCSIDataEventHandler( uint8_t address, USB_EVENT event, void *data, uint32_t size );
+#endif
+
+
 #endif
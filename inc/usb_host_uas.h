@@ -0,0 +1,373 @@
+// DOM-IGNORE-BEGIN
+/*******************************************************************************
+Copyright 2015 Microchip Technology Inc. (www.microchip.com)
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+To request to license the code under the MLA license (www.microchip.com/mla_license),
+please contact mla_licensing@microchip.com
+*******************************************************************************/
+//DOM-IGNORE-END
+
+/*******************************************************************************
+
+    USB Host USB Attached SCSI Client Driver (Header File)
+
+Description:
+    This is the USB Attached SCSI (UAS) client driver file for a USB Embedded
+    Host device.  This driver should be used in a project with usb_host.c to
+    provided the USB hardware interface, and with usb_host_msd_scsi.c to
+    provide the media interface to the file system.
+
+    To interface with USB Embedded Host layer, the routine
+    USBHostUASInitialize() should be specified as the Initialize() function,
+    and USBHostUASEventHandler() should be specified as the EventHandler()
+    function in the usbClientDrvTable[] array declared in usb_config.c.  The
+    TPL must list the mass storage class with the SCSI subclass and the UAS
+    protocol (DEVICE_INTERFACE_PROTOCOL_UAS).  USBHostUASTasks() must be
+    called periodically.
+
+    To use this driver together with the bulk-only driver, define
+    USB_MSD_SCSI_USE_UAS in usb_config.h.  usb_host_msd_scsi.c then performs
+    the commands of each device through the driver that attached its media,
+    and the media interface layer receives the same events
+    (EVENT_MSD_MAX_LUN, EVENT_MSD_TRANSFER, EVENT_MSD_RESET and
+    EVENT_DETACH) from either driver.
+
+    The driver selects the UAS alternate setting of the interface, and finds
+    the command, status, data-in and data-out pipes from their pipe usage
+    descriptors.  Up to USB_UAS_QUEUE_DEPTH tagged commands are given to the
+    device at once, and the device performs them in the order it chooses.
+    The completions are reported in the order the commands were submitted,
+    so the media interface layer sees the same sequence of results as with
+    the bulk-only driver.  Sense data is returned by the device with the
+    status of a failed command, and a following REQUEST SENSE for that
+    logical unit is answered from it.
+
+    The USB Embedded Host layer does not support bulk streams, so the pipes
+    are used as specified for USB 2.0 devices: the device requests the data
+    phase of each command with a READ READY or WRITE READY information unit
+    on the status pipe.
+
+    When an interface offers both transports in different alternate
+    settings, it is given to the driver whose TPL entry comes first.  List
+    the UAS entry before the bulk-only entry, so UAS is used when the device
+    supports it and the bulk-only transport otherwise.  If the TPL lists only
+    the UAS protocol, devices that support only the bulk-only transport are
+    not bound to any driver.
+
+Summary:
+    This is the USB Attached SCSI client driver file for a USB Embedded Host
+    device.
+
+*******************************************************************************/
+
+#ifndef __USBHOSTUAS_H__
+#define __USBHOSTUAS_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "usb_host_msd.h"
+
+// *****************************************************************************
+// *****************************************************************************
+// Section: Constants
+// *****************************************************************************
+// *****************************************************************************
+
+// Number of commands that can be given to the device at once.  A REQUEST
+// SENSE that is answered from the sense data of a failed command also uses
+// one of the command slots.
+#ifndef USB_UAS_QUEUE_DEPTH
+    #define USB_UAS_QUEUE_DEPTH         4
+#endif
+
+// Protocol code for USB Attached SCSI.
+#define DEVICE_INTERFACE_PROTOCOL_UAS   0x62
+
+// Pipe usage descriptor type and pipe IDs (UAS section 5.3.3.1).
+#define USB_UAS_DESCRIPTOR_PIPE_USAGE   0x24
+
+#define USB_UAS_PIPE_COMMAND            1
+#define USB_UAS_PIPE_STATUS             2
+#define USB_UAS_PIPE_DATA_IN            3
+#define USB_UAS_PIPE_DATA_OUT           4
+
+// Information unit IDs (UAS section 6.2).
+#define USB_UAS_IU_COMMAND              0x01
+#define USB_UAS_IU_SENSE                0x03
+#define USB_UAS_IU_RESPONSE             0x04
+#define USB_UAS_IU_TASK_MANAGEMENT      0x05
+#define USB_UAS_IU_READ_READY           0x06
+#define USB_UAS_IU_WRITE_READY          0x07
+
+
+// *****************************************************************************
+// *****************************************************************************
+// Section: Host Stack Interface Functions
+// *****************************************************************************
+// *****************************************************************************
+
+/****************************************************************************
+  Function:
+    bool USBHostUASInitialize( uint8_t address, uint32_t flags,
+                        uint8_t clientDriverID )
+
+  Summary:
+    This function is called by the USB Embedded Host layer when a UAS device
+    attaches.
+
+  Description:
+    This routine is a call out from the USB Embedded Host layer to the USB
+    Attached SCSI client driver.  It is called when a device with a UAS
+    interface has been configured.  It finds the UAS alternate setting and
+    its pipes, and starts the driver state machine, which selects the
+    setting and reads the logical unit inventory of the device.
+
+  Precondition:
+    The device has been configured.
+
+  Parameters:
+    uint8_t address         - Device's address on the bus
+    uint32_t flags          - Initialization flags
+    uint8_t clientDriverID  - Client driver identification for device requests
+
+  Return Values:
+    true    - Initialization was successful
+    false   - Initialization failed
+
+  Remarks:
+    This function should only be called by the USB Embedded Host layer.
+  ***************************************************************************/
+
+bool USBHostUASInitialize( uint8_t address, uint32_t flags, uint8_t clientDriverID );
+
+
+/****************************************************************************
+  Function:
+    bool USBHostUASEventHandler( uint8_t address, USB_EVENT event,
+                        void *data, uint32_t size )
+
+  Summary:
+    This function is called by the USB Embedded Host layer when the UAS
+    device generates an event.
+
+  Description:
+    This function is called by the USB Embedded Host layer when the UAS
+    device generates an event.  The driver polls for the completion of its
+    transfers, so only EVENT_DETACH is acted on.
+
+  Precondition:
+    None
+
+  Parameters:
+    uint8_t address     - Address of the device
+    USB_EVENT event     - Event that has occurred
+    void *data          - Pointer to data pertinent to the event
+    uint32_t size       - Size of the data
+
+  Return Values:
+    true    - Event was handled
+    false   - Event was not handled
+
+  Remarks:
+    This function should only be called by the USB Embedded Host layer.
+  ***************************************************************************/
+
+bool USBHostUASEventHandler( uint8_t address, USB_EVENT event, void *data, uint32_t size );
+
+
+// *****************************************************************************
+// *****************************************************************************
+// Section: Media Interface Functions
+// *****************************************************************************
+// *****************************************************************************
+
+/****************************************************************************
+  Function:
+    uint8_t USBHostUASDeviceStatus( uint8_t deviceAddress )
+
+  Description:
+    This function determines the status of a UAS device.
+
+  Precondition:
+    None
+
+  Parameters:
+    uint8_t deviceAddress - address of device to query
+
+  Return Values:
+    USB_MSD_DEVICE_NOT_FOUND -  Illegal device address, or the device is not
+                                a UAS device
+    USB_MSD_INITIALIZING     -  Device is attached and in the process of
+                                initializing
+    USB_MSD_NORMAL_RUNNING   -  Device is in normal running mode
+    USB_MSD_RESETTING_DEVICE -  Device is resetting
+    USB_MSD_ERROR_STATE      -  Device is holding due to an error.  No
+                                communication is allowed.
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+uint8_t    USBHostUASDeviceStatus( uint8_t deviceAddress );
+
+
+/****************************************************************************
+  Function:
+    uint8_t USBHostUASResetDevice( uint8_t deviceAddress )
+
+  Summary:
+    This function starts a reset of the UAS pipes.
+
+  Description:
+    This function discards every outstanding command, cancels the transfers
+    on the pipes, and clears the halt condition of each pipe.
+    EVENT_MSD_RESET is sent to the media interface layer when the reset is
+    complete.
+
+  Precondition:
+    None
+
+  Parameters:
+    uint8_t deviceAddress - Device address
+
+  Return Values:
+    USB_SUCCESS                 - Reset started
+    USB_MSD_DEVICE_NOT_FOUND    - No device with specified address
+    USB_MSD_ILLEGAL_REQUEST     - Device is in an illegal state for reset
+
+  Remarks:
+    UAS has no class specific reset request.  The commands that the device
+    was performing are not aborted at the device.
+  ***************************************************************************/
+
+uint8_t    USBHostUASResetDevice( uint8_t deviceAddress );
+
+
+/****************************************************************************
+  Function:
+    void USBHostUASTasks( void )
+
+  Summary:
+    This function performs the background tasks of the UAS client driver.
+
+  Description:
+    This function performs the background tasks of the UAS client driver.
+    It selects the UAS alternate setting, sends the command information
+    units, reads the status pipe, performs the data phases requested by the
+    device, and reports completed commands to the media interface layer.
+
+  Precondition:
+    None
+
+  Parameters:
+    None - None
+
+  Returns:
+    None
+
+  Remarks:
+    This function should be called periodically, after USBHostTasks().
+  ***************************************************************************/
+
+void    USBHostUASTasks( void );
+
+
+/****************************************************************************
+  Function:
+    uint8_t USBHostUASTransfer( uint8_t deviceAddress, uint8_t deviceLUN,
+                uint8_t direction, uint8_t *commandBlock, uint8_t commandBlockLength,
+                uint8_t *data, uint32_t dataLength )
+
+  Summary:
+    This function queues a tagged SCSI command.
+
+  Description:
+    This function queues a tagged SCSI command, and returns without waiting.
+    The command information unit is sent by USBHostUASTasks(), while earlier
+    commands may still be in progress.
+
+  Precondition:
+    None
+
+  Parameters:
+    uint8_t deviceAddress      - Device address
+    uint8_t deviceLUN          - Device LUN to access
+    uint8_t direction          - 1=read, 0=write
+    uint8_t *commandBlock      - Pointer to the command block, at most 16
+                                    bytes
+    uint8_t commandBlockLength - Length of the command block
+    uint8_t *data              - Pointer to the data buffer
+    uint32_t dataLength        - Byte size of the data buffer
+
+  Return Values:
+    USB_SUCCESS                 - Command queued successfully
+    USB_MSD_DEVICE_NOT_FOUND    - No device with specified address
+    USB_MSD_DEVICE_BUSY         - Device is not running, or
+                                    USB_UAS_QUEUE_DEPTH commands are
+                                    outstanding
+    USB_MSD_INVALID_LUN         - Specified LUN does not exist
+    USB_MSD_ILLEGAL_REQUEST     - The command block is too long, or the
+                                    data buffer is larger than 0xFFFF
+                                    bytes
+
+  Remarks:
+    Each completion is reported with EVENT_MSD_TRANSFER, during which
+    USBHostUASTransferIsComplete() returns its result.  A REQUEST SENSE is
+    reported before the commands that were already outstanding, so it
+    follows the failed command it reports on.
+  ***************************************************************************/
+
+uint8_t    USBHostUASTransfer( uint8_t deviceAddress, uint8_t deviceLUN, uint8_t direction, uint8_t *commandBlock,
+                            uint8_t commandBlockLength, uint8_t *data, uint32_t dataLength );
+
+
+/****************************************************************************
+  Function:
+    bool USBHostUASTransferIsComplete( uint8_t deviceAddress,
+                        uint8_t *errorCode, uint32_t *byteCount )
+
+  Summary:
+    This function indicates whether or not the oldest outstanding command is
+    complete.
+
+  Description:
+    This function indicates whether or not the oldest outstanding command is
+    complete.  If it is, its error code and byte count are returned and the
+    command is removed, so the next call reports on the next command.  If no
+    command is outstanding, the result of the last command is returned.
+
+  Precondition:
+    None
+
+  Parameters:
+    uint8_t deviceAddress  - Device address
+    uint8_t *errorCode     - Error code of the command
+    uint32_t *byteCount    - Number of bytes transferred
+
+  Return Values:
+    true    - Command is complete, errorCode is valid
+    false   - Command is not complete, errorCode is not valid
+
+  Remarks:
+    errorCode is USB_MSD_COMMAND_FAILED if the device returned a status
+    other than GOOD, and USB_MSD_PHASE_ERROR if it rejected the information
+    unit.
+  ***************************************************************************/
+
+bool    USBHostUASTransferIsComplete( uint8_t deviceAddress, uint8_t *errorCode, uint32_t *byteCount );
+
+
+#endif
@@ -300,6 +300,231 @@ please contact mla_licensing@microchip.com
 #define StructQueueCount(q,N) ( (q)->count )
 
 
+/*************************************************************************
+ * Single Producer, Single Consumer Ring
+ *
+ * The StructRing operations below are a variant of the StructQueue
+ * operations for a queue that is filled by exactly one context (for
+ * example an interrupt handler) and emptied by exactly one other (for
+ * example the main loop).  The producer owns the head index and the
+ * consumer owns the tail index, and there is no shared count, so neither
+ * side has to mask interrupts to use the queue.
+ *
+ * The ring structure must have the following members, with head and tail
+ * declared volatile:
+ *
+ *      head    Free running index of the next item to add
+ *      tail    Free running index of the next item to remove
+ *      buffer  Array of N items
+ *
+ * N must be a power of two.  The indices run from 0 to (2*N)-1, so that a
+ * full ring can be told from an empty one without a count.
+ *************************************************************************/
+
+
+/* StructRingBarrier
+ *************************************************************************
+ * Overview:        This operation keeps the compiler (and, on cores that
+ *                  need it, the processor) from moving accesses to the
+ *                  items across an update of the head or tail index.
+ *
+ * Note:            It may be defined before this file is included to
+ *                  supply a different barrier.  It must be usable as an
+ *                  expression.
+ *************************************************************************/
+
+#ifndef StructRingBarrier
+    #if defined(__XC8) || defined(__18CXX)
+        #define StructRingBarrier() ((void)0)
+    #elif defined(__C30__) || defined(__XC16__)
+        #define StructRingBarrier() ({ __asm__ volatile ("" ::: "memory"); })
+    #else
+        #define StructRingBarrier() __sync_synchronize()
+    #endif
+#endif
+
+
+/* StructRingInit
+ *************************************************************************
+ * Precondition:    None
+ *
+ * Input:           q   Pointer to the ring data structure
+ *
+ *                  N   Number of elements in the ring data buffer array
+ *
+ * Output:          None
+ *
+ * Returns:         zero (0)
+ *
+ * Side Effects:    The ring structure has been initialized and is ready
+ *                  to use.
+ *
+ * Overview:        This operation initializes a ring and makes it empty.
+ *
+ * Note:            Neither the producer nor the consumer may be using
+ *                  the ring while it is initialized.
+ *************************************************************************/
+
+#define StructRingInit(q,N) (  (q)->head = 0, \
+                               (q)->tail = 0  )
+
+
+/* StructRingCount
+ *************************************************************************
+ * Precondition:    The ring must be initialized.
+ *
+ * Input:           q   Pointer to the ring data structure
+ *
+ *                  N   Number of elements in the ring data buffer array
+ *
+ * Output:          None
+ *
+ * Returns:         The number of items in the ring.
+ *
+ * Side Effects:    None
+ *
+ * Overview:        This routine provides the number of items in the ring.
+ *
+ * Note:            Seen from the producer, the count can only decrease
+ *                  before the next add.  Seen from the consumer, it can
+ *                  only increase before the next remove.
+ *************************************************************************/
+
+#define StructRingCount(q,N) ( ((q)->head - (q)->tail) & ((2*(N))-1) )
+
+
+/* StructRingIsNotFull
+ *************************************************************************
+ * Precondition:    The ring must be initialized.  Producer side only.
+ *
+ * Input:           q   Pointer to the ring data structure
+ *
+ *                  N   Number of elements in the ring data buffer array
+ *
+ * Output:          None
+ *
+ * Returns:         FALSE if the ring is full, TRUE otherwise.
+ *
+ * Side Effects:    None
+ *
+ * Overview:        This routine checks to see if the ring is full.
+ *************************************************************************/
+
+#define StructRingIsNotFull(q,N) ( StructRingCount(q,N) < (N) )
+
+
+/* StructRingIsNotEmpty
+ *************************************************************************
+ * Precondition:    The ring must be initialized.  Consumer side only.
+ *
+ * Input:           q   Pointer to the ring data structure
+ *
+ *                  N   Number of elements in the ring data buffer array
+ *
+ * Output:          None
+ *
+ * Returns:         FALSE if the ring is empty, TRUE otherwise.
+ *
+ * Side Effects:    None
+ *
+ * Overview:        This routine checks to see if the ring is not empty.
+ *************************************************************************/
+
+#define StructRingIsNotEmpty(q,N) ( (q)->head != (q)->tail )
+
+
+/* StructRingPeekHead
+ *************************************************************************
+ * Precondition:    The ring must be initialized and must not currently be
+ *                  full.  Producer side only.
+ *
+ * Input:           q   Pointer to the ring data structure
+ *
+ *                  N   Number of elements in the ring data buffer array
+ *
+ * Output:          None
+ *
+ * Returns:         The address of the next free item in the ring.
+ *
+ * Side Effects:    None
+ *
+ * Overview:        This routine provides the item to fill in before it
+ *                  is added with StructRingAdd.  The consumer cannot see
+ *                  the item until then.
+ *************************************************************************/
+
+#define StructRingPeekHead(q,N) ( &(q)->buffer[(q)->head & ((N)-1)] )
+
+
+/* StructRingAdd
+ *************************************************************************
+ * Precondition:    The item returned by StructRingPeekHead has been
+ *                  filled in.  Producer side only.
+ *
+ * Input:           q   Pointer to the ring data structure
+ *
+ *                  N   Number of elements in the ring data buffer array
+ *
+ * Output:          None
+ *
+ * Returns:         None
+ *
+ * Side Effects:    The item has been added to the ring.
+ *
+ * Overview:        This operation publishes the item at the head of the
+ *                  ring to the consumer.
+ *************************************************************************/
+
+#define StructRingAdd(q,N) ( StructRingBarrier(),                           \
+                             (q)->head = ((q)->head + 1) & ((2*(N))-1) )
+
+
+/* StructRingPeekTail
+ *************************************************************************
+ * Precondition:    The ring must be initialized and not currently be
+ *                  empty.  Consumer side only.
+ *
+ * Input:           q   Pointer to the ring data structure
+ *
+ *                  N   Number of elements in the ring data buffer array
+ *
+ * Output:          None
+ *
+ * Returns:         The item at the tail of the ring.
+ *
+ * Side Effects:    None
+ *
+ * Overview:        This routine provides access to the oldest item in the
+ *                  ring.  It stays valid until StructRingRemove.
+ *************************************************************************/
+
+#define StructRingPeekTail(q,N) ( StructRingBarrier(),                    \
+                                  &(q)->buffer[(q)->tail & ((N)-1)] )
+
+
+/* StructRingRemove
+ *************************************************************************
+ * Precondition:    The ring must be initialized and not currently be
+ *                  empty.  Consumer side only.
+ *
+ * Input:           q   Pointer to the ring data structure
+ *
+ *                  N   Number of elements in the ring data buffer array
+ *
+ * Output:          None
+ *
+ * Returns:         None
+ *
+ * Side Effects:    The item at the tail has been removed from the ring,
+ *                  and may be overwritten by the producer.
+ *
+ * Overview:        This routine releases the oldest item in the ring.
+ *************************************************************************/
+
+#define StructRingRemove(q,N) ( StructRingBarrier(),                        \
+                                (q)->tail = ((q)->tail + 1) & ((2*(N))-1) )
+
+
 #endif // STRUCT_QUEUE_H
 /*************************************************************************
  * EOF struct_queue.c
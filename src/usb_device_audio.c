@@ -24,6 +24,8 @@ please contact mla_licensing@microchip.com
 #include "usb.h"
 #include "usb_device_audio.h"
 
+#include <string.h>
+
 #ifdef USB_USE_AUDIO_CLASS
 
 #if defined USB_AUDIO_INPUT_TERMINAL_CONTROL_REQUESTS_HANDLER
@@ -157,4 +159,388 @@ void USBCheckAudioRequest(void)
     }//end switch(SetupPkt.bRequest
 }//end USBCheckAudioRequest
 
+#if defined(USB_AUDIO_SUPPORT_STREAMING)
+
+/** S T R E A M I N G ********************************************************/
+
+static void USBAudioCount(volatile uint16_t* counter)
+{
+    if(*counter != 0xFFFF)
+    {
+        (*counter)++;
+    }
+}
+
+//stream->consumed is advanced by the codec, typically from its own interrupt,
+//and takes more than one access to read on 8 and 16 bit parts.  Read it until
+//two reads agree so a carry between the halves is never seen half done.
+static uint32_t USBAudioGetConsumed(USB_AUDIO_STREAM* stream)
+{
+    uint32_t consumed;
+
+    do
+    {
+        consumed = stream->consumed;
+    } while(consumed != stream->consumed);
+
+    return consumed;
+}
+
+static void USBAudioRingPut(USB_AUDIO_STREAM* stream, const uint8_t* data, uint16_t len)
+{
+    uint16_t index = stream->head & stream->ringMask;
+    uint16_t first = (stream->ringMask + 1) - index;
+
+    if(first > len)
+    {
+        first = len;
+    }
+    memcpy(&stream->ring[index], data, first);
+    memcpy(&stream->ring[0], data + first, len - first);
+    stream->head += len;
+}
+
+static void USBAudioRingGet(USB_AUDIO_STREAM* stream, uint8_t* data, uint16_t len)
+{
+    uint16_t index = stream->tail & stream->ringMask;
+    uint16_t first = (stream->ringMask + 1) - index;
+
+    if(first > len)
+    {
+        first = len;
+    }
+    memcpy(data, &stream->ring[index], first);
+    memcpy(data + first, &stream->ring[0], len - first);
+    stream->tail += len;
+}
+
+/******************************************************************************
+    Function:
+        static void USBAudioStreamArm(USB_AUDIO_STREAM* stream, uint8_t index)
+
+    Description:
+        Hands packet buffer index to the USB module.  For a record stream the
+        buffer is first filled with the samples of the next frame.
+
+    PreCondition:
+        The next BDT of the endpoint is owned by the CPU.
+ *****************************************************************************/
+static void USBAudioStreamArm(USB_AUDIO_STREAM* stream, uint8_t index)
+{
+    uint16_t used;
+    uint16_t bytes;
+
+    if(stream->dir == OUT_FROM_HOST)
+    {
+        stream->handle[index] = USBTransferOnePacket(stream->ep, OUT_FROM_HOST, stream->packet[index], (uint8_t)stream->packetSize);
+        return;
+    }
+
+    //Samples due this frame, carrying the fractional part over to the next.
+    stream->rateAccumulator += stream->rate;
+    bytes = (uint16_t)(stream->rateAccumulator >> 16) * stream->sampleBytes;
+    stream->rateAccumulator &= 0xFFFF;
+    if(bytes > stream->packetSize)
+    {
+        bytes = stream->packetSize - (stream->packetSize % stream->sampleBytes);
+    }
+
+    used = (uint16_t)(stream->head - stream->tail);
+    if(stream->primed == false)
+    {
+        //Let the codec build up half a ring of latency before sending, so the
+        //jitter between the two clocks does not starve the host.
+        if(used < ((stream->ringMask + 1) >> 1))
+        {
+            bytes = 0;
+        }
+        else
+        {
+            stream->primed = true;
+        }
+    }
+    else if(used < bytes)
+    {
+        bytes = used - (used % stream->sampleBytes);
+        USBAudioCount(&stream->underrunCount);
+        stream->primed = false;
+    }
+
+    USBAudioRingGet(stream, stream->packet[index], bytes);
+    stream->handle[index] = USBTransferOnePacket(stream->ep, IN_TO_HOST, stream->packet[index], (uint8_t)bytes);
+}
+
+/******************************************************************************
+    Function:
+        bool USBAudioStreamInit(USB_AUDIO_STREAM* stream, uint8_t ep,
+                                uint8_t dir, uint8_t* ring, uint16_t ringSize,
+                                uint8_t* packet0, uint8_t* packet1,
+                                uint16_t packetSize, uint32_t sampleRate,
+                                uint8_t sampleBytes)
+
+    Summary:
+        Initializes an isochronous audio streaming engine.
+
+    Remarks:
+        See usb_device_audio.h for the full description.
+ *****************************************************************************/
+bool USBAudioStreamInit(USB_AUDIO_STREAM* stream, uint8_t ep, uint8_t dir,
+                        uint8_t* ring, uint16_t ringSize,
+                        uint8_t* packet0, uint8_t* packet1, uint16_t packetSize,
+                        uint32_t sampleRate, uint8_t sampleBytes)
+{
+    memset(stream, 0, sizeof(USB_AUDIO_STREAM));
+
+    //USBTransferOnePacket() takes an 8-bit length, so larger packets would
+    //be silently truncated.
+    if(packetSize > 0xFF)
+    {
+        return false;
+    }
+
+    stream->ring = ring;
+    stream->ringMask = ringSize - 1;
+    stream->packet[0] = packet0;
+    stream->packet[1] = packet1;
+    stream->packetSize = packetSize;
+    stream->ep = ep;
+    stream->dir = dir;
+    stream->sampleBytes = sampleBytes;
+
+    //Samples per 1 ms frame in 16.16 format, split to avoid overflowing 32
+    //bits at sample rates above 65535 Hz.
+    stream->rate = ((sampleRate / 1000) << 16) + (((sampleRate % 1000) << 16) / 1000);
+
+    return true;
+}
+
+/******************************************************************************
+    Function:
+        void USBAudioStreamStart(USB_AUDIO_STREAM* stream)
+
+    Summary:
+        Empties the ring buffer and starts streaming.
+ *****************************************************************************/
+void USBAudioStreamStart(USB_AUDIO_STREAM* stream)
+{
+    stream->running = false;
+
+    stream->head = 0;
+    stream->tail = 0;
+    stream->rateAccumulator = 0;
+    stream->overrunCount = 0;
+    stream->underrunCount = 0;
+    stream->primed = false;
+
+    stream->running = true;
+    USBAudioStreamTasks(stream);
+}
+
+/******************************************************************************
+    Function:
+        void USBAudioStreamStop(USB_AUDIO_STREAM* stream)
+
+    Summary:
+        Stops servicing the stream.
+ *****************************************************************************/
+void USBAudioStreamStop(USB_AUDIO_STREAM* stream)
+{
+    stream->running = false;
+}
+
+/******************************************************************************
+    Function:
+        void USBAudioStreamTasks(USB_AUDIO_STREAM* stream)
+
+    Summary:
+        Services the isochronous packet buffers of a stream.
+
+    Remarks:
+        See usb_device_audio.h for the full description.
+ *****************************************************************************/
+void USBAudioStreamTasks(USB_AUDIO_STREAM* stream)
+{
+    uint16_t len;
+
+    if(stream->running == false)
+    {
+        return;
+    }
+
+    //The packet buffers complete in the order they were armed.
+    while((stream->armed != 0) && !USBHandleBusy(stream->handle[stream->next]))
+    {
+        if(stream->dir == OUT_FROM_HOST)
+        {
+            len = USBHandleGetLength(stream->handle[stream->next]);
+            if(len > (uint16_t)((stream->ringMask + 1) - (uint16_t)(stream->head - stream->tail)))
+            {
+                //The host is ahead of the codec; drop the whole packet so the
+                //ring never holds a partial sample frame.
+                USBAudioCount(&stream->overrunCount);
+            }
+            else
+            {
+                USBAudioRingPut(stream, stream->packet[stream->next], len);
+            }
+        }
+
+        stream->handle[stream->next] = NULL;
+        stream->next ^= 1;
+        stream->armed--;
+    }
+
+    //Keep every BDT of the endpoint owned by the USB module.  Without ping-pong
+    //buffering only one is available.
+    while((stream->armed < 2) && !USBHandleBusy(USBGetNextHandle(stream->ep, stream->dir)))
+    {
+        USBAudioStreamArm(stream, stream->next ^ stream->armed);
+        stream->armed++;
+    }
+}
+
+/******************************************************************************
+    Function:
+        uint16_t USBAudioStreamRead(USB_AUDIO_STREAM* stream, uint8_t* data,
+                                    uint16_t len)
+
+    Summary:
+        Takes playback samples out of the ring buffer.
+ *****************************************************************************/
+uint16_t USBAudioStreamRead(USB_AUDIO_STREAM* stream, uint8_t* data, uint16_t len)
+{
+    uint16_t used = (uint16_t)(stream->head - stream->tail);
+    uint16_t count = len;
+
+    //The codec consumes at its own clock whether or not there is data; that
+    //is what the feedback endpoint measures.
+    stream->consumed += len;
+
+    if(stream->primed == false)
+    {
+        if(used < ((stream->ringMask + 1) >> 1))
+        {
+            memset(data, 0, len);
+            return 0;
+        }
+        stream->primed = true;
+    }
+
+    if(used < len)
+    {
+        count = used - (used % stream->sampleBytes);
+        USBAudioCount(&stream->underrunCount);
+        stream->primed = false;
+    }
+
+    USBAudioRingGet(stream, data, count);
+    memset(data + count, 0, len - count);
+
+    return count;
+}
+
+/******************************************************************************
+    Function:
+        uint16_t USBAudioStreamWrite(USB_AUDIO_STREAM* stream,
+                                     const uint8_t* data, uint16_t len)
+
+    Summary:
+        Puts recorded samples into the ring buffer.
+ *****************************************************************************/
+uint16_t USBAudioStreamWrite(USB_AUDIO_STREAM* stream, const uint8_t* data, uint16_t len)
+{
+    uint16_t space = (stream->ringMask + 1) - (uint16_t)(stream->head - stream->tail);
+    uint16_t count = len;
+
+    if(space < len)
+    {
+        count = space - (space % stream->sampleBytes);
+        USBAudioCount(&stream->overrunCount);
+    }
+
+    USBAudioRingPut(stream, data, count);
+
+    return count;
+}
+
+/******************************************************************************
+    Function:
+        void USBAudioFeedbackInit(USB_AUDIO_FEEDBACK* feedback, uint8_t ep,
+                                  uint8_t refreshShift,
+                                  USB_AUDIO_STREAM* stream)
+
+    Summary:
+        Initializes the explicit feedback endpoint of a playback stream.
+ *****************************************************************************/
+void USBAudioFeedbackInit(USB_AUDIO_FEEDBACK* feedback, uint8_t ep, uint8_t refreshShift, USB_AUDIO_STREAM* stream)
+{
+    memset(feedback, 0, sizeof(USB_AUDIO_FEEDBACK));
+
+    feedback->ep = ep;
+    feedback->refreshShift = refreshShift;
+    feedback->stream = stream;
+    feedback->lastConsumed = USBAudioGetConsumed(stream);
+
+    //Nominal rate: stream->rate is 16.16, the feedback value is 10.14.
+    feedback->feedback = stream->rate >> 2;
+}
+
+/******************************************************************************
+    Function:
+        void USBAudioFeedbackSOFHandler(USB_AUDIO_FEEDBACK* feedback)
+
+    Summary:
+        Updates and transmits the feedback value.
+ *****************************************************************************/
+void USBAudioFeedbackSOFHandler(USB_AUDIO_FEEDBACK* feedback)
+{
+    USB_AUDIO_STREAM* stream = feedback->stream;
+    uint32_t consumed;
+    uint32_t value;
+    uint16_t used;
+    uint16_t half;
+    uint16_t band;
+
+    if(++feedback->frameCount >= ((uint16_t)1 << feedback->refreshShift))
+    {
+        feedback->frameCount = 0;
+
+        consumed = USBAudioGetConsumed(stream);
+        value = (consumed - feedback->lastConsumed) / stream->sampleBytes;
+        feedback->lastConsumed = consumed;
+
+        //Only trust the measurement while the codec is actually playing.
+        if((stream->primed != false) && (value != 0))
+        {
+            //Samples over 2^refreshShift frames to samples per frame, 10.14.
+            value <<= (14 - feedback->refreshShift);
+
+            used = (uint16_t)(stream->head - stream->tail);
+            half = (stream->ringMask + 1) >> 1;
+            band = (stream->ringMask + 1) >> 3;
+            if(used > (half + band))
+            {
+                value -= USB_AUDIO_FEEDBACK_LEVEL_CORRECTION;
+            }
+            else if((used + band) < half)
+            {
+                value += USB_AUDIO_FEEDBACK_LEVEL_CORRECTION;
+            }
+
+            feedback->feedback = value;
+        }
+    }
+
+    if(!USBHandleBusy(feedback->handle))
+    {
+        value = feedback->feedback;
+        feedback->value[0] = (uint8_t)value;
+        feedback->value[1] = (uint8_t)(value >> 8);
+        feedback->value[2] = (uint8_t)(value >> 16);
+        feedback->handle = USBTransferOnePacket(feedback->ep, IN_TO_HOST, feedback->value, USB_AUDIO_FEEDBACK_SIZE);
+    }
+}
+
+#endif //USB_AUDIO_SUPPORT_STREAMING
+
 #endif
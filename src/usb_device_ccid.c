@@ -31,8 +31,53 @@ WORD usbCcidBulkInLen;
 POINTER pCCIDDst;            // Dedicated destination pointer
 POINTER pCCIDSrc;            // Dedicated source pointer
 
+#if defined(USB_CCID_SUPPORT_STREAMING)
+#if defined(__18CXX)
+    //The second packet buffers used for streaming are handed to the USB
+    //module, so they must be located in USB module accessible RAM.
+    #if defined(__18F14K50) || defined(__18F13K50) || defined(__18LF14K50) || defined(__18LF13K50)
+        #pragma udata usbram2
+    #elif defined(__18F2455) || defined(__18F2550) || defined(__18F4455) || defined(__18F4550)\
+        || defined(__18F2458) || defined(__18F2553) || defined(__18F4458) || defined(__18F4553)\
+        || defined(__18LF24K50) || defined(__18F24K50) || defined(__18LF25K50)\
+        || defined(__18F25K50) || defined(__18LF45K50) || defined(__18F45K50)
+        #pragma udata USB_VARIABLES=0x500
+    #elif defined(__18F4450) || defined(__18F2450)
+        #pragma udata USB_VARIABLES=0x480
+    #else
+        #pragma udata
+    #endif
+#endif
+static unsigned char usbCcidBulkInEndpoint2[USB_EP_SIZE];
+static unsigned char usbCcidBulkOutEndpoint2[USB_EP_SIZE];
+#if defined(__18CXX)
+    #pragma udata
+#endif
+
+//Bulk IN streaming state
+static USB_CCID_BULK_IN_CALLBACK usbCcidBulkInCallback;
+static BYTE* usbCcidStreamInBuffer[2];
+static WORD usbCcidStreamInFill;         // bytes in the buffer being filled
+static BYTE usbCcidStreamInIndex;        // buffer being filled
+static DWORD usbCcidStreamInLength;      // total message length
+static DWORD usbCcidStreamInProduced;    // bytes obtained from the callback
+static DWORD usbCcidStreamInSent;        // bytes handed to the USB module
+
+//Bulk OUT streaming state
+static USB_CCID_BULK_OUT_CALLBACK usbCcidBulkOutCallback;
+static BYTE* usbCcidStreamOutBuffer[2];
+static USB_HANDLE usbCcidStreamOutHandle[2];
+static BYTE usbCcidStreamOutIndex;       // buffer that completes next
+static DWORD usbCcidStreamOutOffset;
+static DWORD usbCcidStreamOutLength;
+#endif
+
 
 /** P R I V A T E  P R O T O T Y P E S ***************************************/
+#if defined(USB_CCID_SUPPORT_STREAMING)
+    static void USBCCIDBulkInStreamService(void);
+    static void USBCCIDBulkInStreamFill(void);
+#endif
 #if defined USB_CCID_SUPPORT_ABORT_REQUEST
     void USB_CCID_ABORT_REQUEST_HANDLER(void);
 #endif
@@ -219,6 +264,14 @@ void USBCCIDBulkInService(void)
     WORD byte_to_send;
     BYTE i;
 
+    #if defined(USB_CCID_SUPPORT_STREAMING)
+    if(usbCcidBulkInTrfState == USB_CCID_BULK_IN_STREAMING)
+    {
+        USBCCIDBulkInStreamService();
+        return;
+    }
+    #endif
+
     USBMaskInterrupts();
     if(USBHandleBusy(usbCcidBulkInHandle))
     {
@@ -330,6 +383,241 @@ void USBCCIDSendDataToHost(BYTE *pData, WORD len)
 }
 
 
+#if defined(USB_CCID_SUPPORT_STREAMING)
+/******************************************************************************
+  Function:
+	void USBCCIDSendDataToHostStream(DWORD length, USB_CCID_BULK_IN_CALLBACK callback)
+
+  Summary:
+    Sends a bulk IN message whose payload is produced in chunks.
+
+  Description:
+    See usb_device_ccid.h for a full description.
+
+ *****************************************************************************/
+void USBCCIDSendDataToHostStream(DWORD length, USB_CCID_BULK_IN_CALLBACK callback)
+{
+    if(length == 0)
+    {
+        return;
+    }
+
+    usbCcidBulkInCallback = callback;
+    usbCcidStreamInBuffer[0] = (BYTE*)usbCcidBulkInEndpoint;
+    usbCcidStreamInBuffer[1] = (BYTE*)usbCcidBulkInEndpoint2;
+    usbCcidStreamInIndex = 0;
+    usbCcidStreamInFill = 0;
+    usbCcidStreamInLength = length;
+    usbCcidStreamInProduced = 0;
+    usbCcidStreamInSent = 0;
+    usbCcidBulkInTrfState = USB_CCID_BULK_IN_STREAMING;
+}
+
+/******************************************************************************
+  Function:
+	static void USBCCIDBulkInStreamFill(void)
+
+  Description:
+    Asks the application for as many bytes as fit in the buffer that is not
+    currently owned by the USB module.
+
+ *****************************************************************************/
+static void USBCCIDBulkInStreamFill(void)
+{
+    DWORD remaining;
+    WORD maxLen;
+
+    remaining = usbCcidStreamInLength - usbCcidStreamInProduced;
+    maxLen = USB_EP_SIZE - usbCcidStreamInFill;
+    if(remaining < maxLen)
+    {
+        maxLen = (WORD)remaining;
+    }
+    if(maxLen == 0)
+    {
+        return;
+    }
+
+    usbCcidStreamInFill += usbCcidBulkInCallback(usbCcidStreamInBuffer[usbCcidStreamInIndex] + usbCcidStreamInFill,
+                                                 usbCcidStreamInProduced,
+                                                 maxLen);
+    usbCcidStreamInProduced = usbCcidStreamInSent + usbCcidStreamInFill;
+}
+
+/******************************************************************************
+  Function:
+	static void USBCCIDBulkInStreamService(void)
+
+  Description:
+    Sends the filled buffer once the previous packet is gone, and keeps the
+    other buffer filling while the USB module transmits.
+
+ *****************************************************************************/
+static void USBCCIDBulkInStreamService(void)
+{
+    WORD length;
+
+    //Fill the idle buffer even while a packet is on the bus, this is where
+    //the card I/O overlaps the USB transfer.
+    USBCCIDBulkInStreamFill();
+
+    if(USBHandleBusy(usbCcidBulkInHandle))
+    {
+        return;
+    }
+
+    //Only send full packets, except for the last one of the message, so
+    //the host doesn't see a short packet in the middle of the transfer.
+    length = usbCcidStreamInFill;
+    if((length != USB_EP_SIZE) &&
+       ((length == 0) || (usbCcidStreamInProduced != usbCcidStreamInLength)))
+    {
+        return;
+    }
+
+    USBMaskInterrupts();
+    usbCcidBulkInHandle = USBTxOnePacket(USB_EP_BULK_IN, usbCcidStreamInBuffer[usbCcidStreamInIndex], length);
+    USBUnmaskInterrupts();
+
+    usbCcidStreamInSent += length;
+    usbCcidStreamInIndex ^= 1;
+    usbCcidStreamInFill = 0;
+
+    if(usbCcidStreamInSent == usbCcidStreamInLength)
+    {
+        //See explanation in USB Specification 2.0: Section 5.8.3
+        if(length == USB_EP_SIZE)
+            usbCcidBulkInTrfState = USB_CCID_BULK_IN_BUSY_ZLP;
+        else
+            usbCcidBulkInTrfState = USB_CCID_BULK_IN_COMPLETING;
+        return;
+    }
+
+    //Start on the next packet right away
+    USBCCIDBulkInStreamFill();
+}
+
+/******************************************************************************
+  Function:
+	void USBCCIDBulkOutStreamInit(USB_CCID_BULK_OUT_CALLBACK callback)
+
+  Summary:
+    Switches the bulk OUT endpoint to chained, double buffered reception.
+
+  Description:
+    See usb_device_ccid.h for a full description.
+
+ *****************************************************************************/
+void USBCCIDBulkOutStreamInit(USB_CCID_BULK_OUT_CALLBACK callback)
+{
+    usbCcidBulkOutCallback = callback;
+    usbCcidStreamOutBuffer[0] = (BYTE*)usbCcidBulkOutEndpoint;
+    usbCcidStreamOutBuffer[1] = (BYTE*)usbCcidBulkOutEndpoint2;
+    usbCcidStreamOutIndex = 0;
+    usbCcidStreamOutOffset = 0;
+    usbCcidStreamOutLength = 0;
+
+    //USBCCIDInitEP() already armed the first buffer
+    usbCcidStreamOutHandle[0] = usbCcidBulkOutHandle;
+    usbCcidStreamOutHandle[1] = 0;
+
+    #if (USB_PING_PONG_MODE == USB_PING_PONG__FULL_PING_PONG) || (USB_PING_PONG_MODE == USB_PING_PONG__ALL_BUT_EP0)
+        //Both ping-pong BDTs can be owned by the USB module at once
+        USBMaskInterrupts();
+        usbCcidStreamOutHandle[1] = USBRxOnePacket(USB_EP_BULK_OUT, usbCcidStreamOutBuffer[1], USB_EP_SIZE);
+        USBUnmaskInterrupts();
+    #endif
+}
+
+/************************************************************************
+  Function:
+        void USBCCIDBulkOutService(void)
+
+  Summary:
+    Delivers received bulk OUT packets to the streaming callback.
+
+  Description:
+    See usb_device_ccid.h for a full description.
+
+  ************************************************************************/
+void USBCCIDBulkOutService(void)
+{
+    BYTE index;
+    BYTE* pData;
+    WORD len;
+    BOOL deliver;
+
+    while(1)
+    {
+        index = usbCcidStreamOutIndex;
+        if((usbCcidStreamOutHandle[index] == 0) || USBHandleBusy(usbCcidStreamOutHandle[index]))
+        {
+            return;
+        }
+
+        pData = usbCcidStreamOutBuffer[index];
+        len = USBHandleGetLength(usbCcidStreamOutHandle[index]);
+        deliver = TRUE;
+
+        //The message length comes from dwLength in the header of the first
+        //packet.  A first packet too short to hold the header is dropped.
+        if(usbCcidStreamOutOffset == 0)
+        {
+            if(len < USB_CCID_MESSAGE_HEADER_SIZE)
+            {
+                deliver = FALSE;
+            }
+            else
+            {
+                usbCcidStreamOutLength = USB_CCID_MESSAGE_HEADER_SIZE +
+                                         ((DWORD)pData[1] |
+                                          ((DWORD)pData[2] << 8) |
+                                          ((DWORD)pData[3] << 16) |
+                                          ((DWORD)pData[4] << 24));
+            }
+        }
+
+        #if (USB_PING_PONG_MODE == USB_PING_PONG__FULL_PING_PONG) || (USB_PING_PONG_MODE == USB_PING_PONG__ALL_BUT_EP0)
+            //The other buffer is already armed; this one is re-armed once the
+            //application is done with it.
+            if(deliver)
+            {
+                usbCcidBulkOutCallback(pData, len, usbCcidStreamOutOffset, usbCcidStreamOutLength);
+            }
+
+            USBMaskInterrupts();
+            usbCcidStreamOutHandle[index] = USBRxOnePacket(USB_EP_BULK_OUT, pData, USB_EP_SIZE);
+            USBUnmaskInterrupts();
+        #else
+            //Only one BDT: hand the other buffer to the USB module before the
+            //callback runs so the host can send the next packet meanwhile.
+            USBMaskInterrupts();
+            usbCcidStreamOutHandle[index ^ 1] = USBRxOnePacket(USB_EP_BULK_OUT, usbCcidStreamOutBuffer[index ^ 1], USB_EP_SIZE);
+            USBUnmaskInterrupts();
+            usbCcidStreamOutHandle[index] = 0;
+
+            if(deliver)
+            {
+                usbCcidBulkOutCallback(pData, len, usbCcidStreamOutOffset, usbCcidStreamOutLength);
+            }
+        #endif
+
+        if(deliver)
+        {
+            usbCcidStreamOutOffset += len;
+            if((usbCcidStreamOutOffset >= usbCcidStreamOutLength) || (len < USB_EP_SIZE))
+            {
+                //End of message, the next packet starts a new header
+                usbCcidStreamOutOffset = 0;
+            }
+        }
+
+        usbCcidStreamOutIndex = index ^ 1;
+    }
+}
+#endif //USB_CCID_SUPPORT_STREAMING
+
+
 #endif //def USB_USE_CCID
 
 /** EOF usb_function_ccid.c *************************************************************/
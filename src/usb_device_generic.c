@@ -31,6 +31,7 @@ please contact mla_licensing@microchip.com
 ******************************************************************************/
 
 /** I N C L U D E S **********************************************************/
+#include <stddef.h>
 #include "usb.h"
 #include "usb_device_generic.h"
 
@@ -42,6 +43,13 @@ extern volatile CTRL_TRF_SETUP SetupPkt;    //Common buffer that receives the
                                             //host during control transfer
                                             //requests.
 
+//Number of BDTs that can be armed at once on a non-EP0 endpoint.
+#if (USB_PING_PONG_MODE == USB_PING_PONG__FULL_PING_PONG) || (USB_PING_PONG_MODE == USB_PING_PONG__ALL_BUT_EP0)
+    #define USBGEN_STREAM_BDT_DEPTH     2
+#else
+    #define USBGEN_STREAM_BDT_DEPTH     1
+#endif
+
 /** P R I V A T E  P R O T O T Y P E S ***************************************/
 
 /** D E C L A R A T I O N S **************************************************/
@@ -236,5 +244,212 @@ void USBCheckVendorRequest(void)
 }//void USBCheckVendorRequest(void)
 
 
+/********************************************************************
+    Function:
+        void USBGenStreamInit(USBGEN_STREAM* stream, uint8_t ep, uint8_t dir,
+                              uint16_t maxPacketSize)
+
+    Summary:
+        Initializes a multi-buffer stream on a generic class endpoint.
+
+    Description:
+        See usb_device_generic.h for a full description.
+
+ *******************************************************************/
+void USBGenStreamInit(USBGEN_STREAM* stream, uint8_t ep, uint8_t dir, uint16_t maxPacketSize)
+{
+    stream->submittedHead = NULL;
+    stream->submittedTail = NULL;
+    stream->armedHead = NULL;
+    stream->armedTail = NULL;
+    stream->completedHead = NULL;
+    stream->completedTail = NULL;
+    stream->ep = ep;
+    stream->dir = dir;
+    stream->armedCount = 0;
+    stream->maxPacketSize = maxPacketSize;
+    stream->overrunCount = 0;
+    stream->underrunCount = 0;
+}
+
+/********************************************************************
+    Function:
+        bool USBGenStreamSubmit(USBGEN_STREAM* stream, USBGEN_STREAM_BUFFER* buffer)
+
+    Summary:
+        Queues one buffer, or a chain of buffers, on a stream.
+
+    Description:
+        See usb_device_generic.h for a full description.
+
+ *******************************************************************/
+bool USBGenStreamSubmit(USBGEN_STREAM* stream, USBGEN_STREAM_BUFFER* buffer)
+{
+    USBGEN_STREAM_BUFFER* last;
+
+    if(buffer == NULL)
+    {
+        return true;
+    }
+
+    //Find the end of the chain so it can be appended in one step.  Each
+    //buffer is armed as a single packet, so none may exceed the endpoint,
+    //nor the 8-bit length that USBTransferOnePacket() takes.
+    last = buffer;
+    while(true)
+    {
+        if((last->size > stream->maxPacketSize) || (last->size > 0xFF))
+        {
+            return false;
+        }
+        if(last->next == NULL)
+        {
+            break;
+        }
+        last = last->next;
+    }
+
+    if(stream->submittedHead == NULL)
+    {
+        stream->submittedHead = buffer;
+    }
+    else
+    {
+        stream->submittedTail->next = buffer;
+    }
+    stream->submittedTail = last;
+
+    //Arm right away if a BDT is free, so the caller doesn't have to wait
+    //for the next USBGenStreamTasks() call to get data moving.
+    USBGenStreamTasks(stream);
+    return true;
+}
+
+/********************************************************************
+    Function:
+        USBGEN_STREAM_BUFFER* USBGenStreamGetCompleted(USBGEN_STREAM* stream)
+
+    Summary:
+        Returns the oldest completed buffer of a stream.
+
+    Description:
+        See usb_device_generic.h for a full description.
+
+ *******************************************************************/
+USBGEN_STREAM_BUFFER* USBGenStreamGetCompleted(USBGEN_STREAM* stream)
+{
+    USBGEN_STREAM_BUFFER* buffer;
+
+    buffer = stream->completedHead;
+    if(buffer != NULL)
+    {
+        stream->completedHead = buffer->next;
+        if(stream->completedHead == NULL)
+        {
+            stream->completedTail = NULL;
+        }
+        buffer->next = NULL;
+    }
+
+    return buffer;
+}
+
+/********************************************************************
+    Function:
+        void USBGenStreamTasks(USBGEN_STREAM* stream)
+
+    Summary:
+        Moves finished buffers to the completed list and keeps the
+        endpoint's BDTs armed.
+
+    Description:
+        See usb_device_generic.h for a full description.
+
+ *******************************************************************/
+void USBGenStreamTasks(USBGEN_STREAM* stream)
+{
+    USBGEN_STREAM_BUFFER* buffer;
+    bool retired = false;
+
+    //Retire finished transfers.  The SIE completes the BDTs of an endpoint
+    //in the order they were armed, so only the head of the list needs to be
+    //checked.
+    while((stream->armedHead != NULL) && !USBHandleBusy(stream->armedHead->handle))
+    {
+        buffer = stream->armedHead;
+        stream->armedHead = buffer->next;
+        if(stream->armedHead == NULL)
+        {
+            stream->armedTail = NULL;
+        }
+        stream->armedCount--;
+        retired = true;
+
+        buffer->count = USBHandleGetLength(buffer->handle);
+        buffer->next = NULL;
+
+        if(stream->completedHead == NULL)
+        {
+            stream->completedHead = buffer;
+        }
+        else
+        {
+            stream->completedTail->next = buffer;
+        }
+        stream->completedTail = buffer;
+    }
+
+    //Keep every BDT of the endpoint owned by the SIE while there is
+    //something to arm it with.
+    while((stream->submittedHead != NULL) &&
+          (stream->armedCount < USBGEN_STREAM_BDT_DEPTH) &&
+          !USBHandleBusy(USBGetNextHandle(stream->ep, stream->dir)))
+    {
+        buffer = stream->submittedHead;
+        stream->submittedHead = buffer->next;
+        if(stream->submittedHead == NULL)
+        {
+            stream->submittedTail = NULL;
+        }
+
+        buffer->next = NULL;
+        buffer->count = 0;
+        buffer->handle = USBTransferOnePacket(stream->ep, stream->dir, buffer->data, (uint8_t)buffer->size);
+
+        if(stream->armedHead == NULL)
+        {
+            stream->armedHead = buffer;
+        }
+        else
+        {
+            stream->armedTail->next = buffer;
+        }
+        stream->armedTail = buffer;
+        stream->armedCount++;
+    }
+
+    //The endpoint just went idle with nothing left to arm.  Count it once
+    //per starvation period; it can only happen again after a buffer has been
+    //armed and retired.
+    if(retired && (stream->armedCount == 0))
+    {
+        if(stream->dir == OUT_FROM_HOST)
+        {
+            if(stream->overrunCount != 0xFFFF)
+            {
+                stream->overrunCount++;
+            }
+        }
+        else
+        {
+            if(stream->underrunCount != 0xFFFF)
+            {
+                stream->underrunCount++;
+            }
+        }
+    }
+}
+
+
 #endif //def USB_USE_GEN
 /** EOF usbgen.c *************************************************************/
@@ -0,0 +1,379 @@
+// DOM-IGNORE-BEGIN
+/*******************************************************************************
+Copyright 2015 Microchip Technology Inc. (www.microchip.com)
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+To request to license the code under the MLA license (www.microchip.com/mla_license),
+please contact mla_licensing@microchip.com
+*******************************************************************************/
+//DOM-IGNORE-END
+
+/*******************************************************************************
+  USB Device MIDI Layer
+
+  Company:
+    Microchip Technology Inc.
+
+  File Name:
+    usb_device_midi.c
+
+  Summary:
+    USB Device MIDI event packer.
+
+  Description:
+    Converts a MIDI 1.0 byte stream into USB-MIDI event packets and sends
+    them in wMaxPacketSize batches.
+*******************************************************************************/
+
+
+// *****************************************************************************
+// *****************************************************************************
+// Section: Included Files
+// *****************************************************************************
+// *****************************************************************************
+#include "usb_config.h"
+#include "usb.h"
+#include "usb_device_midi.h"
+
+// *****************************************************************************
+// *****************************************************************************
+// Section: Macros or Functions
+// *****************************************************************************
+// *****************************************************************************
+
+/******************************************************************************
+    Function:
+        static void USBMIDITxSend(USB_DEVICE_MIDI_TX* tx)
+
+    Description:
+        Sends the active buffer if it holds events and the endpoint is free,
+        and switches filling over to the other buffer.
+
+    PreCondition:
+        Called from the USB interrupt or with USB interrupts masked.
+ *****************************************************************************/
+static void USBMIDITxSend(USB_DEVICE_MIDI_TX* tx)
+{
+    if((tx->count == 0) || USBHandleBusy(tx->handle))
+    {
+        return;
+    }
+
+    tx->handle = USBTxOnePacket(tx->ep, tx->buffer[tx->active], tx->count);
+    tx->active ^= 1;
+    tx->count = 0;
+    tx->age = 0;
+}
+
+/******************************************************************************
+    Function:
+        static bool USBMIDITxQueue(USB_DEVICE_MIDI_TX* tx, uint8_t header,
+                                   uint8_t midi0, uint8_t midi1, uint8_t midi2)
+
+    Description:
+        Appends one event packet to the active buffer.
+
+    PreCondition:
+        Called with USB interrupts masked.
+ *****************************************************************************/
+static bool USBMIDITxQueue(USB_DEVICE_MIDI_TX* tx, uint8_t header, uint8_t midi0, uint8_t midi1, uint8_t midi2)
+{
+    uint8_t* event;
+
+    if((tx->count + sizeof(USB_AUDIO_MIDI_EVENT_PACKET)) > tx->size)
+    {
+        USBMIDITxSend(tx);
+        if((tx->count + sizeof(USB_AUDIO_MIDI_EVENT_PACKET)) > tx->size)
+        {
+            return false;
+        }
+    }
+
+    event = &tx->buffer[tx->active][tx->count];
+    event[0] = header;
+    event[1] = midi0;
+    event[2] = midi1;
+    event[3] = midi2;
+    tx->count += sizeof(USB_AUDIO_MIDI_EVENT_PACKET);
+
+    //A full buffer can not wait for the deadline.
+    if((tx->flushFrames == 0) || ((tx->count + sizeof(USB_AUDIO_MIDI_EVENT_PACKET)) > tx->size))
+    {
+        USBMIDITxSend(tx);
+    }
+
+    return true;
+}
+
+/******************************************************************************
+    Function:
+        static void USBMIDITxParse(USB_DEVICE_MIDI_TX* tx, uint8_t data)
+
+    Description:
+        Feeds one MIDI 1.0 byte to the parser.  Queues at most one event.
+
+    PreCondition:
+        Called with USB interrupts masked and room for one event in the
+        active buffer.
+ *****************************************************************************/
+static void USBMIDITxParse(USB_DEVICE_MIDI_TX* tx, uint8_t data)
+{
+    uint8_t cable = tx->cable << 4;
+
+    //System Real Time: a single byte, allowed anywhere, affects no state.
+    if(data >= 0xF8)
+    {
+        USBMIDITxQueue(tx, cable | MIDI_CIN_SINGLE_uint8_t, data, 0, 0);
+        return;
+    }
+
+    //End of SysEx: the remaining 1 to 3 bytes go in a SysEx ends packet.
+    if(data == 0xF7)
+    {
+        if(tx->sysex)
+        {
+            tx->message[tx->index++] = data;
+            if(tx->index < 3)
+            {
+                tx->message[2] = 0;
+            }
+            if(tx->index < 2)
+            {
+                tx->message[1] = 0;
+            }
+            USBMIDITxQueue(tx, cable | (MIDI_CIN_SYSEX_START + tx->index), tx->message[0], tx->message[1], tx->message[2]);
+        }
+        tx->sysex = false;
+        tx->index = 0;
+        return;
+    }
+
+    //Any other status byte starts a new message and aborts an unterminated
+    //SysEx.
+    if(data & 0x80)
+    {
+        tx->sysex = false;
+        tx->message[0] = data;
+        tx->index = 1;
+
+        if(data < 0xF0)
+        {
+            //Program Change and Channel Pressure carry one data byte.
+            tx->runningStatus = data;
+            tx->expected = ((data & 0xE0) == 0xC0) ? 2 : 3;
+            return;
+        }
+
+        //System Common and SysEx cancel running status.
+        tx->runningStatus = 0;
+        switch(data)
+        {
+            case 0xF0:
+                tx->sysex = true;
+                break;
+            case 0xF1:  //MTC quarter frame
+            case 0xF3:  //Song Select
+                tx->expected = 2;
+                break;
+            case 0xF2:  //Song Position Pointer
+                tx->expected = 3;
+                break;
+            case 0xF6:  //Tune Request
+                USBMIDITxQueue(tx, cable | MIDI_CIN_1_uint8_t_MESSAGE, data, 0, 0);
+                tx->index = 0;
+                break;
+            default:    //Undefined
+                tx->index = 0;
+                break;
+        }
+        return;
+    }
+
+    //Data byte inside a SysEx: send every 3 bytes.
+    if(tx->sysex)
+    {
+        tx->message[tx->index++] = data;
+        if(tx->index == 3)
+        {
+            USBMIDITxQueue(tx, cable | MIDI_CIN_SYSEX_CONTINUE, tx->message[0], tx->message[1], tx->message[2]);
+            tx->index = 0;
+        }
+        return;
+    }
+
+    //Data byte without a status: reuse the running status, else drop it.
+    if(tx->index == 0)
+    {
+        if(tx->runningStatus == 0)
+        {
+            return;
+        }
+        tx->message[0] = tx->runningStatus;
+        tx->expected = ((tx->runningStatus & 0xE0) == 0xC0) ? 2 : 3;
+        tx->index = 1;
+    }
+
+    tx->message[tx->index++] = data;
+    if(tx->index == tx->expected)
+    {
+        if(tx->expected == 2)
+        {
+            tx->message[2] = 0;
+        }
+
+        if(tx->message[0] < 0xF0)
+        {
+            //Channel voice messages use the status nibble as the CIN.
+            USBMIDITxQueue(tx, cable | (tx->message[0] >> 4), tx->message[0], tx->message[1], tx->message[2]);
+        }
+        else
+        {
+            USBMIDITxQueue(tx, cable | ((tx->expected == 2) ? MIDI_CIN_2_uint8_t_MESSAGE : MIDI_CIN_3_uint8_t_MESSAGE), tx->message[0], tx->message[1], tx->message[2]);
+        }
+        tx->index = 0;
+    }
+}
+
+/******************************************************************************
+    Function:
+        void USBMIDITxInit(USB_DEVICE_MIDI_TX* tx, uint8_t ep, uint8_t cable,
+                           uint8_t* buffer0, uint8_t* buffer1, uint16_t size,
+                           uint8_t flushFrames)
+
+    Summary:
+        Initializes a MIDI event packer.
+
+    Remarks:
+        See usb_device_midi.h for the full description.
+ *****************************************************************************/
+void USBMIDITxInit(USB_DEVICE_MIDI_TX* tx, uint8_t ep, uint8_t cable,
+                   uint8_t* buffer0, uint8_t* buffer1, uint16_t size,
+                   uint8_t flushFrames)
+{
+    tx->buffer[0] = buffer0;
+    tx->buffer[1] = buffer1;
+    tx->handle = NULL;
+    tx->size = size & ~(sizeof(USB_AUDIO_MIDI_EVENT_PACKET) - 1);
+    tx->count = 0;
+    tx->active = 0;
+    tx->ep = ep;
+    tx->cable = cable & 0x0F;
+    tx->flushFrames = flushFrames;
+    tx->age = 0;
+    tx->runningStatus = 0;
+    tx->index = 0;
+    tx->expected = 0;
+    tx->sysex = false;
+}
+
+/******************************************************************************
+    Function:
+        uint16_t USBMIDITxPutBytes(USB_DEVICE_MIDI_TX* tx, const uint8_t* data,
+                                   uint16_t len)
+
+    Summary:
+        Converts MIDI 1.0 bytes to USB-MIDI event packets and queues them.
+
+    Remarks:
+        See usb_device_midi.h for the full description.
+ *****************************************************************************/
+uint16_t USBMIDITxPutBytes(USB_DEVICE_MIDI_TX* tx, const uint8_t* data, uint16_t len)
+{
+    uint16_t i;
+
+    for(i = 0; i < len; i++)
+    {
+        USBMaskInterrupts();
+
+        //Every byte can complete at most one event; make sure it fits before
+        //the parser state is touched.
+        if((tx->count + sizeof(USB_AUDIO_MIDI_EVENT_PACKET)) > tx->size)
+        {
+            USBMIDITxSend(tx);
+            if((tx->count + sizeof(USB_AUDIO_MIDI_EVENT_PACKET)) > tx->size)
+            {
+                USBUnmaskInterrupts();
+                break;
+            }
+        }
+
+        USBMIDITxParse(tx, data[i]);
+
+        USBUnmaskInterrupts();
+    }
+
+    return i;
+}
+
+/******************************************************************************
+    Function:
+        bool USBMIDITxPutEvent(USB_DEVICE_MIDI_TX* tx,
+                               USB_AUDIO_MIDI_EVENT_PACKET event)
+
+    Summary:
+        Queues an already formed USB-MIDI event packet.
+ *****************************************************************************/
+bool USBMIDITxPutEvent(USB_DEVICE_MIDI_TX* tx, USB_AUDIO_MIDI_EVENT_PACKET event)
+{
+    bool queued;
+
+    USBMaskInterrupts();
+    queued = USBMIDITxQueue(tx, event.v[0], event.v[1], event.v[2], event.v[3]);
+    USBUnmaskInterrupts();
+
+    return queued;
+}
+
+/******************************************************************************
+    Function:
+        void USBMIDITxTasks(USB_DEVICE_MIDI_TX* tx)
+
+    Summary:
+        Ages queued events and sends them when the deadline expires.
+ *****************************************************************************/
+void USBMIDITxTasks(USB_DEVICE_MIDI_TX* tx)
+{
+    if(tx->count == 0)
+    {
+        return;
+    }
+
+    if(tx->age < tx->flushFrames)
+    {
+        tx->age++;
+    }
+
+    if((tx->age >= tx->flushFrames) || ((tx->count + sizeof(USB_AUDIO_MIDI_EVENT_PACKET)) > tx->size))
+    {
+        USBMIDITxSend(tx);
+    }
+}
+
+/******************************************************************************
+    Function:
+        void USBMIDITxFlush(USB_DEVICE_MIDI_TX* tx)
+
+    Summary:
+        Sends the queued events now if the endpoint is free.
+ *****************************************************************************/
+void USBMIDITxFlush(USB_DEVICE_MIDI_TX* tx)
+{
+    USBMaskInterrupts();
+    USBMIDITxSend(tx);
+    USBUnmaskInterrupts();
+}
+
+/*******************************************************************************
+ End of File
+*/
@@ -58,6 +58,9 @@ please contact mla_licensing@microchip.com
 
 volatile FAR unsigned char phdc_data_rx[PHDC_DATA_OUT_EP_SIZE];
 volatile FAR unsigned char phdc_data_tx[PHDC_DATA_IN_EP_SIZE];
+#if defined USE_PHDC_INTERRUPT_ENDPOINT
+volatile FAR unsigned char phdc_int_data_tx[PHDC_INT_IN_EP_SIZE];
+#endif
 
 #if defined(__18CXX)
     #pragma udata
@@ -77,8 +80,20 @@ PHDC_TX_ENDPOINT PhdcTXEP[PHDC_TX_ENDPOINTS];
 UINT16 phdcEpDataBitmap;
 extern BYTE_VAL *pDst;
 
+//Pending transmit requests and statistics, one entry per QoS bin
+static PHDC_TX_QUEUE phdcTxQueue[PHDC_QOS_BINS];
+static PHDC_QOS_BIN_STATS phdcQoSStats[PHDC_QOS_BINS];
+
+//PhdcTXEP[] index of each IN endpoint
+#define PHDC_TX_BULK_INDEX  0
+#define PHDC_TX_INT_INDEX   1
+
 
 /** P R I V A T E  P R O T O T Y P E S ***************************************/
+static UINT8 PHDCGetTxBin(UINT8 qos);
+static void PHDCTxLoadPacket(PTR_PHDC_TX_ENDPOINT tx_endpoint);
+static void PHDCTxStart(PTR_PHDC_TX_ENDPOINT tx_endpoint);
+static void PHDCTxServiceQueues(void);
 
 
 /** D E C L A R A T I O N S **************************************************/
@@ -185,6 +200,7 @@ void USBDevicePHDCInit(USB_PHDC_CB callback)
 	PhdcTXEP[0].transfer_size =0;
 	PhdcTXEP[0].bytes_to_send = 0;
 	PhdcTXEP[0].size =PHDC_DATA_IN_EP_SIZE;
+	PhdcTXEP[0].packet_buff = (UINT8*)phdc_data_tx;
 
     #if defined USE_PHDC_INTERRUPT_ENDPOINT
 		PhdcTXEP[1].ep_num=PHDC_INT_EP;
@@ -193,11 +209,15 @@ void USBDevicePHDCInit(USB_PHDC_CB callback)
 		PhdcTXEP[1].transfer_size =0;
 		PhdcTXEP[1].bytes_to_send = 0;
 		PhdcTXEP[1].size =PHDC_INT_IN_EP_SIZE;
+		PhdcTXEP[1].packet_buff = (UINT8*)phdc_int_data_tx;
 	#endif
 
 	PhdAppCB = callback;
 	phdcEpDataBitmap = 0;
 
+	memset(phdcTxQueue, 0, sizeof(phdcTxQueue));
+	memset(phdcQoSStats, 0, sizeof(phdcQoSStats));
+
 }//end PHDCInitEP
 
 /**********************************************************************************
@@ -264,24 +284,23 @@ UINT8 USBDevicePHDCReceiveData(UINT8 qos, UINT8* buffer, UINT16 len)
 
 /******************************************************************************
   Function:
-	void USBDevicePHDCSendData(UINT8 qos, UINT8 *data, UINT8 Length)
+	BOOL USBDevicePHDCSendData(UINT8 qos, UINT8 *data, UINT16 length, BOOL memtype)
 
   Summary:
-    USBDevicePHDCSendData writes an array of data to the USB.
+    USBDevicePHDCSendData queues an array of data for transmission to the USB.
 
   Description:
-    USBDevicePHDCSendData writes an array of data to the USB.
-
-    Typical Usage:
-    <code>
-
-    </code>
+    USBDevicePHDCSendData queues an array of data for transmission to the USB.
+    The request goes into the queue of the highest priority QoS bin that is
+    set in qos and served by one of the IN endpoints, and is started right
+    away if that endpoint is idle.
 
     The transfer mechanism for device-to-host(put) is more flexible than
     host-to-device(get). It can handle a string of data larger than the
     maximum size of bulk IN endpoint. A state machine is used to transfer a
     \long string of data over multiple USB transactions. USBDevicePHDCTxRXService(PTR_USTAT_STRUCT val)
-    will be called on a transfer event to keep sending blocks of data to the host.
+    will be called on a transfer event to keep sending blocks of data to the host,
+    and to start the next queued transfer once the current one completes.
 
   Conditions:
     None
@@ -292,73 +311,265 @@ UINT8 USBDevicePHDCReceiveData(UINT8 qos, UINT8* buffer, UINT16 len)
     length - the number of bytes to be transfered.
 	memtype - Indicates whether the data array is in ROM or RAM
 
+  Return:
+    TRUE if the request was queued, FALSE otherwise.
+
  *****************************************************************************/
-void USBDevicePHDCSendData(UINT8 qos, UINT8 *data, UINT16 length,BOOL memtype)
+BOOL USBDevicePHDCSendData(UINT8 qos, UINT8 *data, UINT16 length,BOOL memtype)
 {
-    PTR_PHDC_TX_ENDPOINT tx_endpoint;
-    UINT8 index;
-    UINT8 i;
+    PHDC_TX_QUEUE* queue;
+    PHDC_TX_REQUEST* request;
+    UINT8 bin;
 
-    for(index=0; index< PHDC_TX_ENDPOINTS;index++)
+    bin = PHDCGetTxBin(qos);
+    if((bin == PHDC_QOS_BINS) || (length == 0))
     {
-        if((PhdcTXEP[index].qos & qos) != 0)
-        break;
+        return FALSE; //no endpoint supports the qos
     }
-    if(index == PHDC_TX_ENDPOINTS)
+    queue = &phdcTxQueue[bin];
+
+    USBMaskInterrupts();
+    if(queue->count == PHDC_TX_QUEUE_DEPTH)
     {
-        return; //no endpoint supports the qos
+        if(phdcQoSStats[bin].dropped != 0xFFFF)
+        {
+            phdcQoSStats[bin].dropped++;
+        }
+        USBUnmaskInterrupts();
+        return FALSE; //bin is full
     }
-    tx_endpoint = &PhdcTXEP[index];
 
-    if(	(tx_endpoint->transfer_size ==0) && (tx_endpoint->offset ==0) ) //new packet
+    request = &queue->request[queue->tail];
+    request->data = data;
+    request->length = length;
+    request->memtype = memtype;
+    request->queued_time = USBGet1msTickCount();
+
+    queue->tail++;
+    if(queue->tail == PHDC_TX_QUEUE_DEPTH)
     {
-	tx_endpoint->transfer_size = length;
-	tx_endpoint->memtype= memtype;
-	if(tx_endpoint->transfer_size > tx_endpoint->size)
-	{
-        	tx_endpoint->bytes_to_send = tx_endpoint->size; //multiple send
-	}
-	else
-	{
-	    tx_endpoint->bytes_to_send = tx_endpoint->transfer_size; //only packet to send
-	}
+        queue->tail = 0;
     }
-    else
+    queue->count++;
+
+    PHDCTxServiceQueues();
+	USBUnmaskInterrupts();
+
+    return TRUE;
+}//end USBDevicePHDCSendData
+
+/******************************************************************************
+  Function:
+	void USBDevicePHDCGetQoSBinStats(UINT8 bin, PHDC_QOS_BIN_STATS* stats)
+
+  Summary:
+    Returns the transmit statistics of a QoS bin.
+
+  Description:
+    See usb_device_phdc.h for a full description.
+
+ *****************************************************************************/
+void USBDevicePHDCGetQoSBinStats(UINT8 bin, PHDC_QOS_BIN_STATS* stats)
+{
+    if(bin >= PHDC_QOS_BINS)
     {
-        return; //send in progress
+        return;
     }
+
     USBMaskInterrupts();
-    tx_endpoint->app_buff = (UINT8*)data;
+    *stats = phdcQoSStats[bin];
+    USBUnmaskInterrupts();
+}
+
+/******************************************************************************
+  Function:
+	static UINT8 PHDCGetTxBin(UINT8 qos)
+
+  Description:
+    Returns the highest priority bin set in qos that one of the IN endpoints
+    serves, or PHDC_QOS_BINS if there is none.
+
+ *****************************************************************************/
+static UINT8 PHDCGetTxBin(UINT8 qos)
+{
+    UINT8 supported = 0;
+    UINT8 index;
+    UINT8 bin;
+
+    for(index = 0; index < PHDC_TX_ENDPOINTS; index++)
+    {
+        supported |= PhdcTXEP[index].qos;
+    }
+    qos &= supported;
+
+    for(bin = 0; bin < PHDC_QOS_BINS; bin++)
+    {
+        if((qos & (1 << bin)) != 0)
+        {
+            break;
+        }
+    }
+    return bin;
+}
+
+/******************************************************************************
+  Function:
+	static void PHDCTxLoadPacket(PTR_PHDC_TX_ENDPOINT tx_endpoint)
+
+  Description:
+    Copies the next bytes_to_send bytes of the current transfer into the
+    endpoint's packet buffer and arms the endpoint.  With PHDC_TX_ZERO_COPY
+    defined, RAM transfers are armed in place without the copy.  Must be
+    called with USB interrupts masked.
+
+ *****************************************************************************/
+static void PHDCTxLoadPacket(PTR_PHDC_TX_ENDPOINT tx_endpoint)
+{
+    UINT8 i;
+
+    #if defined(PHDC_TX_ZERO_COPY)
+    if(tx_endpoint->memtype == MEM_RAM)
+    {
+        //Let the SIE read the packet directly out of the caller's buffer
+        tx_endpoint->PHDCDataInHandle = USBTxOnePacket(tx_endpoint->ep_num,
+                                                       tx_endpoint->app_buff + tx_endpoint->offset,
+                                                       tx_endpoint->bytes_to_send);
+        USBDevicePHDCUpdateStatus(tx_endpoint->ep_num, 1);
+        return;
+    }
+    #endif
+
     i= tx_endpoint->bytes_to_send;
-    pPHDCDst.bRam = (BYTE*)phdc_data_tx; // Set destination pointer
+    pPHDCDst.bRam = (BYTE*)tx_endpoint->packet_buff; // Set destination pointer
+
     if(tx_endpoint->memtype == MEM_ROM)            // Determine type of memory source
     {
-        pPHDCSrc.bRom = (ROM UINT8 *) data;
+        pPHDCSrc.bRom = (ROM UINT8*)(tx_endpoint->app_buff + tx_endpoint->offset);
+
         while(i)
         {
             *pPHDCDst.bRam = *pPHDCSrc.bRom;
-             pPHDCDst.bRam++;
-             pPHDCSrc.bRom++;
-             i--;
+            pPHDCDst.bRam++;
+            pPHDCSrc.bRom++;
+            i--;
         }//end while(byte_to_send)
+
     }
     else // _RAM
     {
-	pPHDCSrc.bRam = (UINT8*)data;
-	while(i)
+        pPHDCSrc.bRam = (UINT8*)(tx_endpoint->app_buff + tx_endpoint->offset);
+        while(i)
         {
             *pPHDCDst.bRam = *pPHDCSrc.bRam;
-             pPHDCDst.bRam++;
-             pPHDCSrc.bRam++;
-             i--;
+            pPHDCDst.bRam++;
+            pPHDCSrc.bRam++;
+            i--;
         }//end while(byte_to_send._word)
+
     }//end if(phdc_mem_type...)
 
     tx_endpoint->PHDCDataInHandle = USBTxOnePacket(tx_endpoint->ep_num,
-	(BYTE*)phdc_data_tx,tx_endpoint->bytes_to_send);
+                                                   tx_endpoint->packet_buff,
+                                                   tx_endpoint->bytes_to_send);
     USBDevicePHDCUpdateStatus(tx_endpoint->ep_num, 1); // update the endpoint status. '1' if endpoint has data. '0' otherwise.
-	USBUnmaskInterrupts();
-}//end USBDevicePHDCSendData
+}
+
+/******************************************************************************
+  Function:
+	static void PHDCTxStart(PTR_PHDC_TX_ENDPOINT tx_endpoint)
+
+  Description:
+    If the endpoint is idle, starts the oldest request of the highest
+    priority bin it serves and records that bin's queueing latency.
+
+ *****************************************************************************/
+static void PHDCTxStart(PTR_PHDC_TX_ENDPOINT tx_endpoint)
+{
+    PHDC_TX_QUEUE* queue;
+    PHDC_TX_REQUEST* request;
+    PHDC_QOS_BIN_STATS* stats;
+    UINT32 latency;
+    UINT8 bin;
+
+    if((tx_endpoint->transfer_size != 0) || (tx_endpoint->offset != 0))
+    {
+        return; //send in progress
+    }
+
+    for(bin = 0; bin < PHDC_QOS_BINS; bin++)
+    {
+        if(((tx_endpoint->qos & (1 << bin)) != 0) && (phdcTxQueue[bin].count != 0))
+        {
+            break;
+        }
+    }
+    if(bin == PHDC_QOS_BINS)
+    {
+        return; //nothing pending for this endpoint
+    }
+
+    queue = &phdcTxQueue[bin];
+    request = &queue->request[queue->head];
+    queue->head++;
+    if(queue->head == PHDC_TX_QUEUE_DEPTH)
+    {
+        queue->head = 0;
+    }
+    queue->count--;
+
+    stats = &phdcQoSStats[bin];
+    latency = USBGet1msTickCount() - request->queued_time;
+    if(latency > 0xFFFF)
+    {
+        latency = 0xFFFF;
+    }
+    stats->sent++;
+    stats->total_latency += latency;
+    stats->last_latency = (UINT16)latency;
+    if(stats->last_latency > stats->max_latency)
+    {
+        stats->max_latency = stats->last_latency;
+    }
+
+    tx_endpoint->app_buff = request->data;
+    tx_endpoint->memtype = request->memtype;
+    tx_endpoint->transfer_size = request->length;
+    tx_endpoint->offset = 0;
+    if(tx_endpoint->transfer_size > tx_endpoint->size)
+    {
+        tx_endpoint->bytes_to_send = tx_endpoint->size; //multiple send
+    }
+    else
+    {
+        tx_endpoint->bytes_to_send = tx_endpoint->transfer_size; //only packet to send
+    }
+
+    PHDCTxLoadPacket(tx_endpoint);
+}
+
+/******************************************************************************
+  Function:
+	static void PHDCTxServiceQueues(void)
+
+  Description:
+    Starts queued transfers on every idle IN endpoint.  The interrupt
+    endpoint is served first, and a new bulk transfer is not started while
+    low latency data is still in flight on the interrupt endpoint.
+
+ *****************************************************************************/
+static void PHDCTxServiceQueues(void)
+{
+    #if defined USE_PHDC_INTERRUPT_ENDPOINT
+        PHDCTxStart(&PhdcTXEP[PHDC_TX_INT_INDEX]);
+        if((PhdcTXEP[PHDC_TX_INT_INDEX].transfer_size != 0) ||
+           (PhdcTXEP[PHDC_TX_INT_INDEX].offset != 0))
+        {
+            return;
+        }
+    #endif
+
+    PHDCTxStart(&PhdcTXEP[PHDC_TX_BULK_INDEX]);
+}
 
 
 /************************************************************************
@@ -418,7 +629,6 @@ Description:
 void USBDevicePHDCTxRXService(USTAT_FIELDS* pdata)
 {
 
-    UINT8 i;
 	PTR_PHDC_TX_ENDPOINT tx_endpoint;
 	PTR_PHDC_RX_ENDPOINT recv_endpoint;
 	UINT8 index;
@@ -433,6 +643,10 @@ void USBDevicePHDCTxRXService(USTAT_FIELDS* pdata)
             if(PhdcTXEP[index].ep_num == USBHALGetLastEndpoint(val))
             break;
         }
+        if(index == PHDC_TX_ENDPOINTS)
+        {
+            return;
+        }
 
 		tx_endpoint = &PhdcTXEP[index];
 
@@ -455,55 +669,23 @@ void USBDevicePHDCTxRXService(USTAT_FIELDS* pdata)
 		{
 			tx_endpoint->transfer_size = 0;
 			tx_endpoint->offset = 0;
-			PhdAppCB(USB_APP_SEND_COMPLETE,NULL);
+			PhdAppCB(USB_APP_SEND_COMPLETE,tx_endpoint->app_buff);
+
+			//Start the next queued transfer, highest priority bin first
+			USBMaskInterrupts();
+			PHDCTxServiceQueues();
+			USBUnmaskInterrupts();
 			return;
 		}
 
-	    if(tx_endpoint->offset < tx_endpoint->transfer_size)
+		tx_endpoint->bytes_to_send = tx_endpoint->transfer_size - tx_endpoint->offset;
+		if(tx_endpoint->bytes_to_send  > tx_endpoint->size)
 		{
-			tx_endpoint->bytes_to_send = tx_endpoint->transfer_size - tx_endpoint->offset;
-			if(tx_endpoint->bytes_to_send  > tx_endpoint->size)
-			{
-				tx_endpoint->bytes_to_send = tx_endpoint->size; //multiple send
-			}
-
+			tx_endpoint->bytes_to_send = tx_endpoint->size; //multiple send
 		}
 
 		USBMaskInterrupts();
-
-		i= tx_endpoint->bytes_to_send;
-        pPHDCDst.bRam = (BYTE*)phdc_data_tx; // Set destination pointer
-
-        if(tx_endpoint->memtype == MEM_ROM)            // Determine type of memory source
-        {
-			pPHDCSrc.bRom = (ROM UINT8*)(tx_endpoint->app_buff + tx_endpoint->offset);
-
-            while(i)
-            {
-                *pPHDCDst.bRam = *pPHDCSrc.bRom;
-                pPHDCDst.bRam++;
-                pPHDCSrc.bRom++;
-                i--;
-            }//end while(byte_to_send)
-
-        }
-        else // _RAM
-        {
-			pPHDCSrc.bRam = (UINT8*)(tx_endpoint->app_buff + tx_endpoint->offset);
-            while(i)
-            {
-                *pPHDCDst.bRam = *pPHDCSrc.bRam;
-                pPHDCDst.bRam++;
-                pPHDCSrc.bRam++;
-                i--;
-            }//end while(byte_to_send._word)
-
-        }//end if(phdc_mem_type...)
-
-        tx_endpoint->PHDCDataInHandle = USBTxOnePacket(tx_endpoint->ep_num,
-																(UINT8*)phdc_data_tx,
-																tx_endpoint->bytes_to_send);
-	    USBDevicePHDCUpdateStatus(tx_endpoint->ep_num, 1);
+		PHDCTxLoadPacket(tx_endpoint);
 		USBUnmaskInterrupts();
 	}
 
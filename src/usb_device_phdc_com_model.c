@@ -59,12 +59,34 @@ INT16 PhdConfirmTimeout;
 BOOL PhdTimeStateAbsSynced;
 UINT8 *pPhdAppBuffer;
 
+//Scan report being built by the PHDScanReportXxx() functions
+static UINT8 *pPhdScanReport;
+static UINT16 PhdScanReportSize;
+static UINT16 PhdScanReportLength;
+static UINT16 PhdScanReportCount;
+static UINT16 PhdScanReportNumber;
+static UINT16 PhdInvokeId;
+static UINT16 PhdPendingInvokeId[PHD_SCAN_REPORT_MAX_PENDING];  //invoke-ids of unconfirmed scan reports
+static INT16 PhdPendingTimeout[PHD_SCAN_REPORT_MAX_PENDING];    //confirm timeout of each unconfirmed scan report
+static UINT8 PhdPendingCount;
+static UINT16 PhdScanReportRetries;
+
+//pPhdAppBuffer is used for both directions, so it is not armed for
+//reception, and must not be rebuilt, while a send from it is queued.
+static UINT8 PhdAppBufferSends;     //queued sends of pPhdAppBuffer not yet complete
+static BOOL PhdReceivePending;      //reception is armed once those complete
+static UINT8 PhdAbortApdu[6];       //abort and release requests have their own
+static UINT8 PhdReleaseApdu[6];     //buffers, as they are sent at any time
+
 /** DEFINITIONS ****************************************************/
 #define ASSOCIATION_RESPONSE_REJECTED_PERMANENT_SIZE       48
 #define RELEASE_REQUEST_SIZE                                6
 #define RELEASE_RESPONSE_SIZE                               6
 #define ABORT_SIZE                                          6
 
+// Agent initiated measurement data transmission (data-req-id)
+#define DATA_REQ_ID_AGENT_INITIATED                         0xF000
+
 // Timeout
 #define TIMEOUT_ENABLED 1
 #define TIMEOUT_DISABLED 0
@@ -85,6 +107,12 @@ static void PHDDisableAllTimeout(void);
 static void PHDMdsAttributesRequestHandler(BYTE* apdu_val);
 static void PHDSetTime(BYTE* apdu_val);
 static void UsbToPHDComCB(UINT8 USB_Event, void*);
+static void PHDPutUINT16(UINT8* p, UINT16 value);
+static BOOL PHDInvokeIdIsPending(UINT16 invokeId);
+static BOOL PHDInvokeIdConfirmed(UINT16 invokeId);
+static BOOL PHDSendAppBuffer(UINT8 qos, UINT8 *pData, UINT16 length);
+static void PHDAppBufferSendDone(void);
+static void PHDReceive(void);
 
 /** CONSTANT DATA ********************************************************************************/
 
@@ -147,6 +175,11 @@ void PHDAppInit(PHDC_APP_CB callback)
 	PhdComState = PHD_COM_STATE_UNASSOCIATED;
 	PHDDisableAllTimeout();
 	PhdTimeStateAbsSynced = 0;
+	pPhdScanReport = NULL;
+	PhdScanReportCount = 0;
+	PhdScanReportRetries = 0;
+	PhdAppBufferSends = 0;
+	PhdReceivePending = FALSE;
 }
 
 /******************************************************************************
@@ -215,6 +248,10 @@ void UsbToPHDComCB(UINT8 USB_Event, void * val)
 	switch(USB_Event)
 	{
 		case USB_APP_SEND_COMPLETE:
+		    if(val == pPhdAppBuffer)
+		    {
+			    PHDAppBufferSendDone();
+		    }
 		    if(PhdComState == PHD_COM_STATE_ASSOC_CFG_SENDING_CONFIG)
 		    {
 			    PhdComState = PHD_COM_STATE_ASSOC_CFG_WAITING_APPROVAL;
@@ -224,8 +261,8 @@ void UsbToPHDComCB(UINT8 USB_Event, void * val)
 		break;
 
 		case USB_APP_DATA_RECEIVED:
-		    USBDevicePHDCReceiveData(PHDC_BULK_OUT_QOS,pPhdAppBuffer,0); //get ready to receive
 			PHDAppDataRxHandler(pPhdAppBuffer);
+			PHDReceive(); //get ready to receive, once any response has been sent
 		break;
 
 		case USB_APP_GET_TRANSFER_SIZE:
@@ -353,7 +390,7 @@ void PHDConnect(void)
 	{
 		PhdComState= PHD_COM_STATE_ASSOCIATING;
 		USBDevicePHDCSendData(PHDC_BULK_IN_QOS,(UINT8 *) ASSOCIATION_REQUEST,ASSOCIATION_REQUEST_SIZE,MEM_ROM);
-		USBDevicePHDCReceiveData(PHDC_BULK_OUT_QOS,pPhdAppBuffer,0); //get ready to receive
+		PHDReceive(); //get ready to receive
 
 		PhdAssociationRequestTimeoutStatus = TIMEOUT_ENABLED;
 		PhdAssociationRequestTimeout = ASSOCIATION_REQUEST_TIMEOUT;
@@ -445,13 +482,353 @@ void PHDDisConnect(void)
  *****************************************************************************/
 void PHDSendMeasuredData(void)
 {
-	USBDevicePHDCSendData(SEND_QOS,pPhdAppBuffer,(UINT16)MEASUREMENT_DATA_SIZE,MEM_RAM);
-	USBDevicePHDCReceiveData(PHDC_BULK_OUT_QOS,pPhdAppBuffer,0); //get ready to receive
+	PHDSendAppBuffer(SEND_QOS,pPhdAppBuffer,(UINT16)MEASUREMENT_DATA_SIZE);
+	PHDReceive(); //get ready to receive
 
 	PhdConfirmTimeoutStatus = TIMEOUT_ENABLED;
 	PhdConfirmTimeout = CONFIRM_TIMEOUT;
 }
 
+/******************************************************************************
+ * Function:
+ *      BOOL PHDScanReportBegin(UINT8 *pBuffer, UINT16 size, UINT32 eventTime)
+ *
+ * Summary:
+ *      Starts a fixed format scan report that batches several observations.
+ *
+ * Description:
+ *      See usb_device_phdc_com_model.h for a full description.
+ *
+ *****************************************************************************/
+BOOL PHDScanReportBegin(UINT8 *pBuffer, UINT16 size, UINT32 eventTime)
+{
+    if(pBuffer == NULL)
+    {
+        pBuffer = pPhdAppBuffer;
+        size = PHDC_MAX_APDU_SIZE;
+    }
+    if((pBuffer == NULL) || (size < PHD_SCAN_REPORT_HEADER_SIZE))
+    {
+        pPhdScanReport = NULL;
+        return FALSE;
+    }
+
+    pPhdScanReport = pBuffer;
+    PhdScanReportSize = size;
+    PhdScanReportLength = PHD_SCAN_REPORT_HEADER_SIZE;
+    PhdScanReportCount = 0;
+
+    //The length, invoke-id and count fields are filled in by PHDScanReportSend()
+    pBuffer[0] = 0xE7; pBuffer[1] = 0x00;               /* APDU CHOICE Type (PrstApdu) */
+    PHDPutUINT16(&pBuffer[8], ROIV_CMIP_CONFIRMED_EVENT_REPORT_CHOSEN);
+    PHDPutUINT16(&pBuffer[12], 0);                      /* obj-handle = 0 (MDS object) */
+    PHDPutUINT16(&pBuffer[14], (UINT16)(eventTime >> 16));  /* event-time */
+    PHDPutUINT16(&pBuffer[16], (UINT16)eventTime);
+    PHDPutUINT16(&pBuffer[18], MDC_NOTI_SCAN_REPORT_FIXED); /* event-type */
+    PHDPutUINT16(&pBuffer[22], DATA_REQ_ID_AGENT_INITIATED);
+    PHDPutUINT16(&pBuffer[24], PhdScanReportNumber);
+
+    return TRUE;
+}
+
+/******************************************************************************
+ * Function:
+ *      UINT8* PHDScanReportReserveObservation(UINT16 objHandle, UINT16 length)
+ *
+ * Summary:
+ *      Reserves room for one observation in the current scan report.
+ *
+ * Description:
+ *      See usb_device_phdc_com_model.h for a full description.
+ *
+ *****************************************************************************/
+UINT8* PHDScanReportReserveObservation(UINT16 objHandle, UINT16 length)
+{
+    UINT8* p;
+
+    if(pPhdScanReport == NULL)
+    {
+        return NULL;
+    }
+    if((UINT32)PhdScanReportLength + PHD_SCAN_REPORT_OBSERVATION_HEADER + length > PhdScanReportSize)
+    {
+        return NULL;    //report is full, send it and start another one
+    }
+
+    p = &pPhdScanReport[PhdScanReportLength];
+    PHDPutUINT16(&p[0], objHandle);
+    PHDPutUINT16(&p[2], length);
+
+    PhdScanReportLength += PHD_SCAN_REPORT_OBSERVATION_HEADER + length;
+    PhdScanReportCount++;
+
+    return &p[PHD_SCAN_REPORT_OBSERVATION_HEADER];
+}
+
+/******************************************************************************
+ * Function:
+ *      BOOL PHDScanReportAddObservation(UINT16 objHandle, const UINT8 *pData, UINT16 length)
+ *
+ * Summary:
+ *      Appends one already encoded observation to the current scan report.
+ *
+ * Description:
+ *      See usb_device_phdc_com_model.h for a full description.
+ *
+ *****************************************************************************/
+BOOL PHDScanReportAddObservation(UINT16 objHandle, const UINT8 *pData, UINT16 length)
+{
+    UINT8* p;
+
+    p = PHDScanReportReserveObservation(objHandle, length);
+    if(p == NULL)
+    {
+        return FALSE;
+    }
+
+    memcpy(p, pData, length);
+    return TRUE;
+}
+
+/******************************************************************************
+ * Function:
+ *      UINT16 PHDScanReportGetObservationCount(void)
+ *
+ * Summary:
+ *      Returns the number of observations in the current scan report.
+ *
+ * Description:
+ *      See usb_device_phdc_com_model.h for a full description.
+ *
+ *****************************************************************************/
+UINT16 PHDScanReportGetObservationCount(void)
+{
+    return PhdScanReportCount;
+}
+
+/******************************************************************************
+ * Function:
+ *      BOOL PHDScanReportSend(void)
+ *
+ * Summary:
+ *      Sends the current scan report to the PHD Manager.
+ *
+ * Description:
+ *      See usb_device_phdc_com_model.h for a full description.
+ *
+ *****************************************************************************/
+BOOL PHDScanReportSend(void)
+{
+    UINT8* p = pPhdScanReport;
+    UINT16 length = PhdScanReportLength;
+
+    if((p == NULL) || (PhdScanReportCount == 0) || (PhdComState != PHD_COM_STATE_ASSOC_OPERATING))
+    {
+        return FALSE;
+    }
+    if(PhdPendingCount >= PHD_SCAN_REPORT_MAX_PENDING)
+    {
+        PhdScanReportRetries++;
+        return FALSE;   //wait for the Manager to confirm an earlier report
+    }
+
+    //After the invoke-id wraps around, skip the ones of reports the Manager
+    //has not confirmed yet, so each confirmation matches a single report.
+    while(PHDInvokeIdIsPending(PhdInvokeId))
+    {
+        PhdInvokeId++;
+    }
+
+    //Each nested length field counts the bytes that follow it
+    PHDPutUINT16(&p[2], length - 4);        /* CHOICE.length */
+    PHDPutUINT16(&p[4], length - 6);        /* octet string length */
+    PHDPutUINT16(&p[6], PhdInvokeId);       /* invoke-id */
+    PHDPutUINT16(&p[10], length - 12);      /* event report length */
+    PHDPutUINT16(&p[20], length - 22);      /* event-info length */
+    PHDPutUINT16(&p[26], PhdScanReportCount);   /* obs-scan-fixed.count */
+    PHDPutUINT16(&p[28], length - 30);      /* obs-scan-fixed.length */
+
+    if(PHDSendAppBuffer(SEND_QOS, p, length) == FALSE)
+    {
+        PhdScanReportRetries++;
+        return FALSE;
+    }
+    PHDReceive(); //get ready to receive
+
+    //The confirm timeout of a report starts when its invoke-id is issued, so
+    //sending later reports does not extend it.
+    PhdPendingInvokeId[PhdPendingCount] = PhdInvokeId;
+    PhdPendingTimeout[PhdPendingCount] = CONFIRM_TIMEOUT;
+    PhdPendingCount++;
+    PhdInvokeId++;
+    PhdScanReportNumber++;
+    pPhdScanReport = NULL;
+    return TRUE;
+}
+
+/******************************************************************************
+ * Function:
+ *      UINT16 PHDScanReportGetRetryCount(void)
+ *
+ * Summary:
+ *      Returns the number of PHDScanReportSend() calls that had to be retried.
+ *
+ * Description:
+ *      See usb_device_phdc_com_model.h for a full description.
+ *
+ *****************************************************************************/
+UINT16 PHDScanReportGetRetryCount(void)
+{
+    return PhdScanReportRetries;
+}
+
+/******************************************************************************
+ * Function:
+ *      BOOL PHDAppBufferIsBusy(void)
+ *
+ * Summary:
+ *      Returns TRUE while a send from the application buffer is queued.
+ *
+ * Description:
+ *      See usb_device_phdc_com_model.h for a full description.
+ *
+ *****************************************************************************/
+BOOL PHDAppBufferIsBusy(void)
+{
+    return (PhdAppBufferSends != 0);
+}
+
+/******************************************************************************
+ * Function:        static BOOL PHDInvokeIdIsPending(UINT16 invokeId)
+ *
+ * Overview:        Returns TRUE if a scan report sent with invokeId has not
+ *                  been confirmed by the Manager yet.
+ *
+ *****************************************************************************/
+static BOOL PHDInvokeIdIsPending(UINT16 invokeId)
+{
+    UINT8 i;
+
+    for(i = 0; i < PhdPendingCount; i++)
+    {
+        if(PhdPendingInvokeId[i] == invokeId)
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/******************************************************************************
+ * Function:        static BOOL PHDInvokeIdConfirmed(UINT16 invokeId)
+ *
+ * Overview:        Removes invokeId from the unconfirmed scan reports.
+ *                  Returns FALSE if no scan report was sent with invokeId.
+ *
+ *****************************************************************************/
+static BOOL PHDInvokeIdConfirmed(UINT16 invokeId)
+{
+    UINT8 i;
+
+    for(i = 0; i < PhdPendingCount; i++)
+    {
+        if(PhdPendingInvokeId[i] == invokeId)
+        {
+            PhdPendingCount--;
+            PhdPendingInvokeId[i] = PhdPendingInvokeId[PhdPendingCount];
+            PhdPendingTimeout[i] = PhdPendingTimeout[PhdPendingCount];
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/******************************************************************************
+ * Function:        static BOOL PHDSendAppBuffer(UINT8 qos, UINT8 *pData, UINT16 length)
+ *
+ * Overview:        Queues a RAM send and, if pData is pPhdAppBuffer, counts it
+ *                  until USB_APP_SEND_COMPLETE reports that buffer back.
+ *                  Returns FALSE if the send was not queued.
+ *
+ *****************************************************************************/
+static BOOL PHDSendAppBuffer(UINT8 qos, UINT8 *pData, UINT16 length)
+{
+    if(pData != pPhdAppBuffer)
+    {
+        return USBDevicePHDCSendData(qos, pData, length, MEM_RAM);
+    }
+
+    //Counted before queuing, since the send may complete from the USB
+    //interrupt as soon as it is queued.
+    USBMaskInterrupts();
+    PhdAppBufferSends++;
+    USBUnmaskInterrupts();
+
+    if(USBDevicePHDCSendData(qos, pData, length, MEM_RAM) == FALSE)
+    {
+        USBMaskInterrupts();
+        PHDAppBufferSendDone();
+        USBUnmaskInterrupts();
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/******************************************************************************
+ * Function:        static void PHDAppBufferSendDone(void)
+ *
+ * Overview:        Uncounts a send from pPhdAppBuffer, and arms the deferred
+ *                  reception once no send from it is left.
+ *
+ *****************************************************************************/
+static void PHDAppBufferSendDone(void)
+{
+    if(PhdAppBufferSends == 0)
+    {
+        return;
+    }
+
+    PhdAppBufferSends--;
+    if((PhdAppBufferSends == 0) && PhdReceivePending)
+    {
+        PhdReceivePending = FALSE;
+        USBDevicePHDCReceiveData(PHDC_BULK_OUT_QOS,pPhdAppBuffer,0);
+    }
+}
+
+/******************************************************************************
+ * Function:        static void PHDReceive(void)
+ *
+ * Overview:        Arms reception into pPhdAppBuffer, or defers it until the
+ *                  sends queued from pPhdAppBuffer have completed.
+ *
+ *****************************************************************************/
+static void PHDReceive(void)
+{
+    USBMaskInterrupts();
+    if(PhdAppBufferSends != 0)
+    {
+        PhdReceivePending = TRUE;
+    }
+    else
+    {
+        USBDevicePHDCReceiveData(PHDC_BULK_OUT_QOS,pPhdAppBuffer,0);
+    }
+    USBUnmaskInterrupts();
+}
+
+/******************************************************************************
+ * Function:        static void PHDPutUINT16(UINT8* p, UINT16 value)
+ *
+ * Overview:        Stores a 16-bit value in MDER (big endian) byte order.
+ *
+ *****************************************************************************/
+static void PHDPutUINT16(UINT8* p, UINT16 value)
+{
+    p[0] = (UINT8)(value >> 8);
+    p[1] = (UINT8)value;
+}
+
 /******************************************************************************
  * Function:        static void PHDAssocRequestHandler(BYTE* apdu_val)
  *
@@ -474,7 +851,7 @@ static void PHDAssocRequestHandler(BYTE* apdu_val)
     {
         PhdComState = PHD_COM_STATE_UNASSOCIATED;
 		USBDevicePHDCSendData(PHDC_BULK_IN_QOS,(UINT8 *) ASSOCIATION_RESPONSE_REJECTED_PERMANENT, ASSOCIATION_RESPONSE_REJECTED_PERMANENT_SIZE, MEM_ROM);
-		USBDevicePHDCReceiveData(PHDC_BULK_OUT_QOS,pPhdAppBuffer,0); //get ready to receive
+		PHDReceive(); //get ready to receive
     }
     else if ((PhdComState == PHD_COM_STATE_ASSOC_OPERATING) || (PhdComState == PHD_COM_STATE_ASSOC_CFG_WAITING_APPROVAL) || (PhdComState ==  PHD_COM_STATE_DISASSOCIATING))
     {
@@ -650,7 +1027,11 @@ static void PHDPrstApduHandler(BYTE* apdu_val)
     		if (eventType.Val == MDC_NOTI_SCAN_REPORT_FIXED)
     		{
                 //We have received the response for the measurement that we sent.
-                PhdConfirmTimeoutStatus = TIMEOUT_DISABLED;
+                if(PHDInvokeIdConfirmed(invoke_id.Val) == FALSE)
+                {
+                    //Not a scan report, so the one sent by PHDSendMeasuredData()
+                    PhdConfirmTimeoutStatus = TIMEOUT_DISABLED;
+                }
                 AppCB(PHD_MEASUREMENT_SENT);
             }
 		}
@@ -671,7 +1052,7 @@ static void PHDPrstApduHandler(BYTE* apdu_val)
                 pPhdAppBuffer[12] = 0x00; pPhdAppBuffer[13] = 0x00;
                 pPhdAppBuffer[14] = 0x0C; pPhdAppBuffer[15] = 0x17;
                 pPhdAppBuffer[16] = 0x00; pPhdAppBuffer[17] = 0x00;
-                USBDevicePHDCSendData(PHDC_BULK_IN_QOS,pPhdAppBuffer,18,MEM_RAM);
+                PHDSendAppBuffer(PHDC_BULK_IN_QOS,pPhdAppBuffer,18);
             }
             else
             {
@@ -796,15 +1177,15 @@ static void PHDAbortRequestHandler(BYTE* apdu_val)
  *****************************************************************************/
 static void PHDSendAbortRequestToManager(UINT16 abortReason)
 {
-   pPhdAppBuffer[0] = 0xE6;  /* APDU CHOICE Type (AbortApdu) */
-   pPhdAppBuffer[1] = 0x00;
-   pPhdAppBuffer[2] = 0x00;  /* CHOICE.length = 2 */
-   pPhdAppBuffer[3] = 0x02;
-   pPhdAppBuffer[4] = (UINT8)abortReason>>8;  /* reason */
-   pPhdAppBuffer[5] = (UINT8)abortReason;
+   PhdAbortApdu[0] = 0xE6;  /* APDU CHOICE Type (AbortApdu) */
+   PhdAbortApdu[1] = 0x00;
+   PhdAbortApdu[2] = 0x00;  /* CHOICE.length = 2 */
+   PhdAbortApdu[3] = 0x02;
+   PhdAbortApdu[4] = (UINT8)abortReason>>8;  /* reason */
+   PhdAbortApdu[5] = (UINT8)abortReason;
 
    PhdComState = PHD_COM_STATE_UNASSOCIATED;
-   USBDevicePHDCSendData(PHDC_BULK_IN_QOS,(UINT8 *) pPhdAppBuffer,ABORT_SIZE,MEM_RAM);
+   USBDevicePHDCSendData(PHDC_BULK_IN_QOS,PhdAbortApdu,ABORT_SIZE,MEM_RAM);
    AppCB(PHD_DISCONNECTED);
    PHDDisableAllTimeout();
 
@@ -828,15 +1209,15 @@ static void PHDSendAbortRequestToManager(UINT16 abortReason)
  *****************************************************************************/
 void PHDSendReleaseRequestToManager(UINT16 releaseReason)
 {
-   pPhdAppBuffer[0] = 0xE4;  /* APDU CHOICE Type (RlrqApdu) */
-   pPhdAppBuffer[1] = 0x00;
-   pPhdAppBuffer[2] = 0x00;  /* CHOICE.length = 2 */
-   pPhdAppBuffer[3] = 0x02;
-   pPhdAppBuffer[4] = (UINT8)releaseReason>>8;  /* reason */
-   pPhdAppBuffer[5] = (UINT8)releaseReason;
+   PhdReleaseApdu[0] = 0xE4;  /* APDU CHOICE Type (RlrqApdu) */
+   PhdReleaseApdu[1] = 0x00;
+   PhdReleaseApdu[2] = 0x00;  /* CHOICE.length = 2 */
+   PhdReleaseApdu[3] = 0x02;
+   PhdReleaseApdu[4] = (UINT8)releaseReason>>8;  /* reason */
+   PhdReleaseApdu[5] = (UINT8)releaseReason;
 
    PhdComState= PHD_COM_STATE_DISASSOCIATING;
-   USBDevicePHDCSendData(PHDC_BULK_IN_QOS,(UINT8 *) pPhdAppBuffer,RELEASE_REQUEST_SIZE,MEM_RAM);
+   USBDevicePHDCSendData(PHDC_BULK_IN_QOS,PhdReleaseApdu,RELEASE_REQUEST_SIZE,MEM_RAM);
 
    PhdAssociationReleaseTimeoutStatus = TIMEOUT_ENABLED;
    PhdAssociationReleaseTimeout = ASSOCIATION_RELEASE_TIMOUT;
@@ -868,7 +1249,7 @@ void PHDSendRoerMessageToManager (UINT16 invoke_id, UINT16 error_value)
     pPhdAppBuffer[10] = 0x00;  pPhdAppBuffer[11] = 0x04;
     pPhdAppBuffer[12] = (UINT8)(error_value>>8);  pPhdAppBuffer[13] = (UINT8)error_value;
     pPhdAppBuffer[14] = 0x00;  pPhdAppBuffer[15] = 0x00;
-    USBDevicePHDCSendData(PHDC_BULK_IN_QOS,pPhdAppBuffer,16,MEM_RAM);
+    PHDSendAppBuffer(PHDC_BULK_IN_QOS,pPhdAppBuffer,16);
 }
 
 /******************************************************************************
@@ -899,6 +1280,8 @@ void PHDSendRoerMessageToManager (UINT16 invoke_id, UINT16 error_value)
  *****************************************************************************/
  void PHDTimeoutHandler(void)
  {
+    UINT8 i;
+
     if ((PhdAssociationRequestTimeoutStatus == TIMEOUT_ENABLED) && (PhdComState == PHD_COM_STATE_ASSOCIATING))
     {
         PhdAssociationRequestTimeout--;
@@ -909,7 +1292,7 @@ void PHDSendRoerMessageToManager (UINT16 invoke_id, UINT16 error_value)
                 PhdAssociationRequestRetry--;
                 PhdComState= PHD_COM_STATE_ASSOCIATING;
 		        USBDevicePHDCSendData(PHDC_BULK_IN_QOS,(UINT8 *) ASSOCIATION_REQUEST,ASSOCIATION_REQUEST_SIZE,MEM_ROM);
-		        USBDevicePHDCReceiveData(PHDC_BULK_OUT_QOS,pPhdAppBuffer,0); //get ready to receive
+		        PHDReceive(); //get ready to receive
 		        PhdAssociationRequestTimeoutStatus = TIMEOUT_ENABLED;
 		        PhdAssociationRequestTimeout = ASSOCIATION_REQUEST_TIMEOUT;
 		    }
@@ -948,6 +1331,16 @@ void PHDSendRoerMessageToManager (UINT16 invoke_id, UINT16 error_value)
              PHDSendAbortRequestToManager(ABORT_REASON_RESPONSE_TIMEOUT);
          }
     }
+    for (i = 0; i < PhdPendingCount; i++)
+    {
+         PhdPendingTimeout[i]--;
+         if (PhdPendingTimeout[i] <= TIMEOUT_EXPIRED)
+         {
+             PhdPendingCount = 0;
+             PHDSendAbortRequestToManager(ABORT_REASON_RESPONSE_TIMEOUT);
+             break;
+         }
+    }
  }
 
 /******************************************************************************
@@ -972,6 +1365,7 @@ void PHDSendRoerMessageToManager (UINT16 invoke_id, UINT16 error_value)
 	PhdConfigurationTimeoutStatus = TIMEOUT_DISABLED;
 	PhdAssociationReleaseTimeoutStatus = TIMEOUT_DISABLED;
 	PhdConfirmTimeoutStatus = TIMEOUT_DISABLED;
+	PhdPendingCount = 0;    //no confirmation can arrive without a confirm timeout
  }
 
 
@@ -1033,7 +1427,7 @@ void PHDSendRoerMessageToManager (UINT16 invoke_id, UINT16 error_value)
 		 {
 		   pPhdAppBuffer[PHD_MDS_ATTR_ABS_SYNCED_POINTER] = 0x20;
 		 }
-		 USBDevicePHDCSendData(PHDC_BULK_IN_QOS,pPhdAppBuffer,MDS_ATTRIBUTES_SIZE,MEM_RAM);
+		 PHDSendAppBuffer(PHDC_BULK_IN_QOS,pPhdAppBuffer,MDS_ATTRIBUTES_SIZE);
 	 }
 	 else
 	 {
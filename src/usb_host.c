@@ -35,6 +35,7 @@ please contact mla_licensing@microchip.com
 #endif
 
 #define USB_FREE_AND_CLEAR(ptr) {USB_FREE(ptr); ptr = NULL;}
+#define USB_ARENA_FREE_AND_CLEAR(ptr) {_USB_ArenaFree(ptr); ptr = NULL;}
 
 #if defined( USB_ENABLE_TRANSFER_EVENT )
     #include "usb_struct_queue.h"
@@ -126,12 +127,20 @@ volatile uint16_t                 usbOverrideHostState;                       //
     static uint16_t prevHostState;
 #endif
 
+static USB_HOST_ARENA                usbHostArena;                               // Block holding the enumeration data of the attached device.
 static USB_BUS_INFO                  usbBusInfo;                                 // Information about the USB bus.
+static USB_FRAME_SCHEDULE            usbFrameSchedule;                           // Per-frame schedule of the current configuration.
 static USB_DEVICE_INFO               usbDeviceInfo;                              // A collection of information about the attached device.
 #if defined( USB_ENABLE_TRANSFER_EVENT )
     static USB_EVENT_QUEUE           usbEventQueue;                              // Queue of USB events used to synchronize ISR to main tasks loop.
 #endif
 static USB_ROOT_HUB_INFO             usbRootHubInfo;                             // Information about a specific port.
+#if defined( USB_ENABLE_ENUMERATION_CACHE )
+    static USB_ENUMERATION_CACHE     usbEnumerationCache;                        // Configurations of recently attached devices.
+#endif
+#if defined( USB_ENABLE_ENUMERATION_PROFILE )
+    static USB_ENUMERATION_PROFILER  usbEnumerationProfiler;                     // Timing of the enumeration stages.
+#endif
 
 static volatile uint16_t msec_count = 0;                                             // The current millisecond count.
 
@@ -173,6 +182,13 @@ static volatile uint16_t msec_count = 0;
 uint8_t USBHostClearEndpointErrors( uint8_t deviceAddress, uint8_t endpoint )
 {
     USB_ENDPOINT_INFO *ep;
+    #if defined( __C30__ ) || defined __XC16__
+        uint16_t        interrupt_mask;
+    #elif defined( __PIC32__ )
+        uint32_t      interrupt_mask;
+    #else
+        #error Cannot save interrupt status
+    #endif
 
     // Find the required device
     if (deviceAddress != usbDeviceInfo.deviceAddress)
@@ -184,9 +200,23 @@ uint8_t USBHostClearEndpointErrors( uint8_t deviceAddress, uint8_t endpoint )
 
     if (ep != NULL)
     {
+        // Guard against USB interrupts
+        interrupt_mask = U1IE;
+        U1IE = 0;
+
         ep->status.bfStalled    = 0;
         ep->status.bfError      = 0;
 
+        // Resume the submitted requests that were held by the error.
+        if ((ep->pRequestHead != NULL) && (ep->pRequestHead->status == USB_HOST_REQUEST_QUEUED) &&
+            ep->status.bfTransferComplete)
+        {
+            _USB_RequestStart( ep );
+        }
+
+        // Re-enable USB interrupts
+        U1IE = interrupt_mask;
+
         return USB_SUCCESS;
     }
     return USB_ENDPOINT_NOT_FOUND;
@@ -318,6 +348,161 @@ uint8_t USBHostDeviceStatus( uint8_t deviceAddress )
     return USB_HOLDING_UNSUPPORTED_DEVICE;
 }
 
+/****************************************************************************
+  Function:
+    void USBHostEnumerationCacheFlush( void )
+
+  Summary:
+    This function empties the enumeration cache.
+
+  Description:
+    When USB_ENABLE_ENUMERATION_CACHE is defined, the configuration selected
+    for a device is remembered after the device detaches.  When a device with
+    the same VID, PID, bcdDevice and serial number attaches again, the
+    configuration descriptors are not read from the device again, only
+    the remembered configuration is parsed, and its interfaces are bound to
+    the client drivers they were bound to before, without searching the TPL.
+
+    This function forgets all remembered devices and releases their memory.
+    It should be called if a device may have changed its descriptors without
+    changing its bcdDevice, for example after a firmware update, or if the
+    application changes its answers to EVENT_OVERRIDE_CLIENT_DRIVER_SELECTION.
+
+  Precondition:
+    None
+
+  Parameters:
+    None - None
+
+  Returns:
+    None
+
+  Remarks:
+    The device currently attached is not affected.  It is remembered again
+    the next time its configuration is selected.
+  ***************************************************************************/
+
+#if defined( USB_ENABLE_ENUMERATION_CACHE )
+void USBHostEnumerationCacheFlush( void )
+{
+    uint8_t     i;
+
+    for (i=0; i<USB_ENUMERATION_CACHE_ENTRIES; i++)
+    {
+        if (usbEnumerationCache.entry[i].pDescriptor != NULL)
+        {
+            USB_FREE_AND_CLEAR( usbEnumerationCache.entry[i].pDescriptor );
+        }
+    }
+    usbEnumerationCache.pHit = NULL;
+}
+#endif
+
+/****************************************************************************
+  Function:
+    uint8_t USBHostGetArenaInfo( uint8_t deviceAddress,
+                USB_HOST_ARENA_INFO *pInfo )
+
+  Summary:
+    This function reports the memory used for the device's enumeration data.
+
+  Description:
+    The device and configuration descriptors, the EP0 buffer, and the
+    interface, setting and endpoint information of the attached device are
+    all allocated from a single block of heap.  The block is allocated once,
+    when the size of the first configuration descriptor is known, and is
+    released in one step when the device detaches.  This avoids the heap
+    fragmentation caused by allocating and freeing each node separately.
+
+    This function returns the size and use of that block, the most memory
+    ever needed for a device, and the number of allocations that did not fit
+    and had to be taken from the heap.  If allocations fall back to the heap,
+    USB_HOST_ARENA_EXTRA can be defined in usb_config.h to enlarge the block.
+
+  Precondition:
+    None
+
+  Parameters:
+    uint8_t deviceAddress       - Device address, or 0 to read the high water
+                                    mark with no device attached
+    USB_HOST_ARENA_INFO *pInfo  - Where to store the information
+
+  Return Values:
+    USB_SUCCESS         - Success
+    USB_UNKNOWN_DEVICE  - Device not found
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+uint8_t USBHostGetArenaInfo( uint8_t deviceAddress, USB_HOST_ARENA_INFO *pInfo )
+{
+    // Find the required device
+    if ((deviceAddress != 0) && (deviceAddress != usbDeviceInfo.deviceAddress))
+    {
+        return USB_UNKNOWN_DEVICE;
+    }
+
+    pInfo->size             = usbHostArena.size;
+    pInfo->used             = usbHostArena.used;
+    pInfo->highWater        = usbHostArena.highWater;
+    pInfo->heapFallbacks    = usbHostArena.heapFallbacks;
+
+    return USB_SUCCESS;
+}
+
+/****************************************************************************
+  Function:
+    uint8_t USBHostGetEnumerationProfile( uint8_t deviceAddress,
+                USB_ENUMERATION_PROFILE *pProfile )
+
+  Summary:
+    This function reports the time taken by each stage of enumeration.
+
+  Description:
+    When USB_ENABLE_ENUMERATION_PROFILE is defined, the host times each stage
+    of the enumeration of an attached device, and counts the NAKs and retries
+    in each stage.  When the device is running, or is held because of an
+    error, EVENT_ENUMERATION_PROFILE is sent to the application event handler
+    with the profile as its data.  This function returns the same data.
+
+    The profile shows which delays dominate the attach to ready time of a
+    device, so that values such as USB_INSERT_TIME and
+    USB_RESET_RECOVERY_TIME can be tuned.
+
+  Precondition:
+    None
+
+  Parameters:
+    uint8_t deviceAddress               - Device address, or 0 to read the
+                                            profile of the last device
+    USB_ENUMERATION_PROFILE *pProfile   - Where to store the profile
+
+  Return Values:
+    USB_SUCCESS         - Success
+    USB_UNKNOWN_DEVICE  - Device not found
+
+  Remarks:
+    The one millisecond timer interrupt is left enabled, as it is for
+    USB_ENABLE_1MS_EVENT.  If enumeration has not finished, complete is
+    false and the time of the current stage is not yet included.
+  ***************************************************************************/
+
+#if defined( USB_ENABLE_ENUMERATION_PROFILE )
+uint8_t USBHostGetEnumerationProfile( uint8_t deviceAddress, USB_ENUMERATION_PROFILE *pProfile )
+{
+    // Find the required device
+    if ((deviceAddress != 0) && (deviceAddress != usbDeviceInfo.deviceAddress))
+    {
+        return USB_UNKNOWN_DEVICE;
+    }
+
+    memcpy( pProfile, &usbEnumerationProfiler.data, sizeof(USB_ENUMERATION_PROFILE) );
+
+    return USB_SUCCESS;
+}
+#endif
+
 /****************************************************************************
   Function:
     bool USBHostInit(  unsigned long flags  )
@@ -379,7 +564,11 @@ bool USBHostInit(  unsigned long flags  )
 
     // Initialize event queue
     #if defined( USB_ENABLE_TRANSFER_EVENT )
-        StructQueueInit(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
+        StructRingInit(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
+    #endif
+
+    #if defined( USB_ENABLE_ENUMERATION_PROFILE )
+        usbEnumerationProfiler.stage        = USB_ENUMERATION_STAGE_NONE;
     #endif
 
     return true;
@@ -573,7 +762,9 @@ void USBHostIsochronousBuffersReset( ISOCHRONOUS_DATA * isocData, uint8_t number
                                     to do this request
     USB_ENDPOINT_BUSY           - A read or write is already in progress
     USB_ILLEGAL_REQUEST         - SET CONFIGURATION cannot be performed with
-                                    this function.
+                                    this function, or the endpoints of the
+                                    setting requested by SET INTERFACE do not
+                                    fit in the bus bandwidth.
 
   Remarks:
     DTS reset is done before the command is issued.
@@ -615,20 +806,28 @@ uint8_t USBHostIssueDeviceRequest( uint8_t deviceAddress, uint8_t bmRequestType,
         USB_ENDPOINT_INFO           *pEndpoint;
         USB_INTERFACE_INFO          *pInterface;
         USB_INTERFACE_SETTING_INFO  *pSetting;
+        USB_INTERFACE_SETTING_INFO  *pCurrentSetting;
 
         // Make sure there are no transfers currently in progress on the current
         // interface setting.
-        pInterface = usbDeviceInfo.pInterfaceList;
-        while (pInterface && (pInterface->interface != wIndex))
+        pInterface = NULL;
+        if (wIndex <= 0xFF)
         {
-            pInterface = pInterface->next;
+            pInterface = _USB_FindInterface( (uint8_t)wIndex );
         }
-        if ((pInterface == NULL) || (pInterface->pCurrentSetting == NULL))
+        if (pInterface == NULL)
         {
             // The specified interface was not found.
             return USB_ILLEGAL_REQUEST;
         }
-        pEndpoint = pInterface->pCurrentSetting->pEndpointList;
+
+        // If no client driver supports setting 0, the interface has no
+        // current setting, and no transfers can be in progress on it.
+        pEndpoint = NULL;
+        if (pInterface->pCurrentSetting != NULL)
+        {
+            pEndpoint = pInterface->pCurrentSetting->pEndpointList;
+        }
         while (pEndpoint)
         {
             if (!pEndpoint->status.bfTransferComplete)
@@ -650,8 +849,17 @@ uint8_t USBHostIssueDeviceRequest( uint8_t deviceAddress, uint8_t bmRequestType,
             return USB_ILLEGAL_REQUEST;
         }
 
-        // Set the pointer to the new setting.
+        // Set the pointer to the new setting, and reschedule the bus for its
+        // endpoints.  If they do not fit, stay with the old setting.
+        pCurrentSetting = pInterface->pCurrentSetting;
         pInterface->pCurrentSetting = pSetting;
+        if (!_USB_FrameScheduleBuild())
+        {
+            pInterface->pCurrentSetting = pCurrentSetting;
+            _USB_FrameScheduleBuild();
+            return USB_ILLEGAL_REQUEST;
+        }
+        _USB_IndexBuild();
     }
 
     // If the user is doing a CLEAR FEATURE(ENDPOINT_HALT), we must reset DATA0 for that endpoint.
@@ -793,7 +1001,7 @@ uint8_t USBHostRead( uint8_t deviceAddress, uint8_t endpoint, uint8_t *pData, ui
             return USB_ENDPOINT_ERROR;
         }
 
-        if (!ep->status.bfTransferComplete)
+        if (!ep->status.bfTransferComplete || (ep->pRequestHead != NULL))
         {
             // We are already processing a request for this endpoint.
             return USB_ENDPOINT_BUSY;
@@ -1135,6 +1343,160 @@ void USBHostShutdown( void )
 }
 
 
+/****************************************************************************
+  Function:
+    uint8_t USBHostSubmitTransfer( uint8_t deviceAddress, uint8_t endpoint,
+                USB_HOST_TRANSFER_REQUEST *pRequest )
+
+  Summary:
+    This function queues a transfer request on a bulk or interrupt endpoint.
+
+  Description:
+    This function adds a transfer request to the end of the queue of the
+    given endpoint.  The direction of the transfer is given by the endpoint.
+    If no other request is pending, the transfer is started immediately.
+    Otherwise it is started by the USB interrupt as soon as the request ahead
+    of it completes, so back-to-back transfers do not wait for USBHostTasks().
+
+    When the request completes, its dataCount and errorCode are filled in and
+    its status is set to USB_HOST_REQUEST_COMPLETE.  If callback is not NULL,
+    it is then called from USBHostTasks().  Otherwise the usual EVENT_TRANSFER
+    or EVENT_BUS_ERROR is sent to the client driver, with pRequest in the
+    HOST_TRANSFER_DATA pointing to the request.
+
+    The queue is not advanced past a request that ends in error or a STALL.
+    The remaining requests are started once the condition is cleared with
+    USBHostClearEndpointErrors(), or dropped with USBHostTerminateTransfer().
+
+  Precondition:
+    The pData, size, callback and context members of the request have been
+    set up.  The request is not already queued.
+
+  Parameters:
+    uint8_t deviceAddress               - Device address
+    uint8_t endpoint                    - Endpoint number
+    USB_HOST_TRANSFER_REQUEST *pRequest - Request to queue
+
+  Return Values:
+    USB_SUCCESS                 - Request queued.
+    USB_UNKNOWN_DEVICE          - Device with the specified address not found.
+    USB_INVALID_STATE           - We are not in a normal running state.
+    USB_ILLEGAL_REQUEST         - The request is already queued, or size
+                                    is larger than 0xFFFF.
+    USB_ENDPOINT_ILLEGAL_TYPE   - The endpoint is not bulk or interrupt.
+    USB_ENDPOINT_STALLED        - Endpoint is stalled.  Must be cleared
+                                    by the application.
+    USB_ENDPOINT_ERROR          - Endpoint has too many errors.  Must be
+                                    cleared by the application.
+    USB_ENDPOINT_BUSY           - A transfer started with USBHostRead() or
+                                    USBHostWrite() is in progress.
+    USB_ENDPOINT_NOT_FOUND      - Invalid endpoint.
+
+  Remarks:
+    Completion callbacks and events require USB_ENABLE_TRANSFER_EVENT.
+    Without it, the status member of the request must be polled.
+  ***************************************************************************/
+
+uint8_t USBHostSubmitTransfer( uint8_t deviceAddress, uint8_t endpoint, USB_HOST_TRANSFER_REQUEST *pRequest )
+{
+    USB_ENDPOINT_INFO *ep;
+    #if defined( __C30__ ) || defined __XC16__
+        uint16_t        interrupt_mask;
+    #elif defined( __PIC32__ )
+        uint32_t      interrupt_mask;
+    #else
+        #error Cannot save interrupt status
+    #endif
+
+    // Find the required device
+    if (deviceAddress != usbDeviceInfo.deviceAddress)
+    {
+        return USB_UNKNOWN_DEVICE;
+    }
+
+    // If we are not in a normal user running state, we cannot do this.
+    if ((usbHostState & STATE_MASK) != STATE_RUNNING)
+    {
+        return USB_INVALID_STATE;
+    }
+
+    if ((pRequest->status == USB_HOST_REQUEST_QUEUED) || (pRequest->status == USB_HOST_REQUEST_ACTIVE))
+    {
+        // The request is still owned by the stack.
+        return USB_ILLEGAL_REQUEST;
+    }
+
+    if (pRequest->size > 0xFFFF)
+    {
+        // The transfer length is 16 bits in the endpoint information.
+        return USB_ILLEGAL_REQUEST;
+    }
+
+    ep = _USB_FindEndpoint( endpoint );
+    if (ep == NULL)
+    {
+        return USB_ENDPOINT_NOT_FOUND;
+    }
+
+    if ((ep->bmAttributes.bfTransferType != USB_TRANSFER_TYPE_BULK) &&
+        (ep->bmAttributes.bfTransferType != USB_TRANSFER_TYPE_INTERRUPT))
+    {
+        // Control and isochronous transfers cannot be queued.
+        return USB_ENDPOINT_ILLEGAL_TYPE;
+    }
+
+    if (ep->status.bfStalled)
+    {
+        // The endpoint is stalled.  It must be restarted before a transfer
+        // can be performed.
+        return USB_ENDPOINT_STALLED;
+    }
+
+    if (ep->status.bfError)
+    {
+        // The endpoint has errored.  The error must be cleared before a
+        // transfer can be performed.
+        return USB_ENDPOINT_ERROR;
+    }
+
+    if ((ep->pRequestHead == NULL) && !ep->status.bfTransferComplete)
+    {
+        // A USBHostRead() or USBHostWrite() is in progress on this endpoint.
+        return USB_ENDPOINT_BUSY;
+    }
+
+    pRequest->next      = NULL;
+    pRequest->dataCount = 0;
+    pRequest->errorCode = USB_SUCCESS;
+    pRequest->status    = USB_HOST_REQUEST_QUEUED;
+
+    // Guard against USB interrupts, since a completion advances the queue.
+    interrupt_mask = U1IE;
+    U1IE = 0;
+
+    if (ep->pRequestTail == NULL)
+    {
+        ep->pRequestHead = pRequest;
+    }
+    else
+    {
+        ep->pRequestTail->next = pRequest;
+    }
+    ep->pRequestTail = pRequest;
+
+    // If nothing is ahead of it, start it now.
+    if ((ep->pRequestHead == pRequest) && ep->status.bfTransferComplete)
+    {
+        _USB_RequestStart( ep );
+    }
+
+    // Re-enable USB interrupts
+    U1IE = interrupt_mask;
+
+    return USB_SUCCESS;
+}
+
+
 /****************************************************************************
   Function:
     uint8_t USBHostSuspendDevice( uint8_t deviceAddress )
@@ -1247,36 +1609,32 @@ void USBHostTasks( void )
     #if defined ( USB_ENABLE_TRANSFER_EVENT )
     {
         USB_EVENT_DATA *item;
-        #if defined( __C30__ ) || defined __XC16__
-            uint16_t        interrupt_mask;
-        #elif defined( __PIC32__ )
-            uint32_t      interrupt_mask;
-        #else
-            #error Cannot save interrupt status
-        #endif
 
-        while (StructQueueIsNotEmpty(&usbEventQueue, USB_EVENT_QUEUE_DEPTH))
+        // The ISR only moves the head and we only move the tail, so the
+        // queue can be emptied with USB interrupts enabled.
+        while (StructRingIsNotEmpty(&usbEventQueue, USB_EVENT_QUEUE_DEPTH))
         {
-            item = StructQueuePeekTail(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
+            item = StructRingPeekTail(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
 
             switch(item->event)
             {
                 case EVENT_TRANSFER:
                 case EVENT_BUS_ERROR:
-                    _USB_NotifyClients( usbDeviceInfo.deviceAddress, item->event, &item->TransferData, sizeof(HOST_TRANSFER_DATA) );
+                    if ((item->TransferData.pRequest != NULL) && (item->TransferData.pRequest->callback != NULL))
+                    {
+                        // The submitter asked to be called back instead.
+                        item->TransferData.pRequest->callback( item->TransferData.pRequest );
+                    }
+                    else
+                    {
+                        _USB_NotifyClients( usbDeviceInfo.deviceAddress, item->event, &item->TransferData, sizeof(HOST_TRANSFER_DATA) );
+                    }
                     break;
                 default:
                     break;
             }
 
-            // Guard against USB interrupts
-            interrupt_mask = U1IE;
-            U1IE = 0;
-
-            item = StructQueueRemove(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
-
-            // Re-enable USB interrupts
-            U1IE = interrupt_mask;
+            StructRingRemove(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
         }
     }
     #endif
@@ -1292,6 +1650,10 @@ void USBHostTasks( void )
         usbOverrideHostState = NO_STATE;
     }
 
+    #if defined( USB_ENABLE_ENUMERATION_PROFILE )
+        _USB_ProfileUpdate();
+    #endif
+
     //-------------------------------------------------------------------------
     // Main State Machine
 
@@ -1324,6 +1686,8 @@ void USBHostTasks( void )
                     usbDeviceInfo.pEndpoint0->transferState                = TSTATE_IDLE;
                     usbDeviceInfo.pEndpoint0->bmAttributes.bfTransferType  = USB_TRANSFER_TYPE_CONTROL;
                     usbDeviceInfo.pEndpoint0->clientDriver                 = CLIENT_DRIVER_HOST;
+                    usbDeviceInfo.pEndpoint0->pRequestHead                 = NULL;
+                    usbDeviceInfo.pEndpoint0->pRequestTail                 = NULL;
 
                     // Initialize any device specific information.
                     numEnumerationTries                 = USB_NUM_ENUMERATION_TRIES;
@@ -1426,7 +1790,7 @@ void USBHostTasks( void )
                         // Enable the ATTACH interrupt.
                         U1IEbits.ATTACHIE = 1;
 
-                        #if defined(USB_ENABLE_1MS_EVENT)
+                        #if defined(USB_ENABLE_1MS_EVENT) || defined(USB_ENABLE_ENUMERATION_PROFILE)
                             U1OTGIR                 = USB_INTERRUPT_T1MSECIF; // The interrupt is cleared by writing a '1' to the flag.
                             U1OTGIEbits.T1MSECIE    = 1;
                         #endif
@@ -1494,14 +1858,13 @@ void USBHostTasks( void )
                             DEBUG_PutString( "HOST: Resetting the device.\r\n" );
 #endif
 
+                            // Release whatever is left from an earlier enumeration, so the
+                            // enumeration data block is allocated afresh for this one.
+                            _USB_FreeMemory();
+
                             // Prepare a data buffer for us to use.  We'll make it 8 bytes for now,
                             // which is the minimum wMaxPacketSize for EP0.
-                            if (pEP0Data != NULL)
-                            {
-                                USB_FREE_AND_CLEAR( pEP0Data );
-                            }
-
-                            if ((pEP0Data = (uint8_t *)USB_MALLOC( 8 )) == NULL)
+                            if ((pEP0Data = (uint8_t *)_USB_ArenaAlloc( 8 )) == NULL)
                             {
 #if defined (DEBUG_ENABLE)
                                 DEBUG_PutString( "HOST: Error alloc-ing pEP0Data\r\n" );
@@ -1517,6 +1880,12 @@ void USBHostTasks( void )
                             usbDeviceInfo.attributesOTG             = 0;
                             usbDeviceInfo.flags.val                 = 0;
 
+#if defined( USB_ENABLE_ENUMERATION_CACHE )
+                            usbEnumerationCache.pHit                = NULL;
+                            usbEnumerationCache.lookup              = true;
+                            usbEnumerationCache.identified          = false;
+#endif
+
                             _USB_InitErrorCounters();
 
                             // Disable all EP's except EP0.
@@ -1632,7 +2001,7 @@ void USBHostTasks( void )
                             // Set up and send GET DEVICE DESCRIPTOR
                             if (pDeviceDescriptor != NULL)
                             {
-                                USB_FREE_AND_CLEAR( pDeviceDescriptor );
+                                USB_ARENA_FREE_AND_CLEAR( pDeviceDescriptor );
                             }
 
                             pEP0Data[0] = USB_SETUP_DEVICE_TO_HOST | USB_SETUP_TYPE_STANDARD | USB_SETUP_RECIPIENT_DEVICE;
@@ -1680,7 +2049,7 @@ void USBHostTasks( void )
 
                         case SUBSUBSTATE_GET_DEVICE_DESCRIPTOR_SIZE_COMPLETE:
                             // Allocate a buffer for the entire Device Descriptor
-                            if ((pDeviceDescriptor = (uint8_t *)USB_MALLOC( *pEP0Data )) == NULL)
+                            if ((pDeviceDescriptor = (uint8_t *)_USB_ArenaAlloc( *pEP0Data )) == NULL)
                             {
                                 // We cannot continue.  Freeze until the device is removed.
                                 _USB_SetErrorCode( USB_HOLDING_OUT_OF_MEMORY );
@@ -1694,8 +2063,8 @@ void USBHostTasks( void )
                             usbDeviceInfo.pEndpoint0->wMaxPacketSize = ((USB_DEVICE_DESCRIPTOR *)pEP0Data)->bMaxPacketSize0;
 
                             // Make our pEP0Data buffer the size of the max packet.
-                            USB_FREE_AND_CLEAR( pEP0Data );
-                            if ((pEP0Data = (uint8_t *)USB_MALLOC( usbDeviceInfo.pEndpoint0->wMaxPacketSize )) == NULL)
+                            USB_ARENA_FREE_AND_CLEAR( pEP0Data );
+                            if ((pEP0Data = (uint8_t *)_USB_ArenaAlloc( usbDeviceInfo.pEndpoint0->wMaxPacketSize )) == NULL)
                             {
                                 // We cannot continue.  Freeze until the device is removed.
 #if defined (DEBUG_ENABLE)
@@ -1867,8 +2236,8 @@ void USBHostTasks( void )
                     while (usbDeviceInfo.pConfigurationDescriptorList != NULL)
                     {
                         pTemp = (uint8_t *)usbDeviceInfo.pConfigurationDescriptorList->next;
-                        USB_FREE_AND_CLEAR( usbDeviceInfo.pConfigurationDescriptorList->descriptor );
-                        USB_FREE_AND_CLEAR( usbDeviceInfo.pConfigurationDescriptorList );
+                        USB_ARENA_FREE_AND_CLEAR( usbDeviceInfo.pConfigurationDescriptorList->descriptor );
+                        USB_ARENA_FREE_AND_CLEAR( usbDeviceInfo.pConfigurationDescriptorList );
                         usbDeviceInfo.pConfigurationDescriptorList = (USB_CONFIGURATION *)pTemp;
                     }
 
@@ -1877,70 +2246,208 @@ void USBHostTasks( void )
                         _USB_SetErrorCode( USB_HOLDING_CLIENT_INIT_ERROR );
                         _USB_SetHoldState();
                     }
+#if defined( USB_ENABLE_ENUMERATION_CACHE )
+                    else if (usbEnumerationCache.lookup)
+                    {
+                        // Read the serial number to see if the configuration
+                        // descriptors of this device are in the cache.
+                        usbEnumerationCache.lookup = false;
+                        usbHostState = STATE_CONFIGURING | SUBSTATE_GET_SERIAL_NUMBER;
+                    }
+#endif
                     else
                     {
                         _USB_SetNextSubState();
                     }
                     break;
 
-                case SUBSTATE_GET_CONFIG_DESCRIPTOR_SIZE:
-                    // Get the size of the Configuration Descriptor for the current configuration
+#if defined( USB_ENABLE_ENUMERATION_CACHE )
+                case SUBSTATE_GET_SERIAL_NUMBER:
+                    // Get the serial number string to identify the device
                     switch (usbHostState & SUBSUBSTATE_MASK)
                     {
-                        case SUBSUBSTATE_SEND_GET_CONFIG_DESCRIPTOR_SIZE:
-#if defined (DEBUG_ENABLE)
-                            DEBUG_PutString( "HOST: Getting Config Descriptor size.\r\n" );
-#endif
+                        case SUBSUBSTATE_SEND_GET_LANGID:
+                            memset( usbEnumerationCache.serial, 0, USB_ENUMERATION_CACHE_SERIAL_SIZE );
 
-                            // Set up and send GET CONFIGURATION (n) DESCRIPTOR with a length of 8
+                            // Devices without a serial number are identified by
+                            // their device descriptor alone.
+                            if (((USB_DEVICE_DESCRIPTOR *)pDeviceDescriptor)->iSerialNumber == 0)
+                            {
+                                usbHostState = STATE_CONFIGURING | SUBSTATE_GET_SERIAL_NUMBER | SUBSUBSTATE_GET_SERIAL_NUMBER_COMPLETE;
+                                break;
+                            }
+
+                            // Set up and send GET STRING DESCRIPTOR (0) to get
+                            // the first language supported by the device.
+                            memset( usbEnumerationCache.languages, 0, sizeof(usbEnumerationCache.languages) );
                             pEP0Data[0] = USB_SETUP_DEVICE_TO_HOST | USB_SETUP_TYPE_STANDARD | USB_SETUP_RECIPIENT_DEVICE;
                             pEP0Data[1] = USB_REQUEST_GET_DESCRIPTOR;
-                            pEP0Data[2] = countConfigurations-1;    // USB 2.0 - range is 0 - count-1
-                            pEP0Data[3] = USB_DESCRIPTOR_CONFIGURATION;
+                            pEP0Data[2] = 0;
+                            pEP0Data[3] = USB_DESCRIPTOR_STRING;
                             pEP0Data[4] = 0;
                             pEP0Data[5] = 0;
-                            pEP0Data[6] = 8;
+                            pEP0Data[6] = sizeof(usbEnumerationCache.languages);
                             pEP0Data[7] = 0;
-                            _USB_InitControlRead( usbDeviceInfo.pEndpoint0, pEP0Data, 8, pEP0Data, 8 );
+                            _USB_InitControlRead( usbDeviceInfo.pEndpoint0, pEP0Data, 8, usbEnumerationCache.languages, sizeof(usbEnumerationCache.languages) );
                             _USB_SetNextSubSubState();
                             break;
 
-                        case SUBSUBSTATE_WAIT_FOR_GET_CONFIG_DESCRIPTOR_SIZE:
+                        case SUBSUBSTATE_WAIT_FOR_GET_LANGID:
                             if (usbDeviceInfo.pEndpoint0->status.bfTransferComplete)
                             {
-                                if (usbDeviceInfo.pEndpoint0->status.bfTransferSuccessful)
+                                if (usbDeviceInfo.pEndpoint0->status.bfTransferSuccessful &&
+                                    (usbEnumerationCache.languages[0] >= 4) &&
+                                    (usbEnumerationCache.languages[1] == USB_DESCRIPTOR_STRING))
                                 {
                                     _USB_SetNextSubSubState();
                                 }
                                 else
                                 {
-                                    // We are here because of either a STALL or a NAK.  See if
-                                    // we have retries left to try the command again or try to
-                                    // enumerate again.
-                                    _USB_CheckCommandAndEnumerationAttempts();
+                                    // Without a language the serial number cannot
+                                    // be read, so the device is just not cached.
+                                    usbDeviceInfo.pEndpoint0->status.bfError    = 0;
+                                    usbDeviceInfo.pEndpoint0->status.bfStalled  = 0;
+                                    _USB_InitErrorCounters();
+                                    usbHostState = STATE_CONFIGURING | SUBSTATE_GET_CONFIG_DESCRIPTOR_SIZE;
                                 }
                             }
                             break;
 
-                        case SUBSUBSTATE_GET_CONFIG_DESCRIPTOR_SIZECOMPLETE:
-                            // Allocate a buffer for an entry in the configuration descriptor list.
-                            if ((pTemp = (uint8_t *)USB_MALLOC( sizeof (USB_CONFIGURATION) )) == NULL)
+                        case SUBSUBSTATE_SEND_GET_SERIAL_NUMBER:
+#if defined (DEBUG_ENABLE)
+                            DEBUG_PutString( "HOST: Getting serial number.\r\n" );
+#endif
+
+                            // Set up and send GET STRING DESCRIPTOR (iSerialNumber)
+                            pEP0Data[0] = USB_SETUP_DEVICE_TO_HOST | USB_SETUP_TYPE_STANDARD | USB_SETUP_RECIPIENT_DEVICE;
+                            pEP0Data[1] = USB_REQUEST_GET_DESCRIPTOR;
+                            pEP0Data[2] = ((USB_DEVICE_DESCRIPTOR *)pDeviceDescriptor)->iSerialNumber;
+                            pEP0Data[3] = USB_DESCRIPTOR_STRING;
+                            pEP0Data[4] = usbEnumerationCache.languages[2];
+                            pEP0Data[5] = usbEnumerationCache.languages[3];
+                            pEP0Data[6] = USB_ENUMERATION_CACHE_SERIAL_SIZE & 0xFF;
+                            pEP0Data[7] = USB_ENUMERATION_CACHE_SERIAL_SIZE >> 8;
+                            _USB_InitControlRead( usbDeviceInfo.pEndpoint0, pEP0Data, 8, usbEnumerationCache.serial, USB_ENUMERATION_CACHE_SERIAL_SIZE );
+                            _USB_SetNextSubSubState();
+                            break;
+
+                        case SUBSUBSTATE_WAIT_FOR_GET_SERIAL_NUMBER:
+                            if (usbDeviceInfo.pEndpoint0->status.bfTransferComplete)
                             {
-                                // We cannot continue.  Freeze until the device is removed.
-                                _USB_SetErrorCode( USB_HOLDING_OUT_OF_MEMORY );
-                                _USB_SetHoldState();
-                                break;
+                                if (usbDeviceInfo.pEndpoint0->status.bfTransferSuccessful)
+                                {
+                                    _USB_SetNextSubSubState();
+                                }
+                                else
+                                {
+                                    // The serial number is optional for enumeration, so
+                                    // do not retry.  The device is just not cached.
+                                    usbDeviceInfo.pEndpoint0->status.bfError    = 0;
+                                    usbDeviceInfo.pEndpoint0->status.bfStalled  = 0;
+                                    _USB_InitErrorCounters();
+                                    usbHostState = STATE_CONFIGURING | SUBSTATE_GET_CONFIG_DESCRIPTOR_SIZE;
+                                }
                             }
+                            break;
 
-                            // Allocate a buffer for the entire Configuration Descriptor
-                            if ((((USB_CONFIGURATION *)pTemp)->descriptor = (uint8_t *)USB_MALLOC( ((uint16_t)pEP0Data[3] << 8) + (uint16_t)pEP0Data[2] )) == NULL)
+                        case SUBSUBSTATE_GET_SERIAL_NUMBER_COMPLETE:
+                            usbEnumerationCache.identified = true;
+
+                            // Clean up and skip reading the configuration
+                            // descriptors if the device is in the cache.
+                            _USB_InitErrorCounters();
+                            if (_USB_EnumerationCacheLoad())
                             {
-                                // Not enough memory for the descriptor!
-                                USB_FREE_AND_CLEAR( pTemp );
+#if defined (DEBUG_ENABLE)
+                                DEBUG_PutString( "HOST: Configuration found in cache.\r\n" );
+#endif
 
-                                // We cannot continue.  Freeze until the device is removed.
-                                _USB_SetErrorCode( USB_HOLDING_OUT_OF_MEMORY );
-                                _USB_SetHoldState();
+                                // Everything allocated from here on belongs to the
+                                // selected configuration.
+                                usbHostArena.mark = usbHostArena.used;
+                                usbHostState = STATE_CONFIGURING | SUBSTATE_SELECT_CONFIGURATION;
+                            }
+                            else
+                            {
+                                usbHostState = STATE_CONFIGURING | SUBSTATE_GET_CONFIG_DESCRIPTOR_SIZE;
+                            }
+                            break;
+
+                        default:
+                            break;
+                    }
+                    break;
+#endif
+
+                case SUBSTATE_GET_CONFIG_DESCRIPTOR_SIZE:
+                    // Get the size of the Configuration Descriptor for the current configuration
+                    switch (usbHostState & SUBSUBSTATE_MASK)
+                    {
+                        case SUBSUBSTATE_SEND_GET_CONFIG_DESCRIPTOR_SIZE:
+#if defined (DEBUG_ENABLE)
+                            DEBUG_PutString( "HOST: Getting Config Descriptor size.\r\n" );
+#endif
+
+                            // Set up and send GET CONFIGURATION (n) DESCRIPTOR with a length of 8
+                            pEP0Data[0] = USB_SETUP_DEVICE_TO_HOST | USB_SETUP_TYPE_STANDARD | USB_SETUP_RECIPIENT_DEVICE;
+                            pEP0Data[1] = USB_REQUEST_GET_DESCRIPTOR;
+                            pEP0Data[2] = countConfigurations-1;    // USB 2.0 - range is 0 - count-1
+                            pEP0Data[3] = USB_DESCRIPTOR_CONFIGURATION;
+                            pEP0Data[4] = 0;
+                            pEP0Data[5] = 0;
+                            pEP0Data[6] = 8;
+                            pEP0Data[7] = 0;
+                            _USB_InitControlRead( usbDeviceInfo.pEndpoint0, pEP0Data, 8, pEP0Data, 8 );
+                            _USB_SetNextSubSubState();
+                            break;
+
+                        case SUBSUBSTATE_WAIT_FOR_GET_CONFIG_DESCRIPTOR_SIZE:
+                            if (usbDeviceInfo.pEndpoint0->status.bfTransferComplete)
+                            {
+                                if (usbDeviceInfo.pEndpoint0->status.bfTransferSuccessful)
+                                {
+                                    _USB_SetNextSubSubState();
+                                }
+                                else
+                                {
+                                    // We are here because of either a STALL or a NAK.  See if
+                                    // we have retries left to try the command again or try to
+                                    // enumerate again.
+                                    _USB_CheckCommandAndEnumerationAttempts();
+                                }
+                            }
+                            break;
+
+                        case SUBSUBSTATE_GET_CONFIG_DESCRIPTOR_SIZECOMPLETE:
+                            // Now that a configuration size is known, allocate the block for
+                            // all of the enumeration data.
+                            if ((usbHostArena.pBase == NULL) &&
+                                !_USB_ArenaCreate( ((uint16_t)pEP0Data[3] << 8) + (uint16_t)pEP0Data[2] ))
+                            {
+                                // We cannot continue.  Freeze until the device is removed.
+                                _USB_SetErrorCode( USB_HOLDING_OUT_OF_MEMORY );
+                                _USB_SetHoldState();
+                                break;
+                            }
+
+                            // Allocate a buffer for an entry in the configuration descriptor list.
+                            if ((pTemp = (uint8_t *)_USB_ArenaAlloc( sizeof (USB_CONFIGURATION) )) == NULL)
+                            {
+                                // We cannot continue.  Freeze until the device is removed.
+                                _USB_SetErrorCode( USB_HOLDING_OUT_OF_MEMORY );
+                                _USB_SetHoldState();
+                                break;
+                            }
+
+                            // Allocate a buffer for the entire Configuration Descriptor
+                            if ((((USB_CONFIGURATION *)pTemp)->descriptor = (uint8_t *)_USB_ArenaAlloc( ((uint16_t)pEP0Data[3] << 8) + (uint16_t)pEP0Data[2] )) == NULL)
+                            {
+                                // Not enough memory for the descriptor!
+                                USB_ARENA_FREE_AND_CLEAR( pTemp );
+
+                                // We cannot continue.  Freeze until the device is removed.
+                                _USB_SetErrorCode( USB_HOLDING_OUT_OF_MEMORY );
+                                _USB_SetHoldState();
                                 break;
                             }
 
@@ -2017,6 +2524,10 @@ void USBHostTasks( void )
                             }
                             else
                             {
+                                // Everything allocated from here on belongs to the
+                                // selected configuration.
+                                usbHostArena.mark = usbHostArena.used;
+
                                 // Start configuring the device.
                                 _USB_SetNextSubState();
                               }
@@ -2064,6 +2575,16 @@ void USBHostTasks( void )
                                 {
                                     pCurrentConfigurationNode = pCurrentConfigurationNode->next;
                                 }
+#if defined( USB_ENABLE_ENUMERATION_CACHE )
+                                if ((pCurrentConfigurationNode == NULL) && (usbEnumerationCache.pHit != NULL))
+                                {
+                                    // Only the cached configuration descriptor was
+                                    // loaded.  Read all of them from the device.
+                                    usbEnumerationCache.pHit = NULL;
+                                    usbHostState = STATE_CONFIGURING | SUBSTATE_INIT_CONFIGURATION;
+                                    break;
+                                }
+#endif
                                 pCurrentConfigurationDescriptor = pCurrentConfigurationNode->descriptor;
                                 if (!_USB_ParseConfigurationDescriptor())
                                 {
@@ -2073,6 +2594,20 @@ void USBHostTasks( void )
                                 }
                             }
 
+#if defined( USB_ENABLE_ENUMERATION_CACHE )
+                            if (pCurrentConfigurationNode != NULL)
+                            {
+                                // Remember the configuration for the next attach.
+                                _USB_EnumerationCacheStore( pCurrentConfigurationNode );
+                            }
+                            else if (usbEnumerationCache.pHit != NULL)
+                            {
+                                // The cached configuration cannot be used any more.
+                                USB_FREE_AND_CLEAR( usbEnumerationCache.pHit->pDescriptor );
+                                usbEnumerationCache.pHit = NULL;
+                            }
+#endif
+
                             //If No OTG Then
                             if (usbDeviceInfo.flags.bfConfiguredOTG)
                             {
@@ -2214,6 +2749,15 @@ void USBHostTasks( void )
                             DEBUG_PutString( "HOST: Set configuration.\r\n" );
 #endif
 
+                            // Reserve the bus bandwidth of the configuration
+                            // before the device starts using it.
+                            if (!_USB_FrameScheduleBuild())
+                            {
+                                _USB_SetErrorCode( USB_HOLDING_PROCESSING_CAPACITY );
+                                _USB_SetHoldState();
+                                break;
+                            }
+
                             // Set up and send SET CONFIGURATION.
                             pEP0Data[0] = USB_SETUP_HOST_TO_DEVICE | USB_SETUP_TYPE_STANDARD | USB_SETUP_RECIPIENT_DEVICE;
                             pEP0Data[1] = USB_REQUEST_SET_CONFIGURATION;
@@ -2392,7 +2936,7 @@ void USBHostTasks( void )
                     U1EIR               = 0xFF;
                     U1IEbits.DETACHIE   = 1;
 
-                    #if defined(USB_ENABLE_1MS_EVENT)
+                    #if defined(USB_ENABLE_1MS_EVENT) || defined(USB_ENABLE_ENUMERATION_PROFILE)
                         U1OTGIR                 = USB_INTERRUPT_T1MSECIF; // The interrupt is cleared by writing a '1' to the flag.
                         U1OTGIEbits.T1MSECIE    = 1;
                     #endif
@@ -2462,6 +3006,11 @@ void USBHostTasks( void )
     responding to.  It is also the only way to terminate an isochronous
     transfer.
 
+    Any requests queued on the endpoint with USBHostSubmitTransfer() are
+    removed.  Their status is set to USB_HOST_REQUEST_COMPLETE with an
+    errorCode of USB_ENDPOINT_TRANSFER_CANCELLED; no callback or event is
+    sent for them.
+
   Precondition:
     None
 
@@ -2479,6 +3028,13 @@ void USBHostTasks( void )
 void USBHostTerminateTransfer( uint8_t deviceAddress, uint8_t endpoint )
 {
     USB_ENDPOINT_INFO *ep;
+    #if defined( __C30__ ) || defined __XC16__
+        uint16_t        interrupt_mask;
+    #elif defined( __PIC32__ )
+        uint32_t      interrupt_mask;
+    #else
+        #error Cannot save interrupt status
+    #endif
 
     // Find the required device
     if (deviceAddress != usbDeviceInfo.deviceAddress)
@@ -2489,8 +3045,16 @@ void USBHostTerminateTransfer( uint8_t deviceAddress, uint8_t endpoint )
     ep = _USB_FindEndpoint( endpoint );
     if (ep != NULL)
     {
+        // Guard against USB interrupts
+        interrupt_mask = U1IE;
+        U1IE = 0;
+
         ep->status.bfUserAbort          = 1;
         ep->status.bfTransferComplete   = 1;
+        _USB_RequestFlush( ep );
+
+        // Re-enable USB interrupts
+        U1IE = interrupt_mask;
     }
 }
 
@@ -2758,7 +3322,7 @@ uint8_t USBHostWrite( uint8_t deviceAddress, uint8_t endpoint, uint8_t *data, ui
             return USB_ENDPOINT_ERROR;
         }
 
-        if (!ep->status.bfTransferComplete)
+        if (!ep->status.bfTransferComplete || (ep->pRequestHead != NULL))
         {
             // We are already processing a request for this endpoint.
             return USB_ENDPOINT_BUSY;
@@ -2778,6 +3342,244 @@ uint8_t USBHostWrite( uint8_t deviceAddress, uint8_t endpoint, uint8_t *data, ui
 // *****************************************************************************
 // *****************************************************************************
 
+/****************************************************************************
+  Function:
+    void * _USB_ArenaAlloc( uint16_t size )
+
+  Description:
+    This function allocates memory for the enumeration data of the attached
+    device.  Once the enumeration data block exists, the memory is taken from
+    it.  Before that, or if the block is full, it is taken from the heap.
+
+  Precondition:
+    None
+
+  Parameters:
+    uint16_t size   - Number of bytes to allocate
+
+  Returns:
+    Pointer to the memory, or NULL if there is not enough, or if size is too
+    large to be rounded up and given a heap header in 16 bits.
+
+  Remarks:
+    The memory must be released with _USB_ArenaFree().
+  ***************************************************************************/
+
+void * _USB_ArenaAlloc( uint16_t size )
+{
+    void    *ptr;
+
+    // Neither the rounding nor the heap header may wrap the 16-bit size.
+    if (size > (uint16_t)(0xFFFF - 3 - USB_HOST_ARENA_HEADER))
+    {
+        return NULL;
+    }
+    size = USB_HOST_ARENA_ALIGN( size );
+
+    if ((usbHostArena.pBase != NULL) && (size <= (uint16_t)(usbHostArena.size - usbHostArena.used)))
+    {
+        ptr = usbHostArena.pBase + usbHostArena.used;
+        usbHostArena.used += size;
+    }
+    else
+    {
+        // Heap memory is preceded by its size, so that _USB_ArenaFree() can
+        // take it off heapBytes again.
+        if ((ptr = USB_MALLOC( size + USB_HOST_ARENA_HEADER )) == NULL)
+        {
+            return NULL;
+        }
+        *(uint16_t *)ptr = size;
+        ptr = (uint8_t *)ptr + USB_HOST_ARENA_HEADER;
+
+        if (usbHostArena.pBase != NULL)
+        {
+            usbHostArena.heapFallbacks ++;
+        }
+        usbHostArena.heapBytes += size;
+    }
+
+    if ((uint16_t)(usbHostArena.used + usbHostArena.heapBytes) > usbHostArena.highWater)
+    {
+        usbHostArena.highWater = usbHostArena.used + usbHostArena.heapBytes;
+    }
+
+    return ptr;
+}
+
+
+/****************************************************************************
+  Function:
+    bool _USB_ArenaCreate( uint16_t wTotalLength )
+
+  Description:
+    This function allocates the block for the enumeration data of the
+    attached device.  The size is calculated from the size of the first
+    configuration descriptor read, and covers:
+        * the EP0 buffer and the device descriptor
+        * bNumConfigurations configuration descriptors of that size
+        * the most interface, setting and endpoint information that a
+            descriptor of that size can describe
+        * USB_HOST_ARENA_EXTRA
+
+    The EP0 buffer and the device descriptor, which were allocated before the
+    size was known, are moved into the block.
+
+  Precondition:
+    The device descriptor has been read, and the block does not exist.
+
+  Parameters:
+    uint16_t wTotalLength   - wTotalLength of the first configuration
+                                descriptor
+
+  Return Values:
+    true    - The block was allocated
+    false   - There is not enough heap
+
+  Remarks:
+    The other configurations may be larger.  Whatever does not fit is taken
+    from the heap.
+  ***************************************************************************/
+
+bool _USB_ArenaCreate( uint16_t wTotalLength )
+{
+    uint32_t    size;
+    uint32_t    nodes;
+    uint8_t     *ptr;
+
+    size  = USB_HOST_ARENA_ALIGN( (uint32_t)usbDeviceInfo.pEndpoint0->wMaxPacketSize );
+    size += USB_HOST_ARENA_ALIGN( (uint32_t)pDeviceDescriptor[0] );
+    size += (uint32_t)((USB_DEVICE_DESCRIPTOR *)pDeviceDescriptor)->bNumConfigurations *
+                (USB_HOST_ARENA_ALIGN( sizeof(USB_CONFIGURATION) ) + USB_HOST_ARENA_ALIGN( (uint32_t)wTotalLength ));
+
+    // Each interface descriptor (9 bytes) can need an interface and a setting
+    // node, and each endpoint descriptor (7 bytes) an endpoint node.
+    nodes = (uint32_t)(wTotalLength / sizeof(USB_INTERFACE_DESCRIPTOR)) *
+                (USB_HOST_ARENA_ALIGN( sizeof(USB_INTERFACE_INFO) ) + USB_HOST_ARENA_ALIGN( sizeof(USB_INTERFACE_SETTING_INFO) ));
+    if (nodes < (uint32_t)(wTotalLength / sizeof(USB_ENDPOINT_DESCRIPTOR)) * USB_HOST_ARENA_ALIGN( sizeof(USB_ENDPOINT_INFO) ))
+    {
+        nodes = (uint32_t)(wTotalLength / sizeof(USB_ENDPOINT_DESCRIPTOR)) * USB_HOST_ARENA_ALIGN( sizeof(USB_ENDPOINT_INFO) );
+    }
+    size += nodes + USB_HOST_ARENA_EXTRA;
+
+    if ((size > 0xFFFF) || ((ptr = (uint8_t *)USB_MALLOC( size )) == NULL))
+    {
+#if defined (DEBUG_ENABLE)
+        DEBUG_PutString( "HOST: Cannot allocate enumeration data block.\r\n" );
+#endif
+        return false;
+    }
+
+    usbHostArena.pBase          = ptr;
+    usbHostArena.size           = size;
+    usbHostArena.used           = 0;
+    usbHostArena.mark           = 0;
+    usbHostArena.heapFallbacks  = 0;
+
+    // Move the EP0 buffer and the device descriptor into the block.  Freeing
+    // the heap copies takes them off heapBytes.
+    ptr = (uint8_t *)_USB_ArenaAlloc( usbDeviceInfo.pEndpoint0->wMaxPacketSize );
+    memcpy( ptr, pEP0Data, usbDeviceInfo.pEndpoint0->wMaxPacketSize );
+    _USB_ArenaFree( pEP0Data );
+    pEP0Data = ptr;
+
+    ptr = (uint8_t *)_USB_ArenaAlloc( pDeviceDescriptor[0] );
+    memcpy( ptr, pDeviceDescriptor, pDeviceDescriptor[0] );
+    _USB_ArenaFree( pDeviceDescriptor );
+    pDeviceDescriptor = ptr;
+
+    return true;
+}
+
+
+/****************************************************************************
+  Function:
+    void _USB_ArenaDestroy( void )
+
+  Description:
+    This function releases the enumeration data block in one step.
+
+  Precondition:
+    Nothing points into the block any more.
+
+  Parameters:
+    None - None
+
+  Returns:
+    None
+
+  Remarks:
+    The high water mark is kept.
+  ***************************************************************************/
+
+void _USB_ArenaDestroy( void )
+{
+    if (usbHostArena.pBase != NULL)
+    {
+        USB_FREE_AND_CLEAR( usbHostArena.pBase );
+    }
+
+    usbHostArena.size       = 0;
+    usbHostArena.used       = 0;
+    usbHostArena.mark       = 0;
+    usbHostArena.heapBytes  = 0;
+}
+
+
+/****************************************************************************
+  Function:
+    void _USB_ArenaFree( void *ptr )
+
+  Description:
+    This function releases memory allocated with _USB_ArenaAlloc().  Memory
+    taken from the heap is freed, and its size is taken off heapBytes.
+    Memory in the enumeration data block is reclaimed when the configuration
+    is freed or the block is destroyed.
+
+  Precondition:
+    None
+
+  Parameters:
+    void *ptr   - Memory to release, or NULL
+
+  Returns:
+    None
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+void _USB_ArenaFree( void *ptr )
+{
+    uint16_t    size;
+
+    if (ptr == NULL)
+    {
+        return;
+    }
+
+    if ((usbHostArena.pBase != NULL) &&
+        ((uint8_t *)ptr >= usbHostArena.pBase) &&
+        ((uint8_t *)ptr < usbHostArena.pBase + usbHostArena.size))
+    {
+        return;
+    }
+
+    ptr  = (uint8_t *)ptr - USB_HOST_ARENA_HEADER;
+    size = *(uint16_t *)ptr;
+    if (usbHostArena.heapBytes >= size)
+    {
+        usbHostArena.heapBytes -= size;
+    }
+    else
+    {
+        usbHostArena.heapBytes = 0;
+    }
+
+    USB_FREE( ptr );
+}
+
+
 /****************************************************************************
   Function:
     void _USB_CheckCommandAndEnumerationAttempts( void )
@@ -2818,6 +3620,13 @@ void _USB_CheckCommandAndEnumerationAttempts( void )
     pCurrentEndpoint->status.bfError    = 0;
     pCurrentEndpoint->status.bfStalled  = 0;
 
+    #if defined( USB_ENABLE_ENUMERATION_PROFILE )
+        if (usbEnumerationProfiler.stage != USB_ENUMERATION_STAGE_NONE)
+        {
+            usbEnumerationProfiler.data.stageRetries[usbEnumerationProfiler.stage] ++;
+        }
+    #endif
+
     numCommandTries --;
     if (numCommandTries != 0)
     {
@@ -2833,6 +3642,9 @@ void _USB_CheckCommandAndEnumerationAttempts( void )
         {
             // We still have retries left to try to enumerate.  Reset and try again.
             usbHostState = STATE_ATTACHED | SUBSTATE_RESET_DEVICE;
+            #if defined( USB_ENABLE_ENUMERATION_PROFILE )
+                usbEnumerationProfiler.data.enumerationTries ++;
+            #endif
         }
         else
         {
@@ -2844,9 +3656,299 @@ void _USB_CheckCommandAndEnumerationAttempts( void )
 }
 
 
+#if defined( USB_ENABLE_ENUMERATION_CACHE )
+
 /****************************************************************************
   Function:
-    bool _USB_FindClassDriver( uint8_t bClass, uint8_t bSubClass, uint8_t bProtocol, uint8_t *pbClientDrv )
+    USB_ENUMERATION_CACHE_ENTRY * _USB_EnumerationCacheFind( void )
+
+  Description:
+    This function searches the enumeration cache for an entry with the
+    identity of the attached device: the VID, PID, bcdDevice and
+    bNumConfigurations of its device descriptor, and its serial number
+    string.
+
+  Precondition:
+    The device descriptor has been read and usbEnumerationCache.identified
+    is true.
+
+  Parameters:
+    None - None
+
+  Returns:
+    The entry of the device, or NULL if the device is not in the cache.
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+USB_ENUMERATION_CACHE_ENTRY * _USB_EnumerationCacheFind( void )
+{
+    USB_DEVICE_DESCRIPTOR           *pDevice;
+    USB_ENUMERATION_CACHE_ENTRY     *pEntry;
+    uint8_t                         i;
+    uint8_t                         length;
+
+    pDevice = (USB_DEVICE_DESCRIPTOR *)pDeviceDescriptor;
+
+    length = usbEnumerationCache.serial[0];
+    if (length > USB_ENUMERATION_CACHE_SERIAL_SIZE)
+    {
+        length = USB_ENUMERATION_CACHE_SERIAL_SIZE;
+    }
+
+    for (i=0; i<USB_ENUMERATION_CACHE_ENTRIES; i++)
+    {
+        pEntry = &usbEnumerationCache.entry[i];
+        if ((pEntry->pDescriptor != NULL) &&
+            (pEntry->idVendor == pDevice->idVendor) &&
+            (pEntry->idProduct == pDevice->idProduct) &&
+            (pEntry->bcdDevice == pDevice->bcdDevice) &&
+            (pEntry->bNumConfigurations == pDevice->bNumConfigurations) &&
+            (pEntry->serial[0] == usbEnumerationCache.serial[0]) &&
+            (memcmp( pEntry->serial, usbEnumerationCache.serial, length ) == 0))
+        {
+            return pEntry;
+        }
+    }
+
+    return NULL;
+}
+
+
+/****************************************************************************
+  Function:
+    bool _USB_EnumerationCacheLoad( void )
+
+  Description:
+    This function looks the attached device up in the enumeration cache.  If
+    it is found, the cached configuration descriptor is copied into the
+    enumeration data block as the only entry of the configuration descriptor
+    list, so the configuration descriptors do not have to be read from the
+    device.
+
+  Precondition:
+    The configuration descriptor list is empty.
+
+  Parameters:
+    None - None
+
+  Return Values:
+    true    - The configuration descriptor was loaded from the cache
+    false   - The device is not in the cache, or there is not enough heap
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+bool _USB_EnumerationCacheLoad( void )
+{
+    USB_ENUMERATION_CACHE_ENTRY     *pEntry;
+    USB_CONFIGURATION               *pConfiguration;
+    uint16_t                        wTotalLength;
+
+    usbEnumerationCache.pHit = NULL;
+
+    if (!usbEnumerationCache.identified || ((pEntry = _USB_EnumerationCacheFind()) == NULL))
+    {
+        return false;
+    }
+
+    wTotalLength = ((USB_CONFIGURATION_DESCRIPTOR *)pEntry->pDescriptor)->wTotalLength;
+
+    if ((usbHostArena.pBase == NULL) && !_USB_ArenaCreate( wTotalLength ))
+    {
+        return false;
+    }
+
+    if ((pConfiguration = (USB_CONFIGURATION *)_USB_ArenaAlloc( sizeof(USB_CONFIGURATION) )) == NULL)
+    {
+        return false;
+    }
+
+    if ((pConfiguration->descriptor = (uint8_t *)_USB_ArenaAlloc( wTotalLength )) == NULL)
+    {
+        _USB_ArenaFree( pConfiguration );
+        return false;
+    }
+
+    memcpy( pConfiguration->descriptor, pEntry->pDescriptor, wTotalLength );
+    pConfiguration->configNumber = pEntry->configNumber;
+    pConfiguration->next         = NULL;
+
+    usbDeviceInfo.pConfigurationDescriptorList = pConfiguration;
+    pCurrentConfigurationDescriptor            = pConfiguration->descriptor;
+
+    pEntry->lastUsed = ++usbEnumerationCache.useCount;
+    usbEnumerationCache.pHit = pEntry;
+
+    return true;
+}
+
+
+/****************************************************************************
+  Function:
+    void _USB_EnumerationCacheStore( USB_CONFIGURATION *pConfiguration )
+
+  Description:
+    This function stores the configuration selected for the attached device
+    in the enumeration cache, together with the client driver of each
+    supported interface setting.  If the device is already in the cache, its
+    entry is replaced.  Otherwise a free entry is used, or the least recently
+    used entry if there is none.
+
+  Precondition:
+    The configuration has been parsed successfully, and
+    usbDeviceInfo.pInterfaceList holds its interfaces.
+
+  Parameters:
+    USB_CONFIGURATION *pConfiguration   - Node of the selected configuration
+
+  Returns:
+    None
+
+  Remarks:
+    If there is not enough heap for the copy, the device is not cached.
+  ***************************************************************************/
+
+void _USB_EnumerationCacheStore( USB_CONFIGURATION *pConfiguration )
+{
+    USB_DEVICE_DESCRIPTOR           *pDevice;
+    USB_ENUMERATION_CACHE_ENTRY     *pEntry;
+    USB_INTERFACE_INFO              *pInterface;
+    USB_INTERFACE_SETTING_INFO      *pSetting;
+    uint16_t                        wTotalLength;
+    uint8_t                         i;
+
+    if (!usbEnumerationCache.identified)
+    {
+        return;
+    }
+
+    // The configuration came from the cache, so the entry is already current.
+    if (usbEnumerationCache.pHit != NULL)
+    {
+        usbEnumerationCache.pHit->lastUsed = ++usbEnumerationCache.useCount;
+        return;
+    }
+
+    if ((pEntry = _USB_EnumerationCacheFind()) == NULL)
+    {
+        pEntry = &usbEnumerationCache.entry[0];
+        for (i=0; i<USB_ENUMERATION_CACHE_ENTRIES; i++)
+        {
+            if (usbEnumerationCache.entry[i].pDescriptor == NULL)
+            {
+                pEntry = &usbEnumerationCache.entry[i];
+                break;
+            }
+            if ((uint16_t)(usbEnumerationCache.useCount - usbEnumerationCache.entry[i].lastUsed) >
+                (uint16_t)(usbEnumerationCache.useCount - pEntry->lastUsed))
+            {
+                pEntry = &usbEnumerationCache.entry[i];
+            }
+        }
+    }
+
+    if (pEntry->pDescriptor != NULL)
+    {
+        USB_FREE_AND_CLEAR( pEntry->pDescriptor );
+    }
+
+    wTotalLength = ((USB_CONFIGURATION_DESCRIPTOR *)pConfiguration->descriptor)->wTotalLength;
+    if ((pEntry->pDescriptor = (uint8_t *)USB_MALLOC( wTotalLength )) == NULL)
+    {
+        return;
+    }
+    memcpy( pEntry->pDescriptor, pConfiguration->descriptor, wTotalLength );
+
+    pDevice = (USB_DEVICE_DESCRIPTOR *)pDeviceDescriptor;
+    pEntry->idVendor            = pDevice->idVendor;
+    pEntry->idProduct           = pDevice->idProduct;
+    pEntry->bcdDevice           = pDevice->bcdDevice;
+    pEntry->bNumConfigurations  = pDevice->bNumConfigurations;
+    pEntry->configNumber        = pConfiguration->configNumber;
+    pEntry->lastUsed            = ++usbEnumerationCache.useCount;
+    memcpy( pEntry->serial, usbEnumerationCache.serial, USB_ENUMERATION_CACHE_SERIAL_SIZE );
+
+    // Remember the client driver of every supported interface setting.  If
+    // they do not all fit, the drivers are selected through the TPL again.
+    pEntry->bindingCount = 0;
+    for (pInterface = usbDeviceInfo.pInterfaceList; pInterface != NULL; pInterface = pInterface->next)
+    {
+        for (pSetting = pInterface->pInterfaceSettings; pSetting != NULL; pSetting = pSetting->next)
+        {
+            if (pEntry->bindingCount == USB_ENUMERATION_CACHE_SETTINGS)
+            {
+                pEntry->bindingCount = 0;
+                return;
+            }
+            pEntry->binding[pEntry->bindingCount].interface        = pInterface->interface;
+            pEntry->binding[pEntry->bindingCount].alternateSetting = pSetting->interfaceAltSetting;
+            pEntry->binding[pEntry->bindingCount].clientDriver     = pInterface->clientDriver;
+            pEntry->binding[pEntry->bindingCount].tplEntry         = pInterface->tplEntry;
+            pEntry->bindingCount++;
+        }
+    }
+}
+
+
+/****************************************************************************
+  Function:
+    bool _USB_EnumerationCacheFindDriver( uint8_t bInterfaceNumber,
+                uint8_t bAlternateSetting, uint8_t *pbClientDrv,
+                uint8_t *pbTPLEntry )
+
+  Description:
+    This function looks up the client driver that was selected for an
+    interface setting the last time the attached device was configured.
+
+  Precondition:
+    The configuration descriptor was loaded from the enumeration cache, and
+    the cache entry holds the bindings of the device.
+
+  Parameters:
+    uint8_t bInterfaceNumber    - Interface number of the setting
+    uint8_t bAlternateSetting   - Alternate setting number of the setting
+    uint8_t *pbClientDrv        - Returned index to the client driver in the
+                                    client driver table
+    uint8_t *pbTPLEntry         - Returned index of the TPL entry that
+                                    selected the client driver
+
+  Return Values:
+    true    - The setting is supported by the returned client driver
+    false   - The setting was not supported
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+bool _USB_EnumerationCacheFindDriver( uint8_t bInterfaceNumber, uint8_t bAlternateSetting, uint8_t *pbClientDrv, uint8_t *pbTPLEntry )
+{
+    USB_ENUMERATION_CACHE_BINDING   *pBinding;
+    uint8_t                         i;
+
+    pBinding = usbEnumerationCache.pHit->binding;
+    for (i=0; i<usbEnumerationCache.pHit->bindingCount; i++, pBinding++)
+    {
+        if ((pBinding->interface == bInterfaceNumber) && (pBinding->alternateSetting == bAlternateSetting))
+        {
+            *pbClientDrv = pBinding->clientDriver;
+            *pbTPLEntry  = pBinding->tplEntry;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+#endif
+
+
+/****************************************************************************
+  Function:
+    bool _USB_FindClassDriver( uint8_t bClass, uint8_t bSubClass, uint8_t bProtocol,
+                uint8_t *pbClientDrv, uint8_t *pbTPLEntry )
 
   Summary:
 
@@ -2864,6 +3966,7 @@ void _USB_CheckCommandAndEnumerationAttempts( void )
     bProtocol   - The protocol of the desired entry
     pbClientDrv - Returned index to the client driver in the client driver
                     table.
+    pbTPLEntry  - Returned index of the TPL entry that was found.
 
   Return Values:
     true    - A class driver was found.
@@ -2873,7 +3976,7 @@ void _USB_CheckCommandAndEnumerationAttempts( void )
     None
   ***************************************************************************/
 
-bool _USB_FindClassDriver( uint8_t bClass, uint8_t bSubClass, uint8_t bProtocol, uint8_t *pbClientDrv )
+bool _USB_FindClassDriver( uint8_t bClass, uint8_t bSubClass, uint8_t bProtocol, uint8_t *pbClientDrv, uint8_t *pbTPLEntry )
 {
     USB_OVERRIDE_CLIENT_DRIVER_EVENT_DATA   eventData;
     int                                     i;
@@ -2900,6 +4003,7 @@ bool _USB_FindClassDriver( uint8_t bClass, uint8_t bSubClass, uint8_t bProtocol,
                             &eventData, sizeof(USB_OVERRIDE_CLIENT_DRIVER_EVENT_DATA) ))
             {
                 *pbClientDrv = usbTPL[i].ClientDriver;
+                *pbTPLEntry  = i;
 
 #if defined (DEBUG_ENABLE)
                 DEBUG_PutString( "HOST: Client driver found.\r\n" );
@@ -3055,8 +4159,8 @@ bool _USB_FindDeviceLevelClientDriver( void )
     USB_ENDPOINT_INFO * _USB_FindEndpoint( uint8_t endpoint )
 
   Description:
-    This function searches the list of interfaces to try to find the specified
-    endpoint.
+    This function finds the specified endpoint among the active settings of
+    the interfaces.
 
   Precondition:
     None
@@ -3065,87 +4169,77 @@ bool _USB_FindDeviceLevelClientDriver( void )
     uint8_t endpoint   - The endpoint to find.
 
   Returns:
-    Returns a pointer to the USB_ENDPOINT_INFO structure for the endpoint.
+    Returns a pointer to the USB_ENDPOINT_INFO structure for the endpoint,
+    or NULL if it is not part of an active setting.
 
   Remarks:
-    None
+    This is a lookup in the index built by _USB_IndexBuild().
   ***************************************************************************/
 
 USB_ENDPOINT_INFO * _USB_FindEndpoint( uint8_t endpoint )
 {
-    USB_ENDPOINT_INFO           *pEndpoint;
-    USB_INTERFACE_INFO          *pInterface;
-
     if (endpoint == 0)
     {
         return usbDeviceInfo.pEndpoint0;
     }
 
-    pInterface = usbDeviceInfo.pInterfaceList;
-    while (pInterface)
-    {
-        // Look for the endpoint in the currently active setting.
-        if (pInterface->pCurrentSetting)
-        {
-            pEndpoint = pInterface->pCurrentSetting->pEndpointList;
-            while (pEndpoint)
-            {
-                if (pEndpoint->bEndpointAddress == endpoint)
-                {
-                    // We have found the endpoint.
-                    return pEndpoint;
-                }
-                pEndpoint = pEndpoint->next;
-            }
-        }
-
-        // Go to the next interface.
-        pInterface = pInterface->next;
+    if (endpoint & 0x70)
+    {
+        // Reserved bits are set, so this cannot be an endpoint address.
+        return NULL;
     }
 
-    return NULL;
+    // The index holds the endpoints of the currently active settings.
+    return usbDeviceInfo.pEndpointIndex[_USB_EndpointIndex( endpoint )];
 }
 
 
 /****************************************************************************
   Function:
-    USB_INTERFACE_INFO * _USB_FindInterface ( uint8_t bInterface, uint8_t bAltSetting )
+    USB_INTERFACE_INFO * _USB_FindInterface ( uint8_t bInterface )
 
   Description:
-    This routine scans the interface linked list and returns a pointer to the
-    node identified by the interface and alternate setting.
+    This routine returns a pointer to the interface linked list node
+    identified by the interface number.
 
   Precondition:
     None
 
   Parameters:
     bInterface  - Interface number
-    bAltSetting - Interface alternate setting number
 
   Returns:
-    USB_INTERFACE_INFO *  - Pointer to the interface linked list node.
+    USB_INTERFACE_INFO *  - Pointer to the interface linked list node, or
+                            NULL if the interface does not exist.
 
   Remarks:
-    None
+    Interfaces numbered below USB_HOST_MAX_INTERFACES are found in the
+    index built by _USB_IndexBuild().
   ***************************************************************************/
-/*
-USB_INTERFACE_INFO * _USB_FindInterface ( uint8_t bInterface, uint8_t bAltSetting )
+
+USB_INTERFACE_INFO * _USB_FindInterface ( uint8_t bInterface )
 {
-    USB_INTERFACE_INFO *pCurIntf = usbDeviceInfo.pInterfaceList;
+    USB_INTERFACE_INFO *pCurIntf;
 
+    if (bInterface < USB_HOST_MAX_INTERFACES)
+    {
+        return usbDeviceInfo.pInterfaceIndex[bInterface];
+    }
+
+    pCurIntf = usbDeviceInfo.pInterfaceList;
     while (pCurIntf)
     {
-        if (pCurIntf->interface           == bInterface &&
-            pCurIntf->interfaceAltSetting == bAltSetting  )
+        if (pCurIntf->interface == bInterface)
         {
             return pCurIntf;
         }
+        pCurIntf = pCurIntf->next;
     }
 
     return NULL;
 
 } // _USB_FindInterface
-*/
+
 
 /****************************************************************************
   Function:
@@ -3189,6 +4283,49 @@ void _USB_FindNextToken( void )
         return;
     }
 
+    #if defined( USB_SUPPORT_BULK_TRANSFERS ) && defined( USB_ENABLE_BULK_BURST ) && defined( ALLOW_MULTIPLE_BULK_TRANSACTIONS_PER_FRAME )
+        // If the last transaction moved a full packet of a bulk transfer, send
+        // the next packet of that transfer right away, as long as no control or
+        // periodic transfer is waiting and the packet fits in the frame.  The
+        // BDT points at the next packet of the caller's buffer.
+        //
+        // bfBulkBurst is only set after an ACK or DATA0/DATA1 of a full packet
+        // that did not reach dataCountMax, and it is cleared by every Transfer
+        // Done and USB Error interrupt.  So a short packet completes the
+        // transfer through the normal path, and a NAK, STALL or bus error
+        // (including babble, which the module reports as an error) falls back
+        // to the normal retry and error handling.  dataCount is only advanced
+        // by the byte count of an acknowledged packet, which the module limits
+        // to the size programmed in the BDT, so it never passes dataCountMax.
+        if (usbBusInfo.flags.bfBulkBurst)
+        {
+            usbBusInfo.flags.bfBulkBurst = 0;
+
+            if ((usbBusInfo.flags.bfControlTransfersDone || usbDeviceInfo.pEndpoint0->status.bfTransferComplete) &&
+                #ifdef USB_SUPPORT_ISOCHRONOUS_TRANSFERS
+                usbBusInfo.flags.bfIsochronousTransfersDone &&
+                #endif
+                #ifdef USB_SUPPORT_INTERRUPT_TRANSFERS
+                usbBusInfo.flags.bfInterruptTransfersDone &&
+                #endif
+                (usbFrameSchedule.asyncBytesLeft >= (int16_t)_USB_FrameScheduleCost( (USB_ENDPOINT_INFO *)pCurrentEndpoint )))
+            {
+                if (pCurrentEndpoint->transferState == (TSTATE_BULK_READ | TSUBSTATE_BULK_READ_DATA))
+                {
+                    _USB_SetBDT( USB_TOKEN_IN );
+                    _USB_SendToken( pCurrentEndpoint->bEndpointAddress, USB_TOKEN_IN );
+                    return;
+                }
+                if (pCurrentEndpoint->transferState == (TSTATE_BULK_WRITE | TSUBSTATE_BULK_WRITE_DATA))
+                {
+                    _USB_SetBDT( USB_TOKEN_OUT );
+                    _USB_SendToken( pCurrentEndpoint->bEndpointAddress, USB_TOKEN_OUT );
+                    return;
+                }
+            }
+        }
+    #endif
+
     // We will handle control transfers first.  We only allow one control
     // transfer per frame.
     if (!usbBusInfo.flags.bfControlTransfersDone)
@@ -3226,11 +4363,11 @@ void _USB_FindNextToken( void )
                             pCurrentEndpoint->transferState               = TSTATE_IDLE;
                             pCurrentEndpoint->status.bfTransferComplete   = 1;
                             #if defined( USB_ENABLE_TRANSFER_EVENT )
-                                if (StructQueueIsNotFull(&usbEventQueue, USB_EVENT_QUEUE_DEPTH))
+                                if (StructRingIsNotFull(&usbEventQueue, USB_EVENT_QUEUE_DEPTH))
                                 {
                                     USB_EVENT_DATA *data;
 
-                                    data = StructQueueAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
+                                    data = StructRingPeekHead(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                     data->event = EVENT_TRANSFER;
                                     data->TransferData.dataCount        = pCurrentEndpoint->dataCount;
                                     data->TransferData.pUserData        = pCurrentEndpoint->pUserData;
@@ -3238,6 +4375,8 @@ void _USB_FindNextToken( void )
                                     data->TransferData.bEndpointAddress = pCurrentEndpoint->bEndpointAddress;
                                     data->TransferData.bmAttributes.val = pCurrentEndpoint->bmAttributes.val;
                                     data->TransferData.clientDriver     = pCurrentEndpoint->clientDriver;
+                                    data->TransferData.pRequest         = _USB_ActiveRequest( pCurrentEndpoint );
+                                    StructRingAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                 }
                                 else
                                 {
@@ -3250,11 +4389,11 @@ void _USB_FindNextToken( void )
                             pCurrentEndpoint->transferState               = TSTATE_IDLE;
                             pCurrentEndpoint->status.bfTransferComplete   = 1;
                             #if defined( USB_ENABLE_TRANSFER_EVENT )
-                                if (StructQueueIsNotFull(&usbEventQueue, USB_EVENT_QUEUE_DEPTH))
+                                if (StructRingIsNotFull(&usbEventQueue, USB_EVENT_QUEUE_DEPTH))
                                 {
                                     USB_EVENT_DATA *data;
 
-                                    data = StructQueueAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
+                                    data = StructRingPeekHead(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                     data->event = EVENT_BUS_ERROR;
                                     data->TransferData.dataCount        = 0;
                                     data->TransferData.pUserData        = NULL;
@@ -3262,6 +4401,8 @@ void _USB_FindNextToken( void )
                                     data->TransferData.bEndpointAddress = pCurrentEndpoint->bEndpointAddress;
                                     data->TransferData.bmAttributes.val = pCurrentEndpoint->bmAttributes.val;
                                     data->TransferData.clientDriver     = pCurrentEndpoint->clientDriver;
+                                    data->TransferData.pRequest         = _USB_ActiveRequest( pCurrentEndpoint );
+                                    StructRingAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                 }
                                 else
                                 {
@@ -3313,11 +4454,11 @@ void _USB_FindNextToken( void )
                             pCurrentEndpoint->transferState               = TSTATE_IDLE;
                             pCurrentEndpoint->status.bfTransferComplete   = 1;
                             #if defined( USB_ENABLE_TRANSFER_EVENT )
-                                if (StructQueueIsNotFull(&usbEventQueue, USB_EVENT_QUEUE_DEPTH))
+                                if (StructRingIsNotFull(&usbEventQueue, USB_EVENT_QUEUE_DEPTH))
                                 {
                                     USB_EVENT_DATA *data;
 
-                                    data = StructQueueAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
+                                    data = StructRingPeekHead(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                     data->event = EVENT_TRANSFER;
                                     data->TransferData.dataCount        = pCurrentEndpoint->dataCount;
                                     data->TransferData.pUserData        = pCurrentEndpoint->pUserData;
@@ -3325,6 +4466,8 @@ void _USB_FindNextToken( void )
                                     data->TransferData.bEndpointAddress = pCurrentEndpoint->bEndpointAddress;
                                     data->TransferData.bmAttributes.val = pCurrentEndpoint->bmAttributes.val;
                                     data->TransferData.clientDriver     = pCurrentEndpoint->clientDriver;
+                                    data->TransferData.pRequest         = _USB_ActiveRequest( pCurrentEndpoint );
+                                    StructRingAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                 }
                                 else
                                 {
@@ -3337,11 +4480,11 @@ void _USB_FindNextToken( void )
                             pCurrentEndpoint->transferState               = TSTATE_IDLE;
                             pCurrentEndpoint->status.bfTransferComplete   = 1;
                             #if defined( USB_ENABLE_TRANSFER_EVENT )
-                                if (StructQueueIsNotFull(&usbEventQueue, USB_EVENT_QUEUE_DEPTH))
+                                if (StructRingIsNotFull(&usbEventQueue, USB_EVENT_QUEUE_DEPTH))
                                 {
                                     USB_EVENT_DATA *data;
 
-                                    data = StructQueueAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
+                                    data = StructRingPeekHead(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                     data->event = EVENT_BUS_ERROR;
                                     data->TransferData.dataCount        = 0;
                                     data->TransferData.pUserData        = NULL;
@@ -3349,6 +4492,8 @@ void _USB_FindNextToken( void )
                                     data->TransferData.bEndpointAddress = pCurrentEndpoint->bEndpointAddress;
                                     data->TransferData.bmAttributes.val = pCurrentEndpoint->bmAttributes.val;
                                     data->TransferData.clientDriver     = pCurrentEndpoint->clientDriver;
+                                    data->TransferData.pRequest         = _USB_ActiveRequest( pCurrentEndpoint );
+                                    StructRingAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                 }
                                 else
                                 {
@@ -3400,11 +4545,11 @@ void _USB_FindNextToken( void )
                             pCurrentEndpoint->transferState               = TSTATE_IDLE;
                             pCurrentEndpoint->status.bfTransferComplete   = 1;
                             #if defined( USB_ENABLE_TRANSFER_EVENT )
-                                if (StructQueueIsNotFull(&usbEventQueue, USB_EVENT_QUEUE_DEPTH))
+                                if (StructRingIsNotFull(&usbEventQueue, USB_EVENT_QUEUE_DEPTH))
                                 {
                                     USB_EVENT_DATA *data;
 
-                                    data = StructQueueAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
+                                    data = StructRingPeekHead(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                     data->event = EVENT_TRANSFER;
                                     data->TransferData.dataCount        = pCurrentEndpoint->dataCount;
                                     data->TransferData.pUserData        = pCurrentEndpoint->pUserData;
@@ -3412,6 +4557,8 @@ void _USB_FindNextToken( void )
                                     data->TransferData.bEndpointAddress = pCurrentEndpoint->bEndpointAddress;
                                     data->TransferData.bmAttributes.val = pCurrentEndpoint->bmAttributes.val;
                                     data->TransferData.clientDriver     = pCurrentEndpoint->clientDriver;
+                                    data->TransferData.pRequest         = _USB_ActiveRequest( pCurrentEndpoint );
+                                    StructRingAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                 }
                                 else
                                 {
@@ -3424,11 +4571,11 @@ void _USB_FindNextToken( void )
                             pCurrentEndpoint->transferState               = TSTATE_IDLE;
                             pCurrentEndpoint->status.bfTransferComplete   = 1;
                             #if defined( USB_ENABLE_TRANSFER_EVENT )
-                                if (StructQueueIsNotFull(&usbEventQueue, USB_EVENT_QUEUE_DEPTH))
+                                if (StructRingIsNotFull(&usbEventQueue, USB_EVENT_QUEUE_DEPTH))
                                 {
                                     USB_EVENT_DATA *data;
 
-                                    data = StructQueueAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
+                                    data = StructRingPeekHead(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                     data->event = EVENT_BUS_ERROR;
                                     data->TransferData.dataCount        = 0;
                                     data->TransferData.pUserData        = NULL;
@@ -3436,6 +4583,8 @@ void _USB_FindNextToken( void )
                                     data->TransferData.bEndpointAddress = pCurrentEndpoint->bEndpointAddress;
                                     data->TransferData.bmAttributes.val = pCurrentEndpoint->bmAttributes.val;
                                     data->TransferData.clientDriver     = pCurrentEndpoint->clientDriver;
+                                    data->TransferData.pRequest         = _USB_ActiveRequest( pCurrentEndpoint );
+                                    StructRingAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                 }
                                 else
                                 {
@@ -3477,10 +4626,8 @@ void _USB_FindNextToken( void )
 
         // MCHP: Implement scheduling by using usbBusInfo.dBytesSentInFrame
 
-        // Current Limitation:  The stack currently supports only one attached
-        // device.  We will make the assumption that the control, isochronous, and
-        // interrupt transfers requested by a single device will not exceed one
-        // frame, and defer the scheduler.
+        // The bandwidth of the isochronous and interrupt endpoints was reserved
+        // by _USB_FrameScheduleBuild(), so everything due in this frame fits.
 
         // Due to the nature of isochronous transfers, transfer events must be used.
         #if !defined( USB_ENABLE_TRANSFER_EVENT )
@@ -3527,11 +4674,11 @@ void _USB_FindNextToken( void )
                                 ((ISOCHRONOUS_DATA *)(pCurrentEndpoint->pUserData))->buffers[((ISOCHRONOUS_DATA *)(pCurrentEndpoint->pUserData))->currentBufferUSB].dataLength = pCurrentEndpoint->dataCount;
                                 ((ISOCHRONOUS_DATA *)(pCurrentEndpoint->pUserData))->buffers[((ISOCHRONOUS_DATA *)(pCurrentEndpoint->pUserData))->currentBufferUSB].bfDataLengthValid = 1;
                                 #if defined( USB_ENABLE_ISOC_TRANSFER_EVENT )
-                                    if (StructQueueIsNotFull(&usbEventQueue, USB_EVENT_QUEUE_DEPTH))
+                                    if (StructRingIsNotFull(&usbEventQueue, USB_EVENT_QUEUE_DEPTH))
                                     {
                                         USB_EVENT_DATA *data;
 
-                                        data = StructQueueAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
+                                        data = StructRingPeekHead(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                         data->event = EVENT_TRANSFER;
                                         data->TransferData.dataCount        = pCurrentEndpoint->dataCount;
                                         data->TransferData.pUserData        = ((ISOCHRONOUS_DATA *)(pCurrentEndpoint->pUserData))->buffers[((ISOCHRONOUS_DATA *)(pCurrentEndpoint->pUserData))->currentBufferUSB].pBuffer;
@@ -3539,6 +4686,8 @@ void _USB_FindNextToken( void )
                                         data->TransferData.bEndpointAddress = pCurrentEndpoint->bEndpointAddress;
                                         data->TransferData.bmAttributes.val = pCurrentEndpoint->bmAttributes.val;
                                         data->TransferData.clientDriver     = pCurrentEndpoint->clientDriver;
+                                        data->TransferData.pRequest         = _USB_ActiveRequest( pCurrentEndpoint );
+                                        StructRingAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                     }
                                     else
                                     {
@@ -3571,17 +4720,19 @@ void _USB_FindNextToken( void )
                                 pCurrentEndpoint->transferState     = TSTATE_ISOCHRONOUS_READ | TSUBSTATE_ISOCHRONOUS_READ_DATA;
                                 pCurrentEndpoint->wIntervalCount    = pCurrentEndpoint->wInterval;
                                 #if defined( USB_ENABLE_TRANSFER_EVENT )
-                                    if (StructQueueIsNotFull(&usbEventQueue, USB_EVENT_QUEUE_DEPTH))
+                                    if (StructRingIsNotFull(&usbEventQueue, USB_EVENT_QUEUE_DEPTH))
                                     {
                                         USB_EVENT_DATA *data;
 
-                                        data = StructQueueAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
+                                        data = StructRingPeekHead(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                         data->event = EVENT_BUS_ERROR;
                                         data->TransferData.dataCount        = 0;
                                         data->TransferData.pUserData        = NULL;
                                         data->TransferData.bEndpointAddress = pCurrentEndpoint->bEndpointAddress;
                                         data->TransferData.bErrorCode       = pCurrentEndpoint->bErrorCode;
                                         data->TransferData.bmAttributes.val = pCurrentEndpoint->bmAttributes.val;
+                                        data->TransferData.pRequest         = NULL;
+                                        StructRingAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                     }
                                     else
                                     {
@@ -3625,11 +4776,11 @@ void _USB_FindNextToken( void )
                                 // Update the valid data length for this buffer.
                                 ((ISOCHRONOUS_DATA *)(pCurrentEndpoint->pUserData))->buffers[((ISOCHRONOUS_DATA *)(pCurrentEndpoint->pUserData))->currentBufferUSB].bfDataLengthValid = 0;
                                 #if defined( USB_ENABLE_ISOC_TRANSFER_EVENT )
-                                    if (StructQueueIsNotFull(&usbEventQueue, USB_EVENT_QUEUE_DEPTH))
+                                    if (StructRingIsNotFull(&usbEventQueue, USB_EVENT_QUEUE_DEPTH))
                                     {
                                         USB_EVENT_DATA *data;
 
-                                        data = StructQueueAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
+                                        data = StructRingPeekHead(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                         data->event = EVENT_TRANSFER;
                                         data->TransferData.dataCount        = pCurrentEndpoint->dataCount;
                                         data->TransferData.pUserData        = ((ISOCHRONOUS_DATA *)(pCurrentEndpoint->pUserData))->buffers[((ISOCHRONOUS_DATA *)(pCurrentEndpoint->pUserData))->currentBufferUSB].pBuffer;
@@ -3637,6 +4788,8 @@ void _USB_FindNextToken( void )
                                         data->TransferData.bEndpointAddress = pCurrentEndpoint->bEndpointAddress;
                                         data->TransferData.bmAttributes.val = pCurrentEndpoint->bmAttributes.val;
                                         data->TransferData.clientDriver     = pCurrentEndpoint->clientDriver;
+                                        data->TransferData.pRequest         = _USB_ActiveRequest( pCurrentEndpoint );
+                                        StructRingAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                     }
                                     else
                                     {
@@ -3670,11 +4823,11 @@ void _USB_FindNextToken( void )
                                 pCurrentEndpoint->wIntervalCount    = pCurrentEndpoint->wInterval;
 
                                 #if defined( USB_ENABLE_TRANSFER_EVENT )
-                                    if (StructQueueIsNotFull(&usbEventQueue, USB_EVENT_QUEUE_DEPTH))
+                                    if (StructRingIsNotFull(&usbEventQueue, USB_EVENT_QUEUE_DEPTH))
                                     {
                                         USB_EVENT_DATA *data;
 
-                                        data = StructQueueAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
+                                        data = StructRingPeekHead(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                         data->event = EVENT_BUS_ERROR;
                                         data->TransferData.dataCount        = 0;
                                         data->TransferData.pUserData        = NULL;
@@ -3682,6 +4835,8 @@ void _USB_FindNextToken( void )
                                         data->TransferData.bEndpointAddress = pCurrentEndpoint->bEndpointAddress;
                                         data->TransferData.bmAttributes.val = pCurrentEndpoint->bmAttributes.val;
                                         data->TransferData.clientDriver     = pCurrentEndpoint->clientDriver;
+                                        data->TransferData.pRequest         = _USB_ActiveRequest( pCurrentEndpoint );
+                                        StructRingAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                     }
                                     else
                                     {
@@ -3738,11 +4893,11 @@ void _USB_FindNextToken( void )
                                 pCurrentEndpoint->wIntervalCount            = pCurrentEndpoint->wInterval;
                                 pCurrentEndpoint->status.bfTransferComplete = 1;
                                 #if defined( USB_ENABLE_TRANSFER_EVENT )
-                                    if (StructQueueIsNotFull(&usbEventQueue, USB_EVENT_QUEUE_DEPTH))
+                                    if (StructRingIsNotFull(&usbEventQueue, USB_EVENT_QUEUE_DEPTH))
                                     {
                                         USB_EVENT_DATA *data;
 
-                                        data = StructQueueAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
+                                        data = StructRingPeekHead(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                         data->event = EVENT_TRANSFER;
                                         data->TransferData.dataCount        = pCurrentEndpoint->dataCount;
                                         data->TransferData.pUserData        = pCurrentEndpoint->pUserData;
@@ -3750,12 +4905,15 @@ void _USB_FindNextToken( void )
                                         data->TransferData.bEndpointAddress = pCurrentEndpoint->bEndpointAddress;
                                         data->TransferData.bmAttributes.val = pCurrentEndpoint->bmAttributes.val;
                                         data->TransferData.clientDriver     = pCurrentEndpoint->clientDriver;
+                                        data->TransferData.pRequest         = _USB_ActiveRequest( pCurrentEndpoint );
+                                        StructRingAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                     }
                                     else
                                     {
                                         pCurrentEndpoint->bmAttributes.val = USB_EVENT_QUEUE_FULL;
                                     }
                                 #endif
+                                _USB_RequestAdvance( (USB_ENDPOINT_INFO *)pCurrentEndpoint );
                                 break;
 
                             case TSUBSTATE_ERROR:
@@ -3763,11 +4921,11 @@ void _USB_FindNextToken( void )
                                 pCurrentEndpoint->wIntervalCount            = pCurrentEndpoint->wInterval;
                                 pCurrentEndpoint->status.bfTransferComplete = 1;
                                 #if defined( USB_ENABLE_TRANSFER_EVENT )
-                                    if (StructQueueIsNotFull(&usbEventQueue, USB_EVENT_QUEUE_DEPTH))
+                                    if (StructRingIsNotFull(&usbEventQueue, USB_EVENT_QUEUE_DEPTH))
                                     {
                                         USB_EVENT_DATA *data;
 
-                                        data = StructQueueAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
+                                        data = StructRingPeekHead(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                         data->event = EVENT_BUS_ERROR;
                                         data->TransferData.dataCount        = 0;
                                         data->TransferData.pUserData        = NULL;
@@ -3775,12 +4933,15 @@ void _USB_FindNextToken( void )
                                         data->TransferData.bEndpointAddress = pCurrentEndpoint->bEndpointAddress;
                                         data->TransferData.bmAttributes.val = pCurrentEndpoint->bmAttributes.val;
                                         data->TransferData.clientDriver     = pCurrentEndpoint->clientDriver;
+                                        data->TransferData.pRequest         = _USB_ActiveRequest( pCurrentEndpoint );
+                                        StructRingAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                     }
                                     else
                                     {
                                         pCurrentEndpoint->bmAttributes.val = USB_EVENT_QUEUE_FULL;
                                     }
                                 #endif
+                                _USB_RequestAdvance( (USB_ENDPOINT_INFO *)pCurrentEndpoint );
                                 break;
 
                             default:
@@ -3803,11 +4964,11 @@ void _USB_FindNextToken( void )
                                 pCurrentEndpoint->wIntervalCount            = pCurrentEndpoint->wInterval;
                                 pCurrentEndpoint->status.bfTransferComplete = 1;
                                 #if defined( USB_ENABLE_TRANSFER_EVENT )
-                                    if (StructQueueIsNotFull(&usbEventQueue, USB_EVENT_QUEUE_DEPTH))
+                                    if (StructRingIsNotFull(&usbEventQueue, USB_EVENT_QUEUE_DEPTH))
                                     {
                                         USB_EVENT_DATA *data;
 
-                                        data = StructQueueAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
+                                        data = StructRingPeekHead(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                         data->event = EVENT_TRANSFER;
                                         data->TransferData.dataCount        = pCurrentEndpoint->dataCount;
                                         data->TransferData.pUserData        = pCurrentEndpoint->pUserData;
@@ -3815,12 +4976,15 @@ void _USB_FindNextToken( void )
                                         data->TransferData.bEndpointAddress = pCurrentEndpoint->bEndpointAddress;
                                         data->TransferData.bmAttributes.val = pCurrentEndpoint->bmAttributes.val;
                                         data->TransferData.clientDriver     = pCurrentEndpoint->clientDriver;
+                                        data->TransferData.pRequest         = _USB_ActiveRequest( pCurrentEndpoint );
+                                        StructRingAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                     }
                                     else
                                     {
                                         pCurrentEndpoint->bmAttributes.val = USB_EVENT_QUEUE_FULL;
                                     }
                                 #endif
+                                _USB_RequestAdvance( (USB_ENDPOINT_INFO *)pCurrentEndpoint );
                                 break;
 
                             case TSUBSTATE_ERROR:
@@ -3828,11 +4992,11 @@ void _USB_FindNextToken( void )
                                 pCurrentEndpoint->wIntervalCount            = pCurrentEndpoint->wInterval;
                                 pCurrentEndpoint->status.bfTransferComplete = 1;
                                 #if defined( USB_ENABLE_TRANSFER_EVENT )
-                                    if (StructQueueIsNotFull(&usbEventQueue, USB_EVENT_QUEUE_DEPTH))
+                                    if (StructRingIsNotFull(&usbEventQueue, USB_EVENT_QUEUE_DEPTH))
                                     {
                                         USB_EVENT_DATA *data;
 
-                                        data = StructQueueAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
+                                        data = StructRingPeekHead(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                         data->event = EVENT_BUS_ERROR;
                                         data->TransferData.dataCount        = 0;
                                         data->TransferData.pUserData        = NULL;
@@ -3840,12 +5004,15 @@ void _USB_FindNextToken( void )
                                         data->TransferData.bEndpointAddress = pCurrentEndpoint->bEndpointAddress;
                                         data->TransferData.bmAttributes.val = pCurrentEndpoint->bmAttributes.val;
                                         data->TransferData.clientDriver     = pCurrentEndpoint->clientDriver;
+                                        data->TransferData.pRequest         = _USB_ActiveRequest( pCurrentEndpoint );
+                                        StructRingAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                     }
                                     else
                                     {
                                         pCurrentEndpoint->bmAttributes.val = USB_EVENT_QUEUE_FULL;
                                     }
                                 #endif
+                                _USB_RequestAdvance( (USB_ENDPOINT_INFO *)pCurrentEndpoint );
                                 break;
 
                             default:
@@ -3905,11 +5072,11 @@ TryBulk:
                                 pCurrentEndpoint->transferState               = TSTATE_IDLE;
                                 pCurrentEndpoint->status.bfTransferComplete   = 1;
                                 #if defined( USB_ENABLE_TRANSFER_EVENT )
-                                    if (StructQueueIsNotFull(&usbEventQueue, USB_EVENT_QUEUE_DEPTH))
+                                    if (StructRingIsNotFull(&usbEventQueue, USB_EVENT_QUEUE_DEPTH))
                                     {
                                         USB_EVENT_DATA *data;
 
-                                        data = StructQueueAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
+                                        data = StructRingPeekHead(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                         data->event = EVENT_TRANSFER;
                                         data->TransferData.dataCount        = pCurrentEndpoint->dataCount;
                                         data->TransferData.pUserData        = pCurrentEndpoint->pUserData;
@@ -3917,23 +5084,26 @@ TryBulk:
                                         data->TransferData.bEndpointAddress = pCurrentEndpoint->bEndpointAddress;
                                         data->TransferData.bmAttributes.val = pCurrentEndpoint->bmAttributes.val;
                                         data->TransferData.clientDriver     = pCurrentEndpoint->clientDriver;
+                                        data->TransferData.pRequest         = _USB_ActiveRequest( pCurrentEndpoint );
+                                        StructRingAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                     }
                                     else
                                     {
                                         pCurrentEndpoint->bmAttributes.val = USB_EVENT_QUEUE_FULL;
                                     }
                                 #endif
+                                _USB_RequestAdvance( (USB_ENDPOINT_INFO *)pCurrentEndpoint );
                                 break;
 
                             case TSUBSTATE_ERROR:
                                 pCurrentEndpoint->transferState               = TSTATE_IDLE;
                                 pCurrentEndpoint->status.bfTransferComplete   = 1;
                                 #if defined( USB_ENABLE_TRANSFER_EVENT )
-                                    if (StructQueueIsNotFull(&usbEventQueue, USB_EVENT_QUEUE_DEPTH))
+                                    if (StructRingIsNotFull(&usbEventQueue, USB_EVENT_QUEUE_DEPTH))
                                     {
                                         USB_EVENT_DATA *data;
 
-                                        data = StructQueueAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
+                                        data = StructRingPeekHead(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                         data->event = EVENT_BUS_ERROR;
                                         data->TransferData.dataCount        = 0;
                                         data->TransferData.pUserData        = NULL;
@@ -3941,12 +5111,15 @@ TryBulk:
                                         data->TransferData.bEndpointAddress = pCurrentEndpoint->bEndpointAddress;
                                         data->TransferData.bmAttributes.val = pCurrentEndpoint->bmAttributes.val;
                                         data->TransferData.clientDriver     = pCurrentEndpoint->clientDriver;
+                                        data->TransferData.pRequest         = _USB_ActiveRequest( pCurrentEndpoint );
+                                        StructRingAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                     }
                                     else
                                     {
                                         pCurrentEndpoint->bmAttributes.val = USB_EVENT_QUEUE_FULL;
                                     }
                                 #endif
+                                _USB_RequestAdvance( (USB_ENDPOINT_INFO *)pCurrentEndpoint );
                                 break;
 
                             default:
@@ -3968,11 +5141,11 @@ TryBulk:
                                 pCurrentEndpoint->transferState               = TSTATE_IDLE;
                                 pCurrentEndpoint->status.bfTransferComplete   = 1;
                                 #if defined( USB_ENABLE_TRANSFER_EVENT )
-                                    if (StructQueueIsNotFull(&usbEventQueue, USB_EVENT_QUEUE_DEPTH))
+                                    if (StructRingIsNotFull(&usbEventQueue, USB_EVENT_QUEUE_DEPTH))
                                     {
                                         USB_EVENT_DATA *data;
 
-                                        data = StructQueueAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
+                                        data = StructRingPeekHead(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                         data->event = EVENT_TRANSFER;
                                         data->TransferData.dataCount        = pCurrentEndpoint->dataCount;
                                         data->TransferData.pUserData        = pCurrentEndpoint->pUserData;
@@ -3980,23 +5153,26 @@ TryBulk:
                                         data->TransferData.bEndpointAddress = pCurrentEndpoint->bEndpointAddress;
                                         data->TransferData.bmAttributes.val = pCurrentEndpoint->bmAttributes.val;
                                         data->TransferData.clientDriver     = pCurrentEndpoint->clientDriver;
+                                        data->TransferData.pRequest         = _USB_ActiveRequest( pCurrentEndpoint );
+                                        StructRingAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                     }
                                     else
                                     {
                                         pCurrentEndpoint->bmAttributes.val = USB_EVENT_QUEUE_FULL;
                                     }
                                 #endif
+                                _USB_RequestAdvance( (USB_ENDPOINT_INFO *)pCurrentEndpoint );
                                 break;
 
                             case TSUBSTATE_ERROR:
                                 pCurrentEndpoint->transferState               = TSTATE_IDLE;
                                 pCurrentEndpoint->status.bfTransferComplete   = 1;
                                 #if defined( USB_ENABLE_TRANSFER_EVENT )
-                                    if (StructQueueIsNotFull(&usbEventQueue, USB_EVENT_QUEUE_DEPTH))
+                                    if (StructRingIsNotFull(&usbEventQueue, USB_EVENT_QUEUE_DEPTH))
                                     {
                                         USB_EVENT_DATA *data;
 
-                                        data = StructQueueAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
+                                        data = StructRingPeekHead(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                         data->event = EVENT_BUS_ERROR;
                                         data->TransferData.dataCount        = 0;
                                         data->TransferData.pUserData        = NULL;
@@ -4004,12 +5180,15 @@ TryBulk:
                                         data->TransferData.bEndpointAddress = pCurrentEndpoint->bEndpointAddress;
                                         data->TransferData.bmAttributes.val = pCurrentEndpoint->bmAttributes.val;
                                         data->TransferData.clientDriver     = pCurrentEndpoint->clientDriver;
+                                        data->TransferData.pRequest         = _USB_ActiveRequest( pCurrentEndpoint );
+                                        StructRingAdd(&usbEventQueue, USB_EVENT_QUEUE_DEPTH);
                                     }
                                     else
                                     {
                                         pCurrentEndpoint->bmAttributes.val = USB_EVENT_QUEUE_FULL;
                                     }
                                 #endif
+                                _USB_RequestAdvance( (USB_ENDPOINT_INFO *)pCurrentEndpoint );
                                 break;
 
                             default:
@@ -4030,21 +5209,16 @@ TryBulk:
                     pCurrentEndpoint->transferState               = TSTATE_IDLE;
                     pCurrentEndpoint->status.bfTransferComplete   = 1;
                 }
-            }
 
-            // We've gone through all the bulk transactions, but we have time for more.
-            // If we have any bulk transactions, go back to the beginning of the list
-            // and start over.
-            #ifdef ALLOW_MULTIPLE_BULK_TRANSACTIONS_PER_FRAME
-                if (usbBusInfo.countBulkTransactions)
-                {
-                    usbBusInfo.lastBulkTransaction = 0;
+                // No token was sent for that endpoint (its transfer was just
+                // completed), so there may still be time for another one.
+                #ifdef ALLOW_MULTIPLE_BULK_TRANSACTIONS_PER_FRAME
                     goto TryBulk;
+                #endif
+            }
 
-                }
-            #endif
-
-            // If we've gone through all the endpoints, we do not have any more bulk transfers.
+            // No bulk endpoint is ready, or what is left of the frame's budget is
+            // too small for another packet.
             usbBusInfo.flags.bfBulkTransfersDone = 1;
         }
     #endif
@@ -4083,7 +5257,11 @@ TryBulk:
 bool _USB_FindServiceEndpoint( uint8_t transferType )
 {
     USB_ENDPOINT_INFO           *pEndpoint;
-    USB_INTERFACE_INFO          *pInterface;
+    uint8_t                     i;
+    uint8_t                     index;
+    #if defined( USB_SUPPORT_ISOCHRONOUS_TRANSFERS ) || defined( USB_SUPPORT_INTERRUPT_TRANSFERS )
+    uint16_t                    mask;
+    #endif
 
     // Check endpoint 0.
     if ((usbDeviceInfo.pEndpoint0->bmAttributes.bfTransferType == transferType) &&
@@ -4093,101 +5271,342 @@ bool _USB_FindServiceEndpoint( uint8_t transferType )
         return true;
     }
 
-    usbBusInfo.countBulkTransactions = 0;
-    pEndpoint = NULL;
-    pInterface = usbDeviceInfo.pInterfaceList;
-    if (pInterface && pInterface->pCurrentSetting)
+    switch (transferType)
+    {
+        #ifdef USB_SUPPORT_ISOCHRONOUS_TRANSFERS
+        case USB_TRANSFER_TYPE_ISOCHRONOUS:
+        #endif
+        #ifdef USB_SUPPORT_INTERRUPT_TRANSFERS
+        case USB_TRANSFER_TYPE_INTERRUPT:
+        #endif
+        #if defined( USB_SUPPORT_ISOCHRONOUS_TRANSFERS ) || defined( USB_SUPPORT_INTERRUPT_TRANSFERS )
+            // Only the endpoints scheduled in the current frame can be due.  An
+            // endpoint stays due (wIntervalCount == 0) until it has been
+            // serviced, or until the end of the frame.
+            mask = usbFrameSchedule.periodicMask[usbFrameSchedule.frame];
+            for (i = 0; mask != 0; i++, mask >>= 1)
+            {
+                if (mask & 0x0001)
+                {
+                    pEndpoint = usbFrameSchedule.periodic[i];
+                    if ((pEndpoint->bmAttributes.bfTransferType == transferType) &&
+                        !pEndpoint->status.bfTransferComplete &&
+                        (pEndpoint->wIntervalCount == 0))
+                    {
+                        pCurrentEndpoint = pEndpoint;
+                        return true;
+                    }
+                }
+            }
+            break;
+        #endif
+
+        case USB_TRANSFER_TYPE_CONTROL:
+        #ifdef USB_SUPPORT_BULK_TRANSFERS
+        case USB_TRANSFER_TYPE_BULK:
+        #endif
+            // Round robin, starting after the endpoint serviced last.
+            for (i = 0; i < usbFrameSchedule.asyncCount; i++)
+            {
+                index = usbFrameSchedule.asyncNext + i;
+                if (index >= usbFrameSchedule.asyncCount)
+                {
+                    index -= usbFrameSchedule.asyncCount;
+                }
+
+                pEndpoint = usbFrameSchedule.async[index];
+                if ((pEndpoint->bmAttributes.bfTransferType != transferType) ||
+                    pEndpoint->status.bfTransferComplete)
+                {
+                    continue;
+                }
+
+                #ifdef USB_SUPPORT_BULK_TRANSFERS
+                if (transferType == USB_TRANSFER_TYPE_BULK)
+                {
+                    #ifndef ALLOW_MULTIPLE_NAKS_PER_FRAME
+                    if (pEndpoint->status.bfLastTransferNAKd)
+                    {
+                        continue;
+                    }
+                    #endif
+
+                    // A new packet must fit in what the periodic endpoints left
+                    // of this frame.  Completing a transfer sends no token.
+                    // (TSUBSTATE_BULK_READ_DATA == TSUBSTATE_BULK_WRITE_DATA)
+                    if (((pEndpoint->transferState & TSUBSTATE_MASK) == TSUBSTATE_BULK_READ_DATA) &&
+                        (usbFrameSchedule.asyncBytesLeft < (int16_t)_USB_FrameScheduleCost( pEndpoint )))
+                    {
+                        continue;
+                    }
+
+                    usbFrameSchedule.asyncNext = (index + 1 < usbFrameSchedule.asyncCount) ? (index + 1) : 0;
+                }
+                #endif
+
+                pCurrentEndpoint = pEndpoint;
+                return true;
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    // No endpoints with the desired description are ready for servicing.
+    return false;
+}
+
+
+/****************************************************************************
+  Function:
+    uint16_t _USB_FrameScheduleCost( USB_ENDPOINT_INFO *pEndpoint )
+
+  Description:
+    This function returns the bus time of one maximum size transaction on
+    the endpoint, in full speed byte times.
+
+  Precondition:
+    None
+
+  Parameters:
+    USB_ENDPOINT_INFO *pEndpoint - Endpoint
+
+  Returns:
+    Bus time of one transaction
+
+  Remarks:
+    None
+  ***************************************************************************/
+uint16_t _USB_FrameScheduleCost( USB_ENDPOINT_INFO *pEndpoint )
+{
+    uint16_t    cost;
+
+    cost = pEndpoint->wMaxPacketSize + USB_FRAME_TRANSACTION_OVERHEAD;
+    if (usbDeviceInfo.flags.bfIsLowSpeed)
     {
-        pEndpoint = pInterface->pCurrentSetting->pEndpointList;
+        cost *= USB_FRAME_LOW_SPEED_FACTOR;
     }
 
+    return cost;
+}
+
+
+/****************************************************************************
+  Function:
+    bool _USB_FrameScheduleBuild( void )
+
+  Description:
+    This function builds the frame schedule from the endpoints of the
+    current setting of every interface.  Periodic endpoints are placed
+    shortest interval first, each at the phase that keeps the busiest frame
+    it lands in as light as possible.
+
+  Precondition:
+    None
+
+  Parameters:
+    None - None
+
+  Return Values:
+    true    - The schedule was built
+    false   - The configuration has too many endpoints, or its periodic
+                endpoints need more than 90% of a frame.  The schedule is
+                left empty.
+
+  Remarks:
+    Interrupt intervals are rounded down to a power of 2, and intervals
+    longer than USB_HOST_SCHEDULE_FRAMES are polled every
+    USB_HOST_SCHEDULE_FRAMES frames.  Polling an interrupt endpoint more
+    often than bInterval is allowed.
+  ***************************************************************************/
+bool _USB_FrameScheduleBuild( void )
+{
+    USB_ENDPOINT_INFO           *pEndpoint;
+    USB_INTERFACE_INFO          *pInterface;
+    uint16_t                    load[USB_HOST_SCHEDULE_FRAMES];
+    uint16_t                    interval;
+    uint16_t                    cost;
+    uint16_t                    worst;
+    uint16_t                    bestWorst;
+    uint16_t                    phase;
+    uint16_t                    bestPhase;
+    uint16_t                    frame;
+    #if defined( __C30__ ) || defined __XC16__
+        uint16_t                interrupt_mask;
+    #elif defined( __PIC32__ )
+        uint32_t                interrupt_mask;
+    #else
+        #error Cannot save interrupt status
+    #endif
+    uint8_t                     i;
+
+    // Guard against USB interrupts
+    interrupt_mask = U1IE;
+    U1IE = 0;
+
+    _USB_FrameScheduleClear();
+
+    // Collect the endpoints of the active settings, periodic ones sorted by
+    // interval.
+    pInterface = usbDeviceInfo.pInterfaceList;
     while (pInterface)
     {
-        if (pEndpoint != NULL)
+        pEndpoint = NULL;
+        if (pInterface->pCurrentSetting)
+        {
+            pEndpoint = pInterface->pCurrentSetting->pEndpointList;
+        }
+
+        while (pEndpoint)
         {
-            if (pEndpoint->bmAttributes.bfTransferType == transferType)
+            if ((pEndpoint->bmAttributes.bfTransferType == USB_TRANSFER_TYPE_INTERRUPT) ||
+                (pEndpoint->bmAttributes.bfTransferType == USB_TRANSFER_TYPE_ISOCHRONOUS))
             {
-                switch (transferType)
+                if (usbFrameSchedule.periodicCount >= USB_HOST_SCHEDULE_MAX_PERIODIC)
                 {
-                    case USB_TRANSFER_TYPE_CONTROL:
-                            if (!pEndpoint->status.bfTransferComplete)
-                            {
-                                    pCurrentEndpoint = pEndpoint;
-                                    return true;
-                            }
-                            break;
+                    goto Overcommitted;
+                }
 
-                    #ifdef USB_SUPPORT_ISOCHRONOUS_TRANSFERS
-                    case USB_TRANSFER_TYPE_ISOCHRONOUS:
-                    #endif
-                    #ifdef USB_SUPPORT_INTERRUPT_TRANSFERS
-                    case USB_TRANSFER_TYPE_INTERRUPT:
-                    #endif
-                    #if defined( USB_SUPPORT_ISOCHRONOUS_TRANSFERS ) || defined( USB_SUPPORT_INTERRUPT_TRANSFERS )
-                            if (pEndpoint->status.bfTransferComplete)
-                            {
-                                    // The endpoint doesn't need servicing.  If the interval count
-                                    // has reached 0 and the user has not initiated another transaction,
-                                    // reset the interval count for the next interval.
-                                    if (pEndpoint->wIntervalCount == 0)
-                                    {
-                                            // Reset the interval count for the next packet.
-                                            pEndpoint->wIntervalCount = pEndpoint->wInterval;
-                                    }
-                            }
-                            else
-                            {
-                                    if (pEndpoint->wIntervalCount == 0)
-                                    {
-                                    pCurrentEndpoint = pEndpoint;
-                                    return true;
+                // Round the interval down to a power of 2 within the schedule.
+                interval = 1;
+                while ((interval < USB_HOST_SCHEDULE_FRAMES) && ((interval << 1) <= pEndpoint->wInterval))
+                {
+                    interval <<= 1;
                 }
-                            }
-                            break;
-                    #endif
+                pEndpoint->wInterval        = interval;
+                pEndpoint->wIntervalCount   = interval;
 
-                    #ifdef USB_SUPPORT_BULK_TRANSFERS
-                    case USB_TRANSFER_TYPE_BULK:
-                            #ifdef ALLOW_MULTIPLE_NAKS_PER_FRAME
-                            if (!pEndpoint->status.bfTransferComplete)
-                            #else
-                            if (!pEndpoint->status.bfTransferComplete &&
-                                    !pEndpoint->status.bfLastTransferNAKd)
-                            #endif
-                            {
-                                    usbBusInfo.countBulkTransactions ++;
-                                    if (usbBusInfo.countBulkTransactions > usbBusInfo.lastBulkTransaction)
-                                    {
-                                            usbBusInfo.lastBulkTransaction  = usbBusInfo.countBulkTransactions;
-                                            pCurrentEndpoint                = pEndpoint;
-                                            return true;
-                                    }
-                            }
-                            break;
-                    #endif
+                i = usbFrameSchedule.periodicCount++;
+                while ((i > 0) && (usbFrameSchedule.periodic[i-1]->wInterval > interval))
+                {
+                    usbFrameSchedule.periodic[i] = usbFrameSchedule.periodic[i-1];
+                    i--;
+                }
+                usbFrameSchedule.periodic[i] = pEndpoint;
+            }
+            else
+            {
+                if (usbFrameSchedule.asyncCount >= USB_HOST_SCHEDULE_MAX_ASYNC)
+                {
+                    goto Overcommitted;
                 }
+                usbFrameSchedule.async[usbFrameSchedule.asyncCount++] = pEndpoint;
             }
 
-	        // Go to the next endpoint.
             pEndpoint = pEndpoint->next;
         }
 
-        if (pEndpoint == NULL)
+        pInterface = pInterface->next;
+    }
+
+    // Reserve the periodic bandwidth.
+    for (frame = 0; frame < USB_HOST_SCHEDULE_FRAMES; frame++)
+    {
+        load[frame] = 0;
+    }
+
+    for (i = 0; i < usbFrameSchedule.periodicCount; i++)
+    {
+        pEndpoint   = usbFrameSchedule.periodic[i];
+        interval    = pEndpoint->wInterval;
+        cost        = _USB_FrameScheduleCost( pEndpoint );
+
+        bestPhase   = 0;
+        bestWorst   = 0xFFFF;
+        for (phase = 0; phase < interval; phase++)
         {
-            // Go to the next interface.
-            pInterface = pInterface->next;
-            if (pInterface && pInterface->pCurrentSetting)
+            worst = 0;
+            for (frame = phase; frame < USB_HOST_SCHEDULE_FRAMES; frame += interval)
+            {
+                if (load[frame] > worst)
+                {
+                    worst = load[frame];
+                }
+            }
+            if (worst < bestWorst)
             {
-                pEndpoint = pInterface->pCurrentSetting->pEndpointList;
+                bestWorst = worst;
+                bestPhase = phase;
             }
         }
+
+        if ((bestWorst + cost) > USB_FRAME_PERIODIC_BYTES)
+        {
+            goto Overcommitted;
+        }
+
+        for (frame = bestPhase; frame < USB_HOST_SCHEDULE_FRAMES; frame += interval)
+        {
+            load[frame] += cost;
+            usbFrameSchedule.periodicMask[frame] |= (uint16_t)1 << i;
+        }
     }
 
-    // No endpoints with the desired description are ready for servicing.
+    // What is left of each frame goes to bulk.
+    for (frame = 0; frame < USB_HOST_SCHEDULE_FRAMES; frame++)
+    {
+        usbFrameSchedule.asyncBudget[frame] = USB_FRAME_BYTES - load[frame];
+    }
+    usbFrameSchedule.asyncBytesLeft = usbFrameSchedule.asyncBudget[usbFrameSchedule.frame];
+
+#if defined (DEBUG_ENABLE)
+    DEBUG_PutString( "HOST: Frame schedule built.\r\n" );
+#endif
+
+    U1IE = interrupt_mask;
+    return true;
+
+Overcommitted:
+#if defined (DEBUG_ENABLE)
+    DEBUG_PutString( "HOST: Not enough bus bandwidth for the configuration.\r\n" );
+#endif
+
+    // Do not leave a partial schedule around.
+    _USB_FrameScheduleClear();
+
+    U1IE = interrupt_mask;
     return false;
 }
 
 
+/****************************************************************************
+  Function:
+    void _USB_FrameScheduleClear( void )
+
+  Description:
+    This function empties the frame schedule.  Only EP0 is serviced until
+    the next schedule is built.
+
+  Precondition:
+    None
+
+  Parameters:
+    None - None
+
+  Returns:
+    None
+
+  Remarks:
+    This must be called before the endpoint lists are freed.
+  ***************************************************************************/
+void _USB_FrameScheduleClear( void )
+{
+    uint16_t    frame;
+
+    usbFrameSchedule.periodicCount  = 0;
+    usbFrameSchedule.asyncCount     = 0;
+    usbFrameSchedule.asyncNext      = 0;
+
+    for (frame = 0; frame < USB_HOST_SCHEDULE_FRAMES; frame++)
+    {
+        usbFrameSchedule.periodicMask[frame]    = 0;
+        usbFrameSchedule.asyncBudget[frame]     = USB_FRAME_BYTES;
+    }
+    usbFrameSchedule.asyncBytesLeft = USB_FRAME_BYTES;
+}
+
+
 /****************************************************************************
   Function:
     void _USB_FreeConfigMemory( void )
@@ -4215,6 +5634,9 @@ void _USB_FreeConfigMemory( void )
     USB_INTERFACE_SETTING_INFO  *pTempSetting;
     USB_ENDPOINT_INFO           *pTempEndpoint;
 
+    // The schedule points into the lists about to be freed.
+    _USB_FrameScheduleClear();
+
     while (usbDeviceInfo.pInterfaceList != NULL)
     {
         pTempInterface = usbDeviceInfo.pInterfaceList->next;
@@ -4226,16 +5648,26 @@ void _USB_FreeConfigMemory( void )
             while (usbDeviceInfo.pInterfaceList->pInterfaceSettings->pEndpointList != NULL)
             {
                 pTempEndpoint = usbDeviceInfo.pInterfaceList->pInterfaceSettings->pEndpointList->next;
-                USB_FREE_AND_CLEAR( usbDeviceInfo.pInterfaceList->pInterfaceSettings->pEndpointList );
+                _USB_RequestFlush( usbDeviceInfo.pInterfaceList->pInterfaceSettings->pEndpointList );
+                USB_ARENA_FREE_AND_CLEAR( usbDeviceInfo.pInterfaceList->pInterfaceSettings->pEndpointList );
                 usbDeviceInfo.pInterfaceList->pInterfaceSettings->pEndpointList = pTempEndpoint;
             }
-            USB_FREE_AND_CLEAR( usbDeviceInfo.pInterfaceList->pInterfaceSettings );
+            USB_ARENA_FREE_AND_CLEAR( usbDeviceInfo.pInterfaceList->pInterfaceSettings );
             usbDeviceInfo.pInterfaceList->pInterfaceSettings = pTempSetting;
         }
-        USB_FREE_AND_CLEAR( usbDeviceInfo.pInterfaceList );
+        USB_ARENA_FREE_AND_CLEAR( usbDeviceInfo.pInterfaceList );
         usbDeviceInfo.pInterfaceList = pTempInterface;
     }
 
+    // Nothing is left to look up.
+    _USB_IndexBuild();
+
+    // Give the nodes back to the enumeration data block in one step.
+    if (usbHostArena.mark != 0)
+    {
+        usbHostArena.used = usbHostArena.mark;
+    }
+
     pCurrentEndpoint = usbDeviceInfo.pEndpoint0;
 
 } // _USB_FreeConfigMemory
@@ -4269,21 +5701,80 @@ void _USB_FreeMemory( void )
     while (usbDeviceInfo.pConfigurationDescriptorList != NULL)
     {
         pTemp = (uint8_t *)usbDeviceInfo.pConfigurationDescriptorList->next;
-        USB_FREE_AND_CLEAR( usbDeviceInfo.pConfigurationDescriptorList->descriptor );
-        USB_FREE_AND_CLEAR( usbDeviceInfo.pConfigurationDescriptorList );
+        USB_ARENA_FREE_AND_CLEAR( usbDeviceInfo.pConfigurationDescriptorList->descriptor );
+        USB_ARENA_FREE_AND_CLEAR( usbDeviceInfo.pConfigurationDescriptorList );
         usbDeviceInfo.pConfigurationDescriptorList = (USB_CONFIGURATION *)pTemp;
     }
     if (pDeviceDescriptor != NULL)
     {
-        USB_FREE_AND_CLEAR( pDeviceDescriptor );
+        USB_ARENA_FREE_AND_CLEAR( pDeviceDescriptor );
     }
     if (pEP0Data != NULL)
     {
-        USB_FREE_AND_CLEAR( pEP0Data );
-    }
+        USB_ARENA_FREE_AND_CLEAR( pEP0Data );
+    }
+    pCurrentConfigurationDescriptor = NULL;
+
+    _USB_FreeConfigMemory();
+
+    // Nothing points into the enumeration data block any more.
+    _USB_ArenaDestroy();
+
+}
+
+
+/****************************************************************************
+  Function:
+    void _USB_IndexBuild( void )
+
+  Description:
+    This function rebuilds the lookup index used by _USB_FindEndpoint() and
+    _USB_FindInterface(), so that they do not have to walk the interface and
+    endpoint lists.  Only the endpoints of the active interface settings are
+    indexed.
+
+  Precondition:
+    None
+
+  Parameters:
+    None - None
+
+  Returns:
+    None
+
+  Remarks:
+    It must be called whenever the interface list or an active setting
+    changes.
+  ***************************************************************************/
+
+void _USB_IndexBuild( void )
+{
+    USB_INTERFACE_INFO  *pInterface;
+    USB_ENDPOINT_INFO   *pEndpoint;
+
+    memset( usbDeviceInfo.pEndpointIndex, 0, sizeof(usbDeviceInfo.pEndpointIndex) );
+    memset( usbDeviceInfo.pInterfaceIndex, 0, sizeof(usbDeviceInfo.pInterfaceIndex) );
+
+    pInterface = usbDeviceInfo.pInterfaceList;
+    while (pInterface)
+    {
+        if (pInterface->interface < USB_HOST_MAX_INTERFACES)
+        {
+            usbDeviceInfo.pInterfaceIndex[pInterface->interface] = pInterface;
+        }
 
-    _USB_FreeConfigMemory();
+        if (pInterface->pCurrentSetting)
+        {
+            pEndpoint = pInterface->pCurrentSetting->pEndpointList;
+            while (pEndpoint)
+            {
+                usbDeviceInfo.pEndpointIndex[_USB_EndpointIndex( pEndpoint->bEndpointAddress )] = pEndpoint;
+                pEndpoint = pEndpoint->next;
+            }
+        }
 
+        pInterface = pInterface->next;
+    }
 }
 
 
@@ -4727,6 +6218,17 @@ void _USB_NotifyAllDataClients( uint8_t address, USB_EVENT event, void *data, un
         device.  When the driver is modified to support multiple devices,
         each endpoint should be checked to ensure that we have enough
         bandwidth to support it.
+
+    * An interface is normally given to the client driver that matches
+        its first supported alternate setting.  The one exception is a mass
+        storage interface that offers bulk-only transport and USB Attached
+        SCSI in different alternate settings.  If the UAS entry is listed
+        before the bulk-only entry in the TPL, the UAS driver takes the
+        interface; otherwise the bulk-only driver keeps it.
+
+    * If the configuration descriptor was loaded from the enumeration
+        cache, each interface setting gets the client driver recorded in
+        the cache entry, and the TPL is not searched.
   ***************************************************************************/
 
 bool _USB_ParseConfigurationDescriptor( void )
@@ -4743,6 +6245,8 @@ bool _USB_ParseConfigurationDescriptor( void )
     uint8_t                        SubClass;
     uint8_t                        Protocol;
     uint8_t                        ClientDriver;
+    uint8_t                        TPLEntry;
+    bool                           found;
     uint16_t                        wTotalLength;
 
     uint8_t                        currentAlternateSetting;
@@ -4846,10 +6350,23 @@ bool _USB_ParseConfigurationDescriptor( void )
             if (usbDeviceInfo.flags.bfUseDeviceClientDriver)
             {
                 ClientDriver = usbDeviceInfo.deviceClientDriver;
+                TPLEntry     = 0;
             }
             else
             {
-                if (!_USB_FindClassDriver(Class, SubClass, Protocol, &ClientDriver))
+#if defined( USB_ENABLE_ENUMERATION_CACHE )
+                // A cached device gets the drivers it was bound to last time.
+                if ((usbEnumerationCache.pHit != NULL) && (usbEnumerationCache.pHit->bindingCount != 0))
+                {
+                    found = _USB_EnumerationCacheFindDriver(bInterfaceNumber, bAlternateSetting, &ClientDriver, &TPLEntry);
+                }
+                else
+#endif
+                {
+                    found = _USB_FindClassDriver(Class, SubClass, Protocol, &ClientDriver, &TPLEntry);
+                }
+
+                if (!found)
                 {
                     // If we cannot support this interface, skip it.
                     index += bLength;
@@ -4867,7 +6384,7 @@ bool _USB_ParseConfigurationDescriptor( void )
             if (newInterfaceInfo == NULL)
             {
                 // This is the first instance of this interface, so create a new node for it.
-                if ((newInterfaceInfo = (USB_INTERFACE_INFO *)USB_MALLOC( sizeof(USB_INTERFACE_INFO) )) == NULL)
+                if ((newInterfaceInfo = (USB_INTERFACE_INFO *)_USB_ArenaAlloc( sizeof(USB_INTERFACE_INFO) )) == NULL)
                 {
                     // Out of memory
                     error = true;
@@ -4879,6 +6396,8 @@ bool _USB_ParseConfigurationDescriptor( void )
                     // Initialize the interface node
                     newInterfaceInfo->interface             = bInterfaceNumber;
                     newInterfaceInfo->clientDriver          = ClientDriver;
+                    newInterfaceInfo->tplEntry              = TPLEntry;
+                    newInterfaceInfo->protocol              = Protocol;
                     newInterfaceInfo->pInterfaceSettings    = NULL;
                     newInterfaceInfo->pCurrentSetting       = NULL;
 
@@ -4887,11 +6406,29 @@ bool _USB_ParseConfigurationDescriptor( void )
                     pTempInterfaceList                      = newInterfaceInfo;
                 }
             }
+            else if ((Class == USB_HOST_MSD_CLASS) &&
+                     (newInterfaceInfo->protocol == USB_HOST_MSD_PROTOCOL_BULK_ONLY) &&
+                     (Protocol == USB_HOST_MSD_PROTOCOL_UAS) &&
+                     (TPLEntry < newInterfaceInfo->tplEntry))
+            {
+                // A mass storage interface that offers both bulk-only and UAS
+                // goes to whichever transport is listed first in the TPL.
+                newInterfaceInfo->clientDriver  = ClientDriver;
+                newInterfaceInfo->tplEntry      = TPLEntry;
+                newInterfaceInfo->protocol      = Protocol;
+                for (newSettingInfo = newInterfaceInfo->pInterfaceSettings; newSettingInfo != NULL; newSettingInfo = newSettingInfo->next)
+                {
+                    for (newEndpointInfo = newSettingInfo->pEndpointList; newEndpointInfo != NULL; newEndpointInfo = newEndpointInfo->next)
+                    {
+                        newEndpointInfo->clientDriver = ClientDriver;
+                    }
+                }
+            }
 
             if (!error)
             {
                 // Create a new setting for this interface, and add it to the list.
-                if ((newSettingInfo = (USB_INTERFACE_SETTING_INFO *)USB_MALLOC( sizeof(USB_INTERFACE_SETTING_INFO) )) == NULL)
+                if ((newSettingInfo = (USB_INTERFACE_SETTING_INFO *)_USB_ArenaAlloc( sizeof(USB_INTERFACE_SETTING_INFO) )) == NULL)
                 {
                     // Out of memory
                     error = true;
@@ -4929,7 +6466,7 @@ bool _USB_ParseConfigurationDescriptor( void )
                     else
                     {
                         // Create an entry for the new endpoint.
-                        if ((newEndpointInfo = (USB_ENDPOINT_INFO *)USB_MALLOC( sizeof(USB_ENDPOINT_INFO) )) == NULL)
+                        if ((newEndpointInfo = (USB_ENDPOINT_INFO *)_USB_ArenaAlloc( sizeof(USB_ENDPOINT_INFO) )) == NULL)
                         {
                             // Out of memory
                             error = true;
@@ -4944,7 +6481,9 @@ bool _USB_ParseConfigurationDescriptor( void )
                         newEndpointInfo->status.bfTransferComplete  = 1;  // Initialize to success to allow preprocessing loops.
                         newEndpointInfo->dataCount                  = 0;  // Initialize to 0 since we set bfTransferComplete.
                         newEndpointInfo->transferState              = TSTATE_IDLE;
-                        newEndpointInfo->clientDriver               = ClientDriver;
+                        newEndpointInfo->clientDriver               = newInterfaceInfo->clientDriver;
+                        newEndpointInfo->pRequestHead               = NULL;
+                        newEndpointInfo->pRequestTail               = NULL;
 
                         // Special setup for isochronous endpoints.
                         if (newEndpointInfo->bmAttributes.bfTransferType == USB_TRANSFER_TYPE_ISOCHRONOUS)
@@ -5023,13 +6562,13 @@ bool _USB_ParseConfigurationDescriptor( void )
                     newEndpointInfo = newSettingInfo->pEndpointList;
                     newSettingInfo->pEndpointList = newSettingInfo->pEndpointList->next;
 
-                    USB_FREE_AND_CLEAR( newEndpointInfo );
+                    USB_ARENA_FREE_AND_CLEAR( newEndpointInfo );
                 }
 
-                USB_FREE_AND_CLEAR( newSettingInfo );
+                USB_ARENA_FREE_AND_CLEAR( newSettingInfo );
             }
 
-            USB_FREE_AND_CLEAR( newInterfaceInfo );
+            USB_ARENA_FREE_AND_CLEAR( newInterfaceInfo );
         }
         return false;
     }
@@ -5045,11 +6584,318 @@ bool _USB_ParseConfigurationDescriptor( void )
 #endif
 
         usbDeviceInfo.pInterfaceList = pTempInterfaceList;
+        _USB_IndexBuild();
         return true;
     }
 }
 
 
+#if defined( USB_ENABLE_ENUMERATION_PROFILE )
+
+/****************************************************************************
+  Function:
+    uint8_t _USB_ProfileStage( uint16_t state )
+
+  Description:
+    This function returns the enumeration profile stage of a state of the
+    host state machine.
+
+  Precondition:
+    None
+
+  Parameters:
+    uint16_t state  - State machine state
+
+  Returns:
+    The USB_ENUMERATION_STAGE_xxx of the state, or USB_ENUMERATION_STAGE_NONE
+    if the state is not part of enumeration.
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+uint8_t _USB_ProfileStage( uint16_t state )
+{
+    switch (state & STATE_MASK)
+    {
+        case STATE_ATTACHED:
+            switch (state & SUBSTATE_MASK)
+            {
+                case SUBSTATE_SETTLE:
+                    return USB_ENUMERATION_STAGE_SETTLE;
+
+                case SUBSTATE_RESET_DEVICE:
+                    if ((state & SUBSUBSTATE_MASK) <= SUBSUBSTATE_RESET_WAIT)
+                    {
+                        return USB_ENUMERATION_STAGE_RESET;
+                    }
+                    return USB_ENUMERATION_STAGE_RESET_RECOVERY;
+
+                case SUBSTATE_GET_DEVICE_DESCRIPTOR_SIZE:
+                    return USB_ENUMERATION_STAGE_DEVICE_DESCRIPTOR_SIZE;
+
+                default:
+                    return USB_ENUMERATION_STAGE_DEVICE_DESCRIPTOR;
+            }
+
+        case STATE_ADDRESSING:
+            return USB_ENUMERATION_STAGE_SET_ADDRESS;
+
+        case STATE_CONFIGURING:
+            switch (state & SUBSTATE_MASK)
+            {
+                case SUBSTATE_SELECT_CONFIGURATION:
+                    return USB_ENUMERATION_STAGE_SELECT_CONFIGURATION;
+
+                case SUBSTATE_APPLICATION_CONFIGURATION:
+                    return USB_ENUMERATION_STAGE_APPLICATION_HOLD;
+
+                case SUBSTATE_SET_CONFIGURATION:
+                    return USB_ENUMERATION_STAGE_SET_CONFIGURATION;
+
+                default:
+                    return USB_ENUMERATION_STAGE_CONFIG_DESCRIPTORS;
+            }
+
+        default:
+            return USB_ENUMERATION_STAGE_NONE;
+    }
+}
+
+
+/****************************************************************************
+  Function:
+    void _USB_ProfileUpdate( void )
+
+  Description:
+    This function updates the enumeration profile when the state machine has
+    moved to another stage of enumeration.  The time and endpoint 0 NAKs
+    since the last change are charged to the stage that was left.  When
+    enumeration finishes, EVENT_ENUMERATION_PROFILE is sent to the
+    application.
+
+  Precondition:
+    None
+
+  Parameters:
+    None - None
+
+  Returns:
+    None
+
+  Remarks:
+    Called from USBHostTasks() after any state change from interrupt
+    processing has been applied.
+  ***************************************************************************/
+
+void _USB_ProfileUpdate( void )
+{
+    uint8_t     stage;
+    uint16_t    now;
+    uint16_t    naks;
+
+    stage = _USB_ProfileStage( usbHostState );
+    if (stage == usbEnumerationProfiler.stage)
+    {
+        return;
+    }
+
+    now  = msec_count;
+    naks = usbEnumerationProfiler.naks;
+
+    if (usbEnumerationProfiler.stage != USB_ENUMERATION_STAGE_NONE)
+    {
+        usbEnumerationProfiler.data.stageTime[usbEnumerationProfiler.stage] += now - usbEnumerationProfiler.stageTime;
+        usbEnumerationProfiler.data.stageNAKs[usbEnumerationProfiler.stage] += naks - usbEnumerationProfiler.stageNAKs;
+    }
+    else if (stage == USB_ENUMERATION_STAGE_SETTLE)
+    {
+        // A device has attached.
+        memset( &usbEnumerationProfiler.data, 0, sizeof(USB_ENUMERATION_PROFILE) );
+        usbEnumerationProfiler.data.enumerationTries = 1;
+        usbEnumerationProfiler.attachTime = now;
+    }
+    else
+    {
+        // Configuration changes requested by the application are not profiled.
+        return;
+    }
+
+    usbEnumerationProfiler.stage     = stage;
+    usbEnumerationProfiler.stageTime = now;
+    usbEnumerationProfiler.stageNAKs = naks;
+
+    if ((stage == USB_ENUMERATION_STAGE_NONE) &&
+        (((usbHostState & STATE_MASK) == STATE_RUNNING) || ((usbHostState & STATE_MASK) == STATE_HOLDING)))
+    {
+        usbEnumerationProfiler.data.totalTime = now - usbEnumerationProfiler.attachTime;
+        usbEnumerationProfiler.data.complete  = true;
+        if ((usbHostState & STATE_MASK) == STATE_RUNNING)
+        {
+            usbEnumerationProfiler.data.errorCode = USB_SUCCESS;
+        }
+        else
+        {
+            usbEnumerationProfiler.data.errorCode = usbDeviceInfo.errorCode;
+        }
+
+        USB_HOST_APP_EVENT_HANDLER( usbDeviceInfo.deviceAddress, EVENT_ENUMERATION_PROFILE,
+                &usbEnumerationProfiler.data, sizeof(USB_ENUMERATION_PROFILE) );
+    }
+}
+
+#endif
+
+
+/****************************************************************************
+  Function:
+    void _USB_RequestAdvance( USB_ENDPOINT_INFO *pEndpoint )
+
+  Description:
+    This function is called when a bulk or interrupt transfer on the endpoint
+    completes.  If the transfer belongs to a submitted request, the request
+    is removed from the queue and given the result of the transfer.  If it
+    was successful, the next request in the queue is started immediately.
+
+  Precondition:
+    Called from the USB interrupt, after the completion event (if any) has
+    been queued.
+
+  Parameters:
+    USB_ENDPOINT_INFO *pEndpoint  - Endpoint whose transfer completed
+
+  Returns:
+    None
+
+  Remarks:
+    After an error or a STALL, the rest of the queue waits until
+    USBHostClearEndpointErrors() is called.
+  ***************************************************************************/
+
+void _USB_RequestAdvance( USB_ENDPOINT_INFO *pEndpoint )
+{
+    USB_HOST_TRANSFER_REQUEST   *pRequest;
+
+    pRequest = _USB_ActiveRequest( pEndpoint );
+    if (pRequest == NULL)
+    {
+        // Started with USBHostRead() or USBHostWrite(), or cancelled.
+        return;
+    }
+
+    pEndpoint->pRequestHead = pRequest->next;
+    if (pEndpoint->pRequestHead == NULL)
+    {
+        pEndpoint->pRequestTail = NULL;
+    }
+
+    pRequest->dataCount = pEndpoint->dataCount;
+    if (pEndpoint->status.bfTransferSuccessful)
+    {
+        pRequest->errorCode = USB_SUCCESS;
+    }
+    else if (pEndpoint->status.bfStalled)
+    {
+        pRequest->errorCode = USB_ENDPOINT_STALLED;
+    }
+    else
+    {
+        pRequest->errorCode = pEndpoint->bErrorCode;
+    }
+    pRequest->next   = NULL;
+    pRequest->status = USB_HOST_REQUEST_COMPLETE;
+
+    if ((pEndpoint->pRequestHead != NULL) && (pRequest->errorCode == USB_SUCCESS))
+    {
+        _USB_RequestStart( pEndpoint );
+    }
+}
+
+
+/****************************************************************************
+  Function:
+    void _USB_RequestFlush( USB_ENDPOINT_INFO *pEndpoint )
+
+  Description:
+    This function removes all submitted requests from the endpoint.  Each
+    one is completed with USB_ENDPOINT_TRANSFER_CANCELLED.  No callbacks or
+    events are sent for them.
+
+  Precondition:
+    USB interrupts are disabled, or the endpoint is not being serviced.
+
+  Parameters:
+    USB_ENDPOINT_INFO *pEndpoint  - Endpoint to flush
+
+  Returns:
+    None
+
+  Remarks:
+    A transfer of the active request that is already on the bus is not
+    stopped by this function.
+  ***************************************************************************/
+
+void _USB_RequestFlush( USB_ENDPOINT_INFO *pEndpoint )
+{
+    USB_HOST_TRANSFER_REQUEST   *pRequest;
+
+    while (pEndpoint->pRequestHead != NULL)
+    {
+        pRequest                = pEndpoint->pRequestHead;
+        pEndpoint->pRequestHead = pRequest->next;
+
+        if (pRequest->status == USB_HOST_REQUEST_ACTIVE)
+        {
+            pRequest->dataCount = pEndpoint->dataCount;
+        }
+        pRequest->errorCode     = USB_ENDPOINT_TRANSFER_CANCELLED;
+        pRequest->next          = NULL;
+        pRequest->status        = USB_HOST_REQUEST_COMPLETE;
+    }
+    pEndpoint->pRequestTail = NULL;
+}
+
+
+/****************************************************************************
+  Function:
+    void _USB_RequestStart( USB_ENDPOINT_INFO *pEndpoint )
+
+  Description:
+    This function starts the transfer of the request at the head of the
+    endpoint's queue.
+
+  Precondition:
+    The endpoint is idle, and pRequestHead is not NULL.  USB interrupts are
+    disabled, or this is called from the USB interrupt.
+
+  Parameters:
+    USB_ENDPOINT_INFO *pEndpoint  - Endpoint to start
+
+  Returns:
+    None
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+void _USB_RequestStart( USB_ENDPOINT_INFO *pEndpoint )
+{
+    USB_HOST_TRANSFER_REQUEST   *pRequest;
+
+    pRequest            = pEndpoint->pRequestHead;
+    pRequest->status    = USB_HOST_REQUEST_ACTIVE;
+
+    if (pEndpoint->bEndpointAddress & 0x80)
+    {
+        _USB_InitRead( pEndpoint, pRequest->pData, (uint16_t)pRequest->size );
+    }
+    else
+    {
+        _USB_InitWrite( pEndpoint, pRequest->pData, (uint16_t)pRequest->size );
+    }
+}
+
+
 /****************************************************************************
   Function:
     void _USB_ResetDATA0( uint8_t endpoint )
@@ -5159,6 +7005,12 @@ void _USB_SendToken( uint8_t endpoint, uint8_t tokenType )
 
     U1EP0 = temp;
 
+    // Charge bulk packets to the frame's bulk budget.
+    if (pCurrentEndpoint->bmAttributes.bfTransferType == USB_TRANSFER_TYPE_BULK)
+    {
+        usbFrameSchedule.asyncBytesLeft -= _USB_FrameScheduleCost( (USB_ENDPOINT_INFO *)pCurrentEndpoint );
+    }
+
     U1ADDR = usbDeviceInfo.deviceAddressAndSpeed;
     U1TOK = (tokenType << 4) | (endpoint & 0x7F);
 
@@ -5439,9 +7291,11 @@ void USB_HostInterruptHandler(void)
         // The interrupt is cleared by writing a '1' to it.
         U1OTGIR = USB_INTERRUPT_T1MSECIF;
 
-        #if defined(USB_ENABLE_1MS_EVENT) && defined(USB_HOST_APP_DATA_EVENT_HANDLER)
+        #if (defined(USB_ENABLE_1MS_EVENT) && defined(USB_HOST_APP_DATA_EVENT_HANDLER)) || defined(USB_ENABLE_ENUMERATION_PROFILE)
             msec_count++;
+        #endif
 
+        #if defined(USB_ENABLE_1MS_EVENT) && defined(USB_HOST_APP_DATA_EVENT_HANDLER)
             //Notify ping all client drivers of 1MSEC event (address, event, data, sizeof_data)
             _USB_NotifyAllDataClients(0, EVENT_1MS, (void*)&msec_count, 0);
         #endif
@@ -5479,7 +7333,7 @@ void USB_HostInterruptHandler(void)
                     {
                         //If we aren't using the 1ms events, then turn of the interrupt to
                         // save CPU time
-                        #if !defined(USB_ENABLE_1MS_EVENT)
+                        #if !defined(USB_ENABLE_1MS_EVENT) && !defined(USB_ENABLE_ENUMERATION_PROFILE)
                             // Turn off the timer interrupt.
                             U1OTGIEbits.T1MSECIE = 0;
                         #endif
@@ -5503,7 +7357,7 @@ void USB_HostInterruptHandler(void)
                 {
                     //If we aren't using the 1ms events, then turn of the interrupt to
                     // save CPU time
-                    #if !defined(USB_ENABLE_1MS_EVENT)
+                    #if !defined(USB_ENABLE_1MS_EVENT) && !defined(USB_ENABLE_ENUMERATION_PROFILE)
                         // Turn off the timer interrupt.
                         U1OTGIEbits.T1MSECIE = 0;
                     #endif
@@ -5663,6 +7517,7 @@ void USB_HostInterruptHandler(void)
 
         // The previous token has finished, so clear the way for writing a new one.
         usbBusInfo.flags.bfTokenAlreadyWritten = 0;
+        usbBusInfo.flags.bfBulkBurst           = 0;
 
         copyU1STATbits = U1STATbits;    // Read the status register before clearing the flag.
 
@@ -5750,6 +7605,10 @@ void USB_HostInterruptHandler(void)
                     {
                         // We need to process more data.  Keep this endpoint in its current
                         // transfer state.
+                        if (pCurrentEndpoint->bmAttributes.bfTransferType == USB_TRANSFER_TYPE_BULK)
+                        {
+                            usbBusInfo.flags.bfBulkBurst = 1;
+                        }
                     }
                 }
             }
@@ -5786,6 +7645,10 @@ void USB_HostInterruptHandler(void)
                 {
                     // We need to process more data.  Keep this endpoint in its current
                     // transfer state.
+                    if (pCurrentEndpoint->bmAttributes.bfTransferType == USB_TRANSFER_TYPE_BULK)
+                    {
+                        usbBusInfo.flags.bfBulkBurst = 1;
+                    }
                 }
             }
             else if (pBDT->STAT.PID == PID_NAK)
@@ -5795,6 +7658,12 @@ void USB_HostInterruptHandler(void)
                 #endif
 
                 pCurrentEndpoint->countNAKs ++;
+                #if defined( USB_ENABLE_ENUMERATION_PROFILE )
+                    if (pCurrentEndpoint == usbDeviceInfo.pEndpoint0)
+                    {
+                        usbEnumerationProfiler.naks ++;
+                    }
+                #endif
 
                 switch( pCurrentEndpoint->bmAttributes.bfTransferType )
                 {
@@ -5913,8 +7782,8 @@ void USB_HostInterruptHandler(void)
 
     if (U1IEbits.SOFIE && U1IRbits.SOFIF)
     {
-        USB_ENDPOINT_INFO           *pEndpoint;
-        USB_INTERFACE_INFO          *pInterface;
+        uint16_t                    mask;
+        uint8_t                     i;
 
         #if defined(USB_ENABLE_SOF_EVENT) && defined(USB_HOST_APP_DATA_EVENT_HANDLER)
             //Notify ping all client drivers of SOF event (address, event, data, sizeof_data)
@@ -5923,41 +7792,43 @@ void USB_HostInterruptHandler(void)
 
         U1IR = USB_INTERRUPT_SOF; // Clear the interrupt by writing a '1' to the flag.
 
-        pInterface = usbDeviceInfo.pInterfaceList;
-        while (pInterface)
+        // Advance the frame schedule.  Periodic endpoints that were due in the
+        // last frame but not serviced wait for their next slot; the ones
+        // scheduled in this frame become due.
+        mask = usbFrameSchedule.periodicMask[usbFrameSchedule.frame];
+        for (i = 0; mask != 0; i++, mask >>= 1)
         {
-            if (pInterface->pCurrentSetting)
+            if (mask & 0x0001)
             {
-                pEndpoint = pInterface->pCurrentSetting->pEndpointList;
-                while (pEndpoint)
-                {
-                    // Decrement the interval count of all active interrupt and isochronous endpoints.
-                    if ((pEndpoint->bmAttributes.bfTransferType == USB_TRANSFER_TYPE_INTERRUPT) ||
-                        (pEndpoint->bmAttributes.bfTransferType == USB_TRANSFER_TYPE_ISOCHRONOUS))
-                    {
-                        if (pEndpoint->wIntervalCount != 0)
-                        {
-                            pEndpoint->wIntervalCount--;
-                        }
-                    }
+                usbFrameSchedule.periodic[i]->wIntervalCount = usbFrameSchedule.periodic[i]->wInterval;
+            }
+        }
 
-                    #ifndef ALLOW_MULTIPLE_NAKS_PER_FRAME
-                        pEndpoint->status.bfLastTransferNAKd = 0;
-                    #endif
+        usbFrameSchedule.frame = (usbFrameSchedule.frame + 1) & (USB_HOST_SCHEDULE_FRAMES - 1);
 
-                    pEndpoint = pEndpoint->next;
-                }
+        mask = usbFrameSchedule.periodicMask[usbFrameSchedule.frame];
+        for (i = 0; mask != 0; i++, mask >>= 1)
+        {
+            if (mask & 0x0001)
+            {
+                usbFrameSchedule.periodic[i]->wIntervalCount = 0;
             }
-
-            pInterface = pInterface->next;
         }
 
+        usbFrameSchedule.asyncBytesLeft = usbFrameSchedule.asyncBudget[usbFrameSchedule.frame];
+
+        #ifndef ALLOW_MULTIPLE_NAKS_PER_FRAME
+            for (i = 0; i < usbFrameSchedule.asyncCount; i++)
+            {
+                usbFrameSchedule.async[i]->status.bfLastTransferNAKd = 0;
+            }
+        #endif
+
         usbBusInfo.flags.bfControlTransfersDone     = 0;
         usbBusInfo.flags.bfInterruptTransfersDone   = 0;
         usbBusInfo.flags.bfIsochronousTransfersDone = 0;
         usbBusInfo.flags.bfBulkTransfersDone        = 0;
         //usbBusInfo.dBytesSentInFrame                = 0;
-        usbBusInfo.lastBulkTransaction              = 0;
 
         _USB_FindNextToken();
     }
@@ -5974,6 +7845,7 @@ void USB_HostInterruptHandler(void)
 
         // The previous token has finished, so clear the way for writing a new one.
         usbBusInfo.flags.bfTokenAlreadyWritten = 0;
+        usbBusInfo.flags.bfBulkBurst           = 0;
 
         // If we are doing isochronous transfers, ignore the error.
         if (pCurrentEndpoint->bmAttributes.bfTransferType == USB_TRANSFER_TYPE_ISOCHRONOUS)
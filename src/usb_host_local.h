@@ -147,6 +147,13 @@ internal variables to support the device.
 #define SUBSUBSTATE_SET_CONFIGURATION_COMPLETE          0x0002  //
 #define SUBSUBSTATE_INIT_CLIENT_DRIVERS                 0x0003  //
 
+#define SUBSTATE_GET_SERIAL_NUMBER                      0x0060  // Only entered from SUBSTATE_INIT_CONFIGURATION
+#define SUBSUBSTATE_SEND_GET_LANGID                     0x0000  // when USB_ENABLE_ENUMERATION_CACHE is defined.
+#define SUBSUBSTATE_WAIT_FOR_GET_LANGID                 0x0001  //
+#define SUBSUBSTATE_SEND_GET_SERIAL_NUMBER              0x0002  //
+#define SUBSUBSTATE_WAIT_FOR_GET_SERIAL_NUMBER          0x0003  //
+#define SUBSUBSTATE_GET_SERIAL_NUMBER_COMPLETE          0x0004  //
+
 /*
 *******************************************************************************
 RUNNING state machine values
@@ -227,6 +234,14 @@ HOLDING state machine values
 #define TSUBSTATE_BULK_WRITE_DATA               0x0000  //
 #define TSUBSTATE_BULK_WRITE_COMPLETE           0x0001  //
 
+// *****************************************************************************
+// Section: Interface Codes Used When Selecting a Client Driver
+// *****************************************************************************
+
+#define USB_HOST_MSD_CLASS                      0x08    // Mass storage interface class
+#define USB_HOST_MSD_PROTOCOL_BULK_ONLY         0x50    // Bulk-only transport
+#define USB_HOST_MSD_PROTOCOL_UAS               0x62    // USB Attached SCSI
+
 //******************************************************************************
 // Section: USB Peripheral Constants
 //******************************************************************************
@@ -341,6 +356,27 @@ HOLDING state machine values
 #define USB_SOF_THRESHOLD_32                0x2A    // U1SOF - Threshold for a max packet size of 32
 #define USB_SOF_THRESHOLD_64                0x4A    // U1SOF - Threshold for a max packet size of 64
 
+// Frame scheduler.  Bandwidth is counted in full speed byte times; a low speed
+// byte takes 8 of them.  Periodic transfers may use at most 90% of the frame
+// (USB 2.0 section 5.7.4), the rest is left to control and bulk.
+#define USB_FRAME_BYTES                     1500    // Full speed byte times per 1 ms frame.
+#define USB_FRAME_PERIODIC_BYTES            ((USB_FRAME_BYTES * 9) / 10)
+#define USB_FRAME_TRANSACTION_OVERHEAD      13      // Token, handshake, PIDs, CRC, sync and turnaround.
+#define USB_FRAME_LOW_SPEED_FACTOR          8
+
+#ifndef USB_HOST_SCHEDULE_FRAMES
+    #define USB_HOST_SCHEDULE_FRAMES        32      // Schedule length, a power of 2 up to 256.  Longer intervals are polled at this rate.
+#endif
+#ifndef USB_HOST_SCHEDULE_MAX_PERIODIC
+    #define USB_HOST_SCHEDULE_MAX_PERIODIC  16      // Interrupt and isochronous endpoints, at most 16.
+#endif
+#if USB_HOST_SCHEDULE_MAX_PERIODIC > 16
+    #error USB_HOST_SCHEDULE_MAX_PERIODIC must be at most 16, the frame slot masks are 16 bits
+#endif
+#ifndef USB_HOST_SCHEDULE_MAX_ASYNC
+    #define USB_HOST_SCHEDULE_MAX_ASYNC     16      // Bulk and non-EP0 control endpoints.
+#endif
+
 #define USB_1MS_TIMER_FLAG                  0x40
 #ifndef USB_INSERT_TIME
     #define USB_INSERT_TIME                 (250+1) // Insertion delay time (spec minimum is 100 ms)
@@ -381,12 +417,11 @@ typedef struct _USB_BUS_INFO
             uint8_t        bfIsochronousTransfersDone  : 1;    // All isochronous transfers in the current frame are complete.
             uint8_t        bfBulkTransfersDone         : 1;    // All bulk transfers in the current frame are complete.
             uint8_t        bfTokenAlreadyWritten       : 1;    // A token has already been written to the USB module
+            uint8_t        bfBulkBurst                 : 1;    // The last transaction moved a full packet of a bulk transfer that is not complete.
         };
         uint16_t            val;                                //
     }                   flags;                              //
 //    volatile uint32_t      dBytesSentInFrame;                  // The number of bytes sent during the current frame. Isochronous use only.
-    volatile uint8_t       lastBulkTransaction;                // The last bulk transaction sent.
-    volatile uint8_t       countBulkTransactions;              // The number of active bulk transactions.
 } USB_BUS_INFO;
 
 
@@ -446,10 +481,167 @@ typedef struct _USB_ENDPOINT_INFO
     volatile uint8_t               bErrorCode;                     // If bfError is set, this indicates the reason
     volatile uint16_t               countNAKs;                      // Count of NAK's of current transaction.
     uint16_t                        timeoutNAKs;                    // Count of NAK's for a timeout, if bfNAKTimeoutEnabled.
+    USB_HOST_TRANSFER_REQUEST      *pRequestHead;                   // First submitted request (the active one, if any).
+    USB_HOST_TRANSFER_REQUEST      *pRequestTail;                   // Last submitted request.
 
 } USB_ENDPOINT_INFO;
 
 
+// *****************************************************************************
+/* Frame Schedule
+
+This structure holds the per-frame schedule of the current configuration.  It
+is built from wInterval and wMaxPacketSize of the active interface settings
+when the configuration or an alternate setting is selected, so the SOF and
+token interrupts never have to walk the interface and endpoint lists.
+
+Every periodic endpoint is given a phase within its (power of 2) interval so
+that the load of the frames is as even as possible, and each frame slot keeps
+a mask of the periodic endpoints due in it.  Whatever the periodic endpoints
+do not reserve is the byte budget for bulk in that frame.  Bulk and control
+endpoints are serviced round robin from a cursor.
+*/
+typedef struct _USB_FRAME_SCHEDULE
+{
+    USB_ENDPOINT_INFO   *periodic[USB_HOST_SCHEDULE_MAX_PERIODIC];    // Interrupt and isochronous endpoints.
+    USB_ENDPOINT_INFO   *async[USB_HOST_SCHEDULE_MAX_ASYNC];          // Bulk and control endpoints (other than EP0).
+    uint16_t            periodicMask[USB_HOST_SCHEDULE_FRAMES];       // Periodic endpoints due in each frame slot.
+    uint16_t            asyncBudget[USB_HOST_SCHEDULE_FRAMES];        // Byte times left for bulk in each frame slot.
+    uint8_t             periodicCount;                                // Entries used in periodic[].
+    uint8_t             asyncCount;                                   // Entries used in async[].
+    volatile uint8_t    asyncNext;                                    // Round robin cursor into async[].
+    volatile uint8_t    frame;                                        // Current frame slot.
+    volatile int16_t    asyncBytesLeft;                               // Bulk byte times left in the current frame.
+} USB_FRAME_SCHEDULE;
+
+
+// *****************************************************************************
+/* Enumeration Arena
+
+All the enumeration data of the attached device is bump allocated from one
+block of heap, so that it can be released in one step.  The data that must
+survive a change of configuration (descriptors and pEP0Data) is allocated
+first.  mark is the use after the last configuration descriptor, so the
+interface, setting and endpoint lists can be dropped by going back to it.
+Allocations that do not fit are taken from the heap and freed one by one.
+*/
+#ifndef USB_HOST_ARENA_EXTRA
+    #define USB_HOST_ARENA_EXTRA    0       // Extra bytes to add to the calculated block size.
+#endif
+
+#define USB_HOST_ARENA_ALIGN(x)     (((x) + 3) & ~3)
+#define USB_HOST_ARENA_HEADER       USB_HOST_ARENA_ALIGN( sizeof(uint16_t) )   // Size stored in front of heap allocations.
+
+typedef struct _USB_HOST_ARENA
+{
+    uint8_t     *pBase;         // Block of heap, or NULL.
+    uint16_t    size;           // Size of the block.
+    uint16_t    used;           // Bytes allocated from the block.
+    uint16_t    mark;           // Value of used to go back to when the configuration is freed.
+    uint16_t    heapBytes;      // Bytes currently taken from the heap instead of the block.
+    uint16_t    highWater;      // Largest used + heapBytes seen.
+    uint16_t    heapFallbacks;  // Allocations taken from the heap instead since the block was allocated.
+} USB_HOST_ARENA;
+
+
+// *****************************************************************************
+/* Enumeration Cache
+
+When USB_ENABLE_ENUMERATION_CACHE is defined, the configuration descriptor
+selected for a device is kept after the device detaches, keyed by the VID,
+PID, bcdDevice and bNumConfigurations of its device descriptor and by its
+serial number string.  When a device with the same identity attaches again,
+the copy is used instead of reading every configuration descriptor from the
+device, and only the configuration that was selected last time is parsed.
+The client driver chosen for each supported interface setting is kept as
+well, so a cached device is bound to the same drivers without searching the
+TPL or raising EVENT_OVERRIDE_CLIENT_DRIVER_SELECTION again.  A device with
+more supported interface settings than USB_ENUMERATION_CACHE_SETTINGS has
+its drivers selected through the TPL on every attach.
+
+The serial number is read in the first language listed in string
+descriptor 0.
+
+Serial number strings longer than USB_ENUMERATION_CACHE_SERIAL_SIZE are
+compared on their length and first USB_ENUMERATION_CACHE_SERIAL_SIZE bytes.
+A device that has a serial number string but fails to return it is not
+cached.
+*/
+#if defined( USB_ENABLE_ENUMERATION_CACHE )
+    #ifndef USB_ENUMERATION_CACHE_ENTRIES
+        #define USB_ENUMERATION_CACHE_ENTRIES       2   // Number of devices remembered.
+    #endif
+
+    #ifndef USB_ENUMERATION_CACHE_SERIAL_SIZE
+        #define USB_ENUMERATION_CACHE_SERIAL_SIZE   34  // Bytes of the serial number string descriptor kept.
+    #endif
+    #if USB_ENUMERATION_CACHE_SERIAL_SIZE > 255
+        #error USB_ENUMERATION_CACHE_SERIAL_SIZE must be at most 255, the size of the largest string descriptor
+    #endif
+
+    #ifndef USB_ENUMERATION_CACHE_SETTINGS
+        #define USB_ENUMERATION_CACHE_SETTINGS      4   // Interface settings whose client driver is remembered per device.
+    #endif
+
+typedef struct _USB_ENUMERATION_CACHE_BINDING
+{
+    uint8_t     interface;          // bInterfaceNumber of the setting.
+    uint8_t     alternateSetting;   // bAlternateSetting of the setting.
+    uint8_t     clientDriver;       // Index into the client driver table.
+    uint8_t     tplEntry;           // Index of the TPL entry that selected the client driver.
+} USB_ENUMERATION_CACHE_BINDING;
+
+typedef struct _USB_ENUMERATION_CACHE_ENTRY
+{
+    uint8_t     *pDescriptor;       // Heap copy of the selected configuration descriptor, or NULL if the entry is free.
+    uint16_t    idVendor;           // Vendor ID of the device.
+    uint16_t    idProduct;          // Product ID of the device.
+    uint16_t    bcdDevice;          // Release number of the device.
+    uint16_t    lastUsed;           // Value of the use counter when the entry was last stored or found.
+    uint8_t     bNumConfigurations; // Number of configurations of the device.
+    uint8_t     configNumber;       // configNumber of the USB_CONFIGURATION node of the descriptor.
+    uint8_t     bindingCount;       // Number of valid bindings, or 0 if the drivers must be selected through the TPL.
+    USB_ENUMERATION_CACHE_BINDING   binding[USB_ENUMERATION_CACHE_SETTINGS];   // Client driver of each supported interface setting.
+    uint8_t     serial[USB_ENUMERATION_CACHE_SERIAL_SIZE];  // Serial number string descriptor, bLength 0 if none.
+} USB_ENUMERATION_CACHE_ENTRY;
+
+typedef struct _USB_ENUMERATION_CACHE
+{
+    USB_ENUMERATION_CACHE_ENTRY entry[USB_ENUMERATION_CACHE_ENTRIES];
+    USB_ENUMERATION_CACHE_ENTRY *pHit;      // Entry the current configuration descriptor was loaded from, or NULL.
+    uint16_t    useCount;                   // Counter used to find the least recently used entry.
+    bool        lookup;                     // Look the attached device up at the next SUBSTATE_INIT_CONFIGURATION.
+    bool        identified;                 // The serial number of the attached device is known.
+    uint8_t     languages[4];               // Start of string descriptor 0, holding the first LANGID of the device.
+    uint8_t     serial[USB_ENUMERATION_CACHE_SERIAL_SIZE];  // Serial number string descriptor of the attached device.
+} USB_ENUMERATION_CACHE;
+#endif
+
+
+// *****************************************************************************
+/* Enumeration Profiler
+
+When USB_ENABLE_ENUMERATION_PROFILE is defined, USBHostTasks() works out the
+enumeration stage from usbHostState on every call, and charges the time and
+endpoint 0 NAKs since the last change of stage to the stage that was left.
+Profiling starts when the settling delay after an attach starts, and ends
+when the device is running or held.
+*/
+#if defined( USB_ENABLE_ENUMERATION_PROFILE )
+    #define USB_ENUMERATION_STAGE_NONE  0xFF    // Not enumerating.
+
+typedef struct _USB_ENUMERATION_PROFILER
+{
+    USB_ENUMERATION_PROFILE data;           // Profile of the current or last enumeration.
+    uint16_t                attachTime;     // msec_count when the settling delay started.
+    uint16_t                stageTime;      // msec_count when the current stage started.
+    uint16_t                stageNAKs;      // Value of naks when the current stage started.
+    volatile uint16_t       naks;           // Count of NAKs received on endpoint 0.
+    uint8_t                 stage;          // Current stage, or USB_ENUMERATION_STAGE_NONE.
+} USB_ENUMERATION_PROFILER;
+#endif
+
+
 // *****************************************************************************
 /* Interface Setting Information Structure
 
@@ -478,10 +670,27 @@ typedef struct _USB_INTERFACE_INFO
     USB_INTERFACE_SETTING_INFO  *pCurrentSetting;    // Current Alternate Interface setting
     uint8_t                        interface;           // Interface number
     uint8_t                        clientDriver;        // Index into client driver table for this Interface
+    uint8_t                        tplEntry;            // Index of the TPL entry that selected the client driver
+    uint8_t                        protocol;            // Protocol code of the setting that selected the client driver
 
 } USB_INTERFACE_INFO;
 
 
+// *****************************************************************************
+/* Lookup Index Sizes
+
+The endpoints of the active interface settings are indexed by endpoint
+address (16 OUT and 16 IN), and the interfaces by interface number.
+Interfaces numbered USB_HOST_MAX_INTERFACES or above are found by walking
+the interface list.
+*/
+#define USB_HOST_ENDPOINT_INDEX_SIZE    32
+
+#ifndef USB_HOST_MAX_INTERFACES
+    #define USB_HOST_MAX_INTERFACES     8
+#endif
+
+
 // *****************************************************************************
 /* USB Device Information
 
@@ -502,6 +711,8 @@ typedef struct _USB_DEVICE_INFO
     USB_CONFIGURATION   *pConfigurationDescriptorList;      // Pointer to the list of Cnfiguration Descriptors of the attached device.
     USB_INTERFACE_INFO  *pInterfaceList;                    // List of interfaces on the attached device.
     USB_ENDPOINT_INFO   *pEndpoint0;                        // Pointer to a structure that describes EP0.
+    USB_ENDPOINT_INFO   *pEndpointIndex[USB_HOST_ENDPOINT_INDEX_SIZE];  // Endpoints of the active settings, by _USB_EndpointIndex().
+    USB_INTERFACE_INFO  *pInterfaceIndex[USB_HOST_MAX_INTERFACES];      // Interfaces, by interface number.
 
     volatile union
     {
@@ -571,19 +782,24 @@ the client drivers.
 
 This structure defines the queue of USB events that can be generated by the
 ISR that need to be synchronized to the USB event tasks loop (see
-USB_EVENT_DATA, above).  See "struct_queue.h" for usage and operations.
+USB_EVENT_DATA, above).  It is a single producer, single consumer ring: the
+ISR owns the head and the tasks loop owns the tail.  See "usb_struct_queue.h"
+for usage and operations (StructRing).
 */
 #if defined( USB_ENABLE_TRANSFER_EVENT )
     #ifndef USB_EVENT_QUEUE_DEPTH
         #define USB_EVENT_QUEUE_DEPTH   4       // Default depth of 4 events
     #endif
 
+    #if (USB_EVENT_QUEUE_DEPTH & (USB_EVENT_QUEUE_DEPTH - 1)) != 0
+        #error USB_EVENT_QUEUE_DEPTH must be a power of 2
+    #endif
+
     typedef struct _usb_event_queue
     {
-        int             head;
-        int             tail;
-        int             count;
-        USB_EVENT_DATA  buffer[USB_EVENT_QUEUE_DEPTH];
+        volatile unsigned int   head;   // Written by the ISR only.
+        volatile unsigned int   tail;   // Written by USBHostTasks() only.
+        USB_EVENT_DATA          buffer[USB_EVENT_QUEUE_DEPTH];
 
     } USB_EVENT_QUEUE;
 #endif
@@ -607,6 +823,8 @@ USB_EVENT_DATA, above).  See "struct_queue.h" for usage and operations.
 //******************************************************************************
 //******************************************************************************
 
+#define _USB_ActiveRequest(x)           ((((x)->pRequestHead != NULL) && ((x)->pRequestHead->status == USB_HOST_REQUEST_ACTIVE)) ? (x)->pRequestHead : NULL)
+#define _USB_EndpointIndex(x)           ( ((x) & 0x0F) | (((x) & 0x80) >> 3) )
 #define _USB_InitErrorCounters()        { numCommandTries   = USB_NUM_COMMAND_TRIES; }
 #define _USB_SetDATA01(x)               { pCurrentEndpoint->status.bfNextDATA01 = x; }
 #define _USB_SetErrorCode(x)            { usbDeviceInfo.errorCode = x; }
@@ -625,15 +843,29 @@ USB_EVENT_DATA, above).  See "struct_queue.h" for usage and operations.
 //******************************************************************************
 //******************************************************************************
 
+void *               _USB_ArenaAlloc( uint16_t size );
+bool                 _USB_ArenaCreate( uint16_t wTotalLength );
+void                 _USB_ArenaDestroy( void );
+void                 _USB_ArenaFree( void *ptr );
 void                 _USB_CheckCommandAndEnumerationAttempts( void );
-bool                 _USB_FindClassDriver( uint8_t bClass, uint8_t bSubClass, uint8_t bProtocol, uint8_t *pbClientDrv );
+#if defined( USB_ENABLE_ENUMERATION_CACHE )
+USB_ENUMERATION_CACHE_ENTRY * _USB_EnumerationCacheFind( void );
+bool                 _USB_EnumerationCacheFindDriver( uint8_t bInterfaceNumber, uint8_t bAlternateSetting, uint8_t *pbClientDrv, uint8_t *pbTPLEntry );
+bool                 _USB_EnumerationCacheLoad( void );
+void                 _USB_EnumerationCacheStore( USB_CONFIGURATION *pConfiguration );
+#endif
+bool                 _USB_FindClassDriver( uint8_t bClass, uint8_t bSubClass, uint8_t bProtocol, uint8_t *pbClientDrv, uint8_t *pbTPLEntry );
 bool                 _USB_FindDeviceLevelClientDriver( void );
 USB_ENDPOINT_INFO *  _USB_FindEndpoint( uint8_t endpoint );
-USB_INTERFACE_INFO * _USB_FindInterface ( uint8_t bInterface, uint8_t bAltSetting );
+USB_INTERFACE_INFO * _USB_FindInterface ( uint8_t bInterface );
 void                 _USB_FindNextToken( void );
 bool                 _USB_FindServiceEndpoint( uint8_t transferType );
+bool                 _USB_FrameScheduleBuild( void );
+void                 _USB_FrameScheduleClear( void );
+uint16_t             _USB_FrameScheduleCost( USB_ENDPOINT_INFO *pEndpoint );
 void                 _USB_FreeConfigMemory( void );
 void                 _USB_FreeMemory( void );
+void                 _USB_IndexBuild( void );
 void                 _USB_InitControlRead( USB_ENDPOINT_INFO *pEndpoint, uint8_t *pControlData, uint16_t controlSize,
                               uint8_t *pData, uint16_t size );
 void                 _USB_InitControlWrite( USB_ENDPOINT_INFO *pEndpoint, uint8_t *pControlData, uint16_t controlSize,
@@ -642,6 +874,13 @@ void                 _USB_InitRead( USB_ENDPOINT_INFO *pEndpoint, uint8_t *pData
 void                 _USB_InitWrite( USB_ENDPOINT_INFO *pEndpoint, uint8_t *pData, uint16_t size );
 void                 _USB_NotifyClients( uint8_t DevAddress, USB_EVENT event, void *data, unsigned int size );
 bool                 _USB_ParseConfigurationDescriptor( void );
+#if defined( USB_ENABLE_ENUMERATION_PROFILE )
+uint8_t              _USB_ProfileStage( uint16_t state );
+void                 _USB_ProfileUpdate( void );
+#endif
+void                 _USB_RequestAdvance( USB_ENDPOINT_INFO *pEndpoint );
+void                 _USB_RequestFlush( USB_ENDPOINT_INFO *pEndpoint );
+void                 _USB_RequestStart( USB_ENDPOINT_INFO *pEndpoint );
 void                 _USB_ResetDATA0( uint8_t endpoint );
 void                 _USB_SendToken( uint8_t endpoint, uint8_t tokenType );
 void                 _USB_SetBDT( uint8_t  direction );
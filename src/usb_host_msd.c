@@ -43,6 +43,18 @@ Currently this must be set to 1, due to limitations in the USB Host layer.
     #define USB_MAX_MASS_STORAGE_DEVICES        1
 #endif
 
+// *****************************************************************************
+/* Command Queue
+
+The command queue is performed by the USBHostMSDTasks() state machine, and its
+completions are reported with EVENT_MSD_TRANSFER, so it needs both.
+*/
+#if defined( USB_MSD_ENABLE_COMMAND_QUEUE )
+    #if defined( USB_ENABLE_TRANSFER_EVENT ) || !defined( USB_MSD_ENABLE_TRANSFER_EVENT )
+        #error "USB_MSD_ENABLE_COMMAND_QUEUE requires USB_MSD_ENABLE_TRANSFER_EVENT, with USBHostMSDTasks() performing the transfers."
+    #endif
+#endif
+
 // *****************************************************************************
 // *****************************************************************************
 // Section: Constants
@@ -183,6 +195,22 @@ typedef struct __attribute__((packed)) _USB_MSD_CSW
 } USB_MSD_CSW;
 
 
+#if defined( USB_MSD_ENABLE_COMMAND_QUEUE )
+// *****************************************************************************
+/* Queued Command
+
+This structure holds a command that is waiting for the current transfer to
+finish.  Its CBW is built when the command is submitted.
+*/
+typedef struct _USB_MSD_QUEUED_COMMAND
+{
+    USB_MSD_CBW                     cbw;                    // Prebuilt CBW, with its tag.
+    uint8_t                         *userData;              // Pointer to the user's data buffer.
+    uint32_t                        userDataLength;         // Length of the user's data buffer.
+} USB_MSD_QUEUED_COMMAND;
+#endif
+
+
 /* USB Mass Storage Device Information
 This structure is used to hold all the information about an attached Mass Storage device.
 */
@@ -220,6 +248,12 @@ typedef struct _USB_MSD_DEVICE_INFO
     uint32_t                               bytesTransferred;       // Number of bytes transferred to/from the user's data buffer.
     uint32_t                               dCBWTag;                // The value of the dCBWTag to verify against the dCSWtag.
     uint8_t                                attemptsCSW;            // Number of attempts to retrieve the CSW.
+#if defined( USB_MSD_ENABLE_COMMAND_QUEUE )
+    USB_MSD_QUEUED_COMMAND                 queue[USB_MSD_COMMAND_QUEUE_SIZE]; // Commands waiting for the current transfer.
+    uint8_t                                queueHead;              // Index of the oldest queued command.
+    uint8_t                                queueCount;             // Number of queued commands.
+    bool                                   queueHold;              // A new command may go ahead of the queue.
+#endif
 } USB_MSD_DEVICE_INFO;
 
 //******************************************************************************
@@ -228,8 +262,19 @@ typedef struct _USB_MSD_DEVICE_INFO
 //******************************************************************************
 //******************************************************************************
 
+void    _USBHostMSD_BuildCBW( USB_MSD_CBW *cbw, uint8_t deviceLUN, uint8_t direction, uint8_t *commandBlock,
+                        uint8_t commandBlockLength, uint32_t dataLength );
 uint32_t   _USBHostMSD_GetNextTag( void );
 void    _USBHostMSD_ResetStateJump( uint8_t i );
+#ifndef USB_ENABLE_TRANSFER_EVENT
+    void    _USBHostMSD_TransferDone( uint8_t i );
+    #ifdef USB_MSD_ENABLE_TRANSFER_EVENT
+        void    _USBHostMSD_FailCommands( uint8_t i, uint8_t errorCode );
+    #endif
+#endif
+#if defined( USB_MSD_ENABLE_COMMAND_QUEUE )
+    void    _USBHostMSD_StartQueuedCommand( uint8_t i );
+#endif
 
 
 //******************************************************************************
@@ -429,7 +474,9 @@ uint8_t USBHostMSDDeviceStatus( uint8_t deviceAddress )
     USB_MSD_ILLEGAL_REQUEST     - Device is in an illegal state for reset
 
   Remarks:
-    None
+    If USB_MSD_ENABLE_TRANSFER_EVENT is defined, the transfer in progress
+    and any queued transfers are first completed with USB_MSD_RESET_ERROR,
+    each with its own EVENT_MSD_TRANSFER.
   ***************************************************************************/
 
 uint8_t USBHostMSDResetDevice( uint8_t deviceAddress )
@@ -457,6 +504,10 @@ uint8_t USBHostMSDResetDevice( uint8_t deviceAddress )
             (deviceInfoMSD[i].state == STATE_HOLDING ))
     #endif
     {
+        #if !defined( USB_ENABLE_TRANSFER_EVENT ) && defined( USB_MSD_ENABLE_TRANSFER_EVENT )
+            _USBHostMSD_FailCommands( i, USB_MSD_RESET_ERROR );
+        #endif
+        deviceInfoMSD[i].errorCode  = USB_SUCCESS;
         deviceInfoMSD[i].flags.val |= MARK_RESET_RECOVERY;
         #ifndef USB_ENABLE_TRANSFER_EVENT
             deviceInfoMSD[i].returnState = STATE_RUNNING | SUBSTATE_HOLDING;
@@ -775,22 +826,28 @@ void USBHostMSDTasks( void )
                                     }
 
                                     // If we have a phase error, we need to perform corrective action instead of
-                                    // returning to normal running.
+                                    // returning to normal running.  Finish the transfer afterwards, so the
+                                    // media interface layer still gets its transfer event.
                                     if (deviceInfoMSD[i].block.csw.dCSWStatus == MSD_PHASE_ERROR)
                                     {
                                         deviceInfoMSD[i].flags.val |= MARK_RESET_RECOVERY;
-                                        deviceInfoMSD[i].returnState = STATE_RUNNING | SUBSTATE_HOLDING;
+                                        deviceInfoMSD[i].returnState = STATE_RUNNING | SUBSTATE_TRANSFER_DONE;
                                         _USBHostMSD_ResetStateJump( i );
                                     }
+                                    #if defined( USB_MSD_ENABLE_COMMAND_QUEUE )
+                                        else
+                                        {
+                                            // Finish now, so the CBW of the next command is sent in
+                                            // this pass instead of the next ones.
+                                            _USBHostMSD_TransferDone( i );
+                                        }
+                                    #endif
                                 }
                             }
                             break;
 
                         case SUBSTATE_TRANSFER_DONE:
-                            deviceInfoMSD[i].state = STATE_RUNNING | SUBSTATE_HOLDING;
-                            #ifdef USB_MSD_ENABLE_TRANSFER_EVENT
-                                usbMediaInterfaceTable.EventHandler( deviceInfoMSD[i].deviceAddress, EVENT_MSD_TRANSFER, NULL, 0 );
-                            #endif
+                            _USBHostMSD_TransferDone( i );
                             break;
                     }
                     break;
@@ -943,6 +1000,10 @@ void USBHostMSDTasks( void )
   Remarks:
     After executing this function, the application may have to reset the
     device in order for the device to continue working properly.
+
+    If USB_MSD_ENABLE_TRANSFER_EVENT is defined, the terminated transfer
+    and any queued transfers are completed with USB_MSD_RESET_ERROR, each
+    with its own EVENT_MSD_TRANSFER.
   ***************************************************************************/
 
 void USBHostMSDTerminateTransfer( uint8_t deviceAddress )
@@ -972,6 +1033,10 @@ void USBHostMSDTerminateTransfer( uint8_t deviceAddress )
         USBHostTerminateTransfer( deviceInfoMSD[i].deviceAddress, deviceInfoMSD[i].endpointIN );
         USBHostTerminateTransfer( deviceInfoMSD[i].deviceAddress, deviceInfoMSD[i].endpointOUT );
 
+        #if !defined( USB_ENABLE_TRANSFER_EVENT ) && defined( USB_MSD_ENABLE_TRANSFER_EVENT )
+            _USBHostMSD_FailCommands( i, USB_MSD_RESET_ERROR );
+        #endif
+
         // Set the state back to running and waiting for a transfer request.
         #ifndef USB_ENABLE_TRANSFER_EVENT
             deviceInfoMSD[i].state = STATE_RUNNING | SUBSTATE_HOLDING;
@@ -1050,6 +1115,34 @@ uint8_t USBHostMSDTransfer( uint8_t deviceAddress, uint8_t deviceLUN, uint8_t di
         return USB_MSD_DEVICE_NOT_FOUND;
     }
 
+    #if defined( USB_MSD_ENABLE_COMMAND_QUEUE )
+        // If a transfer is in progress, or earlier commands are waiting, put
+        // the command at the end of the queue.  While the media interface layer
+        // handles a failed command, a new command goes ahead of the queue, so
+        // the sense data can be read.
+        if (((deviceInfoMSD[i].state & STATE_MASK) == STATE_RUNNING) &&
+            ((deviceInfoMSD[i].state != (STATE_RUNNING | SUBSTATE_HOLDING)) ||
+             ((deviceInfoMSD[i].queueCount != 0) && !deviceInfoMSD[i].queueHold)))
+        {
+            if (deviceLUN > deviceInfoMSD[i].maxLUN)
+            {
+                return USB_MSD_INVALID_LUN;
+            }
+            if (deviceInfoMSD[i].queueCount == USB_MSD_COMMAND_QUEUE_SIZE)
+            {
+                return USB_MSD_DEVICE_BUSY;
+            }
+
+            j = (deviceInfoMSD[i].queueHead + deviceInfoMSD[i].queueCount) % USB_MSD_COMMAND_QUEUE_SIZE;
+            _USBHostMSD_BuildCBW( &deviceInfoMSD[i].queue[j].cbw, deviceLUN, direction, commandBlock, commandBlockLength, dataLength );
+            deviceInfoMSD[i].queue[j].userData          = data;
+            deviceInfoMSD[i].queue[j].userDataLength    = dataLength;
+            deviceInfoMSD[i].queueCount ++;
+            return USB_SUCCESS;
+        }
+        deviceInfoMSD[i].queueHold = false;
+    #endif
+
     // Make sure the device is in a state ready to read/write.
     #ifndef USB_ENABLE_TRANSFER_EVENT
         if (deviceInfoMSD[i].state != (STATE_RUNNING | SUBSTATE_HOLDING))
@@ -1074,7 +1167,6 @@ uint8_t USBHostMSDTransfer( uint8_t deviceAddress, uint8_t deviceLUN, uint8_t di
     deviceInfoMSD[i].flags.bfDirection = direction;
     deviceInfoMSD[i].userData          = data;
     deviceInfoMSD[i].userDataLength    = dataLength;
-    deviceInfoMSD[i].dCBWTag           = _USBHostMSD_GetNextTag();
     deviceInfoMSD[i].endpointDATA      = deviceInfoMSD[i].endpointIN;
     if (!direction) // OUT
     {
@@ -1087,17 +1179,8 @@ uint8_t USBHostMSDTransfer( uint8_t deviceAddress, uint8_t deviceLUN, uint8_t di
     #endif
 
     // Prepare the CBW so we can give the user back his command block RAM.
-    deviceInfoMSD[i].block.cbw.dCBWSignature             = USB_MSD_DCBWSIGNATURE;
-    deviceInfoMSD[i].block.cbw.dCBWTag                   = deviceInfoMSD[i].dCBWTag;
-    deviceInfoMSD[i].block.cbw.dCBWDataTransferLength    = deviceInfoMSD[i].userDataLength;
-    deviceInfoMSD[i].block.cbw.bmCBWflags.val            = 0;
-    deviceInfoMSD[i].block.cbw.bmCBWflags.bfDirection    = direction;
-    deviceInfoMSD[i].block.cbw.bCBWLUN                   = deviceLUN;
-    deviceInfoMSD[i].block.cbw.bCBWCBLength              = commandBlockLength;
-    for (j=0; j<commandBlockLength; j++)
-    {
-        deviceInfoMSD[i].block.cbw.CBWCB[j]              = commandBlock[j];
-    }
+    _USBHostMSD_BuildCBW( &deviceInfoMSD[i].block.cbw, deviceLUN, direction, commandBlock, commandBlockLength, dataLength );
+    deviceInfoMSD[i].dCBWTag           = deviceInfoMSD[i].block.cbw.dCBWTag;
 
     #ifndef USB_ENABLE_TRANSFER_EVENT
         // Jump to the transfer state.
@@ -1316,6 +1399,10 @@ bool USBHostMSDInitialize( uint8_t address, uint32_t flags, uint8_t clientDriver
                         deviceInfoMSD[device].clientDriverID   = clientDriverID;
                         deviceInfoMSD[device].endpointIN       = endpointIN;
                         deviceInfoMSD[device].endpointOUT      = endpointOUT;
+                        #if defined( USB_MSD_ENABLE_COMMAND_QUEUE )
+                            deviceInfoMSD[device].queueCount   = 0;
+                            deviceInfoMSD[device].queueHold    = false;
+                        #endif
                         #ifdef DEBUG_MODE
                             UART2PrintString( "MSD: Bulk endpoint IN: " );
                             UART2PutHex( endpointIN );
@@ -1857,6 +1944,52 @@ bool USBHostMSDEventHandler( uint8_t address, USB_EVENT event, void *data, uint3
 // *****************************************************************************
 // *****************************************************************************
 
+/****************************************************************************
+  Function:
+    void _USBHostMSD_BuildCBW( USB_MSD_CBW *cbw, uint8_t deviceLUN,
+                uint8_t direction, uint8_t *commandBlock, uint8_t commandBlockLength,
+                uint32_t dataLength )
+
+  Description:
+    This function fills in a Command Block Wrapper, with the next tag.
+
+  Precondition:
+    None
+
+  Parameters:
+    USB_MSD_CBW *cbw            - CBW to fill in
+    uint8_t deviceLUN           - Device LUN to access
+    uint8_t direction           - 1=read, 0=write
+    uint8_t *commandBlock       - Pointer to the command block
+    uint8_t commandBlockLength  - Length of the command block
+    uint32_t dataLength         - Byte size of the data transfer
+
+  Returns:
+    None
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+void _USBHostMSD_BuildCBW( USB_MSD_CBW *cbw, uint8_t deviceLUN, uint8_t direction, uint8_t *commandBlock,
+                        uint8_t commandBlockLength, uint32_t dataLength )
+{
+    uint8_t    j;
+
+    cbw->dCBWSignature             = USB_MSD_DCBWSIGNATURE;
+    cbw->dCBWTag                   = _USBHostMSD_GetNextTag();
+    cbw->dCBWDataTransferLength    = dataLength;
+    cbw->bmCBWflags.val            = 0;
+    cbw->bmCBWflags.bfDirection    = direction;
+    cbw->bCBWLUN                   = deviceLUN;
+    cbw->bCBWCBLength              = commandBlockLength;
+    for (j=0; j<commandBlockLength; j++)
+    {
+        cbw->CBWCB[j]              = commandBlock[j];
+    }
+}
+
+
 /****************************************************************************
   Function:
     uint32_t _USBHostMSD_GetNextTag( void )
@@ -2009,3 +2142,176 @@ void _USBHostMSD_ResetStateJump( uint8_t i )
 }
 
 
+#ifndef USB_ENABLE_TRANSFER_EVENT
+
+/****************************************************************************
+  Function:
+    void _USBHostMSD_TransferDone( uint8_t i )
+
+  Description:
+    This function finishes a transfer.  The device returns to holding, the
+    media interface layer is told with EVENT_MSD_TRANSFER, and, if commands
+    are queued, the next one is started.
+
+  Precondition:
+    The result of the transfer is in the device information.
+
+  Parameters:
+    uint8_t i  - Index into the deviceInfoMSD structure for the device.
+
+  Returns:
+    None
+
+  Remarks:
+    If the transfer failed, a command submitted by the media interface layer
+    while it handles the event goes ahead of the queued commands.
+  ***************************************************************************/
+
+void _USBHostMSD_TransferDone( uint8_t i )
+{
+    deviceInfoMSD[i].state = STATE_RUNNING | SUBSTATE_HOLDING;
+
+    #if defined( USB_MSD_ENABLE_COMMAND_QUEUE )
+        deviceInfoMSD[i].queueHold = (deviceInfoMSD[i].errorCode != USB_SUCCESS);
+    #endif
+
+    #ifdef USB_MSD_ENABLE_TRANSFER_EVENT
+        usbMediaInterfaceTable.EventHandler( deviceInfoMSD[i].deviceAddress, EVENT_MSD_TRANSFER, NULL, 0 );
+    #endif
+
+    #if defined( USB_MSD_ENABLE_COMMAND_QUEUE )
+        deviceInfoMSD[i].queueHold = false;
+        if ((deviceInfoMSD[i].state == (STATE_RUNNING | SUBSTATE_HOLDING)) && (deviceInfoMSD[i].queueCount != 0))
+        {
+            _USBHostMSD_StartQueuedCommand( i );
+        }
+    #endif
+}
+
+
+#ifdef USB_MSD_ENABLE_TRANSFER_EVENT
+
+/****************************************************************************
+  Function:
+    void _USBHostMSD_FailCommands( uint8_t i, uint8_t errorCode )
+
+  Description:
+    This function reports the command in progress, if any, and each queued
+    command as failed, with one EVENT_MSD_TRANSFER for each, in the order
+    they were submitted.  The queue is emptied.  It is used when the
+    transfer is terminated or the device is reset, so the media interface
+    layer does not wait for completions that would never come.
+
+  Precondition:
+    None
+
+  Parameters:
+    uint8_t i           - Index into the deviceInfoMSD structure for the
+                            device.
+    uint8_t errorCode   - Error code to report for each command.
+
+  Returns:
+    None
+
+  Remarks:
+    While the events are handled, the device is holding, so
+    USBHostMSDTransferIsComplete() returns errorCode and
+    USBHostMSDTransfer() refuses new commands with USB_MSD_DEVICE_BUSY.
+    The state of the device is restored afterwards.
+  ***************************************************************************/
+
+void _USBHostMSD_FailCommands( uint8_t i, uint8_t errorCode )
+{
+    uint8_t     count;
+    uint8_t     state;
+
+    state = deviceInfoMSD[i].state;
+
+    count = 0;
+    if (((state & STATE_MASK) == STATE_RUNNING) && (state != (STATE_RUNNING | SUBSTATE_HOLDING)))
+    {
+        count = 1;
+    }
+    #if defined( USB_MSD_ENABLE_COMMAND_QUEUE )
+        count += deviceInfoMSD[i].queueCount;
+        deviceInfoMSD[i].queueCount = 0;
+        deviceInfoMSD[i].queueHold  = false;
+    #endif
+
+    deviceInfoMSD[i].state              = STATE_HOLDING;
+    deviceInfoMSD[i].errorCode          = errorCode;
+    deviceInfoMSD[i].bytesTransferred   = 0;
+    while (count != 0)
+    {
+        usbMediaInterfaceTable.EventHandler( deviceInfoMSD[i].deviceAddress, EVENT_MSD_TRANSFER, NULL, 0 );
+        count --;
+    }
+
+    deviceInfoMSD[i].state = state;
+}
+
+#endif
+
+#endif
+
+
+#if defined( USB_MSD_ENABLE_COMMAND_QUEUE )
+
+/****************************************************************************
+  Function:
+    void _USBHostMSD_StartQueuedCommand( uint8_t i )
+
+  Description:
+    This function removes the oldest command from the queue and sends its
+    prebuilt CBW at once.
+
+  Precondition:
+    The device is holding, and the queue is not empty.
+
+  Parameters:
+    uint8_t i  - Index into the deviceInfoMSD structure for the device.
+
+  Returns:
+    None
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+void _USBHostMSD_StartQueuedCommand( uint8_t i )
+{
+    USB_MSD_QUEUED_COMMAND  *command;
+    uint8_t                 errorCode;
+
+    command = &deviceInfoMSD[i].queue[deviceInfoMSD[i].queueHead];
+    deviceInfoMSD[i].queueHead = (deviceInfoMSD[i].queueHead + 1) % USB_MSD_COMMAND_QUEUE_SIZE;
+    deviceInfoMSD[i].queueCount --;
+
+    // Initialize the transfer information.
+    deviceInfoMSD[i].attemptsCSW       = CSW_RECEIVE_ATTEMPTS;
+    deviceInfoMSD[i].bytesTransferred  = 0;
+    deviceInfoMSD[i].errorCode         = USB_SUCCESS;
+    deviceInfoMSD[i].flags.val         = 0;
+    deviceInfoMSD[i].flags.bfDirection = command->cbw.bmCBWflags.bfDirection;
+    deviceInfoMSD[i].userData          = command->userData;
+    deviceInfoMSD[i].userDataLength    = command->userDataLength;
+    deviceInfoMSD[i].dCBWTag           = command->cbw.dCBWTag;
+    deviceInfoMSD[i].endpointDATA      = deviceInfoMSD[i].endpointIN;
+    if (!deviceInfoMSD[i].flags.bfDirection) // OUT
+    {
+        deviceInfoMSD[i].endpointDATA  = deviceInfoMSD[i].endpointOUT;
+    }
+    memcpy( &deviceInfoMSD[i].block.cbw, &command->cbw, CBW_SIZE );
+
+    errorCode = USBHostWrite( deviceInfoMSD[i].deviceAddress, deviceInfoMSD[i].endpointOUT, deviceInfoMSD[i].block.data, CBW_SIZE );
+    if (errorCode)
+    {
+        _USBHostMSD_TerminateTransfer( errorCode );
+    }
+    else
+    {
+        deviceInfoMSD[i].state = STATE_RUNNING | SUBSTATE_CBW_WAIT;
+    }
+}
+
+#endif
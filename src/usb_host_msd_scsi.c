@@ -27,6 +27,10 @@ please contact mla_licensing@microchip.com
 #include <usb_host_msd.h>
 #include <usb_host_msd_scsi.h>
 
+#if defined( USB_MSD_SCSI_USE_UAS )
+    #include <usb_host_uas.h>
+#endif
+
 //#define DEBUG_MODE
 #if defined(DEBUG_MODE)
     #include "uart2.h"
@@ -48,6 +52,134 @@ please contact mla_licensing@microchip.com
 #define RDPROTECT_NORMAL            0x00        // Normal Read Protect behavior.
 #define WRPROTECT_NORMAL            0x00        // Normal Write Protect behavior.
 
+#if defined( USB_MSD_SCSI_ENABLE_ASYNC )
+    #if !defined( USB_MSD_ENABLE_TRANSFER_EVENT ) || defined( USB_ENABLE_TRANSFER_EVENT )
+        #error "USB_MSD_SCSI_ENABLE_ASYNC requires USB_MSD_ENABLE_TRANSFER_EVENT, with USBHostMSDTasks() performing the transfers."
+    #endif
+
+    #define ASYNC_FREE              0           // Request slot is not in use.
+    #define ASYNC_QUEUED            1           // Request is waiting for the device.
+    #define ASYNC_ACTIVE            2           // Request is being performed.
+    #define ASYNC_SENSE             3           // REQUEST SENSE is being performed after the request failed.
+    #define ASYNC_DONE              4           // Request is complete, waiting to be polled.
+
+    #define ASYNC_SENSE_SIZE        18          // Size of the fixed format sense data.
+    #define ASYNC_NONE              0xFF        // No request is selected.
+
+    // With the MSD command queue, the next requests are handed to the MSD
+    // driver while one is performed, so their CBWs are sent without a gap.
+    // The UAS driver gives them all to the device as tagged commands.
+    #if defined( USB_MSD_SCSI_USE_UAS )
+        #define ASYNC_MAX_ACTIVE    USB_UAS_QUEUE_DEPTH
+    #elif defined( USB_MSD_ENABLE_COMMAND_QUEUE )
+        #define ASYNC_MAX_ACTIVE    (USB_MSD_COMMAND_QUEUE_SIZE + 1)
+    #else
+        #define ASYNC_MAX_ACTIVE    1
+    #endif
+#endif
+
+#if defined( USB_MSD_SCSI_ENABLE_MEDIA_POLL )
+    #if !defined( USB_MSD_SCSI_ENABLE_ASYNC ) || !defined( USB_ENABLE_1MS_EVENT ) || !defined( USB_HOST_APP_DATA_EVENT_HANDLER )
+        #error "USB_MSD_SCSI_ENABLE_MEDIA_POLL requires USB_MSD_SCSI_ENABLE_ASYNC, USB_ENABLE_1MS_EVENT and USB_HOST_APP_DATA_EVENT_HANDLER."
+    #endif
+
+    #define MEDIA_STATE_UNKNOWN     0           // The unit has not been polled since it was attached or reset.
+    #define MEDIA_STATE_READY       1           // The last TEST UNIT READY passed.
+    #define MEDIA_STATE_NOT_READY   2           // The last TEST UNIT READY failed.
+
+    #define SENSE_KEY_UNIT_ATTENTION        0x06    // Sense key reported after a media change or reset.
+    #define ASC_MEDIUM_MAY_HAVE_CHANGED     0x28    // Additional sense code of a media change.
+#endif
+
+
+//******************************************************************************
+//******************************************************************************
+// Section: Data Structures
+//******************************************************************************
+//******************************************************************************
+
+// *****************************************************************************
+/* Logical Unit Information
+
+This structure holds the state of one logical unit of the attached device.
+The address of the address member is the media handle of the logical unit,
+which is passed to the functions of this layer in place of a pointer to the
+device address.
+*/
+#if defined( USB_MSD_SCSI_USE_UAS )
+// *****************************************************************************
+/* Transport
+
+This structure holds the functions of the client driver that performs the
+commands of a device, either the bulk-only driver or the UAS driver.
+*/
+typedef struct _USB_MSD_SCSI_TRANSPORT
+{
+    uint8_t (*DeviceStatus)( uint8_t deviceAddress );
+    uint8_t (*ResetDevice)( uint8_t deviceAddress );
+    uint8_t (*Transfer)( uint8_t deviceAddress, uint8_t deviceLUN, uint8_t direction, uint8_t *commandBlock,
+                    uint8_t commandBlockLength, uint8_t *data, uint32_t dataLength );
+    bool    (*TransferIsComplete)( uint8_t deviceAddress, uint8_t *errorCode, uint32_t *byteCount );
+} USB_MSD_SCSI_TRANSPORT;
+#endif
+
+typedef struct _USB_MSD_SCSI_LUN_INFO
+{
+    uint8_t                     address;            // Address of the device.  Must be first.
+    uint8_t                     lun;                // Logical Unit Number.
+#if defined( USB_MSD_SCSI_USE_UAS )
+    const USB_MSD_SCSI_TRANSPORT *transport;        // Client driver that performs the commands.
+#endif
+    bool                        writeProtected;     // The media is write protected, from MODE SENSE 6.
+    uint32_t                    lastSector;         // Address of the last sector, from READ CAPACITY 10.
+    FILEIO_MEDIA_INFORMATION    mediaInformation;   // Information about the media.
+#if defined( USB_MSD_SCSI_ENABLE_MEDIA_POLL )
+    uint8_t                     mediaState;         // MEDIA_STATE_xxx, from the last TEST UNIT READY.
+    bool                        mediaChanged;       // A media change has not been reported by media detect yet.
+    bool                        pollPending;        // A TEST UNIT READY is queued or being performed.
+#endif
+} USB_MSD_SCSI_LUN_INFO;
+
+#if defined( USB_MSD_SCSI_ENABLE_CACHE )
+// *****************************************************************************
+/* Sector Cache Entry
+
+This structure holds one sector of the sector cache.
+*/
+typedef struct _USB_MSD_SCSI_CACHE_ENTRY
+{
+    USB_MSD_SCSI_LUN_INFO   *pLUN;                      // Logical unit of the cached sector.
+    uint32_t    sectorAddress;                          // Address of the cached sector.
+    uint32_t    lastUsed;                               // Value of cacheUseCount when the sector was last used.
+    bool        valid;                                  // The entry holds a sector.
+    bool        dirty;                                  // The sector has been written, but not to the media.
+    uint8_t     data[USB_MSD_SCSI_CACHE_SECTOR_SIZE];   // Sector data.
+} USB_MSD_SCSI_CACHE_ENTRY;
+#endif
+
+#if defined( USB_MSD_SCSI_ENABLE_ASYNC )
+// *****************************************************************************
+/* Asynchronous Request
+
+This structure holds a request submitted through the asynchronous interface.
+The command block is copied, so the caller only has to keep the data buffer.
+*/
+typedef struct _USB_MSD_SCSI_ASYNC_REQUEST
+{
+    uint8_t                         commandBlock[10];       // Command block for the CBW.
+    uint8_t                         commandBlockLength;     // Length of the command block.
+    uint8_t                         direction;              // 1=read, 0=write.
+    uint8_t                         state;                  // ASYNC_xxx
+    uint8_t                         address;                // Address of the device.
+    uint8_t                         sequence;               // Submission order, for requests of the same LUN.
+    uint8_t                         errorCode;              // Result of the request.
+    uint8_t                         *data;                  // Caller's data buffer.
+    uint32_t                        dataLength;             // Size of the data buffer.
+    uint32_t                        byteCount;              // Number of bytes transferred.
+    USB_MSD_SCSI_LUN_INFO           *pLUN;                  // Logical unit of the request.
+    USB_MSD_SCSI_ASYNC_CALLBACK     callback;               // Completion function, or NULL.
+} USB_MSD_SCSI_ASYNC_REQUEST;
+#endif
 
 //******************************************************************************
 //******************************************************************************
@@ -56,18 +188,82 @@ please contact mla_licensing@microchip.com
 //******************************************************************************
 
 #if !defined( USBTasks )
-    #define USBTasks()                  \
-        {                               \
-            USBHostTasks();             \
-            USBHostMSDTasks();          \
-        }
+    #if defined( USB_MSD_SCSI_USE_UAS )
+        #define USBTasks()                  \
+            {                               \
+                USBHostTasks();             \
+                USBHostMSDTasks();          \
+                USBHostUASTasks();          \
+            }
+    #else
+        #define USBTasks()                  \
+            {                               \
+                USBHostTasks();             \
+                USBHostMSDTasks();          \
+            }
+    #endif
+#endif
+
+#if defined( USB_MSD_SCSI_USE_UAS )
+    // The commands of each device are given to the client driver that
+    // attached its media.  USBHostMSDRead() and USBHostMSDWrite() expand to
+    // USBHostMSDTransfer(), so they are dispatched as well.
+    static const USB_MSD_SCSI_TRANSPORT * _USBHostMSDSCSI_GetTransport( uint8_t address );
+
+    #define USBHostMSDDeviceStatus(a)               (_USBHostMSDSCSI_GetTransport(a)->DeviceStatus(a))
+    #define USBHostMSDResetDevice(a)                (_USBHostMSDSCSI_GetTransport(a)->ResetDevice(a))
+    #define USBHostMSDTransfer(a,l,d,c,cl,p,n)      (_USBHostMSDSCSI_GetTransport(a)->Transfer(a,l,d,c,cl,p,n))
+    #define USBHostMSDTransferIsComplete(a,e,n)     (_USBHostMSDSCSI_GetTransport(a)->TransferIsComplete(a,e,n))
 #endif
 
 #if defined( PERFORM_TEST_UNIT_READY )
     bool    _USBHostMSDSCSI_TestUnitReady( uint8_t * address );
 #endif
 
+static void _USBHostMSDSCSI_DiscardSectors( USB_MSD_SCSI_LUN_INFO *pLUN );
+static USB_MSD_SCSI_LUN_INFO * _USBHostMSDSCSI_GetLUN( uint8_t * address );
+static bool _USBHostMSDSCSI_ModeSenseWriteProtect( uint8_t * address );
 static bool USBHostMSDSCSIRequestSense(uint8_t * address);
+static bool _USBHostMSDSCSI_Read10( uint8_t * address, uint32_t sectorAddress, uint16_t sectorCount, uint8_t *dataBuffer );
+static bool _USBHostMSDSCSI_Write10( uint8_t * address, uint32_t sectorAddress, uint16_t sectorCount, uint8_t *dataBuffer );
+static bool _USBHostMSDSCSI_ReadSector( uint8_t * address, uint32_t sectorAddress, uint8_t *dataBuffer );
+
+// The host layer transfers at most 0xFFFF bytes at once, so a command may not
+// ask for more sectors than fit in that.
+#define _USBHostMSDSCSI_TransferFits(pLUN,count)    ((uint32_t)(count) * (pLUN)->mediaInformation.sectorSize <= 0xFFFF)
+
+#if defined( USB_MSD_SCSI_ENABLE_READ_AHEAD )
+    static void _USBHostMSDSCSI_ReadAheadInvalidate( USB_MSD_SCSI_LUN_INFO *pLUN, uint32_t sectorAddress, uint16_t sectorCount );
+#endif
+
+#if defined( USB_MSD_SCSI_ENABLE_CACHE )
+    #define _USBHostMSDSCSI_CacheUsable(pLUN)   ((pLUN)->mediaInformation.sectorSize <= USB_MSD_SCSI_CACHE_SECTOR_SIZE)
+
+    static USB_MSD_SCSI_CACHE_ENTRY *   _USBHostMSDSCSI_CacheAllocate( USB_MSD_SCSI_LUN_INFO *pLUN, uint32_t sectorAddress );
+    static USB_MSD_SCSI_CACHE_ENTRY *   _USBHostMSDSCSI_CacheFind( USB_MSD_SCSI_LUN_INFO *pLUN, uint32_t sectorAddress );
+    #if defined( USB_MSD_SCSI_ENABLE_ASYNC )
+        static void                     _USBHostMSDSCSI_CacheInvalidate( USB_MSD_SCSI_LUN_INFO *pLUN, uint32_t sectorAddress, uint16_t sectorCount );
+    #endif
+    static void                         _USBHostMSDSCSI_CacheOverlay( USB_MSD_SCSI_LUN_INFO *pLUN, uint32_t sectorAddress, uint16_t sectorCount, uint8_t *dataBuffer );
+    static void                         _USBHostMSDSCSI_CacheUpdate( USB_MSD_SCSI_LUN_INFO *pLUN, uint32_t sectorAddress, uint16_t sectorCount, uint8_t *dataBuffer );
+#endif
+
+#if defined( USB_MSD_SCSI_ENABLE_ASYNC )
+    static void    _USBHostMSDSCSI_AsyncComplete( uint8_t index, uint8_t errorCode, uint32_t byteCount );
+    static uint8_t _USBHostMSDSCSI_AsyncSelect( void );
+    static void    _USBHostMSDSCSI_AsyncStart( void );
+    static uint8_t _USBHostMSDSCSI_AsyncSubmit( uint8_t * address, uint8_t direction, uint8_t *commandBlock,
+                        uint8_t commandBlockLength, uint8_t *data, uint32_t dataLength, USB_MSD_SCSI_ASYNC_CALLBACK callback );
+    static void    _USBHostMSDSCSI_AsyncTransferDone( uint8_t address );
+#endif
+
+#if defined( USB_MSD_SCSI_ENABLE_MEDIA_POLL )
+    static void    _USBHostMSDSCSI_MediaPoll( void );
+    static void    _USBHostMSDSCSI_MediaPollDone( uint8_t handle, uint8_t errorCode, uint32_t byteCount );
+    static void    _USBHostMSDSCSI_MediaPollWait( void );
+#else
+    #define _USBHostMSDSCSI_MediaPollWait()
+#endif
 
 //******************************************************************************
 //******************************************************************************
@@ -79,7 +275,47 @@ static bool USBHostMSDSCSIRequestSense(uint8_t * address);
 // Section: Internal Global Variables
 //******************************************************************************
 
-static FILEIO_MEDIA_INFORMATION   mediaInformation;   // Information about the attached media.
+static USB_MSD_SCSI_LUN_INFO      lunInfo[USB_MSD_SCSI_MAX_LUNS];     // Information about the logical units of the attached device.
+
+#if defined( USB_MSD_SCSI_USE_UAS )
+    // Functions of the bulk-only and UAS client drivers.
+    static const USB_MSD_SCSI_TRANSPORT transportBOT =
+    {
+        USBHostMSDDeviceStatus, USBHostMSDResetDevice, USBHostMSDTransfer, USBHostMSDTransferIsComplete
+    };
+    static const USB_MSD_SCSI_TRANSPORT transportUAS =
+    {
+        USBHostUASDeviceStatus, USBHostUASResetDevice, USBHostUASTransfer, USBHostUASTransferIsComplete
+    };
+#endif
+
+#if defined( USB_MSD_SCSI_ENABLE_READ_AHEAD )
+    static uint8_t      readAheadBuffer[USB_MSD_SCSI_READ_AHEAD_SECTORS * USB_MSD_SCSI_READ_AHEAD_SECTOR_SIZE];   // Sectors read ahead.
+    static USB_MSD_SCSI_LUN_INFO    *readAheadLUN;  // Logical unit of the sectors in readAheadBuffer.
+    static uint32_t     readAheadStart;         // Address of the first sector in readAheadBuffer.
+    static uint16_t     readAheadCount;         // Number of sectors in readAheadBuffer.  0 if empty.
+    static uint32_t     readAheadNext;          // Sector address of the next read if access is sequential.
+    static uint8_t      readAheadRun;           // Number of consecutive sequential reads.
+#endif
+
+#if defined( USB_MSD_SCSI_ENABLE_CACHE )
+    static USB_MSD_SCSI_CACHE_ENTRY         cache[USB_MSD_SCSI_CACHE_SECTORS];  // Sector cache.
+    static USB_MSD_SCSI_CACHE_STATISTICS    cacheStatistics;                    // Sector cache counters.
+    static uint32_t                         cacheUseCount;                      // Incremented each time a cached sector is used.
+#endif
+
+#if defined( USB_MSD_SCSI_ENABLE_ASYNC )
+    static USB_MSD_SCSI_ASYNC_REQUEST   asyncRequest[USB_MSD_SCSI_ASYNC_QUEUE_SIZE];    // Asynchronous request slots.
+    static uint8_t                      asyncActive[ASYNC_MAX_ACTIVE];                  // Slots of the requests given to the MSD driver, in order.
+    static uint8_t                      asyncActiveCount;                               // Number of requests given to the MSD driver.
+    static uint8_t                      asyncLastLUN;                                   // LUN of the last request started.
+    static uint8_t                      asyncSequence;                                  // Sequence number of the next request.
+    static uint8_t                      asyncSense[ASYNC_SENSE_SIZE];                   // Sense data read after a failed request.
+#endif
+
+#if defined( USB_MSD_SCSI_ENABLE_MEDIA_POLL )
+    static volatile uint16_t    mediaPollTimer;     // Milliseconds until the next TEST UNIT READY poll.
+#endif
 
 // *****************************************************************************
 // *****************************************************************************
@@ -151,7 +387,13 @@ bool USBHostMSDSCSIEventHandler( uint8_t address, USB_EVENT event, void *data, u
     switch( (int) event )
     {
         case EVENT_MSD_NONE:
+            return true;
+            break;
+
         case EVENT_MSD_TRANSFER:                 // A MSD transfer has completed
+            #if defined( USB_MSD_SCSI_ENABLE_ASYNC )
+                _USBHostMSDSCSI_AsyncTransferDone( address );
+            #endif
             return true;
             break;
 
@@ -165,13 +407,38 @@ bool USBHostMSDSCSIEventHandler( uint8_t address, USB_EVENT event, void *data, u
         case EVENT_MSD_MAX_LUN:
             {
                 uint8_t i;
+                uint8_t maxLUN;
                 #ifdef DEBUG_MODE
                     UART2PrintString( "SCSI: Max LUN set.\r\n" );
                 #endif
-                mediaInformation.maxLUN                     = *((uint8_t *)data);
-                mediaInformation.validityFlags.bits.maxLUN  = 1;
+                maxLUN = *((uint8_t *)data);
 
-                for (i = 0; i < mediaInformation.maxLUN + 1; i++)
+                // Set up the state of each logical unit that can be handled,
+                // then report it to the application.
+                for (i = 0; (i <= maxLUN) && (i < USB_MSD_SCSI_MAX_LUNS); i++)
+                {
+                    memset( &lunInfo[i], 0x00, sizeof(USB_MSD_SCSI_LUN_INFO) );
+                    lunInfo[i].address                                  = address;
+                    lunInfo[i].lun                                      = i;
+                    #if defined( USB_MSD_SCSI_USE_UAS )
+                        // Remember which client driver attached the media.
+                        if (USBHostUASDeviceStatus( address ) != USB_MSD_DEVICE_NOT_FOUND)
+                        {
+                            lunInfo[i].transport                        = &transportUAS;
+                        }
+                        else
+                        {
+                            lunInfo[i].transport                        = &transportBOT;
+                        }
+                    #endif
+                    lunInfo[i].mediaInformation.maxLUN                  = maxLUN;
+                    lunInfo[i].mediaInformation.validityFlags.bits.maxLUN = 1;
+                }
+                #if defined( USB_MSD_SCSI_ENABLE_MEDIA_POLL )
+                    // Poll the new logical units at the next media detect.
+                    mediaPollTimer = 0;
+                #endif
+                for (i = 0; (i <= maxLUN) && (i < USB_MSD_SCSI_MAX_LUNS); i++)
                 {
                     USB_HOST_APP_EVENT_HANDLER (address, EVENT_MSD_ATTACH, &i, 1);
                 }
@@ -184,7 +451,76 @@ bool USBHostMSDSCSIEventHandler( uint8_t address, USB_EVENT event, void *data, u
                 UART2PrintString( "SCSI: Device detached.\r\n" );
             #endif
             address                           = 0;
-            mediaInformation.validityFlags.value    = 0;
+            memset( lunInfo, 0x00, sizeof(lunInfo) );
+            #if defined( USB_MSD_SCSI_ENABLE_CACHE )
+                // The media is gone, so dirty sectors cannot be written back.
+                memset( cache, 0x00, sizeof(cache) );
+            #endif
+            #if defined( USB_MSD_SCSI_ENABLE_READ_AHEAD )
+                readAheadCount                  = 0;
+            #endif
+            #if defined( USB_MSD_SCSI_ENABLE_ASYNC )
+                // Fail every outstanding request.
+                {
+                    uint8_t i;
+
+                    for (i=0; i<USB_MSD_SCSI_ASYNC_QUEUE_SIZE; i++)
+                    {
+                        if ((asyncRequest[i].state != ASYNC_FREE) && (asyncRequest[i].state != ASYNC_DONE))
+                        {
+                            _USBHostMSDSCSI_AsyncComplete( i, USB_MSD_DEVICE_NOT_FOUND, 0 );
+                        }
+                    }
+                }
+            #endif
+            return true;
+            break;
+
+        default:
+            return false;
+            break;
+    }
+    return false;
+}
+
+
+#if defined( USB_MSD_SCSI_ENABLE_MEDIA_POLL )
+/****************************************************************************
+  Function:
+    bool USBHostMSDSCSIDataEventHandler( uint8_t address, USB_EVENT event,
+                        void *data, uint32_t size )
+
+  Description:
+    This function is called by the USB Embedded Host layer when a data event
+    occurs.  EVENT_1MS counts down the time until the next TEST UNIT READY
+    poll of the logical units.
+
+  Precondition:
+    None
+
+  Parameters:
+    uint8_t address    -   Address of the device
+    USB_EVENT event -   Event that has occurred
+    void *data      -   Pointer to data pertinent to the event
+    uint32_t size      -   Size of the data
+
+  Return Values:
+    true    -   Event was handled
+    false   -   Event was not handled
+
+  Remarks:
+    This function is called from the USB interrupt.
+  ***************************************************************************/
+
+bool USBHostMSDSCSIDataEventHandler( uint8_t address, USB_EVENT event, void *data, uint32_t size )
+{
+    switch( (int) event )
+    {
+        case EVENT_1MS:
+            if (mediaPollTimer != 0)
+            {
+                mediaPollTimer --;
+            }
             return true;
             break;
 
@@ -194,6 +530,7 @@ bool USBHostMSDSCSIEventHandler( uint8_t address, USB_EVENT event, void *data, u
     }
     return false;
 }
+#endif
 
 
 // *****************************************************************************
@@ -223,16 +560,40 @@ bool USBHostMSDSCSIEventHandler( uint8_t address, USB_EVENT event, void *data, u
   Remarks:
     Since this will often be called in a loop while waiting for a device,
     we need to make sure that USB tasks are executed.
+
+    If USB_MSD_SCSI_ENABLE_MEDIA_POLL is defined, the answer also depends on
+    the state of the media, from the last TEST UNIT READY.  This function
+    does not wait for the command; it queues one for each logical unit every
+    USB_MSD_SCSI_MEDIA_POLL_INTERVAL milliseconds.  If UNIT ATTENTION reports
+    that the media may have changed, false is returned once, so the
+    application initializes the media again.
   ***************************************************************************/
 
 uint8_t USBHostMSDSCSIMediaDetect( uint8_t * address)
 {
-    if (USBHostMSDDeviceStatus( *(uint8_t *)address ) == USB_MSD_NORMAL_RUNNING)
+    USB_MSD_SCSI_LUN_INFO   *pLUN = _USBHostMSDSCSI_GetLUN( address );
+
+    if ((USBHostMSDDeviceStatus( *(uint8_t *)address ) != USB_MSD_NORMAL_RUNNING) ||
+        (pLUN->mediaInformation.validityFlags.bits.maxLUN == 0))
     {
-        return true;
+        return false;
     }
 
-    return false;
+    #if defined( USB_MSD_SCSI_ENABLE_MEDIA_POLL )
+        _USBHostMSDSCSI_MediaPoll();
+
+        if (pLUN->mediaChanged)
+        {
+            pLUN->mediaChanged = false;
+            return false;
+        }
+        if (pLUN->mediaState == MEDIA_STATE_NOT_READY)
+        {
+            return false;
+        }
+    #endif
+
+    return true;
 }
 
 
@@ -262,6 +623,7 @@ uint8_t USBHostMSDSCSIMediaDetect( uint8_t * address)
     This function performs the following SCSI commands:
                         * READ CAPACITY 10
                         * REQUEST SENSE
+                        * MODE SENSE 6
 
     The READ CAPACITY 10 command block is as follows:
 
@@ -299,14 +661,27 @@ FILEIO_MEDIA_INFORMATION * USBHostMSDSCSIMediaInitialize( uint8_t * address )
     uint8_t        commandBlock[10];
     uint8_t        errorCode;
     uint8_t        inquiryData[36];
+    USB_MSD_SCSI_LUN_INFO   *pLUN = _USBHostMSDSCSI_GetLUN( address );
 
     // Make sure the device is still attached.
     if (*address == 0)
     {
-        mediaInformation.errorCode = MEDIA_DEVICE_NOT_PRESENT;
-        return &mediaInformation;
+        pLUN->mediaInformation.errorCode = MEDIA_DEVICE_NOT_PRESENT;
+        return &pLUN->mediaInformation;
     }
 
+    // The application may pass its own copy of the device address for LUN 0.
+    pLUN->address = *address;
+
+    _USBHostMSDSCSI_MediaPollWait();
+
+    // The media may have changed, so discard the sectors held for this
+    // logical unit.
+    _USBHostMSDSCSI_DiscardSectors( pLUN );
+    #if defined( USB_MSD_SCSI_ENABLE_CACHE )
+        memset( &cacheStatistics, 0x00, sizeof(cacheStatistics) );
+    #endif
+
     attempts = INITIALIZATION_ATTEMPTS;
     while (attempts != 0)
     {
@@ -328,7 +703,7 @@ FILEIO_MEDIA_INFORMATION * USBHostMSDSCSIMediaInitialize( uint8_t * address )
         commandBlock[8] = 0;        //
         commandBlock[9] = 0x00;     // Control
 
-        errorCode = USBHostMSDRead( *address, 0, commandBlock, 10, inquiryData, 8 );
+        errorCode = USBHostMSDRead( *address, pLUN->lun, commandBlock, 10, inquiryData, 8 );
         #ifdef DEBUG_MODE
             UART2PutHex( errorCode ) ;
             UART2PutChar( ' ' );
@@ -358,11 +733,15 @@ FILEIO_MEDIA_INFORMATION * USBHostMSDSCSIMediaInitialize( uint8_t * address )
                 UART2PutChar( inquiryData[4] + '0' );
                 UART2PrintString( "\r\n" );
             #endif
-            mediaInformation.sectorSize                     = (inquiryData[7] << 12) + (inquiryData[6] << 8) + (inquiryData[5] << 4) + (inquiryData[4]);
-            mediaInformation.validityFlags.bits.sectorSize  = 1;
+            pLUN->mediaInformation.sectorSize                     = (inquiryData[7] << 12) + (inquiryData[6] << 8) + (inquiryData[5] << 4) + (inquiryData[4]);
+            pLUN->mediaInformation.validityFlags.bits.sectorSize  = 1;
+            pLUN->lastSector = ((uint32_t)inquiryData[0] << 24) | ((uint32_t)inquiryData[1] << 16) |
+                               ((uint32_t)inquiryData[2] << 8)  |  (uint32_t)inquiryData[3];
+
+            pLUN->writeProtected = _USBHostMSDSCSI_ModeSenseWriteProtect( address );
 
-            mediaInformation.errorCode = MEDIA_NO_ERROR;
-            return &mediaInformation;
+            pLUN->mediaInformation.errorCode = MEDIA_NO_ERROR;
+            return &pLUN->mediaInformation;
         }
         else
         {
@@ -379,7 +758,7 @@ FILEIO_MEDIA_INFORMATION * USBHostMSDSCSIMediaInitialize( uint8_t * address )
             commandBlock[4] = 18;       // Allocation length
             commandBlock[5] = 0;        // Control
 
-            errorCode = USBHostMSDRead( *address, 0, commandBlock, 6, inquiryData, 18 );
+            errorCode = USBHostMSDRead( *address, pLUN->lun, commandBlock, 6, inquiryData, 18 );
             #ifdef DEBUG_MODE
                 UART2PutHex( errorCode ) ;
                 UART2PutChar( ' ' );
@@ -413,7 +792,7 @@ FILEIO_MEDIA_INFORMATION * USBHostMSDSCSIMediaInitialize( uint8_t * address )
         commandBlock[4] = 18;       // Allocation length
         commandBlock[5] = 0;        // Control
 
-        errorCode = USBHostMSDRead( *address, 0, commandBlock, 6, inquiryData, 18 );
+        errorCode = USBHostMSDRead( *address, pLUN->lun, commandBlock, 6, inquiryData, 18 );
         #ifdef DEBUG_MODE
             UART2PutHex( errorCode ) ;
             UART2PutChar( ' ' );
@@ -444,7 +823,7 @@ FILEIO_MEDIA_INFORMATION * USBHostMSDSCSIMediaInitialize( uint8_t * address )
         commandBlock[4] = 18;       // Allocation length
         commandBlock[5] = 0;        // Control
 
-        errorCode = USBHostMSDRead( *address, 0, commandBlock, 6, inquiryData, 18 );
+        errorCode = USBHostMSDRead( *address, pLUN->lun, commandBlock, 6, inquiryData, 18 );
         #ifdef DEBUG_MODE
             UART2PutHex( errorCode ) ;
             UART2PutChar( ' ' );
@@ -474,7 +853,7 @@ FILEIO_MEDIA_INFORMATION * USBHostMSDSCSIMediaInitialize( uint8_t * address )
         commandBlock[8] = 0;        //
         commandBlock[9] = 0x00;     // Control
 
-        errorCode = USBHostMSDRead( *address, 0, commandBlock, 10, inquiryData, 8 );
+        errorCode = USBHostMSDRead( *address, pLUN->lun, commandBlock, 10, inquiryData, 8 );
         #ifdef DEBUG_MODE
             UART2PutHex( errorCode ) ;
             UART2PutChar( ' ' );
@@ -504,11 +883,15 @@ FILEIO_MEDIA_INFORMATION * USBHostMSDSCSIMediaInitialize( uint8_t * address )
                 UART2PutChar( inquiryData[4] + '0' );
                 UART2PrintString( "\r\n" );
             #endif
-            mediaInformation.sectorSize                     = (inquiryData[7] << 12) + (inquiryData[6] << 8) + (inquiryData[5] << 4) + (inquiryData[4]);
-            mediaInformation.validityFlags.bits.sectorSize  = 1;
+            pLUN->mediaInformation.sectorSize                     = (inquiryData[7] << 12) + (inquiryData[6] << 8) + (inquiryData[5] << 4) + (inquiryData[4]);
+            pLUN->mediaInformation.validityFlags.bits.sectorSize  = 1;
+            pLUN->lastSector = ((uint32_t)inquiryData[0] << 24) | ((uint32_t)inquiryData[1] << 16) |
+                               ((uint32_t)inquiryData[2] << 8)  |  (uint32_t)inquiryData[3];
 
-            mediaInformation.errorCode = MEDIA_NO_ERROR;
-            return &mediaInformation;
+            pLUN->writeProtected = _USBHostMSDSCSI_ModeSenseWriteProtect( address );
+
+            pLUN->mediaInformation.errorCode = MEDIA_NO_ERROR;
+            return &pLUN->mediaInformation;
         }
         else
         {
@@ -525,7 +908,7 @@ FILEIO_MEDIA_INFORMATION * USBHostMSDSCSIMediaInitialize( uint8_t * address )
             commandBlock[4] = 18;       // Allocation length
             commandBlock[5] = 0;        // Control
 
-            errorCode = USBHostMSDRead( *address, 0, commandBlock, 6, inquiryData, 18 );
+            errorCode = USBHostMSDRead( *address, pLUN->lun, commandBlock, 6, inquiryData, 18 );
             #ifdef DEBUG_MODE
                 UART2PutHex( errorCode ) ;
                 UART2PutChar( ' ' );
@@ -541,8 +924,8 @@ FILEIO_MEDIA_INFORMATION * USBHostMSDSCSIMediaInitialize( uint8_t * address )
         }
     }
 
-    mediaInformation.errorCode = MEDIA_CANNOT_INITIALIZE;
-    return &mediaInformation;
+    pLUN->mediaInformation.errorCode = MEDIA_CANNOT_INITIALIZE;
+    return &pLUN->mediaInformation;
 
 }
 
@@ -567,11 +950,16 @@ FILEIO_MEDIA_INFORMATION * USBHostMSDSCSIMediaInitialize( uint8_t * address )
     false - otherwise
 
   Remarks:
-    None
+    If the sector cache is enabled, its dirty sectors are written to the
+    media.
   ***************************************************************************/
 bool USBHostMSDSCSIMediaDeinitialize(void *mediaConfig)
 {
-    return true;
+    #if defined( USB_MSD_SCSI_ENABLE_CACHE )
+        return USBHostMSDSCSICacheFlush( (uint8_t *)mediaConfig );
+    #else
+        return true;
+    #endif
 }
 
 /****************************************************************************
@@ -606,6 +994,8 @@ uint8_t USBHostMSDSCSIMediaReset( uint8_t * address )
     uint32_t   byteCount;
     uint8_t    errorCode;
 
+    _USBHostMSDSCSI_MediaPollWait();
+
     errorCode = USBHostMSDResetDevice( *address );
     if (errorCode)
     {
@@ -619,12 +1009,18 @@ uint8_t USBHostMSDSCSIMediaReset( uint8_t * address )
     } while (errorCode == USB_MSD_RESETTING_DEVICE);
 
 
-    if (USBHostMSDTransferIsComplete( *address, &errorCode, &byteCount ))
+    if (!USBHostMSDTransferIsComplete( *address, &errorCode, &byteCount ))
     {
-        return errorCode;
+        errorCode = USB_MSD_RESET_ERROR;
     }
 
-    return USB_MSD_RESET_ERROR;
+    #if defined( USB_MSD_SCSI_ENABLE_ASYNC )
+        // The active requests were failed by the reset.  Start the ones that
+        // were still queued.
+        _USBHostMSDSCSI_AsyncStart();
+    #endif
+
+    return errorCode;
 }
 
 
@@ -671,56 +1067,89 @@ uint8_t USBHostMSDSCSIMediaReset( uint8_t * address )
 
 uint8_t USBHostMSDSCSISectorRead(uint8_t * address, uint32_t sectorAddress, uint8_t *dataBuffer )
 {
-    uint32_t   byteCount;
-    uint8_t    commandBlock[10];
-    uint8_t    errorCode;
-    uint8_t attempts = 5;
-
-    if (*address == 0)
-    {
-        return false;       // USB_MSD_DEVICE_NOT_FOUND;
-    }
-
-    while(attempts--)
-    {
-        // Fill in the command block with the READ10 parameters.
-        commandBlock[0] = 0x28;     // Operation code
-        commandBlock[1] = RDPROTECT_NORMAL | FUA_ALLOW_CACHE;
-        commandBlock[2] = (uint8_t) (sectorAddress >> 24);     // Big endian!
-        commandBlock[3] = (uint8_t) (sectorAddress >> 16);
-        commandBlock[4] = (uint8_t) (sectorAddress >> 8);
-        commandBlock[5] = (uint8_t) (sectorAddress);
-        commandBlock[6] = 0x00;     // Group Number
-        commandBlock[7] = 0x00;     // Number of blocks - Big endian!
-        commandBlock[8] = 0x01;
-        commandBlock[9] = 0x00;     // Control
+    #if defined( USB_MSD_SCSI_ENABLE_CACHE )
+        USB_MSD_SCSI_CACHE_ENTRY    *entry;
+        USB_MSD_SCSI_LUN_INFO   *pLUN = _USBHostMSDSCSI_GetLUN( address );
 
-        // Currently using LUN=0.  When the File System supports multiple LUN's, this will change.
-        errorCode = USBHostMSDRead( *address, 0, commandBlock, 10, dataBuffer, mediaInformation.sectorSize );
-
-        if (!errorCode)
+        if ((*address != 0) && _USBHostMSDSCSI_CacheUsable(pLUN))
         {
-            while (!USBHostMSDTransferIsComplete( *address, &errorCode, &byteCount ))
+            entry = _USBHostMSDSCSI_CacheFind( pLUN, sectorAddress );
+            if (entry != NULL)
             {
-                USBTasks();
+                cacheStatistics.readHits ++;
+            }
+            else
+            {
+                cacheStatistics.readMisses ++;
+                entry = _USBHostMSDSCSI_CacheAllocate( pLUN, sectorAddress );
+                if (entry == NULL)
+                {
+                    return false;
+                }
+                if (!_USBHostMSDSCSI_ReadSector( address, sectorAddress, entry->data ))
+                {
+                    return false;
+                }
+                entry->valid = true;
             }
+
+            entry->lastUsed = ++cacheUseCount;
+            memcpy( dataBuffer, entry->data, pLUN->mediaInformation.sectorSize );
+            return true;
         }
+    #endif
 
-        switch(errorCode)
-        {
-            case USB_MSD_COMMAND_FAILED:
-                USBHostMSDSCSIRequestSense(address);
-                break;
+    return _USBHostMSDSCSI_ReadSector( address, sectorAddress, dataBuffer );
+}
 
-            case USB_SUCCESS:
-                return true;
 
-            default:
-                return false;
-        }
+/****************************************************************************
+  Function:
+    uint8_t USBHostMSDSCSISectorReadMultiple( uint8_t * address,
+                uint32_t sectorAddress, uint16_t sectorCount, uint8_t *dataBuffer )
+
+  Summary:
+    This function reads several contiguous sectors.
+
+  Description:
+    This function uses the SCSI command READ10 to read sectorCount contiguous
+    sectors, starting at sectorAddress, into the application buffer.  Up to
+    USB_MSD_SCSI_MAX_TRANSFER_SECTORS sectors are requested with each
+    command, so a large read costs one CBW/CSW exchange per group of sectors
+    instead of one per sector.
+
+  Precondition:
+    USBHostMSDSCSIMediaInitialize() has determined the sector size.
+
+  Parameters:
+    uint8_t * address           - Endpoint address of the device
+    uint32_t   sectorAddress    - address of the first sector to read
+    uint16_t   sectorCount      - number of sectors to read
+    uint8_t    *dataBuffer      - buffer to store data; must hold
+                                  sectorCount sectors
+
+  Return Values:
+    true    - read performed successfully
+    false   - read was not successful
+
+  Remarks:
+    This function has the same form as USBHostMSDSCSISectorRead(), with the
+    sector count added, so it can be used as the multiple sector read
+    function of a media interface.
+  ***************************************************************************/
+
+uint8_t USBHostMSDSCSISectorReadMultiple(uint8_t * address, uint32_t sectorAddress, uint16_t sectorCount, uint8_t *dataBuffer )
+{
+    if (!_USBHostMSDSCSI_Read10( address, sectorAddress, sectorCount, dataBuffer ))
+    {
+        return false;
     }
 
-    return false;
+    #if defined( USB_MSD_SCSI_ENABLE_CACHE )
+        // Cached sectors that have not been written back are newer than the media.
+        _USBHostMSDSCSI_CacheOverlay( _USBHostMSDSCSI_GetLUN( address ), sectorAddress, sectorCount, dataBuffer );
+    #endif
+    return true;
 }
 
 static bool USBHostMSDSCSIRequestSense(uint8_t * address)
@@ -729,12 +1158,15 @@ static bool USBHostMSDSCSIRequestSense(uint8_t * address)
     uint8_t    commandBlock[10];
     uint8_t    errorCode;
     uint8_t buffer[18];
+    USB_MSD_SCSI_LUN_INFO   *pLUN = _USBHostMSDSCSI_GetLUN( address );
 
     if (*address == 0)
     {
         return false;       // USB_MSD_DEVICE_NOT_FOUND;
     }
 
+    _USBHostMSDSCSI_MediaPollWait();
+
     // Fill in the command block with the READ10 parameters.
     commandBlock[0] = 0x03;     // Request Sense
     commandBlock[1] = RDPROTECT_NORMAL | FUA_ALLOW_CACHE;
@@ -747,8 +1179,7 @@ static bool USBHostMSDSCSIRequestSense(uint8_t * address)
     commandBlock[8] = 0x00;
     commandBlock[9] = 0x00;     // Control
 
-    // Currently using LUN=0.  When the File System supports multiple LUN's, this will change.
-    errorCode = USBHostMSDRead( *address, 0, commandBlock, 10, buffer, 18 );
+    errorCode = USBHostMSDRead( *address, pLUN->lun, commandBlock, 10, buffer, 18 );
 
     if (!errorCode)
     {
@@ -814,89 +1245,552 @@ static bool USBHostMSDSCSIRequestSense(uint8_t * address)
 
 uint8_t USBHostMSDSCSISectorWrite(uint8_t * address, uint32_t sectorAddress, uint8_t *dataBuffer, uint8_t allowWriteToZero )
 {
-    uint32_t   byteCount;
-    uint8_t    commandBlock[10];
-    uint8_t    errorCode;
-    uint8_t attempts = 5;
-
-    if (*address == 0)
-    {
-        return false;   //USB_MSD_DEVICE_NOT_FOUND;
-    }
-
-    if ((sectorAddress == 0) && (allowWriteToZero == false))
-    {
-        return false;
-    }
-
-    while(attempts--)
-    {
-        // Fill in the command block with the WRITE 10 parameters.
-        commandBlock[0] = 0x2A;     // Operation code
-        commandBlock[1] = WRPROTECT_NORMAL | FUA_ALLOW_CACHE;
-        commandBlock[2] = (uint8_t) (sectorAddress >> 24);     // Big endian!
-        commandBlock[3] = (uint8_t) (sectorAddress >> 16);
-        commandBlock[4] = (uint8_t) (sectorAddress >> 8);
-        commandBlock[5] = (uint8_t) (sectorAddress);
-        commandBlock[6] = 0x00;     // Group Number
-        commandBlock[7] = 0x00;     // Number of blocks - Big endian!
-        commandBlock[8] = 0x01;
-        commandBlock[9] = 0x00;     // Control
-
-        // Currently using LUN=0.  When the File System supports multiple LUN's, this will change.
-        errorCode = USBHostMSDWrite( *address, 0, commandBlock, 10, dataBuffer, mediaInformation.sectorSize );
+    #if defined( USB_MSD_SCSI_ENABLE_CACHE )
+        USB_MSD_SCSI_CACHE_ENTRY    *entry;
+        USB_MSD_SCSI_LUN_INFO   *pLUN = _USBHostMSDSCSI_GetLUN( address );
 
-        if (!errorCode)
+        if ((*address != 0) && _USBHostMSDSCSI_CacheUsable(pLUN))
         {
-            while (!USBHostMSDTransferIsComplete( *address, &errorCode, &byteCount ))
+            entry = _USBHostMSDSCSI_CacheFind( pLUN, sectorAddress );
+            if (entry != NULL)
             {
-                USBTasks();
+                cacheStatistics.writeHits ++;
+            }
+            else
+            {
+                cacheStatistics.writeMisses ++;
             }
-        }
 
-        switch(errorCode)
-        {
-            case USB_MSD_COMMAND_FAILED:
-                USBHostMSDSCSIRequestSense(address);
-                break;
+            #if defined( USB_MSD_SCSI_CACHE_WRITE_BACK )
+                if ((sectorAddress == 0) && (allowWriteToZero == false))
+                {
+                    return false;
+                }
 
-            case USB_SUCCESS:
-                return true;
+                // Keep the sector in the cache.  It is written when it is evicted or flushed.
+                if (entry == NULL)
+                {
+                    entry = _USBHostMSDSCSI_CacheAllocate( pLUN, sectorAddress );
+                    if (entry == NULL)
+                    {
+                        return false;
+                    }
+                }
 
-            default:
-                return false;
+                memcpy( entry->data, dataBuffer, pLUN->mediaInformation.sectorSize );
+                entry->valid    = true;
+                entry->dirty    = true;
+                entry->lastUsed = ++cacheUseCount;
+                return true;
+            #endif
         }
-    }
+    #endif
 
-    return false;
+    return USBHostMSDSCSISectorWriteMultiple( address, sectorAddress, 1, dataBuffer, allowWriteToZero );
 }
 
 
 /****************************************************************************
   Function:
-    uint8_t USBHostMSDSCSIWriteProtectState( void )
+    uint8_t USBHostMSDSCSISectorWriteMultiple( uint8_t * address,
+                uint32_t sectorAddress, uint16_t sectorCount, uint8_t *dataBuffer,
+                uint8_t allowWriteToZero )
+
+  Summary:
+    This function writes several contiguous sectors.
 
   Description:
-    This function returns the write protect status of the device.
+    This function uses the SCSI command WRITE10 to write sectorCount
+    contiguous sectors, starting at sectorAddress, from the application
+    buffer.  Up to USB_MSD_SCSI_MAX_TRANSFER_SECTORS sectors are sent with
+    each command.
 
   Precondition:
-    None
+    USBHostMSDSCSIMediaInitialize() has determined the sector size.
 
   Parameters:
-    None - None
+    uint8_t * address           - Endpoint address of the device
+    uint32_t   sectorAddress    - address of the first sector to write
+    uint16_t   sectorCount      - number of sectors to write
+    uint8_t    *dataBuffer      - buffer with application data
+    uint8_t    allowWriteToZero - If a write to sector 0 is allowed.
 
   Return Values:
-    0 - not write protected
-
+    true    - write performed successfully
+    false   - write was not successful
 
   Remarks:
-    None
+    To follow convention, this function blocks until the write is complete.
+    If the write fails part way, some of the sectors may have been written.
   ***************************************************************************/
 
-uint8_t    USBHostMSDSCSIWriteProtectState( uint8_t * address)
+uint8_t USBHostMSDSCSISectorWriteMultiple(uint8_t * address, uint32_t sectorAddress, uint16_t sectorCount, uint8_t *dataBuffer, uint8_t allowWriteToZero )
 {
-    return 0;
-}
+    if ((sectorAddress == 0) && (sectorCount != 0) && (allowWriteToZero == false))
+    {
+        return false;
+    }
+
+    if (!_USBHostMSDSCSI_Write10( address, sectorAddress, sectorCount, dataBuffer ))
+    {
+        return false;
+    }
+
+    #if defined( USB_MSD_SCSI_ENABLE_CACHE )
+        _USBHostMSDSCSI_CacheUpdate( _USBHostMSDSCSI_GetLUN( address ), sectorAddress, sectorCount, dataBuffer );
+    #endif
+    return true;
+}
+
+
+/****************************************************************************
+  Function:
+    uint8_t USBHostMSDSCSIWriteProtectState( void )
+
+  Description:
+    This function returns the write protect status of the device.
+
+  Precondition:
+    None
+
+  Parameters:
+    None - None
+
+  Return Values:
+    0 - not write protected
+    1 - write protected
+
+  Remarks:
+    The state is read with MODE SENSE 6 by USBHostMSDSCSIMediaInitialize().
+  ***************************************************************************/
+
+uint8_t    USBHostMSDSCSIWriteProtectState( uint8_t * address)
+{
+    return _USBHostMSDSCSI_GetLUN( address )->writeProtected;
+}
+
+
+/****************************************************************************
+  Function:
+    uint8_t * USBHostMSDSCSIGetLUNHandle( uint8_t lun )
+
+  Description:
+    This function returns the media handle of a logical unit of the
+    attached device.
+
+  Precondition:
+    The device has reported its maximum LUN with GET MAX LUN.
+
+  Parameters:
+    uint8_t lun - Logical Unit Number
+
+  Returns:
+    The media handle of the logical unit, or NULL if the logical unit is not
+    present.
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+uint8_t * USBHostMSDSCSIGetLUNHandle( uint8_t lun )
+{
+    if ((lun >= USB_MSD_SCSI_MAX_LUNS) || (lunInfo[lun].address == 0))
+    {
+        return NULL;
+    }
+
+    return &lunInfo[lun].address;
+}
+
+
+#if defined( USB_MSD_SCSI_ENABLE_CACHE )
+
+/****************************************************************************
+  Function:
+    bool USBHostMSDSCSICacheFlush( uint8_t * address )
+
+  Summary:
+    This function writes the dirty sectors of the sector cache to the media.
+
+  Description:
+    This function writes every sector of the sector cache that has been
+    written by the application but not yet by the media.  The sectors stay
+    in the cache.  It is called by USBHostMSDSCSIMediaDeinitialize().
+
+  Precondition:
+    None
+
+  Parameters:
+    uint8_t * address - Endpoint address of the device
+
+  Return Values:
+    true    - All dirty sectors were written
+    false   - A sector could not be written
+
+  Remarks:
+    Without USB_MSD_SCSI_CACHE_WRITE_BACK, the cache never holds dirty
+    sectors.  Dirty sectors are lost if the device is detached.
+  ***************************************************************************/
+
+bool USBHostMSDSCSICacheFlush( uint8_t * address )
+{
+    uint8_t     i;
+    bool        result;
+    USB_MSD_SCSI_LUN_INFO   *pLUN = _USBHostMSDSCSI_GetLUN( address );
+
+    result = true;
+    for (i=0; i<USB_MSD_SCSI_CACHE_SECTORS; i++)
+    {
+        if (cache[i].valid && cache[i].dirty && (cache[i].pLUN == pLUN))
+        {
+            if (_USBHostMSDSCSI_Write10( address, cache[i].sectorAddress, 1, cache[i].data ))
+            {
+                cache[i].dirty = false;
+                cacheStatistics.writeBacks ++;
+            }
+            else
+            {
+                result = false;
+            }
+        }
+    }
+
+    return result;
+}
+
+
+/****************************************************************************
+  Function:
+    void USBHostMSDSCSICacheGetStatistics( USB_MSD_SCSI_CACHE_STATISTICS *pStatistics )
+
+  Summary:
+    This function returns the counters of the sector cache.
+
+  Description:
+    This function copies the counters of the sector cache.
+
+  Precondition:
+    None
+
+  Parameters:
+    USB_MSD_SCSI_CACHE_STATISTICS *pStatistics - Where to store the counters
+
+  Returns:
+    None
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+void USBHostMSDSCSICacheGetStatistics( USB_MSD_SCSI_CACHE_STATISTICS *pStatistics )
+{
+    *pStatistics = cacheStatistics;
+}
+
+#endif
+
+
+#if defined( USB_MSD_SCSI_ENABLE_ASYNC )
+
+/****************************************************************************
+  Function:
+    uint8_t USBHostMSDSCSIAsyncSectorRead( uint8_t * address,
+                uint32_t sectorAddress, uint16_t sectorCount, uint8_t *dataBuffer,
+                USB_MSD_SCSI_ASYNC_CALLBACK callback )
+
+  Summary:
+    This function queues a READ10 of several contiguous sectors.
+
+  Description:
+    This function queues a READ10 of sectorCount contiguous sectors,
+    starting at sectorAddress, and returns without waiting.  The request is
+    performed by USBHostMSDTasks().  When it completes, the callback is
+    called, or, if callback is NULL, USBHostMSDSCSIAsyncIsComplete() reports
+    the result.
+
+  Precondition:
+    USBHostMSDSCSIMediaInitialize() has determined the sector size.
+
+  Parameters:
+    uint8_t * address                       - Endpoint address of the device
+    uint32_t sectorAddress                  - address of the first sector
+    uint16_t sectorCount                    - number of sectors, 1 to
+                                              USB_MSD_SCSI_MAX_TRANSFER_SECTORS,
+                                              and at most 0xFFFF bytes
+    uint8_t *dataBuffer                     - buffer to store data; must stay
+                                              valid until the request completes
+    USB_MSD_SCSI_ASYNC_CALLBACK callback    - completion function, or NULL
+
+  Returns:
+    The handle of the request, or USB_MSD_SCSI_ASYNC_INVALID_HANDLE if the
+    device is not attached, the sector count is not valid, or the queue is
+    full.
+
+  Remarks:
+    The blocking functions of this layer should not be called while
+    asynchronous requests are outstanding.
+  ***************************************************************************/
+
+uint8_t USBHostMSDSCSIAsyncSectorRead( uint8_t * address, uint32_t sectorAddress, uint16_t sectorCount, uint8_t *dataBuffer, USB_MSD_SCSI_ASYNC_CALLBACK callback )
+{
+    uint8_t    commandBlock[10];
+
+    if ((sectorCount == 0) || (sectorCount > USB_MSD_SCSI_MAX_TRANSFER_SECTORS) ||
+        !_USBHostMSDSCSI_TransferFits( _USBHostMSDSCSI_GetLUN( address ), sectorCount ))
+    {
+        return USB_MSD_SCSI_ASYNC_INVALID_HANDLE;
+    }
+
+    // Fill in the command block with the READ10 parameters.
+    commandBlock[0] = 0x28;     // Operation code
+    commandBlock[1] = RDPROTECT_NORMAL | FUA_ALLOW_CACHE;
+    commandBlock[2] = (uint8_t) (sectorAddress >> 24);     // Big endian!
+    commandBlock[3] = (uint8_t) (sectorAddress >> 16);
+    commandBlock[4] = (uint8_t) (sectorAddress >> 8);
+    commandBlock[5] = (uint8_t) (sectorAddress);
+    commandBlock[6] = 0x00;     // Group Number
+    commandBlock[7] = (uint8_t) (sectorCount >> 8);     // Number of blocks - Big endian!
+    commandBlock[8] = (uint8_t) (sectorCount);
+    commandBlock[9] = 0x00;     // Control
+
+    return _USBHostMSDSCSI_AsyncSubmit( address, 1, commandBlock, 10, dataBuffer, (uint32_t)sectorCount * _USBHostMSDSCSI_GetLUN( address )->mediaInformation.sectorSize, callback );
+}
+
+
+/****************************************************************************
+  Function:
+    uint8_t USBHostMSDSCSIAsyncSectorWrite( uint8_t * address,
+                uint32_t sectorAddress, uint16_t sectorCount, uint8_t *dataBuffer,
+                uint8_t allowWriteToZero, USB_MSD_SCSI_ASYNC_CALLBACK callback )
+
+  Summary:
+    This function queues a WRITE10 of several contiguous sectors.
+
+  Description:
+    This function queues a WRITE10 of sectorCount contiguous sectors,
+    starting at sectorAddress, and returns without waiting.  The request is
+    performed by USBHostMSDTasks().  When it completes, the callback is
+    called, or, if callback is NULL, USBHostMSDSCSIAsyncIsComplete() reports
+    the result.
+
+  Precondition:
+    USBHostMSDSCSIMediaInitialize() has determined the sector size.
+
+  Parameters:
+    uint8_t * address                       - Endpoint address of the device
+    uint32_t sectorAddress                  - address of the first sector
+    uint16_t sectorCount                    - number of sectors, 1 to
+                                              USB_MSD_SCSI_MAX_TRANSFER_SECTORS,
+                                              and at most 0xFFFF bytes
+    uint8_t *dataBuffer                     - buffer with application data;
+                                              must stay valid until the
+                                              request completes
+    uint8_t allowWriteToZero                - If a write to sector 0 is allowed.
+    USB_MSD_SCSI_ASYNC_CALLBACK callback    - completion function, or NULL
+
+  Returns:
+    The handle of the request, or USB_MSD_SCSI_ASYNC_INVALID_HANDLE if the
+    request is not valid or the queue is full.
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+uint8_t USBHostMSDSCSIAsyncSectorWrite( uint8_t * address, uint32_t sectorAddress, uint16_t sectorCount, uint8_t *dataBuffer, uint8_t allowWriteToZero, USB_MSD_SCSI_ASYNC_CALLBACK callback )
+{
+    uint8_t    commandBlock[10];
+
+    if ((sectorCount == 0) || (sectorCount > USB_MSD_SCSI_MAX_TRANSFER_SECTORS) ||
+        !_USBHostMSDSCSI_TransferFits( _USBHostMSDSCSI_GetLUN( address ), sectorCount ))
+    {
+        return USB_MSD_SCSI_ASYNC_INVALID_HANDLE;
+    }
+
+    if ((sectorAddress == 0) && (allowWriteToZero == false))
+    {
+        return USB_MSD_SCSI_ASYNC_INVALID_HANDLE;
+    }
+
+    // Fill in the command block with the WRITE 10 parameters.
+    commandBlock[0] = 0x2A;     // Operation code
+    commandBlock[1] = WRPROTECT_NORMAL | FUA_ALLOW_CACHE;
+    commandBlock[2] = (uint8_t) (sectorAddress >> 24);     // Big endian!
+    commandBlock[3] = (uint8_t) (sectorAddress >> 16);
+    commandBlock[4] = (uint8_t) (sectorAddress >> 8);
+    commandBlock[5] = (uint8_t) (sectorAddress);
+    commandBlock[6] = 0x00;     // Group Number
+    commandBlock[7] = (uint8_t) (sectorCount >> 8);     // Number of blocks - Big endian!
+    commandBlock[8] = (uint8_t) (sectorCount);
+    commandBlock[9] = 0x00;     // Control
+
+    #if defined( USB_MSD_SCSI_ENABLE_CACHE )
+        // The cached copies of these sectors are superseded by this write.
+        _USBHostMSDSCSI_CacheInvalidate( _USBHostMSDSCSI_GetLUN( address ), sectorAddress, sectorCount );
+    #endif
+    #if defined( USB_MSD_SCSI_ENABLE_READ_AHEAD )
+        _USBHostMSDSCSI_ReadAheadInvalidate( _USBHostMSDSCSI_GetLUN( address ), sectorAddress, sectorCount );
+    #endif
+
+    return _USBHostMSDSCSI_AsyncSubmit( address, 0, commandBlock, 10, dataBuffer, (uint32_t)sectorCount * _USBHostMSDSCSI_GetLUN( address )->mediaInformation.sectorSize, callback );
+}
+
+
+/****************************************************************************
+  Function:
+    uint8_t USBHostMSDSCSIAsyncInquiry( uint8_t * address,
+                uint8_t *inquiryData, USB_MSD_SCSI_ASYNC_CALLBACK callback )
+
+  Summary:
+    This function queues an INQUIRY command.
+
+  Description:
+    This function queues an INQUIRY command that returns the 36 bytes of
+    standard inquiry data, and returns without waiting.
+
+  Precondition:
+    None
+
+  Parameters:
+    uint8_t * address                       - Endpoint address of the device
+    uint8_t *inquiryData                    - 36 byte buffer for the data
+    USB_MSD_SCSI_ASYNC_CALLBACK callback    - completion function, or NULL
+
+  Returns:
+    The handle of the request, or USB_MSD_SCSI_ASYNC_INVALID_HANDLE if the
+    device is not attached or the queue is full.
+
+  Remarks:
+    The INQUIRY command block is as follows:
+
+    <code>
+        Byte/Bit    7       6       5       4       3       2       1       0
+           0                    Operation Code (0x12)
+           1        [                      Reserved                 ] [ EVPD]
+           2        [                      Page Code                        ]
+           3        [ (MSB)         Allocation Length
+           4                                                          (LSB) ]
+           5        [                    Control                            ]
+    </code>
+  ***************************************************************************/
+
+uint8_t USBHostMSDSCSIAsyncInquiry( uint8_t * address, uint8_t *inquiryData, USB_MSD_SCSI_ASYNC_CALLBACK callback )
+{
+    uint8_t    commandBlock[6];
+
+    // Fill in the command block with the INQUIRY parameters.
+    commandBlock[0] = 0x12;     // Operation Code
+    commandBlock[1] = 0;        // Standard inquiry data
+    commandBlock[2] = 0;        // Page code
+    commandBlock[3] = 0;        // Allocation length - Big endian!
+    commandBlock[4] = 36;
+    commandBlock[5] = 0x00;     // Control
+
+    return _USBHostMSDSCSI_AsyncSubmit( address, 1, commandBlock, 6, inquiryData, 36, callback );
+}
+
+
+/****************************************************************************
+  Function:
+    uint8_t USBHostMSDSCSIAsyncTestUnitReady( uint8_t * address,
+                USB_MSD_SCSI_ASYNC_CALLBACK callback )
+
+  Summary:
+    This function queues a TEST UNIT READY command.
+
+  Description:
+    This function queues a TEST UNIT READY command, and returns without
+    waiting.  The request completes with USB_SUCCESS if the unit is ready.
+
+  Precondition:
+    None
+
+  Parameters:
+    uint8_t * address                       - Endpoint address of the device
+    USB_MSD_SCSI_ASYNC_CALLBACK callback    - completion function, or NULL
+
+  Returns:
+    The handle of the request, or USB_MSD_SCSI_ASYNC_INVALID_HANDLE if the
+    device is not attached or the queue is full.
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+uint8_t USBHostMSDSCSIAsyncTestUnitReady( uint8_t * address, USB_MSD_SCSI_ASYNC_CALLBACK callback )
+{
+    uint8_t    commandBlock[6];
+
+    // Fill in the command block with the TEST UNIT READY parameters.
+    commandBlock[0] = 0x00;     // Operation Code
+    commandBlock[1] = 0;        // Reserved
+    commandBlock[2] = 0;        // Reserved
+    commandBlock[3] = 0;        // Reserved
+    commandBlock[4] = 0;        // Reserved
+    commandBlock[5] = 0x00;     // Control
+
+    return _USBHostMSDSCSI_AsyncSubmit( address, 1, commandBlock, 6, NULL, 0, callback );
+}
+
+
+/****************************************************************************
+  Function:
+    bool USBHostMSDSCSIAsyncIsComplete( uint8_t handle, uint8_t *errorCode,
+                uint32_t *byteCount )
+
+  Summary:
+    This function indicates whether or not an asynchronous request is
+    complete.
+
+  Description:
+    This function indicates whether or not an asynchronous request that was
+    submitted without a callback is complete.  When it returns true, the
+    error code and byte count are valid and the handle is released.
+
+  Precondition:
+    None
+
+  Parameters:
+    uint8_t handle      - Handle returned when the request was submitted
+    uint8_t *errorCode  - Error code of the request
+    uint32_t *byteCount - Number of data bytes transferred
+
+  Return Values:
+    true    - Request is complete, or the handle is not valid
+              (errorCode is USB_MSD_ILLEGAL_REQUEST)
+    false   - Request is not complete
+
+  Remarks:
+    If a callback was given, the handle is released after the callback
+    returns, and this function must not be used.
+  ***************************************************************************/
+
+bool USBHostMSDSCSIAsyncIsComplete( uint8_t handle, uint8_t *errorCode, uint32_t *byteCount )
+{
+    USB_MSD_SCSI_ASYNC_REQUEST  *request;
+
+    if ((handle == USB_MSD_SCSI_ASYNC_INVALID_HANDLE) || (handle > USB_MSD_SCSI_ASYNC_QUEUE_SIZE) ||
+        (asyncRequest[handle-1].state == ASYNC_FREE))
+    {
+        *errorCode = USB_MSD_ILLEGAL_REQUEST;
+        *byteCount = 0;
+        return true;
+    }
+
+    request = &asyncRequest[handle-1];
+    if (request->state == ASYNC_DONE)
+    {
+        *errorCode      = request->errorCode;
+        *byteCount      = request->byteCount;
+        request->state  = ASYNC_FREE;
+        return true;
+    }
+
+    // The request may be waiting for a transfer that was started elsewhere.
+    _USBHostMSDSCSI_AsyncStart();
+    return false;
+}
+
+#endif
 
 
 // *****************************************************************************
@@ -905,89 +1799,1366 @@ uint8_t    USBHostMSDSCSIWriteProtectState( uint8_t * address)
 // *****************************************************************************
 // *****************************************************************************
 
+/*******************************************************************************
+  Function:
+    USB_MSD_SCSI_LUN_INFO * _USBHostMSDSCSI_GetLUN( uint8_t * address )
+
+  Precondition:
+    None
+
+  Overview:
+    This function finds the logical unit addressed by a media handle.
+
+  Parameters:
+    uint8_t * address   - Media handle, or pointer to the device address
+
+  Returns:
+    The information of the logical unit.
+
+  Remarks:
+    A pointer that is not a handle returned by USBHostMSDSCSIGetLUNHandle()
+    addresses LUN 0, so applications written for a single LUN keep working.
+  ***************************************************************************/
+
+static USB_MSD_SCSI_LUN_INFO * _USBHostMSDSCSI_GetLUN( uint8_t * address )
+{
+    uint8_t     i;
+
+    for (i=1; i<USB_MSD_SCSI_MAX_LUNS; i++)
+    {
+        if (address == &lunInfo[i].address)
+        {
+            return &lunInfo[i];
+        }
+    }
+
+    return &lunInfo[0];
+}
+
+
+#if defined( USB_MSD_SCSI_USE_UAS )
+/*******************************************************************************
+  Function:
+    const USB_MSD_SCSI_TRANSPORT * _USBHostMSDSCSI_GetTransport( uint8_t address )
+
+  Precondition:
+    None
+
+  Overview:
+    This function finds the client driver that performs the commands of a
+    device.
+
+  Parameters:
+    uint8_t address     - Address of the device
+
+  Returns:
+    The functions of the UAS driver if it attached the media of the device,
+    otherwise the functions of the bulk-only driver.
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+static const USB_MSD_SCSI_TRANSPORT * _USBHostMSDSCSI_GetTransport( uint8_t address )
+{
+    if ((lunInfo[0].address == address) && (lunInfo[0].transport != NULL))
+    {
+        return lunInfo[0].transport;
+    }
+
+    return &transportBOT;
+}
+#endif
+
+
+/*******************************************************************************
+  Function:
+    void _USBHostMSDSCSI_DiscardSectors( USB_MSD_SCSI_LUN_INFO *pLUN )
+
+  Precondition:
+    None
+
+  Overview:
+    This function discards the cached and read ahead sectors of a logical
+    unit, including cached sectors that have not been written back.
+
+  Parameters:
+    USB_MSD_SCSI_LUN_INFO *pLUN - Logical unit
+
+  Returns:
+    None
+
+  Remarks:
+    This function is called when the media may have changed.
+  ***************************************************************************/
+
+static void _USBHostMSDSCSI_DiscardSectors( USB_MSD_SCSI_LUN_INFO *pLUN )
+{
+    #if defined( USB_MSD_SCSI_ENABLE_CACHE )
+        uint8_t i;
+
+        for (i=0; i<USB_MSD_SCSI_CACHE_SECTORS; i++)
+        {
+            if (cache[i].pLUN == pLUN)
+            {
+                memset( &cache[i], 0x00, sizeof(USB_MSD_SCSI_CACHE_ENTRY) );
+            }
+        }
+    #endif
+    #if defined( USB_MSD_SCSI_ENABLE_READ_AHEAD )
+        if (readAheadLUN == pLUN)
+        {
+            readAheadCount  = 0;
+            readAheadRun    = 0;
+        }
+    #endif
+}
+
+
+/*******************************************************************************
+  Function:
+    bool _USBHostMSDSCSI_ModeSenseWriteProtect( uint8_t * address )
+
+  Precondition:
+    None
+
+  Overview:
+    This function reads the mode parameter header of a logical unit with
+    MODE SENSE 6, and returns its write protect bit.
+
+  Parameters:
+    uint8_t * address   - Media handle of the logical unit
+
+  Return Values:
+    true    - The media is write protected
+    false   - The media is not write protected, or the command failed
+
+  Remarks:
+    Many devices do not support MODE SENSE, so a failure is not treated as
+    an error.  The MODE SENSE 6 command block is as follows:
+
+    <code>
+        Byte/Bit    7       6       5       4       3       2       1       0
+           0                    Operation Code (0x1A)
+           1        [       Reserved        ] [ DBD ] [      Reserved       ]
+           2        [   PC   ] [               Page Code                    ]
+           3        [                    Subpage Code                       ]
+           4        [                  Allocation Length                    ]
+           5        [                    Control                            ]
+    </code>
+  ***************************************************************************/
+
+static bool _USBHostMSDSCSI_ModeSenseWriteProtect( uint8_t * address )
+{
+    uint32_t       byteCount;
+    uint8_t        commandBlock[6];
+    uint8_t        errorCode;
+    uint8_t        modeData[4];
+    USB_MSD_SCSI_LUN_INFO   *pLUN = _USBHostMSDSCSI_GetLUN( address );
+
+    // Fill in the command block with the MODE SENSE 6 parameters.
+    commandBlock[0] = 0x1A;     // Operation Code
+    commandBlock[1] = 0;        //
+    commandBlock[2] = 0x3F;     // All pages
+    commandBlock[3] = 0;        //
+    commandBlock[4] = 4;        // Allocation length, the mode parameter header only
+    commandBlock[5] = 0;        // Control
+
+    errorCode = USBHostMSDRead( *address, pLUN->lun, commandBlock, 6, modeData, 4 );
+    if (!errorCode)
+    {
+        while (!USBHostMSDTransferIsComplete( *address, &errorCode, &byteCount ))
+        {
+            USBTasks();
+        }
+    }
+
+    if (errorCode)
+    {
+        // Clear the CHECK CONDITION.
+        USBHostMSDSCSIRequestSense( address );
+        return false;
+    }
+
+    // The WP bit is bit 7 of the device-specific parameter.
+    return ((modeData[2] & 0x80) != 0);
+}
+
+
+
+/*******************************************************************************
+  Function:
+    bool _USBHostMSDSCSI_TestUnitReady( void )
+
+  Precondition:
+    None
+
+  Overview:
+    This function sends the TEST UNIT READY SCSI command
+
+  Parameters:
+    None - None
+
+  Return Values:
+    true    - Command completed without error
+    false   - Error while performing command
+
+  Remarks:
+    The format of the TEST UNIT READY command is as follows:
+
+    <code>
+        Byte/Bit    7       6       5       4       3       2       1       0
+           0                    Operation Code (0x00)
+           1        [
+           2                               Reserved
+           3
+           4                                                                ]
+           5        [                    Control                            ]
+    </code>
+  ***************************************************************************/
+
+#ifdef PERFORM_TEST_UNIT_READY
+bool _USBHostMSDSCSI_TestUnitReady( uint8_t * address)
+{
+    uint32_t       byteCount;
+    uint8_t        commandBlock[10];
+    uint8_t        errorCode;
+    uint8_t        inquiryData[36];
+    uint8_t        unitReadyCount;
+    USB_MSD_SCSI_LUN_INFO   *pLUN = _USBHostMSDSCSI_GetLUN( address );
+
+    // Issue a TEST UNIT READY
+    #ifdef DEBUG_MODE
+        UART2PrintString( "SCSI: TEST UNIT READY..." );
+    #endif
+
+    unitReadyCount = 0;
+    while (unitReadyCount < 5)
+    {
+        unitReadyCount ++;
+
+        // Fill in the command block with the TEST UNIT READY parameters.
+        commandBlock[0] = 0x00;     // Operation Code
+        commandBlock[1] = 0;        // Reserved
+        commandBlock[2] = 0;        // Reserved
+        commandBlock[3] = 0;        // Reserved
+        commandBlock[4] = 0;        // Reserved
+        commandBlock[5] = 0x00;     // Control
+
+        errorCode = USBHostMSDRead( *address, pLUN->lun, commandBlock, 6, inquiryData, 0 );
+        #ifdef DEBUG_MODE
+            UART2PutHex( errorCode ) ;
+            UART2PutChar( ' ' );
+        #endif
+
+        if (!errorCode)
+        {
+            while (!USBHostMSDTransferIsComplete( *address, &errorCode, &byteCount ))
+            {
+                USBTasks();
+            }
+        }
+        #ifdef DEBUG_MODE
+            UART2PutHex( errorCode ) ;
+            UART2PrintString( "\r\n" );
+        #endif
+        if (!errorCode)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+#endif
+
+
+/*******************************************************************************
+  Function:
+    bool _USBHostMSDSCSI_Read10( uint8_t * address, uint32_t sectorAddress,
+                uint16_t sectorCount, uint8_t *dataBuffer )
+
+  Precondition:
+    None
+
+  Overview:
+    This function reads sectorCount contiguous sectors from the media with
+    READ10, using one command per USB_MSD_SCSI_MAX_TRANSFER_SECTORS sectors.
+    A command that fails is retried after REQUEST SENSE.
+
+  Parameters:
+    uint8_t * address       - Endpoint address of the device
+    uint32_t sectorAddress  - address of the first sector to read
+    uint16_t sectorCount    - number of sectors to read
+    uint8_t *dataBuffer     - buffer to store data
+
+  Return Values:
+    true    - read performed successfully
+    false   - read was not successful
+
+  Remarks:
+    The sector cache is not used.
+  ***************************************************************************/
+
+static bool _USBHostMSDSCSI_Read10( uint8_t * address, uint32_t sectorAddress, uint16_t sectorCount, uint8_t *dataBuffer )
+{
+    uint32_t   byteCount;
+    uint8_t    commandBlock[10];
+    uint8_t    errorCode;
+    uint8_t    attempts;
+    uint16_t   blocks;
+    USB_MSD_SCSI_LUN_INFO   *pLUN = _USBHostMSDSCSI_GetLUN( address );
+
+    if (*address == 0)
+    {
+        return false;       // USB_MSD_DEVICE_NOT_FOUND;
+    }
+
+    // The sector size comes from READ CAPACITY, so it is 0 until the media
+    // has been initialized.  The transfer split below divides by it.
+    if (pLUN->mediaInformation.sectorSize == 0)
+    {
+        return false;
+    }
+
+    _USBHostMSDSCSI_MediaPollWait();
+
+    while (sectorCount != 0)
+    {
+        blocks = sectorCount;
+        if (blocks > USB_MSD_SCSI_MAX_TRANSFER_SECTORS)
+        {
+            blocks = USB_MSD_SCSI_MAX_TRANSFER_SECTORS;
+        }
+        if (!_USBHostMSDSCSI_TransferFits( pLUN, blocks ))
+        {
+            blocks = 0xFFFF / pLUN->mediaInformation.sectorSize;
+        }
+
+        attempts = 5;
+        do
+        {
+            if (attempts-- == 0)
+            {
+                return false;
+            }
+
+            // Fill in the command block with the READ10 parameters.
+            commandBlock[0] = 0x28;     // Operation code
+            commandBlock[1] = RDPROTECT_NORMAL | FUA_ALLOW_CACHE;
+            commandBlock[2] = (uint8_t) (sectorAddress >> 24);     // Big endian!
+            commandBlock[3] = (uint8_t) (sectorAddress >> 16);
+            commandBlock[4] = (uint8_t) (sectorAddress >> 8);
+            commandBlock[5] = (uint8_t) (sectorAddress);
+            commandBlock[6] = 0x00;     // Group Number
+            commandBlock[7] = (uint8_t) (blocks >> 8);     // Number of blocks - Big endian!
+            commandBlock[8] = (uint8_t) (blocks);
+            commandBlock[9] = 0x00;     // Control
+
+            errorCode = USBHostMSDRead( *address, pLUN->lun, commandBlock, 10, dataBuffer, (uint32_t)blocks * pLUN->mediaInformation.sectorSize );
+
+            if (!errorCode)
+            {
+                while (!USBHostMSDTransferIsComplete( *address, &errorCode, &byteCount ))
+                {
+                    USBTasks();
+                }
+            }
+
+            switch(errorCode)
+            {
+                case USB_MSD_COMMAND_FAILED:
+                    USBHostMSDSCSIRequestSense(address);
+                    break;
+
+                case USB_SUCCESS:
+                    break;
+
+                default:
+                    return false;
+            }
+        } while (errorCode != USB_SUCCESS);
+
+        sectorAddress += blocks;
+        sectorCount   -= blocks;
+        dataBuffer    += (uint32_t)blocks * pLUN->mediaInformation.sectorSize;
+    }
+
+    return true;
+}
+
+
+/*******************************************************************************
+  Function:
+    bool _USBHostMSDSCSI_Write10( uint8_t * address, uint32_t sectorAddress,
+                uint16_t sectorCount, uint8_t *dataBuffer )
+
+  Precondition:
+    None
+
+  Overview:
+    This function writes sectorCount contiguous sectors to the media with
+    WRITE10, using one command per USB_MSD_SCSI_MAX_TRANSFER_SECTORS sectors.
+    A command that fails is retried after REQUEST SENSE.
+
+  Parameters:
+    uint8_t * address       - Endpoint address of the device
+    uint32_t sectorAddress  - address of the first sector to write
+    uint16_t sectorCount    - number of sectors to write
+    uint8_t *dataBuffer     - buffer with application data
+
+  Return Values:
+    true    - write performed successfully
+    false   - write was not successful
+
+  Remarks:
+    The sector cache is not used, and sector 0 is not protected.
+  ***************************************************************************/
+
+static bool _USBHostMSDSCSI_Write10( uint8_t * address, uint32_t sectorAddress, uint16_t sectorCount, uint8_t *dataBuffer )
+{
+    uint32_t   byteCount;
+    uint8_t    commandBlock[10];
+    uint8_t    errorCode;
+    uint8_t    attempts;
+    uint16_t   blocks;
+    USB_MSD_SCSI_LUN_INFO   *pLUN = _USBHostMSDSCSI_GetLUN( address );
+
+    if (*address == 0)
+    {
+        return false;   //USB_MSD_DEVICE_NOT_FOUND;
+    }
+
+    // The sector size comes from READ CAPACITY, so it is 0 until the media
+    // has been initialized.  The transfer split below divides by it.
+    if (pLUN->mediaInformation.sectorSize == 0)
+    {
+        return false;
+    }
+
+    _USBHostMSDSCSI_MediaPollWait();
+
+    #if defined( USB_MSD_SCSI_ENABLE_READ_AHEAD )
+        _USBHostMSDSCSI_ReadAheadInvalidate( pLUN, sectorAddress, sectorCount );
+    #endif
+
+    while (sectorCount != 0)
+    {
+        blocks = sectorCount;
+        if (blocks > USB_MSD_SCSI_MAX_TRANSFER_SECTORS)
+        {
+            blocks = USB_MSD_SCSI_MAX_TRANSFER_SECTORS;
+        }
+        if (!_USBHostMSDSCSI_TransferFits( pLUN, blocks ))
+        {
+            blocks = 0xFFFF / pLUN->mediaInformation.sectorSize;
+        }
+
+        attempts = 5;
+        do
+        {
+            if (attempts-- == 0)
+            {
+                return false;
+            }
+
+            // Fill in the command block with the WRITE 10 parameters.
+            commandBlock[0] = 0x2A;     // Operation code
+            commandBlock[1] = WRPROTECT_NORMAL | FUA_ALLOW_CACHE;
+            commandBlock[2] = (uint8_t) (sectorAddress >> 24);     // Big endian!
+            commandBlock[3] = (uint8_t) (sectorAddress >> 16);
+            commandBlock[4] = (uint8_t) (sectorAddress >> 8);
+            commandBlock[5] = (uint8_t) (sectorAddress);
+            commandBlock[6] = 0x00;     // Group Number
+            commandBlock[7] = (uint8_t) (blocks >> 8);     // Number of blocks - Big endian!
+            commandBlock[8] = (uint8_t) (blocks);
+            commandBlock[9] = 0x00;     // Control
+
+            errorCode = USBHostMSDWrite( *address, pLUN->lun, commandBlock, 10, dataBuffer, (uint32_t)blocks * pLUN->mediaInformation.sectorSize );
+
+            if (!errorCode)
+            {
+                while (!USBHostMSDTransferIsComplete( *address, &errorCode, &byteCount ))
+                {
+                    USBTasks();
+                }
+            }
+
+            switch(errorCode)
+            {
+                case USB_MSD_COMMAND_FAILED:
+                    USBHostMSDSCSIRequestSense(address);
+                    break;
+
+                case USB_SUCCESS:
+                    break;
+
+                default:
+                    return false;
+            }
+        } while (errorCode != USB_SUCCESS);
+
+        sectorAddress += blocks;
+        sectorCount   -= blocks;
+        dataBuffer    += (uint32_t)blocks * pLUN->mediaInformation.sectorSize;
+    }
+
+    return true;
+}
+
+
+/*******************************************************************************
+  Function:
+    bool _USBHostMSDSCSI_ReadSector( uint8_t * address, uint32_t sectorAddress,
+                uint8_t *dataBuffer )
+
+  Precondition:
+    None
+
+  Overview:
+    This function reads one sector from the media.  If read ahead is
+    enabled and the last USB_MSD_SCSI_READ_AHEAD_THRESHOLD reads were
+    sequential, USB_MSD_SCSI_READ_AHEAD_SECTORS sectors are read with one
+    READ10, and the following sequential reads are served from the read
+    ahead buffer.
+
+  Parameters:
+    uint8_t * address       - Endpoint address of the device
+    uint32_t sectorAddress  - address of the sector to read
+    uint8_t *dataBuffer     - buffer to store data
+
+  Return Values:
+    true    - read performed successfully
+    false   - read was not successful
+
+  Remarks:
+    If the read ahead fails, for example past the end of the media, only
+    the requested sector is read.
+  ***************************************************************************/
+
+static bool _USBHostMSDSCSI_ReadSector( uint8_t * address, uint32_t sectorAddress, uint8_t *dataBuffer )
+{
+    #if defined( USB_MSD_SCSI_ENABLE_READ_AHEAD )
+        uint16_t    count;
+        USB_MSD_SCSI_LUN_INFO   *pLUN = _USBHostMSDSCSI_GetLUN( address );
+
+        if (pLUN->mediaInformation.sectorSize <= USB_MSD_SCSI_READ_AHEAD_SECTOR_SIZE)
+        {
+            // Sequential reads are tracked for one logical unit at a time.
+            if (readAheadLUN != pLUN)
+            {
+                readAheadLUN    = pLUN;
+                readAheadCount  = 0;
+                readAheadRun    = 0;
+            }
+
+            if (sectorAddress == readAheadNext)
+            {
+                if (readAheadRun < 0xFF)
+                {
+                    readAheadRun ++;
+                }
+            }
+            else
+            {
+                readAheadRun = 0;
+            }
+            readAheadNext = sectorAddress + 1;
+
+            if ((sectorAddress - readAheadStart) < readAheadCount)
+            {
+                memcpy( dataBuffer, &readAheadBuffer[(sectorAddress - readAheadStart) * pLUN->mediaInformation.sectorSize], pLUN->mediaInformation.sectorSize );
+                return true;
+            }
+
+            if ((readAheadRun >= USB_MSD_SCSI_READ_AHEAD_THRESHOLD) && (sectorAddress <= pLUN->lastSector))
+            {
+                count = USB_MSD_SCSI_READ_AHEAD_SECTORS;
+                if ((pLUN->lastSector - sectorAddress) < (count - 1))
+                {
+                    count = pLUN->lastSector - sectorAddress + 1;
+                }
+
+                readAheadCount = 0;
+                if (_USBHostMSDSCSI_Read10( address, sectorAddress, count, readAheadBuffer ))
+                {
+                    readAheadStart = sectorAddress;
+                    readAheadCount = count;
+                    memcpy( dataBuffer, readAheadBuffer, pLUN->mediaInformation.sectorSize );
+                    return true;
+                }
+            }
+        }
+    #endif
+
+    return _USBHostMSDSCSI_Read10( address, sectorAddress, 1, dataBuffer );
+}
+
+
+#if defined( USB_MSD_SCSI_ENABLE_READ_AHEAD )
+
+/*******************************************************************************
+  Function:
+    void _USBHostMSDSCSI_ReadAheadInvalidate( USB_MSD_SCSI_LUN_INFO *pLUN,
+                uint32_t sectorAddress, uint16_t sectorCount )
+
+  Precondition:
+    None
+
+  Overview:
+    This function empties the read ahead buffer if it holds any sector of
+    a range that is being written.
+
+  Parameters:
+    USB_MSD_SCSI_LUN_INFO *pLUN - logical unit being written
+    uint32_t sectorAddress  - address of the first sector
+    uint16_t sectorCount    - number of sectors
+
+  Returns:
+    None
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+static void _USBHostMSDSCSI_ReadAheadInvalidate( USB_MSD_SCSI_LUN_INFO *pLUN, uint32_t sectorAddress, uint16_t sectorCount )
+{
+    if ((readAheadCount != 0) && (readAheadLUN == pLUN) &&
+        (sectorAddress < (readAheadStart + readAheadCount)) &&
+        (readAheadStart < (sectorAddress + sectorCount)))
+    {
+        readAheadCount = 0;
+    }
+}
+
+#endif
+
+
+#if defined( USB_MSD_SCSI_ENABLE_CACHE )
+
+/*******************************************************************************
+  Function:
+    USB_MSD_SCSI_CACHE_ENTRY * _USBHostMSDSCSI_CacheFind( USB_MSD_SCSI_LUN_INFO *pLUN,
+                uint32_t sectorAddress )
+
+  Precondition:
+    None
+
+  Overview:
+    This function finds a sector in the sector cache.
+
+  Parameters:
+    USB_MSD_SCSI_LUN_INFO *pLUN - logical unit of the sector
+    uint32_t sectorAddress  - address of the sector
+
+  Returns:
+    The cache entry of the sector, or NULL if the sector is not cached.
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+static USB_MSD_SCSI_CACHE_ENTRY * _USBHostMSDSCSI_CacheFind( USB_MSD_SCSI_LUN_INFO *pLUN, uint32_t sectorAddress )
+{
+    uint8_t     i;
+
+    for (i=0; i<USB_MSD_SCSI_CACHE_SECTORS; i++)
+    {
+        if (cache[i].valid && (cache[i].pLUN == pLUN) && (cache[i].sectorAddress == sectorAddress))
+        {
+            return &cache[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+/*******************************************************************************
+  Function:
+    USB_MSD_SCSI_CACHE_ENTRY * _USBHostMSDSCSI_CacheAllocate( USB_MSD_SCSI_LUN_INFO *pLUN,
+                uint32_t sectorAddress )
+
+  Precondition:
+    The sector is not in the cache.
+
+  Overview:
+    This function selects the cache entry for a new sector: a free entry if
+    there is one, or else the least recently used entry.  A dirty sector is
+    written to its logical unit before its entry is reused.
+
+  Parameters:
+    USB_MSD_SCSI_LUN_INFO *pLUN - logical unit of the new sector
+    uint32_t sectorAddress  - address of the new sector
+
+  Returns:
+    The cache entry, marked not valid and clean, with its sector address
+    set, or NULL if the evicted sector could not be written.
+
+  Remarks:
+    The caller fills the data and marks the entry valid.
+  ***************************************************************************/
+
+static USB_MSD_SCSI_CACHE_ENTRY * _USBHostMSDSCSI_CacheAllocate( USB_MSD_SCSI_LUN_INFO *pLUN, uint32_t sectorAddress )
+{
+    USB_MSD_SCSI_CACHE_ENTRY    *entry;
+    uint8_t                     i;
+
+    entry = &cache[0];
+    for (i=0; i<USB_MSD_SCSI_CACHE_SECTORS; i++)
+    {
+        if (!cache[i].valid)
+        {
+            entry = &cache[i];
+            break;
+        }
+        if ((cacheUseCount - cache[i].lastUsed) > (cacheUseCount - entry->lastUsed))
+        {
+            entry = &cache[i];
+        }
+    }
+
+    if (entry->valid && entry->dirty)
+    {
+        if (!_USBHostMSDSCSI_Write10( &entry->pLUN->address, entry->sectorAddress, 1, entry->data ))
+        {
+            return NULL;
+        }
+        cacheStatistics.writeBacks ++;
+    }
+
+    entry->pLUN             = pLUN;
+    entry->sectorAddress    = sectorAddress;
+    entry->valid            = false;
+    entry->dirty            = false;
+    return entry;
+}
+
+
+#if defined( USB_MSD_SCSI_ENABLE_ASYNC )
+
+/*******************************************************************************
+  Function:
+    void _USBHostMSDSCSI_CacheInvalidate( USB_MSD_SCSI_LUN_INFO *pLUN,
+                uint32_t sectorAddress, uint16_t sectorCount )
+
+  Precondition:
+    None
+
+  Overview:
+    This function removes a range of sectors from the sector cache, without
+    writing them to the media.
+
+  Parameters:
+    USB_MSD_SCSI_LUN_INFO *pLUN - logical unit of the sectors
+    uint32_t sectorAddress  - address of the first sector
+    uint16_t sectorCount    - number of sectors
+
+  Returns:
+    None
+
+  Remarks:
+    This is used by asynchronous writes, which bypass the cache.
+  ***************************************************************************/
+
+static void _USBHostMSDSCSI_CacheInvalidate( USB_MSD_SCSI_LUN_INFO *pLUN, uint32_t sectorAddress, uint16_t sectorCount )
+{
+    uint8_t     i;
+
+    for (i=0; i<USB_MSD_SCSI_CACHE_SECTORS; i++)
+    {
+        if (cache[i].valid && (cache[i].pLUN == pLUN) && ((cache[i].sectorAddress - sectorAddress) < sectorCount))
+        {
+            cache[i].valid = false;
+            cache[i].dirty = false;
+        }
+    }
+}
+
+#endif
+
+
+/*******************************************************************************
+  Function:
+    void _USBHostMSDSCSI_CacheOverlay( USB_MSD_SCSI_LUN_INFO *pLUN,
+                uint32_t sectorAddress, uint16_t sectorCount, uint8_t *dataBuffer )
+
+  Precondition:
+    The sectors have just been read from the media into dataBuffer.
+
+  Overview:
+    This function copies the dirty cached sectors of a range over the data
+    read from the media, so the caller sees the latest data.
+
+  Parameters:
+    USB_MSD_SCSI_LUN_INFO *pLUN - logical unit of the sectors
+    uint32_t sectorAddress  - address of the first sector
+    uint16_t sectorCount    - number of sectors
+    uint8_t *dataBuffer     - data of the sectors
+
+  Returns:
+    None
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+static void _USBHostMSDSCSI_CacheOverlay( USB_MSD_SCSI_LUN_INFO *pLUN, uint32_t sectorAddress, uint16_t sectorCount, uint8_t *dataBuffer )
+{
+    uint8_t     i;
+
+    for (i=0; i<USB_MSD_SCSI_CACHE_SECTORS; i++)
+    {
+        if (cache[i].valid && cache[i].dirty && (cache[i].pLUN == pLUN) && ((cache[i].sectorAddress - sectorAddress) < sectorCount))
+        {
+            memcpy( &dataBuffer[(cache[i].sectorAddress - sectorAddress) * pLUN->mediaInformation.sectorSize],
+                    cache[i].data, pLUN->mediaInformation.sectorSize );
+        }
+    }
+}
+
+
+/*******************************************************************************
+  Function:
+    void _USBHostMSDSCSI_CacheUpdate( USB_MSD_SCSI_LUN_INFO *pLUN,
+                uint32_t sectorAddress, uint16_t sectorCount, uint8_t *dataBuffer )
+
+  Precondition:
+    The sectors have just been written to the media from dataBuffer.
+
+  Overview:
+    This function copies the written data into the cached sectors of a
+    range, and marks them clean.
+
+  Parameters:
+    USB_MSD_SCSI_LUN_INFO *pLUN - logical unit of the sectors
+    uint32_t sectorAddress  - address of the first sector
+    uint16_t sectorCount    - number of sectors
+    uint8_t *dataBuffer     - data of the sectors
+
+  Returns:
+    None
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+static void _USBHostMSDSCSI_CacheUpdate( USB_MSD_SCSI_LUN_INFO *pLUN, uint32_t sectorAddress, uint16_t sectorCount, uint8_t *dataBuffer )
+{
+    uint8_t     i;
+
+    for (i=0; i<USB_MSD_SCSI_CACHE_SECTORS; i++)
+    {
+        if (cache[i].valid && (cache[i].pLUN == pLUN) && ((cache[i].sectorAddress - sectorAddress) < sectorCount))
+        {
+            memcpy( cache[i].data, &dataBuffer[(cache[i].sectorAddress - sectorAddress) * pLUN->mediaInformation.sectorSize],
+                    pLUN->mediaInformation.sectorSize );
+            cache[i].dirty = false;
+        }
+    }
+}
+
+#endif
+
+
+#if defined( USB_MSD_SCSI_ENABLE_ASYNC )
+
+/*******************************************************************************
+  Function:
+    uint8_t _USBHostMSDSCSI_AsyncSubmit( uint8_t * address, uint8_t direction,
+                uint8_t *commandBlock, uint8_t commandBlockLength, uint8_t *data,
+                uint32_t dataLength, USB_MSD_SCSI_ASYNC_CALLBACK callback )
+
+  Precondition:
+    None
+
+  Overview:
+    This function places a request in a free slot, marks it with the next
+    sequence number, and starts it if the device is idle.
+
+  Parameters:
+    uint8_t * address                       - Endpoint address of the device
+    uint8_t direction                       - 1=read, 0=write
+    uint8_t *commandBlock                   - Command block for the CBW
+    uint8_t commandBlockLength              - Length of the command block
+    uint8_t *data                           - Data buffer
+    uint32_t dataLength                     - Size of the data buffer
+    USB_MSD_SCSI_ASYNC_CALLBACK callback    - Completion function, or NULL
+
+  Returns:
+    The handle of the request, or USB_MSD_SCSI_ASYNC_INVALID_HANDLE.
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+static uint8_t _USBHostMSDSCSI_AsyncSubmit( uint8_t * address, uint8_t direction, uint8_t *commandBlock,
+                        uint8_t commandBlockLength, uint8_t *data, uint32_t dataLength, USB_MSD_SCSI_ASYNC_CALLBACK callback )
+{
+    USB_MSD_SCSI_ASYNC_REQUEST  *request;
+    uint8_t                     i;
+
+    if (*address == 0)
+    {
+        return USB_MSD_SCSI_ASYNC_INVALID_HANDLE;
+    }
+
+    // Completed requests that have not been polled still hold their slot.
+    for (i=0; (i<USB_MSD_SCSI_ASYNC_QUEUE_SIZE) && (asyncRequest[i].state != ASYNC_FREE); i++);
+    if (i == USB_MSD_SCSI_ASYNC_QUEUE_SIZE)
+    {
+        return USB_MSD_SCSI_ASYNC_INVALID_HANDLE;
+    }
+
+    request = &asyncRequest[i];
+    memcpy( request->commandBlock, commandBlock, commandBlockLength );
+    request->commandBlockLength = commandBlockLength;
+    request->direction          = direction;
+    request->address            = *address;
+    request->sequence           = asyncSequence++;
+    request->errorCode          = USB_SUCCESS;
+    request->data               = data;
+    request->dataLength         = dataLength;
+    request->byteCount          = 0;
+    request->pLUN               = _USBHostMSDSCSI_GetLUN( address );
+    request->callback           = callback;
+    request->state              = ASYNC_QUEUED;
+
+    _USBHostMSDSCSI_AsyncStart();
+
+    return i + 1;
+}
+
+
+/*******************************************************************************
+  Function:
+    uint8_t _USBHostMSDSCSI_AsyncSelect( void )
+
+  Precondition:
+    None
+
+  Overview:
+    This function selects the next request to start.  The logical units are
+    serviced in turn, starting after the unit of the last request started,
+    and the oldest queued request of the first unit that has one is
+    selected.  A busy logical unit therefore cannot hold off the others.
+
+  Parameters:
+    None - None
+
+  Returns:
+    The slot of the selected request, or ASYNC_NONE if no request is queued.
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+static uint8_t _USBHostMSDSCSI_AsyncSelect( void )
+{
+    uint8_t     i;
+    uint8_t     lun;
+    uint8_t     offset;
+    uint8_t     selected;
+
+    for (offset=1; offset<=USB_MSD_SCSI_MAX_LUNS; offset++)
+    {
+        lun         = (asyncLastLUN + offset) % USB_MSD_SCSI_MAX_LUNS;
+        selected    = ASYNC_NONE;
+
+        for (i=0; i<USB_MSD_SCSI_ASYNC_QUEUE_SIZE; i++)
+        {
+            if ((asyncRequest[i].state == ASYNC_QUEUED) && (asyncRequest[i].pLUN->lun == lun))
+            {
+                // The oldest request has been waiting for the most sequence numbers.
+                if ((selected == ASYNC_NONE) ||
+                    ((uint8_t)(asyncSequence - asyncRequest[i].sequence) > (uint8_t)(asyncSequence - asyncRequest[selected].sequence)))
+                {
+                    selected = i;
+                }
+            }
+        }
+
+        if (selected != ASYNC_NONE)
+        {
+            return selected;
+        }
+    }
+
+    return ASYNC_NONE;
+}
+
 
 /*******************************************************************************
   Function:
-    bool _USBHostMSDSCSI_TestUnitReady( void )
+    void _USBHostMSDSCSI_AsyncStart( void )
 
   Precondition:
     None
 
   Overview:
-    This function sends the TEST UNIT READY SCSI command
+    This function gives the next outstanding requests to the MSD driver,
+    until ASYNC_MAX_ACTIVE requests are in progress or the driver cannot
+    accept more.
 
   Parameters:
     None - None
 
-  Return Values:
-    true    - Command completed without error
-    false   - Error while performing command
+  Returns:
+    None
 
   Remarks:
-    The format of the TEST UNIT READY command is as follows:
+    If the device is busy, the request stays queued and is started by the
+    next submit, poll or transfer completion.
+  ***************************************************************************/
 
-    <code>
-        Byte/Bit    7       6       5       4       3       2       1       0
-           0                    Operation Code (0x00)
-           1        [
-           2                               Reserved
-           3
-           4                                                                ]
-           5        [                    Control                            ]
-    </code>
+static void _USBHostMSDSCSI_AsyncStart( void )
+{
+    USB_MSD_SCSI_ASYNC_REQUEST  *request;
+    uint8_t                     errorCode;
+    uint8_t                     i;
+
+    while (asyncActiveCount < ASYNC_MAX_ACTIVE)
+    {
+        i = _USBHostMSDSCSI_AsyncSelect();
+        if (i == ASYNC_NONE)
+        {
+            return;
+        }
+
+        request = &asyncRequest[i];
+        errorCode = USBHostMSDTransfer( request->address, request->pLUN->lun, request->direction, request->commandBlock,
+                        request->commandBlockLength, request->data, request->dataLength );
+        if (errorCode == USB_MSD_DEVICE_BUSY)
+        {
+            return;
+        }
+
+        asyncLastLUN = request->pLUN->lun;
+        if (errorCode == USB_SUCCESS)
+        {
+            request->state  = ASYNC_ACTIVE;
+            asyncActive[asyncActiveCount++] = i;
+            continue;
+        }
+
+        // The request cannot be performed.  Complete it and try the next one.
+        _USBHostMSDSCSI_AsyncComplete( i, errorCode, 0 );
+    }
+}
+
+
+/*******************************************************************************
+  Function:
+    void _USBHostMSDSCSI_AsyncTransferDone( uint8_t address )
+
+  Precondition:
+    EVENT_MSD_TRANSFER has been received, so the MSD driver is idle.
+
+  Overview:
+    This function handles the end of the transfer of the oldest active
+    request.
+    If the command failed, REQUEST SENSE is performed to clear the CHECK
+    CONDITION before the request is completed.  The next request is then
+    started.
+
+  Parameters:
+    uint8_t address - Address of the device
+
+  Returns:
+    None
+
+  Remarks:
+    None
   ***************************************************************************/
 
-#ifdef PERFORM_TEST_UNIT_READY
-bool _USBHostMSDSCSI_TestUnitReady( uint8_t * address)
+static void _USBHostMSDSCSI_AsyncTransferDone( uint8_t address )
 {
-    uint32_t       byteCount;
-    uint8_t        commandBlock[10];
-    uint8_t        errorCode;
-    uint8_t        inquiryData[36];
-    uint8_t        unitReadyCount;
+    USB_MSD_SCSI_ASYNC_REQUEST  *request;
+    uint32_t                    byteCount;
+    uint8_t                     commandBlock[6];
+    uint8_t                     errorCode;
 
-    // Issue a TEST UNIT READY
-    #ifdef DEBUG_MODE
-        UART2PrintString( "SCSI: TEST UNIT READY..." );
+    if (asyncActiveCount == 0)
+    {
+        return;
+    }
+
+    request = &asyncRequest[asyncActive[0]];
+    if ((request->address != address) ||
+        ((request->state != ASYNC_ACTIVE) && (request->state != ASYNC_SENSE)))
+    {
+        // This was not one of our transfers.
+        return;
+    }
+
+    USBHostMSDTransferIsComplete( address, &errorCode, &byteCount );
+
+    if (request->state == ASYNC_SENSE)
+    {
+        _USBHostMSDSCSI_AsyncComplete( asyncActive[0], request->errorCode, request->byteCount );
+    }
+    else if (errorCode == USB_MSD_COMMAND_FAILED)
+    {
+        request->errorCode  = errorCode;
+        request->byteCount  = byteCount;
+
+        // Fill in the command block with the REQUEST SENSE parameters.
+        commandBlock[0] = 0x03;     // Operation Code
+        commandBlock[1] = 0;        //
+        commandBlock[2] = 0;        //
+        commandBlock[3] = 0;        //
+        commandBlock[4] = ASYNC_SENSE_SIZE; // Allocation length
+        commandBlock[5] = 0;        // Control
+
+        // Stale sense data must not be taken for the sense of this request.
+        memset( asyncSense, 0x00, ASYNC_SENSE_SIZE );
+
+        if (USBHostMSDRead( address, request->pLUN->lun, commandBlock, 6, asyncSense, ASYNC_SENSE_SIZE ) == USB_SUCCESS)
+        {
+            request->state = ASYNC_SENSE;
+            return;
+        }
+        _USBHostMSDSCSI_AsyncComplete( asyncActive[0], request->errorCode, request->byteCount );
+    }
+    else
+    {
+        _USBHostMSDSCSI_AsyncComplete( asyncActive[0], errorCode, byteCount );
+    }
+
+    _USBHostMSDSCSI_AsyncStart();
+}
+
+
+/*******************************************************************************
+  Function:
+    void _USBHostMSDSCSI_AsyncComplete( uint8_t index, uint8_t errorCode,
+                uint32_t byteCount )
+
+  Precondition:
+    The request is queued or being performed.
+
+  Overview:
+    This function completes a request, either by calling its callback and
+    releasing the slot, or by leaving the result for
+    USBHostMSDSCSIAsyncIsComplete().
+
+  Parameters:
+    uint8_t index       - Slot of the request
+    uint8_t errorCode   - Result of the request
+    uint32_t byteCount  - Number of data bytes transferred
+
+  Returns:
+    None
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+static void _USBHostMSDSCSI_AsyncComplete( uint8_t index, uint8_t errorCode, uint32_t byteCount )
+{
+    USB_MSD_SCSI_ASYNC_REQUEST  *request;
+    uint8_t                     i;
+
+    // Remove the request from the active list.
+    for (i=0; (i<asyncActiveCount) && (asyncActive[i] != index); i++);
+    if (i < asyncActiveCount)
+    {
+        asyncActiveCount --;
+        for ( ; i<asyncActiveCount; i++)
+        {
+            asyncActive[i] = asyncActive[i+1];
+        }
+    }
+
+    request             = &asyncRequest[index];
+    request->errorCode  = errorCode;
+    request->byteCount  = byteCount;
+    request->state      = ASYNC_DONE;
+
+    #if defined( USB_MSD_SCSI_ENABLE_CACHE )
+        if ((errorCode == USB_SUCCESS) && (request->commandBlock[0] == 0x28))
+        {
+            // Cached sectors that have not been written back are newer than the media.
+            _USBHostMSDSCSI_CacheOverlay( request->pLUN,
+                                          ((uint32_t)request->commandBlock[2] << 24) | ((uint32_t)request->commandBlock[3] << 16) |
+                                          ((uint32_t)request->commandBlock[4] << 8)  |  (uint32_t)request->commandBlock[5],
+                                          ((uint16_t)request->commandBlock[7] << 8)  |  request->commandBlock[8], request->data );
+        }
     #endif
 
-    unitReadyCount = 0;
-    while (unitReadyCount < 5)
+    if (request->callback != NULL)
     {
-        unitReadyCount ++;
+        request->callback( index + 1, errorCode, byteCount );
+        request->state  = ASYNC_FREE;
+    }
+}
 
-        // Fill in the command block with the TEST UNIT READY parameters.
-        commandBlock[0] = 0x00;     // Operation Code
-        commandBlock[1] = 0;        // Reserved
-        commandBlock[2] = 0;        // Reserved
-        commandBlock[3] = 0;        // Reserved
-        commandBlock[4] = 0;        // Reserved
-        commandBlock[5] = 0x00;     // Control
+#endif
 
-        errorCode = USBHostMSDRead( *address, 0, commandBlock, 6, inquiryData, 0 );
-        #ifdef DEBUG_MODE
-            UART2PutHex( errorCode ) ;
-            UART2PutChar( ' ' );
-        #endif
 
-        if (!errorCode)
+#if defined( USB_MSD_SCSI_ENABLE_MEDIA_POLL )
+
+/*******************************************************************************
+  Function:
+    void _USBHostMSDSCSI_MediaPoll( void )
+
+  Precondition:
+    None
+
+  Overview:
+    This function queues a TEST UNIT READY for each logical unit of the
+    device, if USB_MSD_SCSI_MEDIA_POLL_INTERVAL milliseconds have passed
+    since the last poll.  A logical unit whose last poll has not completed
+    is skipped.
+
+  Parameters:
+    None - None
+
+  Returns:
+    None
+
+  Remarks:
+    The result is handled by _USBHostMSDSCSI_MediaPollDone().
+  ***************************************************************************/
+
+static void _USBHostMSDSCSI_MediaPoll( void )
+{
+    uint8_t     i;
+    bool        due;
+    #if defined( __C30__ ) || defined __XC16__
+        uint16_t    interrupt_mask;
+    #elif defined( __PIC32__ )
+        uint32_t    interrupt_mask;
+    #else
+        #error Cannot save interrupt status
+    #endif
+
+    // The timer is counted down by the 1 ms interrupt, so it is tested and
+    // reloaded with that interrupt masked.
+    interrupt_mask = U1OTGIE;
+    U1OTGIEbits.T1MSECIE = 0;
+
+    due = (mediaPollTimer == 0);
+    if (due)
+    {
+        mediaPollTimer = USB_MSD_SCSI_MEDIA_POLL_INTERVAL;
+    }
+
+    U1OTGIE = interrupt_mask;
+
+    if (!due)
+    {
+        return;
+    }
+
+    for (i=0; i<USB_MSD_SCSI_MAX_LUNS; i++)
+    {
+        if (lunInfo[i].mediaInformation.validityFlags.bits.maxLUN && !lunInfo[i].pollPending)
         {
-            while (!USBHostMSDTransferIsComplete( *address, &errorCode, &byteCount ))
+            // The flag is set first, since the request may complete before
+            // the submit function returns.
+            lunInfo[i].pollPending = true;
+            if (USBHostMSDSCSIAsyncTestUnitReady( &lunInfo[i].address, _USBHostMSDSCSI_MediaPollDone ) == USB_MSD_SCSI_ASYNC_INVALID_HANDLE)
             {
-                USBTasks();
+                // The queue is full.  Try again at the next poll.
+                lunInfo[i].pollPending = false;
             }
         }
-        #ifdef DEBUG_MODE
-            UART2PutHex( errorCode ) ;
-            UART2PrintString( "\r\n" );
-        #endif
-        if (!errorCode)
+    }
+}
+
+
+/*******************************************************************************
+  Function:
+    void _USBHostMSDSCSI_MediaPollDone( uint8_t handle, uint8_t errorCode,
+                uint32_t byteCount )
+
+  Precondition:
+    The request was queued by _USBHostMSDSCSI_MediaPoll().
+
+  Overview:
+    This function records the result of a TEST UNIT READY poll.  If the
+    command failed with UNIT ATTENTION, the unit is polled again right away.
+    If the sense data reports that the media may have changed, the sectors
+    held for the unit are discarded and the change is reported by the next
+    media detect.
+
+  Parameters:
+    uint8_t handle      - Handle of the request
+    uint8_t errorCode   - Result of the request
+    uint32_t byteCount  - Number of data bytes transferred
+
+  Returns:
+    None
+
+  Remarks:
+    asyncSense holds the sense data of a request that failed with
+    USB_MSD_COMMAND_FAILED until the next request is started.
+  ***************************************************************************/
+
+static void _USBHostMSDSCSI_MediaPollDone( uint8_t handle, uint8_t errorCode, uint32_t byteCount )
+{
+    USB_MSD_SCSI_LUN_INFO   *pLUN = asyncRequest[handle-1].pLUN;
+
+    pLUN->pollPending = false;
+
+    if (errorCode == USB_SUCCESS)
+    {
+        pLUN->mediaState = MEDIA_STATE_READY;
+    }
+    else if ((errorCode == USB_MSD_COMMAND_FAILED) && ((asyncSense[2] & 0x0F) == SENSE_KEY_UNIT_ATTENTION))
+    {
+        // The unit reports an event, such as a reset, rather than a problem.
+        pLUN->mediaState    = MEDIA_STATE_UNKNOWN;
+        mediaPollTimer      = 0;
+
+        if (asyncSense[12] == ASC_MEDIUM_MAY_HAVE_CHANGED)
         {
-            return true;
+            pLUN->mediaChanged = true;
+            _USBHostMSDSCSI_DiscardSectors( pLUN );
         }
     }
+    else
+    {
+        pLUN->mediaState = MEDIA_STATE_NOT_READY;
+    }
+}
 
-    return false;
+
+/*******************************************************************************
+  Function:
+    void _USBHostMSDSCSI_MediaPollWait( void )
+
+  Precondition:
+    None
+
+  Overview:
+    This function waits until no TEST UNIT READY poll is outstanding, so a
+    blocking command can be given to the MSD driver.
+
+  Parameters:
+    None - None
+
+  Returns:
+    None
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+static void _USBHostMSDSCSI_MediaPollWait( void )
+{
+    uint8_t     i;
+
+    for (i=0; i<USB_MSD_SCSI_MAX_LUNS; i++)
+    {
+        while (lunInfo[i].pollPending)
+        {
+            // The poll may be waiting for a transfer that was started elsewhere.
+            _USBHostMSDSCSI_AsyncStart();
+            USBTasks();
+        }
+    }
 }
-#endif
 
+#endif
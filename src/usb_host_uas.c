@@ -0,0 +1,1321 @@
+// DOM-IGNORE-BEGIN
+/*******************************************************************************
+Copyright 2015 Microchip Technology Inc. (www.microchip.com)
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+To request to license the code under the MLA license (www.microchip.com/mla_license),
+please contact mla_licensing@microchip.com
+*******************************************************************************/
+//DOM-IGNORE-END
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "usb.h"
+#include "usb_host_uas.h"
+
+//#define DEBUG_MODE
+#ifdef DEBUG_MODE
+    #include "uart2.h"
+#endif
+
+
+// *****************************************************************************
+// *****************************************************************************
+// Section: Configuration
+// *****************************************************************************
+// *****************************************************************************
+
+#if !defined( USB_SUPPORT_BULK_TRANSFERS )
+    #error The UAS client driver requires USB_SUPPORT_BULK_TRANSFERS.
+#endif
+
+#if (USB_UAS_QUEUE_DEPTH < 1) || (USB_UAS_QUEUE_DEPTH > 16)
+    #error USB_UAS_QUEUE_DEPTH must be between 1 and 16.
+#endif
+
+
+// *****************************************************************************
+// *****************************************************************************
+// Section: Constants
+// *****************************************************************************
+// *****************************************************************************
+
+// Driver states.
+#define UAS_STATE_DETACHED                  0x00
+#define UAS_STATE_SET_INTERFACE             0x01
+#define UAS_STATE_WAIT_SET_INTERFACE        0x02
+#define UAS_STATE_REPORT_LUNS               0x03
+#define UAS_STATE_WAIT_REPORT_LUNS          0x04
+#define UAS_STATE_RUNNING                   0x05
+#define UAS_STATE_RESETTING                 0x06
+#define UAS_STATE_ERROR                     0x07
+
+// Command slot states.
+#define UAS_SLOT_FREE                       0x00    // Slot is not in use.
+#define UAS_SLOT_QUEUED                     0x01    // Command IU is waiting for the command pipe.
+#define UAS_SLOT_SENT                       0x02    // Command IU was sent.  Waiting for READY or SENSE.
+#define UAS_SLOT_READY                      0x03    // The device requested the data phase.  Waiting for the data pipe.
+#define UAS_SLOT_DATA                       0x04    // Data phase in progress.
+#define UAS_SLOT_DONE                       0x05    // Command is complete, waiting to be reported.
+
+#define UAS_NO_SLOT                         0xFF
+
+// Information unit sizes.
+#define UAS_COMMAND_IU_SIZE                 32      // Command IU with a 16 byte CDB.
+#define UAS_STATUS_IU_SIZE                  64      // One full speed packet.  Sense data beyond it is not read.
+#define UAS_SENSE_IU_HEADER_SIZE            16      // Sense IU up to the sense data.
+#define UAS_SENSE_SIZE                      18      // Fixed format sense data kept for REQUEST SENSE.
+#define UAS_REPORT_LUNS_SIZE                16      // LUN list header and the first entry.
+
+#define UAS_MAX_LUN                         15      // Largest LUN reported to the media interface layer.
+
+// SCSI status codes in the Sense IU.
+#define UAS_STATUS_GOOD                     0x00
+#define UAS_STATUS_BUSY                     0x08
+#define UAS_STATUS_TASK_SET_FULL            0x28
+
+// SCSI operation codes handled by the driver.
+#define UAS_SCSI_REQUEST_SENSE              0x03
+#define UAS_SCSI_REPORT_LUNS                0xA0
+
+// All four pipes, for a reset (bit n = pipe ID n).
+#define UAS_ALL_PIPES                       ((1 << USB_UAS_PIPE_COMMAND) | (1 << USB_UAS_PIPE_STATUS) | \
+                                             (1 << USB_UAS_PIPE_DATA_IN) | (1 << USB_UAS_PIPE_DATA_OUT))
+
+
+// *****************************************************************************
+// *****************************************************************************
+// Section: Data Structures
+// *****************************************************************************
+// *****************************************************************************
+
+// *****************************************************************************
+/* UAS Command
+
+This structure holds one tagged command.  The tag of the command in slot n
+is n + 1.
+*/
+typedef struct _UAS_COMMAND
+{
+    uint8_t     iu[UAS_COMMAND_IU_SIZE];    // Command IU.
+    uint8_t     sense[UAS_SENSE_SIZE];      // Sense data from the Sense IU.
+    uint8_t     *data;                      // Caller's data buffer.
+    uint32_t    dataLength;                 // Size of the data buffer.
+    uint32_t    byteCount;                  // Number of bytes transferred.
+    uint8_t     direction;                  // 1=read, 0=write.
+    uint8_t     lun;                        // Logical Unit Number.
+    uint8_t     errorCode;                  // Result of the command.
+    uint8_t     state;                      // UAS_SLOT_xxx
+} UAS_COMMAND;
+
+// *****************************************************************************
+/* UAS Device Information
+
+This structure contains information about the attached UAS device.
+*/
+typedef struct _UAS_DEVICE
+{
+    UAS_COMMAND command[USB_UAS_QUEUE_DEPTH];   // Command slots.
+    uint8_t     order[USB_UAS_QUEUE_DEPTH];     // Slots of the outstanding commands, in the order they are reported.
+    uint8_t     statusIU[UAS_STATUS_IU_SIZE];   // Information unit read from the status pipe.
+    uint8_t     sense[UAS_SENSE_SIZE];          // Sense data of the last failed command reported.
+    uint8_t     reportLUNs[UAS_REPORT_LUNS_SIZE];   // REPORT LUNS data.
+    uint32_t    lastByteCount;                  // Byte count of the last command reported.
+    uint8_t     endpoint[5];                    // Endpoint of each pipe, by pipe ID.
+    uint8_t     address;                        // Address of the device.
+    uint8_t     clientDriverID;                 // ID to send when issuing a Device Request.
+    uint8_t     interface;                      // Interface number of the UAS interface.
+    uint8_t     alternateSetting;               // Alternate setting with the UAS protocol.
+    uint8_t     maxLUN;                         // Largest LUN of the device.
+    uint8_t     orderCount;                     // Number of outstanding commands.
+    uint8_t     commandSlot;                    // Slot whose Command IU is being sent.
+    uint8_t     dataInSlot;                     // Slot using the data-in pipe.
+    uint8_t     dataOutSlot;                    // Slot using the data-out pipe.
+    uint8_t     haltRequest;                    // Pipes whose halt must be cleared (bit n = pipe ID n).
+    uint8_t     haltPipe;                       // Pipe whose halt is being cleared, 0 if none.
+    uint8_t     senseLUN;                       // LUN of the sense data.
+    uint8_t     lastErrorCode;                  // Error code of the last command reported.
+    uint8_t     state;                          // Driver state.
+    bool        statusBusy;                     // A read of the status pipe is in progress.
+    bool        senseValid;                     // sense holds data for the next REQUEST SENSE of senseLUN.
+    bool        eventSent;                      // EVENT_MSD_TRANSFER was sent for the oldest command.
+} UAS_DEVICE;
+
+
+// *****************************************************************************
+// *****************************************************************************
+// Section: Global Variables
+// *****************************************************************************
+// *****************************************************************************
+
+extern CLIENT_DRIVER_TABLE usbMediaInterfaceTable;  // This table contains the initialization
+                                                    // routine and event handler for the media
+                                                    // interface layer of the application.
+                                                    // It is defined in usb_config.c.
+
+static UAS_DEVICE   uasDevice;    // Information about the attached UAS device.
+
+
+// *****************************************************************************
+// *****************************************************************************
+// Section: Local Prototypes and Macros
+// *****************************************************************************
+// *****************************************************************************
+
+#define _USBHostUAS_PipeHalted(pipe)    (((uasDevice.haltRequest & (1 << (pipe))) != 0) || (uasDevice.haltPipe == (pipe)))
+
+static void     _USBHostUAS_Halt( uint8_t pipe );
+static void     _USBHostUAS_HaltTasks( void );
+static void     _USBHostUAS_Notify( void );
+static void     _USBHostUAS_PipeTasks( void );
+static void     _USBHostUAS_ProcessStatus( uint32_t byteCount );
+static uint8_t  _USBHostUAS_Submit( uint8_t lun, uint8_t direction, uint8_t *commandBlock, uint8_t commandBlockLength,
+                        uint8_t *data, uint32_t dataLength, bool first );
+
+
+// *****************************************************************************
+// *****************************************************************************
+// Section: Host Stack Interface Functions
+// *****************************************************************************
+// *****************************************************************************
+
+/****************************************************************************
+  Function:
+    bool USBHostUASInitialize( uint8_t address, uint32_t flags,
+                        uint8_t clientDriverID )
+
+  Summary:
+    This function is called by the USB Embedded Host layer when a UAS device
+    attaches.
+
+  Description:
+    This routine is a call out from the USB Embedded Host layer to the USB
+    Attached SCSI client driver.  It is called when a device with a UAS
+    interface has been configured.  It finds the UAS alternate setting and
+    its pipes, and starts the driver state machine, which selects the
+    setting and reads the logical unit inventory of the device.
+
+  Precondition:
+    The device has been configured.
+
+  Parameters:
+    uint8_t address         - Device's address on the bus
+    uint32_t flags          - Initialization flags
+    uint8_t clientDriverID  - Client driver identification for device requests
+
+  Return Values:
+    true    - Initialization was successful
+    false   - Initialization failed
+
+  Remarks:
+    This function should only be called by the USB Embedded Host layer.
+  ***************************************************************************/
+
+bool USBHostUASInitialize( uint8_t address, uint32_t flags, uint8_t clientDriverID )
+{
+    uint8_t     *descriptor;
+    uint16_t    i;
+    uint16_t    length;
+    uint8_t     lastEndpoint;
+    bool        inSetting;
+
+    memset( &uasDevice, 0, sizeof(UAS_DEVICE) );
+
+    descriptor = USBHostGetCurrentConfigurationDescriptor( address );
+    if (descriptor == NULL)
+    {
+        return false;
+    }
+
+    // Find the UAS interface setting, and the endpoint that each of its
+    // pipe usage descriptors follows.
+    length       = ((USB_CONFIGURATION_DESCRIPTOR *)descriptor)->wTotalLength;
+    inSetting    = false;
+    lastEndpoint = 0;
+    i = 0;
+    while ((i + 1) < length)
+    {
+        if (descriptor[i+1] == USB_DESCRIPTOR_INTERFACE)
+        {
+            if (inSetting)
+            {
+                break;
+            }
+            if ((descriptor[i+5] == DEVICE_CLASS_MASS_STORAGE) &&
+                (descriptor[i+6] == DEVICE_SUBCLASS_SCSI) &&
+                (descriptor[i+7] == DEVICE_INTERFACE_PROTOCOL_UAS))
+            {
+                uasDevice.interface        = descriptor[i+2];
+                uasDevice.alternateSetting = descriptor[i+3];
+                inSetting                  = true;
+            }
+        }
+        else if (inSetting && (descriptor[i+1] == USB_DESCRIPTOR_ENDPOINT) &&
+                 ((descriptor[i+3] & 0x03) == USB_TRANSFER_TYPE_BULK))
+        {
+            lastEndpoint = descriptor[i+2];
+        }
+        else if (inSetting && (descriptor[i+1] == USB_UAS_DESCRIPTOR_PIPE_USAGE) &&
+                 (descriptor[i+2] >= USB_UAS_PIPE_COMMAND) && (descriptor[i+2] <= USB_UAS_PIPE_DATA_OUT))
+        {
+            uasDevice.endpoint[descriptor[i+2]] = lastEndpoint;
+        }
+
+        if (descriptor[i] == 0)
+        {
+            break;
+        }
+        i += descriptor[i];
+    }
+
+    if ((uasDevice.endpoint[USB_UAS_PIPE_COMMAND] == 0) || (uasDevice.endpoint[USB_UAS_PIPE_STATUS] == 0) ||
+        (uasDevice.endpoint[USB_UAS_PIPE_DATA_IN] == 0) || (uasDevice.endpoint[USB_UAS_PIPE_DATA_OUT] == 0))
+    {
+        #ifdef DEBUG_MODE
+            UART2PrintString( "UAS: No UAS setting\r\n" );
+        #endif
+        return false;
+    }
+
+    uasDevice.address        = address;
+    uasDevice.clientDriverID = clientDriverID;
+    uasDevice.commandSlot    = UAS_NO_SLOT;
+    uasDevice.dataInSlot     = UAS_NO_SLOT;
+    uasDevice.dataOutSlot    = UAS_NO_SLOT;
+    uasDevice.state          = UAS_STATE_SET_INTERFACE;
+
+    #ifdef DEBUG_MODE
+        UART2PrintString( "UAS: Device attached\r\n" );
+    #endif
+
+    return true;
+}
+
+
+/****************************************************************************
+  Function:
+    bool USBHostUASEventHandler( uint8_t address, USB_EVENT event,
+                        void *data, uint32_t size )
+
+  Summary:
+    This function is called by the USB Embedded Host layer when the UAS
+    device generates an event.
+
+  Description:
+    This function is called by the USB Embedded Host layer when the UAS
+    device generates an event.  The driver polls for the completion of its
+    transfers, so only EVENT_DETACH is acted on.
+
+  Precondition:
+    None
+
+  Parameters:
+    uint8_t address     - Address of the device
+    USB_EVENT event     - Event that has occurred
+    void *data          - Pointer to data pertinent to the event
+    uint32_t size       - Size of the data
+
+  Return Values:
+    true    - Event was handled
+    false   - Event was not handled
+
+  Remarks:
+    This function should only be called by the USB Embedded Host layer.
+  ***************************************************************************/
+
+bool USBHostUASEventHandler( uint8_t address, USB_EVENT event, void *data, uint32_t size )
+{
+    if ((uasDevice.state == UAS_STATE_DETACHED) || (address != uasDevice.address))
+    {
+        return false;
+    }
+
+    switch (event)
+    {
+        case EVENT_DETACH:
+            // Notify the media interface layer, then forget the device.
+            usbMediaInterfaceTable.EventHandler( uasDevice.address, EVENT_DETACH, NULL, 0 );
+            memset( &uasDevice, 0, sizeof(UAS_DEVICE) );
+            #ifdef DEBUG_MODE
+                UART2PrintString( "UAS: Device detached\r\n" );
+            #endif
+            return true;
+
+        case EVENT_TRANSFER:
+        case EVENT_BUS_ERROR:
+            // The transfers are polled in USBHostUASTasks().
+            return true;
+
+        default:
+            break;
+    }
+
+    return false;
+}
+
+
+// *****************************************************************************
+// *****************************************************************************
+// Section: Media Interface Functions
+// *****************************************************************************
+// *****************************************************************************
+
+/****************************************************************************
+  Function:
+    uint8_t USBHostUASDeviceStatus( uint8_t deviceAddress )
+
+  Description:
+    This function determines the status of a UAS device.
+
+  Precondition:
+    None
+
+  Parameters:
+    uint8_t deviceAddress - address of device to query
+
+  Return Values:
+    USB_MSD_DEVICE_NOT_FOUND -  Illegal device address, or the device is not
+                                a UAS device
+    USB_MSD_INITIALIZING     -  Device is attached and in the process of
+                                initializing
+    USB_MSD_NORMAL_RUNNING   -  Device is in normal running mode
+    USB_MSD_RESETTING_DEVICE -  Device is resetting
+    USB_MSD_ERROR_STATE      -  Device is holding due to an error.  No
+                                communication is allowed.
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+uint8_t USBHostUASDeviceStatus( uint8_t deviceAddress )
+{
+    if ((uasDevice.state == UAS_STATE_DETACHED) || (deviceAddress != uasDevice.address))
+    {
+        return USB_MSD_DEVICE_NOT_FOUND;
+    }
+
+    switch (uasDevice.state)
+    {
+        case UAS_STATE_RUNNING:
+            return USB_MSD_NORMAL_RUNNING;
+
+        case UAS_STATE_RESETTING:
+            return USB_MSD_RESETTING_DEVICE;
+
+        case UAS_STATE_ERROR:
+            return USB_MSD_ERROR_STATE;
+
+        default:
+            return USB_MSD_INITIALIZING;
+    }
+}
+
+
+/****************************************************************************
+  Function:
+    uint8_t USBHostUASResetDevice( uint8_t deviceAddress )
+
+  Summary:
+    This function starts a reset of the UAS pipes.
+
+  Description:
+    This function discards every outstanding command, cancels the transfers
+    on the pipes, and clears the halt condition of each pipe.
+    EVENT_MSD_RESET is sent to the media interface layer when the reset is
+    complete.
+
+  Precondition:
+    None
+
+  Parameters:
+    uint8_t deviceAddress - Device address
+
+  Return Values:
+    USB_SUCCESS                 - Reset started
+    USB_MSD_DEVICE_NOT_FOUND    - No device with specified address
+    USB_MSD_ILLEGAL_REQUEST     - Device is in an illegal state for reset
+
+  Remarks:
+    UAS has no class specific reset request.  The commands that the device
+    was performing are not aborted at the device.
+  ***************************************************************************/
+
+uint8_t USBHostUASResetDevice( uint8_t deviceAddress )
+{
+    uint8_t     pipe;
+
+    if ((uasDevice.state == UAS_STATE_DETACHED) || (deviceAddress != uasDevice.address))
+    {
+        return USB_MSD_DEVICE_NOT_FOUND;
+    }
+
+    if (uasDevice.state != UAS_STATE_RUNNING)
+    {
+        return USB_MSD_ILLEGAL_REQUEST;
+    }
+
+    for (pipe=USB_UAS_PIPE_COMMAND; pipe<=USB_UAS_PIPE_DATA_OUT; pipe++)
+    {
+        USBHostTerminateTransfer( uasDevice.address, uasDevice.endpoint[pipe] );
+    }
+
+    memset( uasDevice.command, 0, sizeof(uasDevice.command) );
+    uasDevice.orderCount    = 0;
+    uasDevice.commandSlot   = UAS_NO_SLOT;
+    uasDevice.dataInSlot    = UAS_NO_SLOT;
+    uasDevice.dataOutSlot   = UAS_NO_SLOT;
+    uasDevice.statusBusy    = false;
+    uasDevice.senseValid    = false;
+    uasDevice.eventSent     = false;
+    uasDevice.haltRequest   = UAS_ALL_PIPES;
+    uasDevice.state         = UAS_STATE_RESETTING;
+
+    return USB_SUCCESS;
+}
+
+
+/****************************************************************************
+  Function:
+    void USBHostUASTasks( void )
+
+  Summary:
+    This function performs the background tasks of the UAS client driver.
+
+  Description:
+    This function performs the background tasks of the UAS client driver.
+    It selects the UAS alternate setting, sends the command information
+    units, reads the status pipe, performs the data phases requested by the
+    device, and reports completed commands to the media interface layer.
+
+  Precondition:
+    None
+
+  Parameters:
+    None - None
+
+  Returns:
+    None
+
+  Remarks:
+    This function should be called periodically, after USBHostTasks().
+  ***************************************************************************/
+
+void USBHostUASTasks( void )
+{
+    uint8_t     commandBlock[12];
+    uint8_t     errorCode;
+    uint32_t    byteCount;
+    uint32_t    listLength;
+
+    switch (uasDevice.state)
+    {
+        case UAS_STATE_SET_INTERFACE:
+            if (uasDevice.alternateSetting == 0)
+            {
+                // The device is already using the UAS setting.
+                USBHostSetNAKTimeout( uasDevice.address, uasDevice.endpoint[USB_UAS_PIPE_STATUS], 0, 0 );
+                uasDevice.state = UAS_STATE_REPORT_LUNS;
+                break;
+            }
+
+            if (USBHostIssueDeviceRequest( uasDevice.address,
+                    USB_SETUP_HOST_TO_DEVICE | USB_SETUP_TYPE_STANDARD | USB_SETUP_RECIPIENT_INTERFACE,
+                    USB_REQUEST_SET_INTERFACE, uasDevice.alternateSetting, uasDevice.interface,
+                    0, NULL, USB_DEVICE_REQUEST_SET, uasDevice.clientDriverID ) == USB_SUCCESS)
+            {
+                uasDevice.state = UAS_STATE_WAIT_SET_INTERFACE;
+            }
+            break;
+
+        case UAS_STATE_WAIT_SET_INTERFACE:
+            if (USBHostTransferIsComplete( uasDevice.address, 0, &errorCode, &byteCount ))
+            {
+                if (errorCode != USB_SUCCESS)
+                {
+                    #ifdef DEBUG_MODE
+                        UART2PrintString( "UAS: SET INTERFACE failed\r\n" );
+                    #endif
+                    uasDevice.state = UAS_STATE_ERROR;
+                    break;
+                }
+
+                // The status pipe is read while the device performs the
+                // commands, which can take longer than the NAK limit.
+                USBHostSetNAKTimeout( uasDevice.address, uasDevice.endpoint[USB_UAS_PIPE_STATUS], 0, 0 );
+                uasDevice.state = UAS_STATE_REPORT_LUNS;
+            }
+            break;
+
+        case UAS_STATE_REPORT_LUNS:
+            // Fill in the command block with the REPORT LUNS parameters.
+            memset( commandBlock, 0, sizeof(commandBlock) );
+            commandBlock[0] = UAS_SCSI_REPORT_LUNS;     // Operation Code
+            commandBlock[9] = UAS_REPORT_LUNS_SIZE;     // Allocation Length - Big endian!
+
+            if (_USBHostUAS_Submit( 0, 1, commandBlock, 12, uasDevice.reportLUNs, UAS_REPORT_LUNS_SIZE, false ) == USB_SUCCESS)
+            {
+                uasDevice.state = UAS_STATE_WAIT_REPORT_LUNS;
+            }
+            break;
+
+        case UAS_STATE_WAIT_REPORT_LUNS:
+            _USBHostUAS_PipeTasks();
+            if (USBHostUASTransferIsComplete( uasDevice.address, &errorCode, &byteCount ))
+            {
+                // The LUN list holds 8 bytes per logical unit.  The logical
+                // units are taken to be numbered from 0.
+                uasDevice.maxLUN = 0;
+                if ((errorCode == USB_SUCCESS) && (byteCount >= 4))
+                {
+                    listLength = ((uint32_t)uasDevice.reportLUNs[0] << 24) | ((uint32_t)uasDevice.reportLUNs[1] << 16) |
+                                 ((uint32_t)uasDevice.reportLUNs[2] << 8)  |  (uint32_t)uasDevice.reportLUNs[3];
+                    if (listLength >= 16)
+                    {
+                        uasDevice.maxLUN = ((listLength / 8) > (UAS_MAX_LUN + 1)) ? UAS_MAX_LUN : (uint8_t)((listLength / 8) - 1);
+                    }
+                }
+
+                #ifdef DEBUG_MODE
+                    UART2PrintString( "UAS: Max LUN is " );
+                    UART2PutHex( uasDevice.maxLUN );
+                    UART2PrintString( "\r\nUAS: Running...\r\n" );
+                #endif
+
+                // Tell the media interface layer that we have a device attached.
+                if (usbMediaInterfaceTable.Initialize( uasDevice.address, usbMediaInterfaceTable.flags, 0 ))
+                {
+                    uasDevice.state = UAS_STATE_RUNNING;
+                    usbMediaInterfaceTable.EventHandler( uasDevice.address, EVENT_MSD_MAX_LUN, &uasDevice.maxLUN, 1 );
+                }
+                else
+                {
+                    // The media interface layer cannot support the device.
+                    uasDevice.state = UAS_STATE_ERROR;
+                }
+            }
+            break;
+
+        case UAS_STATE_RUNNING:
+            _USBHostUAS_HaltTasks();
+            _USBHostUAS_PipeTasks();
+            _USBHostUAS_Notify();
+            break;
+
+        case UAS_STATE_RESETTING:
+            _USBHostUAS_HaltTasks();
+            if ((uasDevice.haltRequest == 0) && (uasDevice.haltPipe == 0))
+            {
+                uasDevice.state = UAS_STATE_RUNNING;
+                usbMediaInterfaceTable.EventHandler( uasDevice.address, EVENT_MSD_RESET, NULL, 0 );
+            }
+            break;
+
+        case UAS_STATE_DETACHED:
+        case UAS_STATE_ERROR:
+        default:
+            break;
+    }
+}
+
+
+/****************************************************************************
+  Function:
+    uint8_t USBHostUASTransfer( uint8_t deviceAddress, uint8_t deviceLUN,
+                uint8_t direction, uint8_t *commandBlock, uint8_t commandBlockLength,
+                uint8_t *data, uint32_t dataLength )
+
+  Summary:
+    This function queues a tagged SCSI command.
+
+  Description:
+    This function queues a tagged SCSI command, and returns without waiting.
+    The command information unit is sent by USBHostUASTasks(), while earlier
+    commands may still be in progress.
+
+  Precondition:
+    None
+
+  Parameters:
+    uint8_t deviceAddress      - Device address
+    uint8_t deviceLUN          - Device LUN to access
+    uint8_t direction          - 1=read, 0=write
+    uint8_t *commandBlock      - Pointer to the command block, at most 16
+                                    bytes
+    uint8_t commandBlockLength - Length of the command block
+    uint8_t *data              - Pointer to the data buffer
+    uint32_t dataLength        - Byte size of the data buffer
+
+  Return Values:
+    USB_SUCCESS                 - Command queued successfully
+    USB_MSD_DEVICE_NOT_FOUND    - No device with specified address
+    USB_MSD_DEVICE_BUSY         - Device is not running, or
+                                    USB_UAS_QUEUE_DEPTH commands are
+                                    outstanding
+    USB_MSD_INVALID_LUN         - Specified LUN does not exist
+    USB_MSD_ILLEGAL_REQUEST     - The command block is too long, or the
+                                    data buffer is larger than 0xFFFF
+                                    bytes
+
+  Remarks:
+    Each completion is reported with EVENT_MSD_TRANSFER, during which
+    USBHostUASTransferIsComplete() returns its result.  A REQUEST SENSE is
+    reported before the commands that were already outstanding, so it
+    follows the failed command it reports on.
+  ***************************************************************************/
+
+uint8_t USBHostUASTransfer( uint8_t deviceAddress, uint8_t deviceLUN, uint8_t direction, uint8_t *commandBlock,
+                            uint8_t commandBlockLength, uint8_t *data, uint32_t dataLength )
+{
+    UAS_COMMAND     *command;
+    uint8_t         errorCode;
+
+    if ((uasDevice.state == UAS_STATE_DETACHED) || (deviceAddress != uasDevice.address))
+    {
+        return USB_MSD_DEVICE_NOT_FOUND;
+    }
+
+    if (uasDevice.state != UAS_STATE_RUNNING)
+    {
+        return USB_MSD_DEVICE_BUSY;
+    }
+
+    if (deviceLUN > uasDevice.maxLUN)
+    {
+        return USB_MSD_INVALID_LUN;
+    }
+
+    // The data phase is performed with a single host transfer.
+    if ((commandBlockLength > 16) || (dataLength > 0xFFFF))
+    {
+        return USB_MSD_ILLEGAL_REQUEST;
+    }
+
+    if (commandBlock[0] != UAS_SCSI_REQUEST_SENSE)
+    {
+        // Sense data is only kept until the next command to the logical unit.
+        if (uasDevice.senseLUN == deviceLUN)
+        {
+            uasDevice.senseValid = false;
+        }
+        return _USBHostUAS_Submit( deviceLUN, direction, commandBlock, commandBlockLength, data, dataLength, false );
+    }
+
+    // REQUEST SENSE goes ahead of the outstanding commands.
+    errorCode = _USBHostUAS_Submit( deviceLUN, direction, commandBlock, commandBlockLength, data, dataLength, true );
+    if ((errorCode == USB_SUCCESS) && uasDevice.senseValid && (uasDevice.senseLUN == deviceLUN))
+    {
+        // The device returned the sense data with the status of the failed
+        // command, and has cleared it, so answer from the saved copy.
+        command = &uasDevice.command[uasDevice.order[0]];
+        command->byteCount = (dataLength < UAS_SENSE_SIZE) ? dataLength : UAS_SENSE_SIZE;
+        memcpy( data, uasDevice.sense, command->byteCount );
+        command->state = UAS_SLOT_DONE;
+        uasDevice.senseValid = false;
+    }
+
+    return errorCode;
+}
+
+
+/****************************************************************************
+  Function:
+    bool USBHostUASTransferIsComplete( uint8_t deviceAddress,
+                        uint8_t *errorCode, uint32_t *byteCount )
+
+  Summary:
+    This function indicates whether or not the oldest outstanding command is
+    complete.
+
+  Description:
+    This function indicates whether or not the oldest outstanding command is
+    complete.  If it is, its error code and byte count are returned and the
+    command is removed, so the next call reports on the next command.  If no
+    command is outstanding, the result of the last command is returned.
+
+  Precondition:
+    None
+
+  Parameters:
+    uint8_t deviceAddress  - Device address
+    uint8_t *errorCode     - Error code of the command
+    uint32_t *byteCount    - Number of bytes transferred
+
+  Return Values:
+    true    - Command is complete, errorCode is valid
+    false   - Command is not complete, errorCode is not valid
+
+  Remarks:
+    errorCode is USB_MSD_COMMAND_FAILED if the device returned a status
+    other than GOOD, and USB_MSD_PHASE_ERROR if it rejected the information
+    unit.
+  ***************************************************************************/
+
+bool USBHostUASTransferIsComplete( uint8_t deviceAddress, uint8_t *errorCode, uint32_t *byteCount )
+{
+    UAS_COMMAND     *command;
+    uint8_t         i;
+
+    if ((uasDevice.state == UAS_STATE_DETACHED) || (deviceAddress != uasDevice.address))
+    {
+        *errorCode = USB_MSD_DEVICE_NOT_FOUND;
+        *byteCount = 0;
+        return true;
+    }
+
+    if (uasDevice.orderCount != 0)
+    {
+        command = &uasDevice.command[uasDevice.order[0]];
+        if (command->state != UAS_SLOT_DONE)
+        {
+            return false;
+        }
+
+        if (command->errorCode == USB_MSD_COMMAND_FAILED)
+        {
+            // Keep the sense data for the REQUEST SENSE that follows.
+            memcpy( uasDevice.sense, command->sense, UAS_SENSE_SIZE );
+            uasDevice.senseLUN   = command->lun;
+            uasDevice.senseValid = true;
+        }
+
+        uasDevice.lastErrorCode = command->errorCode;
+        uasDevice.lastByteCount = command->byteCount;
+        command->state          = UAS_SLOT_FREE;
+
+        uasDevice.orderCount --;
+        for (i=0; i<uasDevice.orderCount; i++)
+        {
+            uasDevice.order[i] = uasDevice.order[i+1];
+        }
+        uasDevice.eventSent = false;
+    }
+
+    *errorCode = uasDevice.lastErrorCode;
+    *byteCount = uasDevice.lastByteCount;
+    return true;
+}
+
+
+// *****************************************************************************
+// *****************************************************************************
+// Section: Internal Functions
+// *****************************************************************************
+// *****************************************************************************
+
+/****************************************************************************
+  Function:
+    static void _USBHostUAS_Halt( uint8_t pipe )
+
+  Description:
+    This function cancels the transfer on a pipe, and requests that its
+    halt condition be cleared.
+
+  Precondition:
+    None
+
+  Parameters:
+    uint8_t pipe    - Pipe ID
+
+  Returns:
+    None
+
+  Remarks:
+    The pipe is not used until the halt has been cleared.
+  ***************************************************************************/
+
+static void _USBHostUAS_Halt( uint8_t pipe )
+{
+    USBHostTerminateTransfer( uasDevice.address, uasDevice.endpoint[pipe] );
+    uasDevice.haltRequest |= (1 << pipe);
+}
+
+
+/****************************************************************************
+  Function:
+    static void _USBHostUAS_HaltTasks( void )
+
+  Description:
+    This function clears the halt condition of the pipes in haltRequest, one
+    CLEAR FEATURE (ENDPOINT HALT) request at a time.
+
+  Precondition:
+    None
+
+  Parameters:
+    None - None
+
+  Returns:
+    None
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+static void _USBHostUAS_HaltTasks( void )
+{
+    uint8_t     errorCode;
+    uint32_t    byteCount;
+    uint8_t     pipe;
+
+    if (uasDevice.haltPipe != 0)
+    {
+        if (USBHostTransferIsComplete( uasDevice.address, 0, &errorCode, &byteCount ))
+        {
+            USBHostClearEndpointErrors( uasDevice.address, uasDevice.endpoint[uasDevice.haltPipe] );
+            uasDevice.haltPipe = 0;
+        }
+        return;
+    }
+
+    if (uasDevice.haltRequest == 0)
+    {
+        return;
+    }
+
+    for (pipe=USB_UAS_PIPE_COMMAND; (uasDevice.haltRequest & (1 << pipe)) == 0; pipe++);
+
+    if (USBHostIssueDeviceRequest( uasDevice.address,
+            USB_SETUP_HOST_TO_DEVICE | USB_SETUP_TYPE_STANDARD | USB_SETUP_RECIPIENT_ENDPOINT,
+            USB_REQUEST_CLEAR_FEATURE, USB_FEATURE_ENDPOINT_HALT, uasDevice.endpoint[pipe],
+            0, NULL, USB_DEVICE_REQUEST_SET, uasDevice.clientDriverID ) == USB_SUCCESS)
+    {
+        uasDevice.haltRequest &= ~(1 << pipe);
+        uasDevice.haltPipe     = pipe;
+    }
+}
+
+
+/****************************************************************************
+  Function:
+    static void _USBHostUAS_Notify( void )
+
+  Description:
+    This function sends EVENT_MSD_TRANSFER to the media interface layer when
+    the oldest outstanding command is complete.  If the layer collects the
+    result during the event, the next command is checked.
+
+  Precondition:
+    None
+
+  Parameters:
+    None - None
+
+  Returns:
+    None
+
+  Remarks:
+    The event is only sent if USB_MSD_ENABLE_TRANSFER_EVENT is defined.
+  ***************************************************************************/
+
+static void _USBHostUAS_Notify( void )
+{
+    #if defined( USB_MSD_ENABLE_TRANSFER_EVENT )
+        while (!uasDevice.eventSent && (uasDevice.orderCount != 0) &&
+               (uasDevice.command[uasDevice.order[0]].state == UAS_SLOT_DONE))
+        {
+            uasDevice.eventSent = true;
+            usbMediaInterfaceTable.EventHandler( uasDevice.address, EVENT_MSD_TRANSFER, NULL, 0 );
+        }
+    #endif
+}
+
+
+/****************************************************************************
+  Function:
+    static void _USBHostUAS_PipeTasks( void )
+
+  Description:
+    This function moves the commands through the pipes.  It sends the queued
+    Command IUs in order, keeps a read of the status pipe in progress while
+    the device holds commands, and performs the data phases that the device
+    has requested, one per data pipe.
+
+  Precondition:
+    None
+
+  Parameters:
+    None - None
+
+  Returns:
+    None
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+static void _USBHostUAS_PipeTasks( void )
+{
+    UAS_COMMAND     *command;
+    uint8_t         errorCode;
+    uint32_t        byteCount;
+    uint8_t         i;
+    bool            outstanding;
+
+    // Command pipe.
+    if (uasDevice.commandSlot != UAS_NO_SLOT)
+    {
+        if (USBHostTransferIsComplete( uasDevice.address, uasDevice.endpoint[USB_UAS_PIPE_COMMAND], &errorCode, &byteCount ))
+        {
+            command = &uasDevice.command[uasDevice.commandSlot];
+            uasDevice.commandSlot = UAS_NO_SLOT;
+            if (errorCode == USB_SUCCESS)
+            {
+                command->state = UAS_SLOT_SENT;
+            }
+            else
+            {
+                command->errorCode  = USB_MSD_CBW_ERROR;
+                command->state      = UAS_SLOT_DONE;
+                if (errorCode == USB_ENDPOINT_STALLED)
+                {
+                    _USBHostUAS_Halt( USB_UAS_PIPE_COMMAND );
+                }
+            }
+        }
+    }
+    if ((uasDevice.commandSlot == UAS_NO_SLOT) && !_USBHostUAS_PipeHalted( USB_UAS_PIPE_COMMAND ))
+    {
+        for (i=0; i<uasDevice.orderCount; i++)
+        {
+            command = &uasDevice.command[uasDevice.order[i]];
+            if (command->state == UAS_SLOT_QUEUED)
+            {
+                if (USBHostWrite( uasDevice.address, uasDevice.endpoint[USB_UAS_PIPE_COMMAND], command->iu, UAS_COMMAND_IU_SIZE ) == USB_SUCCESS)
+                {
+                    uasDevice.commandSlot = uasDevice.order[i];
+                }
+                break;
+            }
+        }
+    }
+
+    // Status pipe.
+    if (uasDevice.statusBusy)
+    {
+        if (USBHostTransferIsComplete( uasDevice.address, uasDevice.endpoint[USB_UAS_PIPE_STATUS], &errorCode, &byteCount ))
+        {
+            uasDevice.statusBusy = false;
+            if (errorCode == USB_SUCCESS)
+            {
+                _USBHostUAS_ProcessStatus( byteCount );
+            }
+            else if (errorCode == USB_ENDPOINT_STALLED)
+            {
+                _USBHostUAS_Halt( USB_UAS_PIPE_STATUS );
+            }
+        }
+    }
+    if (!uasDevice.statusBusy && !_USBHostUAS_PipeHalted( USB_UAS_PIPE_STATUS ))
+    {
+        // Only read the status pipe while the device holds commands.
+        outstanding = false;
+        for (i=0; i<USB_UAS_QUEUE_DEPTH; i++)
+        {
+            if ((uasDevice.command[i].state >= UAS_SLOT_SENT) && (uasDevice.command[i].state <= UAS_SLOT_DATA))
+            {
+                outstanding = true;
+            }
+        }
+        if (outstanding &&
+            (USBHostRead( uasDevice.address, uasDevice.endpoint[USB_UAS_PIPE_STATUS], uasDevice.statusIU, UAS_STATUS_IU_SIZE ) == USB_SUCCESS))
+        {
+            uasDevice.statusBusy = true;
+        }
+    }
+
+    // Data-in pipe.
+    if (uasDevice.dataInSlot != UAS_NO_SLOT)
+    {
+        if (USBHostTransferIsComplete( uasDevice.address, uasDevice.endpoint[USB_UAS_PIPE_DATA_IN], &errorCode, &byteCount ))
+        {
+            command = &uasDevice.command[uasDevice.dataInSlot];
+            uasDevice.dataInSlot = UAS_NO_SLOT;
+            command->byteCount = byteCount;
+            command->state     = UAS_SLOT_SENT;
+            if (errorCode == USB_ENDPOINT_STALLED)
+            {
+                // The device ended the data phase.  The status follows.
+                _USBHostUAS_Halt( USB_UAS_PIPE_DATA_IN );
+            }
+            else if (errorCode != USB_SUCCESS)
+            {
+                command->errorCode = USB_MSD_PHASE_ERROR;
+            }
+        }
+    }
+    if ((uasDevice.dataInSlot == UAS_NO_SLOT) && !_USBHostUAS_PipeHalted( USB_UAS_PIPE_DATA_IN ))
+    {
+        for (i=0; i<uasDevice.orderCount; i++)
+        {
+            command = &uasDevice.command[uasDevice.order[i]];
+            if ((command->state == UAS_SLOT_READY) && command->direction)
+            {
+                if (USBHostRead( uasDevice.address, uasDevice.endpoint[USB_UAS_PIPE_DATA_IN], command->data, (uint16_t)command->dataLength ) == USB_SUCCESS)
+                {
+                    command->state          = UAS_SLOT_DATA;
+                    uasDevice.dataInSlot    = uasDevice.order[i];
+                }
+                break;
+            }
+        }
+    }
+
+    // Data-out pipe.
+    if (uasDevice.dataOutSlot != UAS_NO_SLOT)
+    {
+        if (USBHostTransferIsComplete( uasDevice.address, uasDevice.endpoint[USB_UAS_PIPE_DATA_OUT], &errorCode, &byteCount ))
+        {
+            command = &uasDevice.command[uasDevice.dataOutSlot];
+            uasDevice.dataOutSlot = UAS_NO_SLOT;
+            command->byteCount = byteCount;
+            command->state     = UAS_SLOT_SENT;
+            if (errorCode == USB_ENDPOINT_STALLED)
+            {
+                _USBHostUAS_Halt( USB_UAS_PIPE_DATA_OUT );
+            }
+            else if (errorCode != USB_SUCCESS)
+            {
+                command->errorCode = USB_MSD_PHASE_ERROR;
+            }
+        }
+    }
+    if ((uasDevice.dataOutSlot == UAS_NO_SLOT) && !_USBHostUAS_PipeHalted( USB_UAS_PIPE_DATA_OUT ))
+    {
+        for (i=0; i<uasDevice.orderCount; i++)
+        {
+            command = &uasDevice.command[uasDevice.order[i]];
+            if ((command->state == UAS_SLOT_READY) && !command->direction)
+            {
+                if (USBHostWrite( uasDevice.address, uasDevice.endpoint[USB_UAS_PIPE_DATA_OUT], command->data, (uint16_t)command->dataLength ) == USB_SUCCESS)
+                {
+                    command->state          = UAS_SLOT_DATA;
+                    uasDevice.dataOutSlot   = uasDevice.order[i];
+                }
+                break;
+            }
+        }
+    }
+}
+
+
+/****************************************************************************
+  Function:
+    static void _USBHostUAS_ProcessStatus( uint32_t byteCount )
+
+  Description:
+    This function handles an information unit read from the status pipe.  A
+    READ READY or WRITE READY IU lets the data phase of its command start.
+    A Sense IU completes its command, unless the device reported BUSY or
+    TASK SET FULL, in which case the command is sent again.  A Response IU
+    for a command means the device rejected it.
+
+  Precondition:
+    None
+
+  Parameters:
+    uint32_t byteCount  - Size of the information unit
+
+  Returns:
+    None
+
+  Remarks:
+    IUs with an unknown tag are ignored.
+  ***************************************************************************/
+
+static void _USBHostUAS_ProcessStatus( uint32_t byteCount )
+{
+    UAS_COMMAND     *command;
+    uint16_t        tag;
+    uint16_t        senseLength;
+    uint32_t        dataCount;
+    uint8_t         errorCode;
+    uint8_t         pipe;
+    uint8_t         *iu = uasDevice.statusIU;
+
+    if (byteCount < 4)
+    {
+        return;
+    }
+
+    tag = ((uint16_t)iu[2] << 8) | iu[3];
+    if ((tag == 0) || (tag > USB_UAS_QUEUE_DEPTH))
+    {
+        return;
+    }
+    command = &uasDevice.command[tag-1];
+    if ((command->state < UAS_SLOT_SENT) || (command->state > UAS_SLOT_DATA))
+    {
+        return;
+    }
+
+    switch (iu[0])
+    {
+        case USB_UAS_IU_READ_READY:
+        case USB_UAS_IU_WRITE_READY:
+            if (command->state == UAS_SLOT_SENT)
+            {
+                command->state = UAS_SLOT_READY;
+            }
+            return;
+
+        case USB_UAS_IU_SENSE:
+            if ((iu[6] == UAS_STATUS_BUSY) || (iu[6] == UAS_STATUS_TASK_SET_FULL))
+            {
+                // The device cannot take the command now.  Send it again.
+                command->state = UAS_SLOT_QUEUED;
+                return;
+            }
+            if (iu[6] != UAS_STATUS_GOOD)
+            {
+                memset( command->sense, 0, UAS_SENSE_SIZE );
+                if (byteCount > UAS_SENSE_IU_HEADER_SIZE)
+                {
+                    senseLength = ((uint16_t)iu[14] << 8) | iu[15];
+                    if (senseLength > byteCount - UAS_SENSE_IU_HEADER_SIZE)
+                    {
+                        senseLength = byteCount - UAS_SENSE_IU_HEADER_SIZE;
+                    }
+                    if (senseLength > UAS_SENSE_SIZE)
+                    {
+                        senseLength = UAS_SENSE_SIZE;
+                    }
+                    memcpy( command->sense, &iu[UAS_SENSE_IU_HEADER_SIZE], senseLength );
+                }
+                command->errorCode = USB_MSD_COMMAND_FAILED;
+            }
+            break;
+
+        case USB_UAS_IU_RESPONSE:
+            command->errorCode = USB_MSD_PHASE_ERROR;
+            break;
+
+        default:
+            return;
+    }
+
+    // The command is complete.  If the data phase has not been seen to end,
+    // either it ended with a STALL that has not been handled yet, or the
+    // device ended the command early and the transfer must be cancelled.
+    if (command->state == UAS_SLOT_DATA)
+    {
+        pipe = command->direction ? USB_UAS_PIPE_DATA_IN : USB_UAS_PIPE_DATA_OUT;
+        if (USBHostTransferIsComplete( uasDevice.address, uasDevice.endpoint[pipe], &errorCode, &dataCount ))
+        {
+            command->byteCount = dataCount;
+            if (errorCode == USB_ENDPOINT_STALLED)
+            {
+                _USBHostUAS_Halt( pipe );
+            }
+        }
+        else
+        {
+            USBHostTerminateTransfer( uasDevice.address, uasDevice.endpoint[pipe] );
+        }
+
+        if (pipe == USB_UAS_PIPE_DATA_IN)
+        {
+            uasDevice.dataInSlot = UAS_NO_SLOT;
+        }
+        else
+        {
+            uasDevice.dataOutSlot = UAS_NO_SLOT;
+        }
+    }
+    command->state = UAS_SLOT_DONE;
+}
+
+
+/****************************************************************************
+  Function:
+    static uint8_t _USBHostUAS_Submit( uint8_t lun, uint8_t direction,
+                        uint8_t *commandBlock, uint8_t commandBlockLength,
+                        uint8_t *data, uint32_t dataLength, bool first )
+
+  Description:
+    This function places a command in a free slot, builds its Command IU,
+    and adds it to the list of outstanding commands.
+
+  Precondition:
+    None
+
+  Parameters:
+    uint8_t lun                 - Logical Unit Number
+    uint8_t direction           - 1=read, 0=write
+    uint8_t *commandBlock       - Command block
+    uint8_t commandBlockLength  - Length of the command block, at most 16
+    uint8_t *data               - Data buffer
+    uint32_t dataLength         - Size of the data buffer
+    bool first                  - true to report the command before the
+                                    outstanding commands
+
+  Return Values:
+    USB_SUCCESS         - The command was queued
+    USB_MSD_DEVICE_BUSY - Every slot is in use
+
+  Remarks:
+    None
+  ***************************************************************************/
+
+static uint8_t _USBHostUAS_Submit( uint8_t lun, uint8_t direction, uint8_t *commandBlock, uint8_t commandBlockLength,
+                        uint8_t *data, uint32_t dataLength, bool first )
+{
+    UAS_COMMAND     *command;
+    uint8_t         slot;
+    uint8_t         i;
+
+    for (slot=0; (slot<USB_UAS_QUEUE_DEPTH) && (uasDevice.command[slot].state != UAS_SLOT_FREE); slot++);
+    if (slot == USB_UAS_QUEUE_DEPTH)
+    {
+        return USB_MSD_DEVICE_BUSY;
+    }
+
+    command = &uasDevice.command[slot];
+    memset( command, 0, sizeof(UAS_COMMAND) );
+
+    // Build the Command IU.  The tag is the slot number plus one, the task
+    // attribute is SIMPLE, and the LUN uses single level addressing.
+    command->iu[0]  = USB_UAS_IU_COMMAND;
+    command->iu[3]  = slot + 1;
+    command->iu[9]  = lun;
+    memcpy( &command->iu[16], commandBlock, commandBlockLength );
+
+    command->data       = data;
+    command->dataLength = dataLength;
+    command->direction  = direction;
+    command->lun        = lun;
+    command->errorCode  = USB_SUCCESS;
+    command->state      = UAS_SLOT_QUEUED;
+
+    if (first)
+    {
+        for (i=uasDevice.orderCount; i>0; i--)
+        {
+            uasDevice.order[i] = uasDevice.order[i-1];
+        }
+        uasDevice.order[0] = slot;
+
+        // The event for the old first command may already have been sent.
+        uasDevice.eventSent = false;
+    }
+    else
+    {
+        uasDevice.order[uasDevice.orderCount] = slot;
+    }
+    uasDevice.orderCount ++;
+
+    return USB_SUCCESS;
+}